@@ -0,0 +1,789 @@
+/**
+ * @file attachmentstore.cpp
+ * @brief Stores attachments as deduplicated content-defined chunks and streams them back
+ *
+ * Chunk boundaries come from FastCDC: a gear hash rolls over the bytes after the minimum chunk
+ * size, and a boundary is declared where its top bits are all zero. Before the average size a
+ * stricter mask is used and after it a looser one, which keeps chunk sizes close to the average.
+ *
+ * Chunk files are written and read in batches through a FileIo per thread: an upload writes and
+ * syncs every new chunk of a read block together, and a download reads several chunks at once
+ * into the FileIo's registered buffers.
+ *
+ * Removing the last reference to a chunk deletes its file, unless a store() has pinned the chunk
+ * between finding its file and committing its reference; the store() then records the chunk again.
+ * A pinned chunk whose store() fails keeps its file, which the next upload of that chunk reuses.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <attachmentstore.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <fileio.h>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QScopedPointer>
+#include <openssl/evp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+
+// Boundary masks for the stricter and looser halves of normalized chunking (average 32 KiB)
+static const quint64 strictMask = 0xffff800000000000ULL;	// 17 bits
+static const quint64 looseMask = 0xfff8000000000000ULL;	// 13 bits
+
+// The number of chunks a download reads at once
+static const int readBatchSize = 16;
+
+static QMutex pinMutex;
+static QHash<QByteArray, int> pinnedChunks;	// chunk hash -> the store() calls relying on its file
+static std::atomic<quint64> temporaryCounter(0);
+
+// The random value the gear hash adds for each byte value, fixed so boundaries never change
+struct GearTable
+{
+	quint64 values[256];
+
+	GearTable()
+	{
+		quint64 state = 0x6a09e667f3bcc908ULL;
+		for (int i = 0; i < 256; i++)
+		{
+			// splitmix64
+			state += 0x9e3779b97f4a7c15ULL;
+			quint64 z = state;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			values[i] = z ^ (z >> 31);
+		}
+	}
+};
+
+static const GearTable gear;
+
+// A chunk cut from an upload, waiting to be written
+struct AttachmentStore::PendingChunk
+{
+	QByteArray hash;
+	const char* data;
+	int length;
+};
+
+// A chunk a download needs, read into the FileIo buffer with the same index in its batch
+struct AttachmentStore::ChunkRead
+{
+	QByteArray hash;
+	int size;
+	qint64 offset;	// within the attachment
+};
+
+// The chunks one store() has pinned, unpinned when it returns
+struct ChunkPins
+{
+	QVector<QByteArray> hashes;
+
+	void pin(const QByteArray& hash)
+	{
+		QMutexLocker locker(&pinMutex);
+		pinnedChunks[hash]++;
+		hashes.append(hash);
+	}
+
+	~ChunkPins()
+	{
+		QMutexLocker locker(&pinMutex);
+		for (int i = 0; i < hashes.size(); i++)
+		{
+			if (--pinnedChunks[hashes[i]] == 0)
+			{
+				pinnedChunks.remove(hashes[i]);
+			}
+		}
+	}
+};
+
+// A SHA-256 context per thread, so hashing chunks allocates nothing
+struct ChunkDigest
+{
+	EVP_MD_CTX* ctx;
+
+	ChunkDigest() : ctx(EVP_MD_CTX_new()) {}
+	~ChunkDigest()
+	{
+		EVP_MD_CTX_free(ctx);
+	}
+};
+
+/**
+ * @brief Computes the SHA-256 of a chunk
+ * @param data The chunk
+ * @param length The length of the chunk
+ * @return The 32-byte hash, or an empty QByteArray if hashing failed
+ */
+static QByteArray hashChunk(const char* data, int length)
+{
+	thread_local ChunkDigest digest;
+	QByteArray hash(AttachmentStore::hashSize, '\0');
+	unsigned int hashLength = 0;
+	bool ok = digest.ctx
+		&& EVP_DigestInit_ex(digest.ctx, EVP_sha256(), nullptr) == 1
+		&& EVP_DigestUpdate(digest.ctx, data, length) == 1
+		&& EVP_DigestFinal_ex(digest.ctx, reinterpret_cast<unsigned char*>(hash.data()), &hashLength) == 1;
+	return ok ? hash : QByteArray();
+}
+
+/**
+ * @brief Gets the calling thread's FileIo for chunk files, creating it on first use
+ * @return The FileIo, with a maximum-size chunk buffer for each chunk of a download batch
+ */
+static FileIo& chunkIo()
+{
+	thread_local QScopedPointer<FileIo> io(FileIo::create(readBatchSize, AttachmentStore::maxChunkSize));
+	return *io;
+}
+
+/**
+ * @brief Constructor for an attachment store
+ * @param manager The database manager whose connection records attachments and chunks
+ * @param directory The directory chunk files are kept in
+ */
+AttachmentStore::AttachmentStore(DbManager& manager, const QString& directory)
+	: manager(manager), directory(directory)
+{
+}
+
+/**
+ * @brief Creates the attachment tables and chunk directories if they do not exist
+ * @return boolean indicating whether the store is ready
+ */
+bool AttachmentStore::createTables()
+{
+	QSqlQuery query(manager.database());
+	bool ok = query.exec("CREATE TABLE IF NOT EXISTS attachments(hash BLOB PRIMARY KEY, size INTEGER NOT NULL, "
+		"chunkcount INTEGER NOT NULL, created INTEGER NOT NULL) WITHOUT ROWID;")
+		&& query.exec("CREATE TABLE IF NOT EXISTS chunks(hash BLOB PRIMARY KEY, size INTEGER NOT NULL) WITHOUT ROWID;")
+		&& query.exec("CREATE TABLE IF NOT EXISTS attachmentchunks(attachment BLOB NOT NULL, offset INTEGER NOT NULL, "
+			"chunk BLOB NOT NULL, PRIMARY KEY (attachment, offset)) WITHOUT ROWID;")
+		&& query.exec("CREATE INDEX IF NOT EXISTS attachmentchunks_chunk ON attachmentchunks(chunk);")
+		&& query.exec("CREATE TABLE IF NOT EXISTS chatattachments(chatid INTEGER NOT NULL, attachment BLOB NOT NULL, "
+			"sender TEXT NOT NULL, added INTEGER NOT NULL, PRIMARY KEY (chatid, attachment)) WITHOUT ROWID;")
+		&& query.exec("CREATE INDEX IF NOT EXISTS chatattachments_attachment ON chatattachments(attachment);");
+	if (!ok)
+	{
+		DBLOG_ERROR("createTables", DbErrorQuery, 0, "attachment tables could not be created", query.lastError().text());
+		return false;
+	}
+
+	// Chunk files are spread over 256 directories by the first byte of their hash
+	QDir root(directory);
+	for (int i = 0; i < 256; i++)
+	{
+		QString subdirectory = QString::fromLatin1(QByteArray(1, char(i)).toHex());
+		if (!root.mkpath(subdirectory))
+		{
+			DBLOG_ERROR("createTables", DbErrorAttachment, 0, "chunk directory could not be created", root.filePath(subdirectory));
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Stores an attachment read from a device and posts it to a chat
+ * The device is read until it reports no more data, so it must be a file, a buffer or another
+ * device whose read() only returns 0 at the end. Chunks that are already stored are not written
+ * again, and content that is already stored is only posted to the chat.
+ * @param chatID An integer representing the chat ID number
+ * @param sender The username of the member posting the attachment
+ * @param source The device to read the attachment from
+ * @return The attachment's hash, or an empty QByteArray on error
+ */
+QByteArray AttachmentStore::store(int chatID, const QString& sender, QIODevice& source)
+{
+	ChunkPins pins;
+	EVP_MD_CTX* whole = EVP_MD_CTX_new();
+	if (!whole || EVP_DigestInit_ex(whole, EVP_sha256(), nullptr) != 1)
+	{
+		EVP_MD_CTX_free(whole);
+		DBLOG_ERROR("store", DbErrorCrypto, chatID, "attachment hash could not be started", sender);
+		return QByteArray();
+	}
+
+	QVector<QByteArray> chunkHashes;
+	QVector<int> chunkSizes;
+	QVector<PendingChunk> pending;
+	QByteArray buffer(readBlockSize + maxChunkSize, '\0');
+	int start = 0;
+	int filled = 0;
+	bool atEnd = false;
+	bool ok = true;
+	while (ok)
+	{
+		// Keep at least one maximum-size chunk buffered so every boundary sees the bytes it needs
+		while (!atEnd && filled - start < maxChunkSize)
+		{
+			if (start > 0)
+			{
+				// Pending chunks point into the buffer, so they are written before it moves
+				if (!writeChunks(pending))
+				{
+					ok = false;
+					break;
+				}
+				pending.clear();
+				memmove(buffer.data(), buffer.constData() + start, filled - start);
+				filled -= start;
+				start = 0;
+			}
+			qint64 count = source.read(buffer.data() + filled, buffer.size() - filled);
+			if (count < 0)
+			{
+				DBLOG_ERROR("store", DbErrorAttachment, chatID, "attachment could not be read", source.errorString());
+				ok = false;
+				break;
+			}
+			atEnd = count == 0;
+			filled += int(count);
+		}
+		if (!ok || filled == start)
+		{
+			break;
+		}
+
+		const char* chunk = buffer.constData() + start;
+		int length = cutPoint(chunk, filled - start);
+		QByteArray hash = hashChunk(chunk, length);
+		ok = !hash.isEmpty() && EVP_DigestUpdate(whole, chunk, length) == 1;
+
+		// Pinned before writeChunks() looks for its file, so a removal either deletes the file first or keeps it
+		pins.pin(hash);
+		PendingChunk next = { hash, chunk, length };
+		pending.append(next);
+		chunkHashes.append(hash);
+		chunkSizes.append(length);
+		start += length;
+	}
+
+	ok = ok && writeChunks(pending);
+
+	QByteArray attachment(hashSize, '\0');
+	unsigned int hashLength = 0;
+	ok = ok && EVP_DigestFinal_ex(whole, reinterpret_cast<unsigned char*>(attachment.data()), &hashLength) == 1;
+	EVP_MD_CTX_free(whole);
+	if (!ok)
+	{
+		return QByteArray();
+	}
+
+	// Takes the write lock first, so a connection storing the same attachment concurrently waits
+	// here rather than failing on the upgrade; whichever stores it second only records the chat
+	QSqlDatabase db = manager.database();
+	if (!manager.beginImmediate())
+	{
+		return QByteArray();
+	}
+	qint64 size = 0;
+	for (int i = 0; i < chunkSizes.size(); i++)
+	{
+		size += chunkSizes[i];
+	}
+	QSqlQuery query(db);
+	query.prepare("INSERT OR IGNORE INTO attachments (hash, size, chunkcount, created) VALUES (:hash, :size, :chunkCount, :created)");
+	query.bindValue(":hash", attachment);
+	query.bindValue(":size", size);
+	query.bindValue(":chunkCount", chunkHashes.size());
+	query.bindValue(":created", QDateTime::currentSecsSinceEpoch());
+	ok = query.exec();
+
+	if (ok && query.numRowsAffected() > 0)
+	{
+		QSqlQuery chunkInsert(db);
+		chunkInsert.prepare("INSERT OR IGNORE INTO chunks (hash, size) VALUES (:hash, :size)");
+		QSqlQuery referenceInsert(db);
+		referenceInsert.prepare("INSERT INTO attachmentchunks (attachment, offset, chunk) VALUES (:attachment, :offset, :chunk)");
+		qint64 offset = 0;
+		for (int i = 0; ok && i < chunkHashes.size(); i++)
+		{
+			chunkInsert.bindValue(":hash", chunkHashes[i]);
+			chunkInsert.bindValue(":size", chunkSizes[i]);
+			referenceInsert.bindValue(":attachment", attachment);
+			referenceInsert.bindValue(":offset", offset);
+			referenceInsert.bindValue(":chunk", chunkHashes[i]);
+			ok = chunkInsert.exec() && referenceInsert.exec();
+			offset += chunkSizes[i];
+		}
+	}
+
+	if (ok)
+	{
+		query.prepare("INSERT OR IGNORE INTO chatattachments (chatid, attachment, sender, added) VALUES (:chatID, :attachment, :sender, :added)");
+		query.bindValue(":chatID", chatID);
+		query.bindValue(":attachment", attachment);
+		query.bindValue(":sender", sender);
+		query.bindValue(":added", QDateTime::currentSecsSinceEpoch());
+		ok = query.exec();
+	}
+
+	if (!ok || !db.commit())
+	{
+		DBLOG_ERROR("store", DbErrorQuery, chatID, "attachment could not be recorded", db.lastError().text());
+		db.rollback();
+		return QByteArray();
+	}
+	return attachment;
+}
+
+/**
+ * @brief Posts an attachment that is already stored to a chat, as forwarding does
+ * @param chatID An integer representing the chat ID number
+ * @param hash The attachment's hash
+ * @param sender The username of the member posting the attachment
+ * @return boolean indicating whether the attachment exists and is now in the chat
+ */
+bool AttachmentStore::attach(int chatID, const QByteArray& hash, const QString& sender)
+{
+	QSqlQuery query(manager.database());
+	query.prepare("INSERT OR IGNORE INTO chatattachments (chatid, attachment, sender, added) "
+		"SELECT :chatID, hash, :sender, :added FROM attachments WHERE hash = (:hash)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":sender", sender);
+	query.bindValue(":added", QDateTime::currentSecsSinceEpoch());
+	query.bindValue(":hash", hash);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("attach", DbErrorQuery, chatID, "attachment could not be posted", query.lastError().text());
+		return false;
+	}
+	if (query.numRowsAffected() == 0 && size(hash) < 0)
+	{
+		DBLOG_WARNING("attach", DbErrorAttachment, chatID, "attachment does not exist", QString::fromLatin1(hash.toHex()));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Writes all or part of an attachment to a device, one chunk at a time
+ * @param hash The attachment's hash
+ * @param sink The device to write to
+ * @param offset The first byte to write
+ * @param length The number of bytes to write, or -1 for the rest of the attachment
+ * @return boolean indicating whether every byte was read, verified and written
+ */
+bool AttachmentStore::retrieve(const QByteArray& hash, QIODevice& sink, qint64 offset, qint64 length)
+{
+	qint64 total = size(hash);
+	if (total < 0 || offset < 0 || offset > total)
+	{
+		return false;
+	}
+	qint64 end = length < 0 ? total : qMin(total, offset + length);
+
+	// The chunk holding the first byte starts at the greatest offset not after it
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT ac.offset, ac.chunk, c.size FROM attachmentchunks ac JOIN chunks c ON c.hash = ac.chunk "
+		"WHERE ac.attachment = :attachment AND ac.offset >= COALESCE((SELECT MAX(offset) FROM attachmentchunks "
+		"WHERE attachment = :first AND offset <= :start), 0) AND ac.offset < :end ORDER BY ac.offset");
+	query.bindValue(":attachment", hash);
+	query.bindValue(":first", hash);
+	query.bindValue(":start", offset);
+	query.bindValue(":end", end);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("retrieve", DbErrorQuery, 0, "attachment chunks could not be read", query.lastError().text());
+		return false;
+	}
+
+	QVector<ChunkRead> batch;
+	qint64 position = offset;
+	while (position < end)
+	{
+		batch.clear();
+		while (batch.size() < readBatchSize && query.next())
+		{
+			ChunkRead chunk = { query.value(1).toByteArray(), query.value(2).toInt(), query.value(0).toLongLong() };
+			batch.append(chunk);
+		}
+		if (batch.isEmpty())
+		{
+			break;
+		}
+		if (!readChunks(batch))
+		{
+			return false;
+		}
+
+		for (int i = 0; i < batch.size() && position < end; i++)
+		{
+			qint64 from = position - batch[i].offset;
+			qint64 count = qMin<qint64>(batch[i].size - from, end - position);
+			if (sink.write(chunkIo().buffer(i) + from, count) != count)
+			{
+				DBLOG_ERROR("retrieve", DbErrorAttachment, 0, "attachment could not be written", sink.errorString());
+				return false;
+			}
+			position += count;
+		}
+	}
+	return position == end;
+}
+
+/**
+ * @brief Gets the size of an attachment
+ * @param hash The attachment's hash
+ * @return The size in bytes, or -1 if the attachment does not exist
+ */
+qint64 AttachmentStore::size(const QByteArray& hash)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT size FROM attachments WHERE hash = (:hash)");
+	query.bindValue(":hash", hash);
+	if (!query.exec() || !query.next())
+	{
+		return -1;
+	}
+	return query.value(0).toLongLong();
+}
+
+/**
+ * @brief Removes an attachment from a chat
+ * When no chat has the attachment any more it is deleted, along with the files of any chunks
+ * no other attachment uses
+ * @param chatID An integer representing the chat ID number
+ * @param hash The attachment's hash
+ * @return boolean indicating whether the attachment was in the chat and has been removed
+ */
+bool AttachmentStore::remove(int chatID, const QByteArray& hash)
+{
+	QSqlDatabase db = manager.database();
+	if (!manager.beginImmediate())
+	{
+		return false;
+	}
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	query.prepare("DELETE FROM chatattachments WHERE chatid = (:chatID) AND attachment = (:hash)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":hash", hash);
+	if (!query.exec() || query.numRowsAffected() == 0)
+	{
+		db.rollback();
+		return false;
+	}
+
+	query.prepare("SELECT 1 FROM chatattachments WHERE attachment = (:hash) LIMIT 1");
+	query.bindValue(":hash", hash);
+	bool ok = query.exec();
+	if (ok && query.next())
+	{
+		query.finish();
+		return db.commit();
+	}
+	query.finish();
+
+	QVector<QByteArray> chunks;
+	query.prepare("SELECT DISTINCT chunk FROM attachmentchunks WHERE attachment = (:hash)");
+	query.bindValue(":hash", hash);
+	ok = ok && query.exec();
+	while (ok && query.next())
+	{
+		chunks.append(query.value(0).toByteArray());
+	}
+	query.finish();
+
+	query.prepare("DELETE FROM attachmentchunks WHERE attachment = (:hash)");
+	query.bindValue(":hash", hash);
+	ok = ok && query.exec();
+	query.prepare("DELETE FROM attachments WHERE hash = (:hash)");
+	query.bindValue(":hash", hash);
+	ok = ok && query.exec();
+
+	QVector<QByteArray> unused;
+	QSqlQuery chunkDelete(db);
+	chunkDelete.prepare("DELETE FROM chunks WHERE hash = (:hash) AND NOT EXISTS (SELECT 1 FROM attachmentchunks WHERE chunk = (:chunk))");
+	for (int i = 0; ok && i < chunks.size(); i++)
+	{
+		chunkDelete.bindValue(":hash", chunks[i]);
+		chunkDelete.bindValue(":chunk", chunks[i]);
+		ok = chunkDelete.exec();
+		if (ok && chunkDelete.numRowsAffected() > 0)
+		{
+			unused.append(chunks[i]);
+		}
+	}
+
+	if (!ok || !db.commit())
+	{
+		DBLOG_ERROR("remove", DbErrorQuery, chatID, "attachment could not be removed", db.lastError().text());
+		db.rollback();
+		return false;
+	}
+	QMutexLocker locker(&pinMutex);
+	for (int i = 0; i < unused.size(); i++)
+	{
+		if (!pinnedChunks.contains(unused[i]))
+		{
+			QFile::remove(chunkPath(unused[i]));
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Gets the attachments posted to a chat, oldest first
+ * @param chatID An integer representing the chat ID number
+ * @return The attachments
+ */
+QVector<AttachmentInfo> AttachmentStore::chatAttachments(int chatID)
+{
+	QVector<AttachmentInfo> attachments;
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT ca.attachment, a.size, ca.sender, ca.added FROM chatattachments ca "
+		"JOIN attachments a ON a.hash = ca.attachment WHERE ca.chatid = (:chatID) ORDER BY ca.added");
+	query.bindValue(":chatID", chatID);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("chatAttachments", DbErrorQuery, chatID, "chat attachments could not be read", query.lastError().text());
+		return attachments;
+	}
+	while (query.next())
+	{
+		AttachmentInfo info;
+		info.hash = query.value(0).toByteArray();
+		info.size = query.value(1).toLongLong();
+		info.sender = query.value(2).toString();
+		info.added = query.value(3).toLongLong();
+		attachments.append(info);
+	}
+	return attachments;
+}
+
+/**
+ * @brief Measures how much the store holds and how much deduplication saved
+ * @return The usage, all zero on error
+ */
+AttachmentUsage AttachmentStore::usage()
+{
+	AttachmentUsage result;
+	memset(&result, 0, sizeof(result));
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	if (query.exec("SELECT COUNT(*), COALESCE(SUM(a.size), 0) FROM chatattachments ca JOIN attachments a ON a.hash = ca.attachment") && query.next())
+	{
+		result.references = query.value(0).toLongLong();
+		result.referencedBytes = query.value(1).toLongLong();
+	}
+	if (query.exec("SELECT COUNT(*), COALESCE(SUM(size), 0) FROM attachments") && query.next())
+	{
+		result.attachments = query.value(0).toLongLong();
+		result.attachmentBytes = query.value(1).toLongLong();
+	}
+	if (query.exec("SELECT COUNT(*), COALESCE(SUM(size), 0) FROM chunks") && query.next())
+	{
+		result.chunks = query.value(0).toLongLong();
+		result.storedBytes = query.value(1).toLongLong();
+	}
+	return result;
+}
+
+/**
+ * @brief Finds where the chunk starting at data ends
+ * Unless the data is the end of the attachment, at least maxChunkSize bytes must be given
+ * @param data The bytes from the start of the chunk
+ * @param length The number of bytes available
+ * @return The length of the chunk
+ */
+int AttachmentStore::cutPoint(const char* data, int length)
+{
+	if (length <= minChunkSize)
+	{
+		return length;
+	}
+	const quint8* bytes = reinterpret_cast<const quint8*>(data);
+	int normal = length < averageChunkSize ? length : averageChunkSize;
+	int end = length < maxChunkSize ? length : maxChunkSize;
+	quint64 hash = 0;
+	int i = minChunkSize;
+	for (; i < normal; i++)
+	{
+		hash = (hash << 1) + gear.values[bytes[i]];
+		if ((hash & strictMask) == 0)
+		{
+			return i + 1;
+		}
+	}
+	for (; i < end; i++)
+	{
+		hash = (hash << 1) + gear.values[bytes[i]];
+		if ((hash & looseMask) == 0)
+		{
+			return i + 1;
+		}
+	}
+	return end;
+}
+
+/**
+ * @brief Gets the path of a chunk's file
+ * @param hash The chunk's hash
+ * @return The path
+ */
+QString AttachmentStore::chunkPath(const QByteArray& hash) const
+{
+	QByteArray hex = hash.toHex();
+	return directory + "/" + QString::fromLatin1(hex.left(2)) + "/" + QString::fromLatin1(hex.mid(2));
+}
+
+/**
+ * @brief Writes the files of chunks that do not have one yet, all in one batch
+ * Each chunk is written and synced under a temporary name and then renamed into place, and the
+ * directories the renames changed are synced so the new names survive a crash
+ * @param chunks The chunks
+ * @return boolean indicating whether every chunk is stored
+ */
+bool AttachmentStore::writeChunks(const QVector<PendingChunk>& chunks)
+{
+	QVector<IoRequest> requests;
+	QVector<int> written;
+	QVector<QString> temporaries;
+	bool ok = true;
+	for (int i = 0; i < chunks.size(); i++)
+	{
+		if (QFile::exists(chunkPath(chunks[i].hash)))
+		{
+			continue;
+		}
+		QString temporary = QString("%1.%2.%3.tmp").arg(chunkPath(chunks[i].hash)).arg(qint64(getpid()))
+			.arg(temporaryCounter.fetch_add(1));
+		int fd = ::open(QFile::encodeName(temporary).constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd < 0)
+		{
+			DBLOG_ERROR("store", DbErrorAttachment, 0, "chunk could not be created", temporary);
+			ok = false;
+			break;
+		}
+		requests.append(FileIo::write(fd, 0, chunks[i].data, chunks[i].length));
+		requests.append(FileIo::sync(fd));
+		written.append(i);
+		temporaries.append(temporary);
+	}
+	if (ok && !requests.isEmpty())
+	{
+		chunkIo().run(requests.data(), requests.size());
+	}
+
+	QVector<QString> renamedDirectories;
+	for (int i = 0; i < written.size(); i++)
+	{
+		::close(requests[2 * i].fd);
+		QString path = chunkPath(chunks[written[i]].hash);
+		bool stored = ok && requests[2 * i].result == chunks[written[i]].length && requests[2 * i + 1].result == 0;
+		if (stored && QFile::rename(temporaries[i], path))
+		{
+			QString subdirectory = directory + "/" + QString::fromLatin1(chunks[written[i]].hash.toHex().left(2));
+			if (!renamedDirectories.contains(subdirectory))
+			{
+				renamedDirectories.append(subdirectory);
+			}
+			continue;
+		}
+		QFile::remove(temporaries[i]);
+
+		// Another upload may have stored the same chunk meanwhile, which is just as good
+		if (!stored || !QFile::exists(path))
+		{
+			if (ok)
+			{
+				DBLOG_ERROR("store", DbErrorAttachment, 0, "chunk could not be written", path);
+			}
+			ok = false;
+		}
+	}
+
+	QVector<IoRequest> syncs;
+	QVector<QString> synced;
+	for (int i = 0; i < renamedDirectories.size(); i++)
+	{
+		int fd = ::open(QFile::encodeName(renamedDirectories[i]).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			DBLOG_ERROR("store", DbErrorAttachment, 0, "chunk directory could not be opened", renamedDirectories[i]);
+			ok = false;
+			continue;
+		}
+		syncs.append(FileIo::sync(fd));
+		synced.append(renamedDirectories[i]);
+	}
+	if (!syncs.isEmpty())
+	{
+		chunkIo().run(syncs.data(), syncs.size());
+	}
+	for (int i = 0; i < syncs.size(); i++)
+	{
+		::close(syncs[i].fd);
+		if (syncs[i].result != 0)
+		{
+			DBLOG_ERROR("store", DbErrorAttachment, 0, "chunk directory could not be synced", synced[i]);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/**
+ * @brief Reads a batch of chunk files into the FileIo's buffers and checks them against their hashes
+ * @param chunks The chunks; chunk i is read into buffer i
+ * @return boolean indicating whether every chunk was read intact
+ */
+bool AttachmentStore::readChunks(const QVector<ChunkRead>& chunks)
+{
+	FileIo& io = chunkIo();
+	QVector<IoRequest> requests;
+	bool ok = true;
+	for (int i = 0; i < chunks.size(); i++)
+	{
+		QString path = chunkPath(chunks[i].hash);
+		int fd = chunks[i].size <= io.bufferSize() ? ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC) : -1;
+		if (fd < 0)
+		{
+			DBLOG_ERROR("retrieve", DbErrorAttachment, 0, "chunk is missing", path);
+			ok = false;
+			break;
+		}
+		requests.append(FileIo::read(fd, 0, io.buffer(i), chunks[i].size, i));
+	}
+	if (ok)
+	{
+		io.run(requests.data(), requests.size());
+	}
+
+	for (int i = 0; i < requests.size(); i++)
+	{
+		::close(requests[i].fd);
+		if (!ok)
+		{
+			continue;
+		}
+		if (requests[i].result != chunks[i].size)
+		{
+			DBLOG_ERROR("retrieve", DbErrorAttachment, 0, "chunk is missing", chunkPath(chunks[i].hash));
+			ok = false;
+		}
+		else if (hashChunk(io.buffer(i), chunks[i].size) != chunks[i].hash)
+		{
+			DBLOG_ERROR("retrieve", DbErrorAttachment, 0, "chunk does not match its hash", chunkPath(chunks[i].hash));
+			ok = false;
+		}
+	}
+	return ok;
+}
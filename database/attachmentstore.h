@@ -0,0 +1,88 @@
+/**
+ * @file attachmentstore.h
+ * @brief This contains the prototypes for the content-addressed attachment store
+ *
+ * Attachments are named by the SHA-256 of their contents and split into content-defined chunks
+ * with FastCDC, so a chunk boundary depends only on the bytes around it. Chunks are stored once
+ * however many attachments contain them: forwarding a file into another chat stores nothing new,
+ * and a file that differs from a stored one in a few places only stores the chunks around the
+ * differences. SHA-256 runs through OpenSSL, which uses the SHA extensions when the CPU has them.
+ *
+ * Uploads and downloads are streamed through a QIODevice a block at a time, so a file is never
+ * held in memory whole. Each chunk is a file under the store's directory, named by its hash and
+ * written to a temporary name first, so a chunk file either is complete or does not exist.
+ * retrieve() checks every chunk against its hash before handing it out.
+ *
+ * Chunk files are written, synced and read in batches through a FileIo, so one upload or
+ * download keeps many chunk files in flight with io_uring instead of waiting on each in turn.
+ *
+ * Tables:
+ * attachments--one row per distinct attachment: its hash, size, chunk count and when it was stored.
+ * chunks--one row per stored chunk: its hash and size.
+ * attachmentchunks--the chunks of each attachment by their offset within it.
+ * chatattachments--which chats each attachment was posted to, by whom and when.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef ATTACHMENTSTORE_H
+#define ATTACHMENTSTORE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QIODevice>
+
+class DbManager;
+
+// An attachment posted to a chat
+struct AttachmentInfo
+{
+	QByteArray hash;	// SHA-256 of the contents
+	qint64 size;
+	QString sender;
+	qint64 added;	// seconds since the Unix epoch
+};
+
+// What the store holds, before and after deduplication
+struct AttachmentUsage
+{
+	qint64 references;		// attachments posted to chats
+	qint64 referencedBytes;	// their total size, counting every chat they were posted to
+	qint64 attachments;		// distinct attachments
+	qint64 attachmentBytes;
+	qint64 chunks;			// distinct chunks
+	qint64 storedBytes;		// bytes actually on disk
+};
+
+class AttachmentStore
+{
+	public:
+		static const int hashSize = 32;
+		static const int minChunkSize = 8 * 1024;
+		static const int averageChunkSize = 32 * 1024;
+		static const int maxChunkSize = 128 * 1024;
+		static const int readBlockSize = 1024 * 1024;
+
+		AttachmentStore(DbManager& manager, const QString& directory);
+		bool createTables();
+		QByteArray store(int chatID, const QString& sender, QIODevice& source);
+		bool attach(int chatID, const QByteArray& hash, const QString& sender);
+		bool retrieve(const QByteArray& hash, QIODevice& sink, qint64 offset = 0, qint64 length = -1);
+		qint64 size(const QByteArray& hash);
+		bool remove(int chatID, const QByteArray& hash);
+		QVector<AttachmentInfo> chatAttachments(int chatID);
+		AttachmentUsage usage();
+		static int cutPoint(const char* data, int length);
+	private:
+		struct PendingChunk;
+		struct ChunkRead;
+		QString chunkPath(const QByteArray& hash) const;
+		bool writeChunks(const QVector<PendingChunk>& chunks);
+		bool readChunks(const QVector<ChunkRead>& chunks);
+		DbManager& manager;
+		QString directory;
+};
+
+#endif	// ATTACHMENTSTORE_H
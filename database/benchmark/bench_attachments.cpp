@@ -0,0 +1,180 @@
+/**
+ * @file bench_attachments.cpp
+ * @brief Benchmarks the attachment store on a forwarding-heavy workload
+ *
+ * A stream of uploads where most files are forwarded copies of earlier ones, some are lightly
+ * edited versions of earlier ones and the rest are new. Forwarded copies are uploaded again in
+ * full, as clients that do not know the hash would, and then also forwarded by hash with
+ * attach(). Downloads read every attachment back and verify it.
+ *
+ * Usage: benchmark.out attachments [uploads] [distinct files] [mean file KiB]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <attachmentstore.h>
+#include <QBuffer>
+#include <QDir>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+/**
+ * @brief Makes a file of random bytes
+ * @param random The random generator
+ * @param size The size of the file
+ * @return The file
+ */
+static QByteArray makeFile(std::mt19937& random, int size)
+{
+	QByteArray file(size, '\0');
+	for (int i = 0; i + 4 <= size; i += 4)
+	{
+		quint32 value = random();
+		memcpy(file.data() + i, &value, 4);
+	}
+	return file;
+}
+
+/**
+ * @brief Makes an edited version of a file, as re-saving an image or document would
+ * @param random The random generator
+ * @param file The original
+ * @return The original with a few bytes inserted and a few overwritten
+ */
+static QByteArray editFile(std::mt19937& random, const QByteArray& file)
+{
+	QByteArray edited = file;
+	edited.insert(int(random() % (edited.size() + 1)), makeFile(random, 16 + int(random() % 200)));
+	for (int e = 0; e < 3; e++)
+	{
+		edited[int(random() % edited.size())] = char(random());
+	}
+	return edited;
+}
+
+/**
+ * @brief Runs the attachment store benchmark
+ * @param args Optional number of uploads, distinct files and mean file size in KiB
+ * @return 0 on success
+ */
+int benchAttachments(const QStringList& args)
+{
+	int uploads = args.size() > 0 ? qMax(args[0].toInt(), 1) : 400;
+	int distinct = args.size() > 1 ? qMax(args[1].toInt(), 1) : 40;
+	int meanKiB = args.size() > 2 ? qMax(args[2].toInt(), 1) : 1024;
+
+	DbManager db(benchDatabase("attachments"), "bench-attachments");
+	QDir chunkDirectory("bench_attachments.chunks");
+	chunkDirectory.removeRecursively();
+	AttachmentStore store(db, "bench_attachments.chunks");
+	if (!store.createTables())
+	{
+		return 1;
+	}
+
+	// 60% forwarded copies, 20% edited versions, 20% new files, 20 chats
+	std::mt19937 random(3307);
+	QVector<QByteArray> files;
+	QVector<QByteArray> hashes;
+	qint64 ingested = 0;
+	int forwarded = 0;
+	int edited = 0;
+	int created = 0;
+	qint64 start = benchNow();
+	for (int u = 0; u < uploads; u++)
+	{
+		int kind = files.isEmpty() ? 4 : int(random() % 5);
+		QByteArray file;
+		if (kind < 3)
+		{
+			file = files[int(random() % files.size())];
+			forwarded++;
+		}
+		else if (kind == 3 || created >= distinct)
+		{
+			file = editFile(random, files[int(random() % files.size())]);
+			edited++;
+		}
+		else
+		{
+			file = makeFile(random, meanKiB * 1024 / 4 + int(random() % (meanKiB * 1024 * 3 / 2)));
+			created++;
+		}
+
+		QBuffer source(&file);
+		source.open(QIODevice::ReadOnly);
+		QByteArray hash = store.store(1 + u % 20, QString("user%1").arg(u % 50), source);
+		if (hash.isEmpty())
+		{
+			std::cout << "upload " << u << " failed" << std::endl;
+			return 1;
+		}
+		if (!hashes.contains(hash))
+		{
+			files.append(file);
+			hashes.append(hash);
+		}
+		ingested += file.size();
+	}
+	double seconds = (benchNow() - start) / 1e9;
+	AttachmentUsage usage = store.usage();
+
+	std::cout << uploads << " uploads: " << forwarded << " forwarded copies, " << edited << " edited, "
+		<< created << " new" << std::endl;
+	std::cout << std::fixed << std::setprecision(1) << "ingest                 " << ingested / seconds / 1e6 << " MB/s ("
+		<< ingested / 1e6 << " MB in " << seconds << " s)" << std::endl;
+	std::cout << std::setprecision(2) << "dedup ratio            " << double(ingested) / qMax<qint64>(usage.storedBytes, 1)
+		<< " (" << usage.storedBytes / 1e6 << " MB stored)" << std::endl;
+	std::cout << "  of distinct files    " << double(usage.attachmentBytes) / qMax<qint64>(usage.storedBytes, 1)
+		<< " (" << usage.attachments << " attachments in " << usage.chunks << " chunks, mean chunk "
+		<< std::setprecision(1) << usage.storedBytes / 1024.0 / qMax<qint64>(usage.chunks, 1) << " KiB)" << std::endl;
+
+	// Forwarding by hash into every chat costs a row, not an upload
+	int attaches = 0;
+	start = benchNow();
+	for (int h = 0; h < hashes.size(); h++)
+	{
+		for (int chat = 100; chat < 120; chat++)
+		{
+			attaches += store.attach(chat, hashes[h], "forwarder") ? 1 : 0;
+		}
+	}
+	seconds = (benchNow() - start) / 1e9;
+	std::cout << std::setprecision(0) << "attach by hash         " << attaches / seconds << " forwards/s" << std::endl;
+
+	qint64 downloaded = 0;
+	bool intact = true;
+	start = benchNow();
+	for (int h = 0; h < hashes.size(); h++)
+	{
+		QByteArray copy;
+		QBuffer sink(&copy);
+		sink.open(QIODevice::WriteOnly);
+		intact = store.retrieve(hashes[h], sink) && copy == files[h] && intact;
+		downloaded += copy.size();
+	}
+	seconds = (benchNow() - start) / 1e9;
+	std::cout << std::setprecision(1) << "download               " << downloaded / seconds / 1e6 << " MB/s"
+		<< (intact ? "" : " (verification failed)") << std::endl;
+
+	// Ranged reads, as a client resuming a download or seeking in a video would make
+	const int ranges = 2000;
+	start = benchNow();
+	for (int r = 0; r < ranges; r++)
+	{
+		int h = int(random() % hashes.size());
+		qint64 offset = random() % files[h].size();
+		QByteArray copy;
+		QBuffer sink(&copy);
+		sink.open(QIODevice::WriteOnly);
+		intact = store.retrieve(hashes[h], sink, offset, 4096) && copy == files[h].mid(int(offset), 4096) && intact;
+	}
+	seconds = (benchNow() - start) / 1e9;
+	std::cout << std::setprecision(1) << "4 KiB ranged read      " << seconds / ranges * 1e6 << " us"
+		<< (intact ? "" : " (verification failed)") << std::endl;
+	return intact ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+/**
+ * @file bench_backends.cpp
+ * @brief Benchmarks every public DbManager method on the QtSql and the sqlite3 storage backends
+ *
+ * Two databases are filled with the same users and chats, one through each backend. Each method
+ * is then called many times on both and the time per call compared. Methods that add rows are
+ * timed on fresh usernames and chat ID numbers, and removeChat removes the chats addChat added.
+ * getOnlineChatUsers is getChatUsers followed by a presence lookup, so it is not timed apart.
+ *
+ * Usage: benchmark.out backends [users] [calls]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+/**
+ * @brief Times a call on one database manager
+ * @param db The database manager
+ * @param calls The number of calls
+ * @param call The call, given the database manager and the call's index
+ * @return The time per call in microseconds
+ */
+static double timeCalls(DbManager& db, int calls, const std::function<void(DbManager&, int)>& call)
+{
+	qint64 start = benchNow();
+	for (int i = 0; i < calls; i++)
+	{
+		call(db, i);
+	}
+	return (benchNow() - start) / 1000.0 / calls;
+}
+
+/**
+ * @brief Times a call on both backends and prints one row of the comparison
+ * @param label The row label
+ * @param qtsql The database manager on the QtSql backend
+ * @param sqlite The database manager on the sqlite3 backend
+ * @param calls The number of calls
+ * @param call The call, given the database manager and the call's index
+ * @return void
+ */
+static void compare(const std::string& label, DbManager& qtsql, DbManager& sqlite, int calls, const std::function<void(DbManager&, int)>& call)
+{
+	double qtsqlMicros = timeCalls(qtsql, calls, call);
+	double sqliteMicros = timeCalls(sqlite, calls, call);
+	std::cout << std::left << std::setw(40) << label << std::right << std::setprecision(2)
+		<< std::setw(12) << qtsqlMicros << std::setw(12) << sqliteMicros
+		<< std::setw(10) << std::setprecision(2) << qtsqlMicros / sqliteMicros << "x" << std::endl;
+	return;
+}
+
+/**
+ * @brief Fills a database with users, small chats, one large chat and a user in many chats
+ * @param db The database manager
+ * @param users The usernames
+ * @param chats The number of small chats
+ * @param chatSize The members in each small chat
+ * @param largeChat The members in the large chat
+ * @return The time taken in seconds
+ */
+static double fill(DbManager& db, const QVector<QString>& users, int chats, int chatSize, int largeChat)
+{
+	qint64 start = benchNow();
+	db.database().transaction();
+	for (const QString& user : users)
+	{
+		db.addUser(user, "password");
+	}
+	for (int c = 0; c < chats; c++)
+	{
+		QVector<QString> members;
+		// users[0] is in every chat, for the roster; the rest are spread out
+		members.append(users[0]);
+		for (int m = 1; m < chatSize; m++)
+		{
+			members.append(users[1 + (c * chatSize + m) % (users.size() - 1)]);
+		}
+		db.addChat(c + 1, members[1], members);
+	}
+	db.addChat(chats + 1, users[1], users.mid(1, largeChat));
+	db.database().commit();
+	return (benchNow() - start) / 1e9;
+}
+
+/**
+ * @brief Runs the storage backend benchmark
+ * @param args Optional user count and number of calls per point lookup
+ * @return 0 on success
+ */
+int benchBackends(const QStringList& args)
+{
+	int userCount = args.size() > 0 ? qMax(args[0].toInt(), 100) : 10000;
+	int calls = args.size() > 1 ? qMax(args[1].toInt(), 20) : 2000;
+	int chats = 50;
+	int chatSize = 10;
+	int largeChat = qMin(1000, userCount - 1);
+	int scans = qMax(calls / 20, 1);
+
+	QVector<QString> users;
+	for (int u = 0; u < userCount; u++)
+	{
+		users.append(QString("member%1").arg(u));
+	}
+
+	DbManager qtsql(benchDatabase("backends-qtsql"), "bench-backends-qtsql", StorageKind::QtSql);
+	DbManager sqlite(benchDatabase("backends-sqlite"), "bench-backends-sqlite", StorageKind::Sqlite);
+	if (sqlite.storageKind() != StorageKind::Sqlite)
+	{
+		std::cout << "The connection has no sqlite3 handle, so both runs would use QtSql" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::fixed;
+	std::cout << std::left << std::setw(40) << "call" << std::right << std::setw(12) << "QtSql us" << std::setw(12) << "sqlite3 us" << std::setw(11) << "speedup" << std::endl;
+	compare("createUserTable + createChatTables", qtsql, sqlite, 1, [](DbManager& db, int)
+	{
+		db.createUserTable();
+		db.createChatTables();
+	});
+	double qtsqlFill = fill(qtsql, users, chats, chatSize, largeChat);
+	double sqliteFill = fill(sqlite, users, chats, chatSize, largeChat);
+	std::cout << std::left << std::setw(40) << "fill, in one transaction (s)" << std::right << std::setprecision(2)
+		<< std::setw(12) << qtsqlFill << std::setw(12) << sqliteFill << std::setw(10) << qtsqlFill / sqliteFill << "x" << std::endl;
+
+	qint64 seen = 0;
+	compare("userExists", qtsql, sqlite, calls, [&](DbManager& db, int i)
+	{
+		seen += db.userExists(users[(i * 7919) % userCount]);
+	});
+	compare("userExists, missing user", qtsql, sqlite, calls, [&](DbManager& db, int)
+	{
+		seen += db.userExists("nobody");
+	});
+	compare("checkUserInfo", qtsql, sqlite, calls, [&](DbManager& db, int i)
+	{
+		seen += db.checkUserInfo(users[(i * 7919) % userCount], "password");
+	});
+	compare("chatExists", qtsql, sqlite, calls, [&](DbManager& db, int i)
+	{
+		seen += db.chatExists(1 + i % chats);
+	});
+	compare("getChatOwner", qtsql, sqlite, calls, [&](DbManager& db, int i)
+	{
+		seen += db.getChatOwner(1 + i % chats).size();
+	});
+	compare("doUsersChat", qtsql, sqlite, scans, [&](DbManager& db, int i)
+	{
+		seen += db.doUsersChat(users[1 + i % (userCount - 1)], users[0]);
+	});
+	compare(QString("getChatUsers, %1 members").arg(chatSize).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int i)
+	{
+		seen += db.getChatUsers(1 + i % chats).size();
+	});
+	compare(QString("getChatUsers, %1 members").arg(largeChat).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int)
+	{
+		seen += db.getChatUsers(chats + 1).size();
+	});
+	compare(QString("getChatUserList, %1 members").arg(largeChat).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int)
+	{
+		seen += db.getChatUserList(chats + 1).size();
+	});
+	compare(QString("forEachChatUser, %1 members").arg(largeChat).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int)
+	{
+		db.forEachChatUser(chats + 1, [&](Utf8View member)
+		{
+			seen += member.size();
+			return true;
+		});
+	});
+	compare(QString("getChatsUserIsIn, %1 chats").arg(chats).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int)
+	{
+		seen += db.getChatsUserIsIn(users[0]).size();
+	});
+	compare(QString("getChatIdsUserIsIn, %1 chats").arg(chats).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int)
+	{
+		seen += db.getChatIdsUserIsIn(users[0]).size();
+	});
+	compare(QString("forEachChatOfUser, %1 chats").arg(chats).toStdString(), qtsql, sqlite, scans, [&](DbManager& db, int)
+	{
+		db.forEachChatOfUser(users[0], [&](int chatID)
+		{
+			seen += chatID;
+			return true;
+		});
+	});
+	compare(QString("forEachRosterEntry, %1 chats").arg(chats).toStdString(), qtsql, sqlite, scans / 10 + 1, [&](DbManager& db, int)
+	{
+		db.forEachRosterEntry(users[0], [&](int, Utf8View member)
+		{
+			seen += member.size();
+			return true;
+		});
+	});
+	compare(QString("getUserChatInfo, %1 chats").arg(chats).toStdString(), qtsql, sqlite, scans / 10 + 1, [&](DbManager& db, int)
+	{
+		seen += db.getUserChatInfo(users[0]).size();
+	});
+	compare("addUser", qtsql, sqlite, calls, [&](DbManager& db, int i)
+	{
+		seen += db.addUser(QString("added%1").arg(i), "password");
+	});
+	QVector<QString> members = users.mid(1, 3);
+	compare("addChat, 3 members", qtsql, sqlite, scans, [&](DbManager& db, int i)
+	{
+		seen += db.addChat(1000000 + i, members[0], members);
+	});
+	compare("removeChat", qtsql, sqlite, scans, [&](DbManager& db, int i)
+	{
+		seen += db.removeChat(1000000 + i, members[0]);
+	});
+	std::cout << "(" << seen << " results seen)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,203 @@
+/**
+ * @file bench_compression.cpp
+ * @brief Benchmarks message compression without a dictionary and with per-chat dictionaries
+ *
+ * Three synthetic corpora stand in for real traffic: short casual chatter, chatter mixed with
+ * longer messages and links, and JSON notifications from bots. Every chat draws on a common
+ * vocabulary plus words of its own, as real chats do. The first half of each chat's messages
+ * trains the dictionaries and the second half is measured.
+ *
+ * Usage: benchmark.out compression [chats] [messages per chat]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <messagecompressor.h>
+#include <messagecrypto.h>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+static const char* commonWords[] = {
+	"the", "a", "to", "and", "is", "it", "you", "that", "for", "on", "was", "are", "with", "be", "this",
+	"have", "just", "not", "so", "what", "lol", "yeah", "ok", "think", "going", "now", "today", "tomorrow",
+	"meeting", "later", "sure", "thanks", "can", "we", "i", "do", "know", "get", "about", "there", "time",
+	"good", "when", "see", "need", "will", "like", "my", "all", "how", "out", "up", "if", "at", "me"
+};
+static const int commonWordCount = sizeof(commonWords) / sizeof(commonWords[0]);
+
+/**
+ * @brief Makes up a word
+ * @param random The random generator
+ * @return A word of 3 to 9 lowercase letters
+ */
+static QByteArray makeWord(std::mt19937& random)
+{
+	static const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+	QByteArray word;
+	int length = 3 + int(random() % 7);
+	for (int i = 0; i < length; i++)
+	{
+		// Skewed towards the frequent letters, like English
+		int r = int(random() % 26);
+		word.append(letters[(r * r) / 26]);
+	}
+	return word;
+}
+
+/**
+ * @brief Writes a sentence mixing common words with words of the chat
+ * @param random The random generator
+ * @param chatWords The chat's own vocabulary
+ * @param words The number of words
+ * @return The sentence
+ */
+static QByteArray makeSentence(std::mt19937& random, const QVector<QByteArray>& chatWords, int words)
+{
+	QByteArray sentence;
+	for (int w = 0; w < words; w++)
+	{
+		if (w > 0)
+		{
+			sentence.append(' ');
+		}
+		if (random() % 3 == 0)
+		{
+			sentence.append(chatWords[int(random() % chatWords.size())]);
+		}
+		else
+		{
+			sentence.append(commonWords[random() % commonWordCount]);
+		}
+	}
+	return sentence;
+}
+
+/**
+ * @brief Generates the messages of one chat
+ * @param corpus 0 for chatter, 1 for mixed, 2 for bot notifications
+ * @param chatID The chat, which seeds its vocabulary
+ * @param count The number of messages
+ * @return The messages
+ */
+static QVector<QByteArray> makeChat(int corpus, int chatID, int count)
+{
+	std::mt19937 random(chatID * 7919 + corpus);
+	QVector<QByteArray> chatWords;
+	for (int i = 0; i < 40; i++)
+	{
+		chatWords.append(makeWord(random));
+	}
+
+	QVector<QByteArray> messages;
+	messages.reserve(count);
+	for (int i = 0; i < count; i++)
+	{
+		QByteArray message;
+		if (corpus == 2)
+		{
+			message = QString("{\"type\":\"%1\",\"project\":\"%2\",\"status\":\"%3\",\"build\":%4,\"author\":\"%5\",\"url\":\"https://ci.example.com/%2/builds/%4\"}")
+				.arg(random() % 4 == 0 ? "deploy" : "build")
+				.arg(QString::fromUtf8(chatWords[int(random() % 4)]))
+				.arg(random() % 5 == 0 ? "failed" : "passed")
+				.arg(100000 + i)
+				.arg(QString::fromUtf8(chatWords[4 + int(random() % 8)])).toUtf8();
+		}
+		else if (corpus == 1 && random() % 5 == 0)
+		{
+			message = makeSentence(random, chatWords, 30 + int(random() % 60));
+			if (random() % 2 == 0)
+			{
+				message.append(" https://www.example.com/" + chatWords[int(random() % chatWords.size())] + "/" + QByteArray::number(int(random() % 100000)));
+			}
+		}
+		else
+		{
+			message = makeSentence(random, chatWords, 2 + int(random() % 10));
+		}
+		messages.append(message);
+	}
+	return messages;
+}
+
+/**
+ * @brief Runs the compression benchmark
+ * @param args Optional number of chats and messages per chat
+ * @return 0 on success
+ */
+int benchCompression(const QStringList& args)
+{
+	int chats = args.size() > 0 ? qMax(args[0].toInt(), 1) : 8;
+	int perChat = args.size() > 1 ? qMax(args[1].toInt(), 2 * MessageCompressor::minSamples) : 4000;
+	const char* corpusNames[] = { "chatter", "mixed", "notifications" };
+	const char* modeNames[] = { "no dictionary", "per chat" };
+	QByteArray dictionaryKey = MessageCrypto::generateKey();
+
+	DbManager db(benchDatabase("compression"), "bench-compression");
+	std::cout << chats << " chats, " << perChat / 2 << " training and " << perChat - perChat / 2 << " measured messages each" << std::endl;
+	std::cout << std::left << std::setw(15) << "corpus" << std::setw(15) << "dictionary" << std::right << std::setw(10) << "avg bytes"
+		<< std::setw(8) << "ratio" << std::setw(16) << "compress MB/s" << std::setw(18) << "decompress MB/s" << std::endl;
+
+	for (int corpus = 0; corpus < 3; corpus++)
+	{
+		QVector<QVector<QByteArray> > corpusChats;
+		for (int c = 1; c <= chats; c++)
+		{
+			corpusChats.append(makeChat(corpus, c, perChat));
+		}
+
+		for (int mode = 0; mode < 2; mode++)
+		{
+			MessageCompressor compressor(db, dictionaryKey);
+			if (!compressor.createTables())
+			{
+				return 1;
+			}
+			if (mode > 0)
+			{
+				for (int c = 0; c < chats; c++)
+				{
+					for (int i = 0; i < perChat / 2; i++)
+					{
+						compressor.compress(c + 1, corpusChats[c][i]);
+					}
+				}
+				compressor.retrain();
+			}
+
+			qint64 raw = 0;
+			qint64 packed = 0;
+			QVector<QByteArray> compressed;
+			qint64 start = benchNow();
+			for (int c = 0; c < chats; c++)
+			{
+				for (int i = perChat / 2; i < perChat; i++)
+				{
+					compressed.append(compressor.compress(c + 1, corpusChats[c][i]));
+					raw += corpusChats[c][i].size();
+					packed += compressed.last().size();
+				}
+			}
+			double compressSeconds = (benchNow() - start) / 1e9;
+
+			QByteArray message;
+			bool ok = true;
+			start = benchNow();
+			for (int i = 0; i < compressed.size(); i++)
+			{
+				ok = compressor.decompress(i / (perChat - perChat / 2) + 1, compressed[i], message) && ok;
+			}
+			double decompressSeconds = (benchNow() - start) / 1e9;
+
+			std::cout << std::left << std::setw(15) << (mode == 0 ? corpusNames[corpus] : "") << std::setw(15) << modeNames[mode]
+				<< std::right << std::fixed << std::setprecision(1) << std::setw(10) << double(raw) / compressed.size()
+				<< std::setprecision(2) << std::setw(8) << double(raw) / packed
+				<< std::setprecision(1) << std::setw(16) << raw / compressSeconds / 1e6
+				<< std::setw(18) << raw / decompressSeconds / 1e6 << (ok ? "" : "  (decompression failed)") << std::endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,170 @@
+/**
+ * @file bench_fanout.cpp
+ * @brief Benchmarks sending chat messages through the fan-out engine
+ *
+ * Every member of a chat has one connection. Producer threads send messages to the chat while
+ * consumer threads, woken through the wake handler, drain the connections' queues and release
+ * the messages as a server's writers would. Reports messages and deliveries per second and the
+ * 99th percentile time of a send.
+ *
+ * Usage: benchmark.out fanout [producers] [chat sizes...]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <fanout.h>
+#include <mpscring.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+/**
+ * @brief Runs the fan-out benchmark
+ * @param args Optional producer thread count followed by chat sizes
+ * @return 0 on success
+ */
+int benchFanout(const QStringList& args)
+{
+	int producers = args.size() > 0 ? qMax(args[0].toInt(), 1) : 16;
+	QVector<int> sizes;
+	for (int i = 1; i < args.size(); i++)
+	{
+		sizes.append(args[i].toInt());
+	}
+	if (sizes.isEmpty())
+	{
+		sizes << 10 << 1000 << 100000;
+	}
+	int consumers = qMax(int(std::thread::hardware_concurrency()) / 2, 1);
+	QByteArray payload(256, 'x');
+
+	DbManager db(benchDatabase("fanout"), "bench-fanout");
+	db.createUserTable();
+	db.createChatTables();
+
+	std::cout << std::left << std::setw(10) << "members" << std::right << std::setw(14) << "messages/s"
+		<< std::setw(16) << "deliveries/s" << std::setw(16) << "p99 send us" << std::setw(12) << "wakeups"
+		<< std::setw(12) << "dropped" << std::endl;
+
+	for (int s = 0; s < sizes.size(); s++)
+	{
+		int chatID = s + 1;
+		QVector<QString> members;
+		db.database().transaction();
+		for (int m = 0; m < sizes[s]; m++)
+		{
+			members.append(QString("fan%1user%2").arg(chatID).arg(m));
+			db.addUser(members[m], "password");
+		}
+		db.database().commit();
+		db.addChat(chatID, members[0], members);
+
+		FanoutEngine engine(64);
+		for (int m = 0; m < members.size(); m++)
+		{
+			engine.addConnection(members[m]);
+		}
+
+		// A connection has at most one wakeup outstanding, so each ready ring can hold all of them
+		std::vector<std::unique_ptr<MpscRing<int> > > ready;
+		for (int c = 0; c < consumers; c++)
+		{
+			ready.emplace_back(new MpscRing<int>(members.size() + 1));
+		}
+		engine.setWakeHandler([&](const QVector<int>& connectionIDs)
+		{
+			for (int i = 0; i < connectionIDs.size(); i++)
+			{
+				while (!ready[connectionIDs[i] % consumers]->tryPush(connectionIDs[i]))
+				{
+					std::this_thread::yield();
+				}
+			}
+		});
+
+		std::atomic<bool> done(false);
+		std::vector<std::thread> drainers;
+		for (int c = 0; c < consumers; c++)
+		{
+			drainers.emplace_back([&, c]()
+			{
+				QVector<FanoutMessage*> messages;
+				int connectionID;
+				while (true)
+				{
+					if (!ready[c]->tryPop(connectionID))
+					{
+						if (done.load())
+						{
+							break;
+						}
+						std::this_thread::yield();
+						continue;
+					}
+					messages.clear();
+					engine.drain(connectionID, messages);
+					for (int i = 0; i < messages.size(); i++)
+					{
+						messages[i]->release();
+					}
+				}
+			});
+		}
+
+		// Enough sends for a stable figure without the largest chat taking minutes
+		int perProducer = qMax(20, 4000000 / (sizes[s] * producers));
+		// Caches the route, so the producers never use db from their own threads
+		engine.send(db, chatID, payload);
+		std::vector<std::vector<qint64> > latencies(producers);
+		std::vector<std::thread> senders;
+		qint64 start = benchNow();
+		for (int p = 0; p < producers; p++)
+		{
+			senders.emplace_back([&, p]()
+			{
+				latencies[p].reserve(perProducer);
+				for (int i = 0; i < perProducer; i++)
+				{
+					qint64 sendStart = benchNow();
+					engine.send(db, chatID, payload);
+					latencies[p].push_back(benchNow() - sendStart);
+				}
+			});
+		}
+		for (std::thread& sender : senders)
+		{
+			sender.join();
+		}
+		double seconds = (benchNow() - start) / 1e9;
+		done = true;
+		for (std::thread& drainer : drainers)
+		{
+			drainer.join();
+		}
+
+		std::vector<qint64> all;
+		for (int p = 0; p < producers; p++)
+		{
+			all.insert(all.end(), latencies[p].begin(), latencies[p].end());
+		}
+		std::sort(all.begin(), all.end());
+		qint64 p99 = all[qMin(int(all.size()) - 1, int(all.size() * 0.99))];
+
+		FanoutStats stats = engine.stats();
+		int messages = perProducer * producers;
+		std::cout << std::left << std::setw(10) << sizes[s] << std::right << std::fixed << std::setprecision(0)
+			<< std::setw(14) << messages / seconds << std::setw(16) << stats.deliveries / seconds
+			<< std::setprecision(2) << std::setw(16) << p99 / 1e3 << std::setw(12) << stats.wakeups
+			<< std::setw(12) << stats.dropped << std::endl;
+	}
+
+	db.close();
+	return 0;
+}
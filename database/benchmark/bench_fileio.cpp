@@ -0,0 +1,179 @@
+/**
+ * @file bench_fileio.cpp
+ * @brief Benchmarks the batched file I/O backends against blocking system calls
+ *
+ * Two workloads run against each backend: 4 KiB reads at random aligned offsets in a large
+ * file, as downloads of many small attachments touch it, and 1 MiB sequential writes ending in
+ * one data sync, as an upload does. The blocking baseline makes one pread or pwrite per request;
+ * the backends take the same requests in batches of the queue depth. CPU time per I/O counts
+ * every thread of the process, so the thread pool's workers are included.
+ *
+ * The file is opened with O_DIRECT where the file system supports it, so reads reach the device
+ * instead of the page cache.
+ *
+ * Usage: benchmark.out fileio [file megabytes] [queue depth] [random reads]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <fileio.h>
+#include <QFile>
+#include <QScopedPointer>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+static const int readSize = 4096;
+static const int writeSize = 1024 * 1024;
+
+/**
+ * @brief Gets the CPU time the process has used
+ * @return The user and system time in nanoseconds
+ */
+static qint64 cpuNow()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (qint64(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000LL
+		+ (qint64(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+/**
+ * @brief Opens the benchmark file, directly if the file system allows it
+ * @param path The file's path
+ * @param flags The open flags
+ * @param direct Set to whether O_DIRECT was used
+ * @return The file descriptor, or -1 on error
+ */
+static int openFile(const char* path, int flags, bool& direct)
+{
+	int fd = ::open(path, flags | O_DIRECT | O_CLOEXEC, 0644);
+	direct = fd >= 0;
+	return direct ? fd : ::open(path, flags | O_CLOEXEC, 0644);
+}
+
+/**
+ * @brief Runs the file I/O benchmark
+ * @param args Optional file size in megabytes, queue depth and number of random reads
+ * @return 0 on success
+ */
+int benchFileio(const QStringList& args)
+{
+	int megabytes = args.size() > 0 ? qMax(args[0].toInt(), 1) : 256;
+	int depth = args.size() > 1 ? qMax(args[1].toInt(), 1) : 32;
+	int reads = args.size() > 2 ? qMax(args[2].toInt(), depth) : 20000;
+	const char* path = "bench_fileio.data";
+	qint64 blocks = qint64(megabytes) * writeSize / readSize;
+
+	std::mt19937 random(42);
+	std::vector<qint64> offsets(reads);
+	for (int i = 0; i < reads; i++)
+	{
+		offsets[i] = qint64(random() % quint64(blocks)) * readSize;
+	}
+
+	std::cout << megabytes << " MB file, queue depth " << depth << ", " << reads << " random reads" << std::endl;
+	std::cout << std::left << std::setw(14) << "backend" << std::right << std::setw(12) << "read IOPS"
+		<< std::setw(16) << "read CPU us/IO" << std::setw(14) << "write MB/s" << std::setw(17) << "write CPU us/IO" << std::endl;
+
+	bool ok = true;
+	bool direct = false;
+	for (int b = 0; b < 3; b++)
+	{
+		// The blocking baseline only uses the FileIo for its aligned buffers
+		bool blocking = b == 0;
+		QScopedPointer<FileIo> io(FileIo::create(depth, writeSize, b == 2 ? FileIoBackend::Uring : FileIoBackend::ThreadPool));
+		for (int i = 0; i < io->bufferCount(); i++)
+		{
+			for (int j = 0; j < writeSize; j++)
+			{
+				io->buffer(i)[j] = char(random());
+			}
+		}
+
+		// Sequential writes of the whole file, then one sync
+		QFile::remove(path);
+		int fd = openFile(path, O_RDWR | O_CREAT | O_TRUNC, direct);
+		if (fd < 0)
+		{
+			std::cout << "the benchmark file could not be created" << std::endl;
+			return 1;
+		}
+		qint64 start = benchNow();
+		qint64 cpuStart = cpuNow();
+		if (blocking)
+		{
+			for (int m = 0; m < megabytes; m++)
+			{
+				ok = pwrite(fd, io->buffer(0), writeSize, qint64(m) * writeSize) == writeSize && ok;
+			}
+			ok = fdatasync(fd) == 0 && ok;
+		}
+		else
+		{
+			std::vector<IoRequest> requests;
+			for (int m = 0; m < megabytes; m += depth)
+			{
+				requests.clear();
+				for (int i = 0; i < depth && m + i < megabytes; i++)
+				{
+					requests.push_back(FileIo::write(fd, qint64(m + i) * writeSize, io->buffer(i), writeSize, i));
+				}
+				if (m + depth >= megabytes)
+				{
+					requests.push_back(FileIo::sync(fd));
+				}
+				ok = io->run(requests.data(), int(requests.size())) && ok;
+			}
+		}
+		double writeSeconds = (benchNow() - start) / 1e9;
+		double writeCpu = double(cpuNow() - cpuStart) / 1e3 / megabytes;
+
+		// 4 KiB reads at random offsets
+		start = benchNow();
+		cpuStart = cpuNow();
+		if (blocking)
+		{
+			for (int i = 0; i < reads; i++)
+			{
+				ok = pread(fd, io->buffer(0), readSize, offsets[i]) == readSize && ok;
+			}
+		}
+		else
+		{
+			std::vector<IoRequest> requests;
+			for (int r = 0; r < reads; r += depth)
+			{
+				requests.clear();
+				for (int i = 0; i < depth && r + i < reads; i++)
+				{
+					requests.push_back(FileIo::read(fd, offsets[r + i], io->buffer(i), readSize, i));
+				}
+				ok = io->run(requests.data(), int(requests.size())) && ok;
+			}
+		}
+		double readSeconds = (benchNow() - start) / 1e9;
+		double readCpu = double(cpuNow() - cpuStart) / 1e3 / reads;
+		::close(fd);
+
+		std::cout << std::left << std::setw(14) << (blocking ? "blocking" : io->name()) << std::right << std::fixed
+			<< std::setprecision(0) << std::setw(12) << reads / readSeconds << std::setprecision(2) << std::setw(16) << readCpu
+			<< std::setprecision(0) << std::setw(14) << megabytes * (writeSize / 1e6) / writeSeconds
+			<< std::setprecision(2) << std::setw(17) << writeCpu << std::endl;
+	}
+	if (!direct)
+	{
+		std::cout << "O_DIRECT is not supported here, so reads may be served from the page cache" << std::endl;
+	}
+	if (!ok)
+	{
+		std::cout << "an I/O request failed" << std::endl;
+	}
+	QFile::remove(path);
+	return ok ? 0 : 1;
+}
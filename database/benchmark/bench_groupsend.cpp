@@ -0,0 +1,191 @@
+/**
+ * @file bench_groupsend.cpp
+ * @brief Benchmarks sending messages to a large chat with copied and with shared output frames
+ *
+ * Every member of one chat holds a binary connection to the server and one member sends a run
+ * of messages to the chat. The run is done twice, first with every frame copied into each
+ * recipient's output buffer and then with the shared frame written by scatter-gather, and the
+ * bytes copied and write system calls per delivered message are reported for both.
+ *
+ * Usage: benchmark.out groupsend [members] [messages] [message bytes]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <chatserver.h>
+#include <wireprotocol.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/**
+ * @brief Runs one group send with output sharing on or off
+ * @param path The database, which already holds the chat
+ * @param members The number of members, each of whom connects
+ * @param messages The number of messages to send
+ * @param text The message text
+ * @param shared Whether the server shares frames between connections
+ * @return 0 on success
+ */
+static int runGroupSend(const QString& path, int members, int messages, const QByteArray& text, bool shared)
+{
+	ChatServer server(path);
+	server.setSharedFrames(shared);
+	server.setLoginThrottle(false);
+	if (!server.start(0))
+	{
+		std::cout << "Error: the server could not be started" << std::endl;
+		return 1;
+	}
+
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	std::vector<int> fds;
+	for (int m = 0; m < members; m++)
+	{
+		int fd = benchBinaryClient(server.port(), QString("group%1").arg(m), "password");
+		if (fd < 0)
+		{
+			std::cout << "Error: member " << m << " could not log in; check the open file limit" << std::endl;
+			server.stop();
+			return 1;
+		}
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u32 = quint32(fds.size());
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+		fds.push_back(fd);
+	}
+
+	QByteArray burst;
+	for (int i = 0; i < messages; i++)
+	{
+		WireWriter send(quint8(WireOp::Send), quint64(i + 1));
+		send.writeVarint(1);
+		send.writeString(text);
+		send.appendTo(burst);
+	}
+
+	ServerStats before = server.stats();
+	qint64 start = benchNow();
+
+	// The first member writes the whole run from its own thread while this one reads
+	std::thread sender([&]()
+	{
+		int fd = fds[0];
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		int offset = 0;
+		while (offset < burst.size())
+		{
+			ssize_t sent = ::send(fd, burst.constData() + offset, burst.size() - offset, MSG_NOSIGNAL);
+			if (sent <= 0)
+			{
+				break;
+			}
+			offset += int(sent);
+		}
+	});
+
+	// Count message frames until they have all arrived or nothing arrives for a second
+	qint64 expected = qint64(members) * messages;
+	qint64 received = 0;
+	std::vector<QByteArray> pending(fds.size());
+	std::vector<epoll_event> events(1024);
+	qint64 lastData = benchNow();
+	while (received < expected && benchNow() - lastData < 1000000000)
+	{
+		int count = epoll_wait(epollFd, events.data(), int(events.size()), 100);
+		for (int i = 0; i < count; i++)
+		{
+			int c = int(events[i].data.u32);
+			char chunk[65536];
+			ssize_t bytes;
+			while ((bytes = recv(fds[c], chunk, sizeof(chunk), MSG_DONTWAIT)) > 0)
+			{
+				pending[c].append(chunk, int(bytes));
+			}
+
+			int offset = 0;
+			int size;
+			WireFrame frame;
+			while ((size = WireParser::parse(pending[c].constData() + offset, pending[c].size() - offset, frame)) > 0)
+			{
+				offset += size;
+				received += frame.opcode == quint8(WireOp::Message) ? 1 : 0;
+			}
+			pending[c].remove(0, offset);
+			lastData = benchNow();
+		}
+	}
+	double seconds = (benchNow() - start) / 1e9;
+	sender.join();
+	ServerStats after = server.stats();
+
+	for (size_t c = 0; c < fds.size(); c++)
+	{
+		close(fds[c]);
+	}
+	close(epollFd);
+	server.stop();
+
+	double delivered = double(qMax<qint64>(received, 1));
+	std::cout << std::left << std::setw(10) << (shared ? "shared" : "copied") << std::right << std::fixed
+		<< std::setprecision(0) << std::setw(14) << received / seconds
+		<< std::setprecision(1) << std::setw(18) << (after.bytesCopied - before.bytesCopied) / delivered
+		<< std::setprecision(3) << std::setw(18) << (after.writeCalls - before.writeCalls) / delivered
+		<< std::setw(12) << expected - received << std::endl;
+	return 0;
+}
+
+/**
+ * @brief Runs the group send benchmark
+ * @param args Optional member count, message count and message size
+ * @return 0 on success
+ */
+int benchGroupsend(const QStringList& args)
+{
+	int members = args.size() > 0 ? args[0].toInt() : 1000;
+	int messages = args.size() > 1 ? args[1].toInt() : 200;
+	int size = args.size() > 2 ? args[2].toInt() : 120;
+
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	QString path = benchDatabase("groupsend");
+	{
+		DbManager db(path, "bench-groupsend-setup");
+		db.createUserTable();
+		db.createChatTables();
+		db.database().transaction();
+		QVector<QString> names;
+		for (int m = 0; m < members; m++)
+		{
+			names.append(QString("group%1").arg(m));
+			db.addUser(names[m], "password");
+		}
+		db.addChat(1, names[0], names);
+		db.database().commit();
+		db.close();
+	}
+
+	std::cout << std::left << std::setw(10) << "frames" << std::right << std::setw(14) << "deliveries/s"
+		<< std::setw(18) << "bytes copied/msg" << std::setw(18) << "syscalls/msg" << std::setw(12) << "dropped" << std::endl;
+	QByteArray text(size, 'x');
+	if (runGroupSend(path, members, messages, text, false) != 0)
+	{
+		return 1;
+	}
+	return runGroupSend(path, members, messages, text, true);
+}
@@ -0,0 +1,136 @@
+/**
+ * @file bench_inbox.cpp
+ * @brief Benchmarks draining offline inboxes of different sizes
+ *
+ * Each inbox is filled directly in SQL and then drained as a login would drain it: once in a
+ * single call, and once in batches of the server's size, where the first batch is what the
+ * user waits for. Queuing a message for the offline members of a chat is timed as well.
+ *
+ * Usage: benchmark.out inbox [message bytes] [inbox sizes...]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <inbox.h>
+#include <chatserver.h>
+#include <QDateTime>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+
+/**
+ * @brief Fills a user's inbox with generated messages
+ * @param db The database manager
+ * @param username The user whose inbox is filled, which must be empty
+ * @param count The number of messages
+ * @param bytes The size of each message
+ * @return boolean indicating whether the inbox was filled
+ */
+static bool fillInbox(DbManager& db, const QString& username, int count, int bytes)
+{
+	QSqlQuery query(db.database());
+	query.prepare("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < :count) "
+		"INSERT INTO inbox (username, seq, chatid, sender, queued, payload) SELECT :username, i, 1, 'sender', :queued, randomblob(:bytes) FROM n");
+	query.bindValue(":count", count);
+	query.bindValue(":username", username);
+	query.bindValue(":queued", QDateTime::currentSecsSinceEpoch());
+	query.bindValue(":bytes", bytes);
+	return query.exec();
+}
+
+/**
+ * @brief Runs the inbox benchmark
+ * @param args Optional message size followed by inbox sizes
+ * @return 0 on success
+ */
+int benchInbox(const QStringList& args)
+{
+	int bytes = args.size() > 0 ? qMax(args[0].toInt(), 1) : 64;
+	QVector<int> sizes;
+	for (int i = 1; i < args.size(); i++)
+	{
+		sizes.append(args[i].toInt());
+	}
+	if (sizes.isEmpty())
+	{
+		sizes << 100 << 10000 << 1000000;
+	}
+
+	DbManager db(benchDatabase("inbox"), "bench-inbox");
+	db.createUserTable();
+	db.createChatTables();
+	int largest = *std::max_element(sizes.begin(), sizes.end());
+	InboxStore inbox(db, qMax(largest, InboxStore::defaultCapacity));
+	if (!inbox.createTables())
+	{
+		return 1;
+	}
+
+	// Queuing: one message at a time to a chat whose other members are all offline
+	const int sends = 1000;
+	QVector<QString> offline;
+	for (int m = 0; m < 100; m++)
+	{
+		offline.append(QString("away%1").arg(m));
+	}
+	QByteArray payload(bytes, 'x');
+	qint64 start = benchNow();
+	for (int i = 0; i < sends; i++)
+	{
+		inbox.store(1, "sender", payload, offline);
+	}
+	double seconds = (benchNow() - start) / 1e9;
+	std::cout << "store to " << offline.size() << " offline members: " << std::fixed << std::setprecision(0)
+		<< sends / seconds << " messages/s, " << sends * offline.size() / seconds << " rows/s" << std::endl << std::endl;
+
+	std::cout << std::left << std::setw(10) << "queued" << std::right << std::setw(16) << "full drain ms"
+		<< std::setw(16) << "messages/s" << std::setw(18) << "first batch ms" << std::setw(16) << "batched ms" << std::endl;
+
+	for (int s = 0; s < sizes.size(); s++)
+	{
+		QString username = QString("inbox%1").arg(sizes[s]);
+		int repeats = qBound(1, 100000 / qMax(sizes[s], 1), 20);
+		std::vector<qint64> full;
+		std::vector<qint64> first;
+		std::vector<qint64> batched;
+		int drained = 0;
+		for (int r = 0; r < repeats; r++)
+		{
+			fillInbox(db, username, sizes[s], bytes);
+			start = benchNow();
+			drained = inbox.drain(username).size();
+			full.push_back(benchNow() - start);
+
+			// As the server drains at login: one batch per worker job until a short batch
+			fillInbox(db, username, sizes[s], bytes);
+			start = benchNow();
+			int taken = inbox.drain(username, ChatServer::inboxBatch).size();
+			first.push_back(benchNow() - start);
+			while (taken == ChatServer::inboxBatch)
+			{
+				taken = inbox.drain(username, ChatServer::inboxBatch).size();
+			}
+			batched.push_back(benchNow() - start);
+		}
+		std::sort(full.begin(), full.end());
+		std::sort(first.begin(), first.end());
+		std::sort(batched.begin(), batched.end());
+		qint64 fullMedian = full[full.size() / 2];
+
+		std::cout << std::left << std::setw(10) << sizes[s] << std::right << std::fixed << std::setprecision(3)
+			<< std::setw(16) << fullMedian / 1e6 << std::setprecision(0) << std::setw(16) << drained / (fullMedian / 1e9)
+			<< std::setprecision(3) << std::setw(18) << first[first.size() / 2] / 1e6
+			<< std::setw(16) << batched[batched.size() / 2] / 1e6 << std::endl;
+		if (drained != sizes[s] || inbox.pending(username) != 0)
+		{
+			std::cout << "Error: drained " << drained << " of " << sizes[s] << " messages" << std::endl;
+		}
+	}
+
+	db.close();
+	return 0;
+}
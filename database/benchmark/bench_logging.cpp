@@ -0,0 +1,110 @@
+/**
+ * @file bench_logging.cpp
+ * @brief Benchmarks a client flooding addUser with a name that already exists
+ *
+ * Every rejected addUser logs an error. The flood is run once with the logger in synchronous
+ * mode, which formats and writes every message on the calling thread like the old qDebug calls,
+ * and once with the normal asynchronous, rate-limited logger. Log output goes to /dev/null so the
+ * terminal does not dominate the result. The cost of the log call alone is also measured.
+ *
+ * Usage: benchmark.out logging [calls]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <QDebug>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <unistd.h>
+
+/**
+ * @brief Prints one result row
+ * @param label What was measured
+ * @param calls The number of calls made
+ * @param elapsedNs The total time taken
+ * @return void
+ */
+static void printRow(const char* label, int calls, qint64 elapsedNs)
+{
+	std::cout << std::left << std::setw(34) << label << std::right << std::fixed << std::setprecision(2)
+		<< std::setw(12) << double(elapsedNs) / calls / 1000.0 << " us/call"
+		<< std::setw(14) << std::setprecision(0) << calls / (double(elapsedNs) / 1e9) << " calls/s" << std::endl;
+}
+
+/**
+ * @brief Runs the duplicate addUser flood benchmark
+ * @param args Optional number of calls per run
+ * @return 0 on success
+ */
+int benchLogging(const QStringList& args)
+{
+	int calls = args.size() > 0 ? args[0].toInt() : 20000;
+	FILE* devNull = fopen("/dev/null", "w");
+	if (!devNull)
+	{
+		return 1;
+	}
+
+	QString path = benchDatabase("logging");
+	{
+		DbManager db(path, "bench-logging");
+		db.createUserTable();
+		db.addUser("flood", "password");
+
+		AsyncLogger& logger = AsyncLogger::instance();
+		logger.setOutput(devNull);
+
+		// Old behaviour: every rejected call formats and writes its message before returning
+		logger.setSynchronous(true);
+		qint64 start = benchNow();
+		for (int i = 0; i < calls; i++)
+		{
+			db.addUser("flood", "password");
+		}
+		printRow("addUser flood, synchronous log", calls, benchNow() - start);
+
+		// New behaviour: rate limited, queued and written by the background thread
+		logger.setSynchronous(false);
+		start = benchNow();
+		for (int i = 0; i < calls; i++)
+		{
+			db.addUser("flood", "password");
+		}
+		printRow("addUser flood, asynchronous log", calls, benchNow() - start);
+		logger.flush();
+
+		// The log call on its own, without the database work around it
+		// qDebug writes to file descriptor 2, so point that at /dev/null for the measurement
+		fflush(stderr);
+		int savedStderr = dup(STDERR_FILENO);
+		dup2(fileno(devNull), STDERR_FILENO);
+		start = benchNow();
+		for (int i = 0; i < calls; i++)
+		{
+			qDebug() << "Error: this user already exists";
+		}
+		printRow("qDebug() alone", calls, benchNow() - start);
+		fflush(stderr);
+		dup2(savedStderr, STDERR_FILENO);
+		close(savedStderr);
+
+		start = benchNow();
+		for (int i = 0; i < calls; i++)
+		{
+			DBLOG_ERROR("benchLogging", DbErrorUserExists, 0, "this user already exists", QString());
+		}
+		printRow("DBLOG_ERROR alone", calls, benchNow() - start);
+		logger.flush();
+
+		std::cout << "Entries dropped by the ring buffer: " << logger.droppedEntries() << std::endl;
+		logger.setOutput(stderr);
+		db.close();
+	}
+	QSqlDatabase::removeDatabase("bench-logging");
+	fclose(devNull);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file bench_presence.cpp
+ * @brief Benchmarks presence updates and online filtering under many threads
+ *
+ * Threads bring every user online, then half of them offline again, then check single users
+ * and filter chat-sized lists of members against the registry while other threads keep
+ * connecting and disconnecting. Finally getOnlineChatUsers is timed for a chat in the database.
+ *
+ * Usage: benchmark.out presence [users] [threads] [chat size]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <presence.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <random>
+
+/**
+ * @brief Runs a function on several threads at once and times it
+ * @param threads The number of threads
+ * @param work The function, given the thread's index
+ * @return The elapsed time in seconds
+ */
+static double runThreads(int threads, const std::function<void(int)>& work)
+{
+	std::vector<std::thread> workers;
+	qint64 start = benchNow();
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back(work, t);
+	}
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	return (benchNow() - start) / 1e9;
+}
+
+/**
+ * @brief Prints one line of results
+ * @param name What was measured
+ * @param operations The number of operations
+ * @param seconds How long they took
+ * @return void
+ */
+static void printRate(const char* name, qint64 operations, double seconds)
+{
+	std::cout << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(0)
+		<< std::setw(14) << operations / seconds << " /s" << std::setprecision(1)
+		<< std::setw(10) << seconds * 1e9 / operations << " ns" << std::endl;
+	return;
+}
+
+/**
+ * @brief Runs the presence benchmark
+ * @param args Optional user count, thread count and chat size
+ * @return 0 on success
+ */
+int benchPresence(const QStringList& args)
+{
+	int users = args.size() > 0 ? qMax(args[0].toInt(), 1) : 1000000;
+	int threads = args.size() > 1 ? qMax(args[1].toInt(), 1) : 32;
+	int chatSize = args.size() > 2 ? qMax(args[2].toInt(), 1) : 100;
+	const int lookups = 4000000;	// in total, split between the threads
+
+	QVector<QString> names;
+	names.reserve(users);
+	for (int u = 0; u < users; u++)
+	{
+		names.append(QString("user%1").arg(u));
+	}
+	PresenceRegistry presence;
+
+	// Each thread owns the users whose index is its own modulo the thread count
+	double seconds = runThreads(threads, [&](int t)
+	{
+		for (int u = t; u < users; u += threads)
+		{
+			presence.setOnline(names[u], u);
+		}
+	});
+	printRate("setOnline, every user", users, seconds);
+
+	seconds = runThreads(threads, [&](int t)
+	{
+		for (int u = t; u < users; u += 2 * threads)
+		{
+			presence.setOffline(names[u], u);
+		}
+	});
+	printRate("setOffline, half the users", (users + 1) / 2, seconds);
+	std::cout << "online users: " << presence.onlineCount() << " of " << users << std::endl;
+
+	std::atomic<qint64> found(0);
+	seconds = runThreads(threads, [&](int t)
+	{
+		std::mt19937 random(t);
+		qint64 online = 0;
+		for (int i = 0; i < lookups / threads; i++)
+		{
+			online += presence.isOnline(names[random() % users]) ? 1 : 0;
+		}
+		found += online;
+	});
+	printRate("isOnline", qint64(lookups / threads) * threads, seconds);
+
+	// Chats of random members, filtered while a quarter of the threads churn their users
+	int chatCount = 1024;
+	std::vector<QVector<QString> > chats(chatCount);
+	std::mt19937 random(1);
+	for (int c = 0; c < chatCount; c++)
+	{
+		for (int m = 0; m < chatSize; m++)
+		{
+			chats[c].append(names[random() % users]);
+		}
+	}
+	int churners = qMax(threads / 4, 1);
+	int filters = qMax(threads - churners, 1);
+	int filtersEach = qMax(lookups / (chatSize * filters), 1);
+	std::atomic<int> filtering(filters);
+	std::atomic<qint64> updates(0);
+	std::atomic<qint64> filtered(0);
+	seconds = runThreads(churners + filters, [&](int t)
+	{
+		if (t < churners)
+		{
+			qint64 count = 0;
+			for (int u = t; filtering.load(std::memory_order_relaxed) > 0; u = (u + churners) % users)
+			{
+				presence.setOnline(names[u], -1);
+				presence.setOffline(names[u], -1);
+				count += 2;
+			}
+			updates += count;
+			return;
+		}
+		qint64 kept = 0;
+		for (int i = 0; i < filtersEach; i++)
+		{
+			kept += presence.filterOnline(chats[(t * 7919 + i) % chatCount]).size();
+		}
+		filtered += kept;
+		filtering--;
+	});
+	printRate("filterOnline, one chat", qint64(filtersEach) * filters, seconds);
+	printRate("  members checked", qint64(filtersEach) * filters * chatSize, seconds);
+	printRate("  concurrent updates", updates.load(), seconds);
+
+	// The same filter through the database for one chat
+	DbManager db(benchDatabase("presence"), "bench-presence");
+	db.createUserTable();
+	db.createChatTables();
+	int members = qMin(chatSize, users);
+	QVector<QString> chatMembers;
+	db.database().transaction();
+	for (int m = 0; m < members; m++)
+	{
+		chatMembers.append(names[m]);
+		db.addUser(names[m], "password");
+	}
+	db.addChat(1, chatMembers[0], chatMembers);
+	db.database().commit();
+	db.setPresence(&presence);
+
+	const int calls = 2000;
+	int online = 0;
+	qint64 start = benchNow();
+	for (int i = 0; i < calls; i++)
+	{
+		online = db.getOnlineChatUsers(1).size();
+	}
+	printRate("getOnlineChatUsers", calls, (benchNow() - start) / 1e9);
+	std::cout << "online members: " << online << " of " << members << std::endl;
+
+	db.close();
+	return 0;
+}
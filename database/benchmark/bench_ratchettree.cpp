@@ -0,0 +1,126 @@
+/**
+ * @file bench_ratchettree.cpp
+ * @brief Benchmarks tree-based group rekeying against sealing a new group key for every member
+ *
+ * For each chat size a chat and its key tree are built, then members are removed and added.
+ * Each change is compared with the flat scheme, which seals a fresh group key under the user key
+ * of every remaining member. Reported per change: encryptions, bytes members must download and
+ * time; per chat: the stored size of the tree.
+ *
+ * Usage: benchmark.out ratchettree [chat sizes...]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <senderkeys.h>
+#include <ratchettree.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * @brief Runs the group rekeying benchmark
+ * @param args Optional list of chat sizes
+ * @return 0 on success
+ */
+int benchRatchettree(const QStringList& args)
+{
+	QVector<int> sizes;
+	for (int i = 0; i < args.size(); i++)
+	{
+		sizes.append(args[i].toInt());
+	}
+	if (sizes.isEmpty())
+	{
+		sizes << 10 << 100 << 1000 << 10000 << 50000;
+	}
+	const int changes = 10;
+
+	QString path = benchDatabase("ratchettree");
+	DbManager db(path, "bench-ratchettree");
+	db.createUserTable();
+	db.createChatTables();
+	SenderKeyManager keys(db);
+	keys.createTables();
+	RatchetTreeManager trees(db, keys);
+	trees.createTables();
+
+	std::cout << std::left << std::setw(9) << "members" << std::right << std::setw(12) << "build ms" << std::setw(12) << "tree KB"
+		<< std::setw(12) << "flat seals" << std::setw(12) << "flat KB" << std::setw(12) << "flat ms"
+		<< std::setw(12) << "tree seals" << std::setw(12) << "tree bytes" << std::setw(12) << "tree ms" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+
+	for (int s = 0; s < sizes.size(); s++)
+	{
+		int chatID = s + 1;
+		QVector<QString> members;
+		QVector<QByteArray> memberKeys;
+		QSqlDatabase connection = db.database();
+		connection.transaction();
+		for (int m = 0; m < sizes[s] + changes; m++)
+		{
+			QString name = QString("chat%1user%2").arg(chatID).arg(m);
+			db.addUser(name, "password");
+			if (m < sizes[s])
+			{
+				members.append(name);
+			}
+			memberKeys.append(keys.userKey(name));
+		}
+		connection.commit();
+		db.addChat(chatID, members[0], members);
+
+		qint64 start = benchNow();
+		trees.createGroup(chatID);
+		double build = (benchNow() - start) / 1000000.0;
+		qint64 treeBytes = trees.stateSize(chatID);
+
+		// The flat scheme: a new group key sealed for each of the n - 1 remaining members
+		QByteArray groupKey = MessageCrypto::generateKey();
+		qint64 flatBytes = 0;
+		start = benchNow();
+		for (int m = 1; m < members.size(); m++)
+		{
+			MessageCrypto crypto(memberKeys[m]);
+			flatBytes += crypto.seal(groupKey).size();
+		}
+		double flat = (benchNow() - start) / 1000000.0;
+
+		// Tree changes: remove some members, then add new ones into the freed leaves
+		qint64 treeSeals = 0;
+		qint64 updateBytes = 0;
+		int removed = qMin(changes, sizes[s] - 1);
+		start = benchNow();
+		for (int c = 0; c < removed; c++)
+		{
+			trees.removeMember(chatID, members[members.size() - 1 - c * (members.size() / (removed + 1))]);
+			treeSeals += trees.lastEncryptions();
+			updateBytes += trees.lastUpdateBytes();
+		}
+		for (int c = 0; c < changes; c++)
+		{
+			trees.addMember(chatID, QString("chat%1user%2").arg(chatID).arg(sizes[s] + c));
+			treeSeals += trees.lastEncryptions();
+			updateBytes += trees.lastUpdateBytes();
+		}
+		double tree = (benchNow() - start) / 1000000.0 / (removed + changes);
+
+		QByteArray rootKey = trees.groupKey(chatID);
+		if (rootKey.isEmpty() || trees.memberGroupKey(chatID, members[0]) != rootKey
+			|| trees.memberGroupKey(chatID, QString("chat%1user%2").arg(chatID).arg(sizes[s])) != rootKey)
+		{
+			std::cout << "Error: a member derived the wrong group key" << std::endl;
+			return 1;
+		}
+
+		std::cout << std::left << std::setw(9) << sizes[s] << std::right << std::setw(12) << build << std::setw(12) << treeBytes / 1024.0
+			<< std::setw(12) << members.size() - 1 << std::setw(12) << flatBytes / 1024.0 << std::setw(12) << flat
+			<< std::setw(12) << double(treeSeals) / (removed + changes) << std::setw(12) << double(updateBytes) / (removed + changes)
+			<< std::setw(12) << tree << std::endl;
+	}
+
+	db.close();
+	return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file bench_resultsets.cpp
+ * @brief Benchmarks arena-backed membership results against QVector<QString> results
+ *
+ * Chats of several sizes are read with getChatUsers and with getChatUserList, first from SQLite
+ * and then from a membership snapshot, and a user in many chats is read with getChatsUserIsIn and
+ * getChatIdsUserIsIn. Each call is timed and its heap allocations counted; every result is also
+ * walked once, as a caller would, so the cost of reading it back is included.
+ *
+ * Allocations are counted by the allocator in benchheap.cpp, so they include Qt's, SQLite's and
+ * operator new's. Where the C library cannot be interposed the counts are reported as unavailable.
+ *
+ * Usage: benchmark.out resultsets [largest chat] [calls]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+/**
+ * @brief Times a call and counts its allocations, averaged over many calls
+ * @param label The row label
+ * @param calls The number of calls
+ * @param call The call, which also walks its result
+ * @return void
+ */
+static void measure(const std::string& label, int calls, const std::function<void()>& call)
+{
+	// One call first, so the arena pool and SQLite's caches are warm
+	call();
+	qint64 allocations = benchHeap().allocations;
+	qint64 start = benchNow();
+	for (int i = 0; i < calls; i++)
+	{
+		call();
+	}
+	double micros = (benchNow() - start) / 1000.0 / calls;
+	BenchHeap heap = benchHeap();
+	allocations = heap.allocations - allocations;
+	std::cout << std::left << std::setw(44) << label << std::right << std::setw(12) << std::setprecision(1) << micros;
+	if (heap.counted)
+	{
+		std::cout << std::setw(16) << std::setprecision(1) << double(allocations) / calls;
+	}
+	else
+	{
+		std::cout << std::setw(16) << "n/a";
+	}
+	std::cout << std::endl;
+	return;
+}
+
+/**
+ * @brief Runs the result set benchmark
+ * @param args Optional largest chat size and number of calls per measurement
+ * @return 0 on success
+ */
+int benchResultsets(const QStringList& args)
+{
+	int largest = args.size() > 0 ? qMax(args[0].toInt(), 10) : 10000;
+	int calls = args.size() > 1 ? qMax(args[1].toInt(), 1) : 200;
+	int userChats = 1000;
+	QVector<int> sizes;
+	for (int size = 10; size <= largest; size *= 10)
+	{
+		sizes.append(size);
+	}
+	if (sizes.last() != largest)
+	{
+		sizes.append(largest);
+	}
+
+	QString path = benchDatabase("resultsets");
+	DbManager db(path, "bench-resultsets");
+	db.createUserTable();
+	db.createChatTables();
+	db.database().transaction();
+	QVector<QString> users;
+	for (int u = 0; u < largest; u++)
+	{
+		users.append(QString("member%1").arg(u));
+		db.addUser(users.last(), "password");
+	}
+	for (int s = 0; s < sizes.size(); s++)
+	{
+		db.addChat(s + 1, users[0], users.mid(0, sizes[s]));
+	}
+	// users[1] is also in many small chats
+	for (int c = 0; c < userChats; c++)
+	{
+		QVector<QString> members;
+		members.append(users[1]);
+		members.append(users[2 + c % (largest - 2)]);
+		db.addChat(100 + c, users[1], members);
+	}
+	db.database().commit();
+
+	qint64 walked = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			db.writeMembershipSnapshot(path + ".snap");
+			db.loadMembershipSnapshot(path + ".snap");
+		}
+		std::cout << (pass == 0 ? "From SQLite" : "From a membership snapshot") << std::endl;
+		std::cout << std::left << std::setw(44) << "call" << std::right << std::setw(12) << "us/call" << std::setw(16) << "allocs/call" << std::endl;
+		std::cout << std::fixed;
+		for (int s = 0; s < sizes.size(); s++)
+		{
+			int chatID = s + 1;
+			measure(QString("getChatUsers, %1 members").arg(sizes[s]).toStdString(), calls, [&]()
+			{
+				QVector<QString> members = db.getChatUsers(chatID);
+				for (const QString& member : members)
+				{
+					walked += member.size();
+				}
+			});
+			measure(QString("getChatUserList, %1 members").arg(sizes[s]).toStdString(), calls, [&]()
+			{
+				UsernameList members = db.getChatUserList(chatID);
+				for (Utf8View member : members)
+				{
+					walked += member.size();
+				}
+			});
+		}
+		measure(QString("getChatsUserIsIn, %1 chats").arg(userChats + sizes.size()).toStdString(), calls, [&]()
+		{
+			QVector<int> chats = db.getChatsUserIsIn(users[1]);
+			for (int chatID : chats)
+			{
+				walked += chatID;
+			}
+		});
+		measure(QString("getChatIdsUserIsIn, %1 chats").arg(userChats + sizes.size()).toStdString(), calls, [&]()
+		{
+			ChatIdList chats = db.getChatIdsUserIsIn(users[1]);
+			for (int chatID : chats)
+			{
+				walked += chatID;
+			}
+		});
+		std::cout << std::endl;
+	}
+	std::cout << "(" << walked << " characters and IDs walked)" << std::endl;
+	return 0;
+}
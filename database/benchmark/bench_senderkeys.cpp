@@ -0,0 +1,109 @@
+/**
+ * @file bench_senderkeys.cpp
+ * @brief Benchmarks sealing a chat message per recipient against sealing it once with a sender key
+ *
+ * For each chat size a chat is created and one member sends 1 KB messages. The per-recipient
+ * scheme seals every message once for each member under that member's key; the sender key scheme
+ * pays one distribution per membership epoch and then seals every message once. The cost of the
+ * distribution and of a message after it are reported separately.
+ *
+ * Usage: benchmark.out senderkeys [chat sizes...]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <senderkeys.h>
+#include <QSharedPointer>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * @brief Runs the sender key benchmark
+ * @param args Optional list of chat sizes
+ * @return 0 on success
+ */
+int benchSenderkeys(const QStringList& args)
+{
+	QVector<int> sizes;
+	for (int i = 0; i < args.size(); i++)
+	{
+		sizes.append(args[i].toInt());
+	}
+	if (sizes.isEmpty())
+	{
+		sizes << 2 << 10 << 100 << 1000 << 10000;
+	}
+
+	QString path = benchDatabase("senderkeys");
+	DbManager db(path, "bench-senderkeys");
+	db.createUserTable();
+	db.createChatTables();
+	SenderKeyManager keys(db);
+	keys.createTables();
+	QByteArray message(1024, 'x');
+
+	std::cout << std::left << std::setw(10) << "members" << std::right << std::setw(22) << "per-recipient us/msg"
+		<< std::setw(22) << "distribution us" << std::setw(22) << "sender key us/msg" << std::setw(12) << "speedup" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+
+	for (int s = 0; s < sizes.size(); s++)
+	{
+		int chatID = s + 1;
+		QVector<QString> members;
+		QVector<QSharedPointer<MessageCrypto> > memberCrypto;
+		QSqlDatabase connection = db.database();
+		connection.transaction();
+		for (int m = 0; m < sizes[s]; m++)
+		{
+			members.append(QString("chat%1user%2").arg(chatID).arg(m));
+			db.addUser(members[m], "password");
+			memberCrypto.append(QSharedPointer<MessageCrypto>(new MessageCrypto(keys.userKey(members[m]))));
+		}
+		connection.commit();
+		db.addChat(chatID, members[0], members);
+
+		// Enough messages for a stable figure without the largest chats taking minutes
+		int messages = qMax(10, 200000 / sizes[s]);
+
+		qint64 start = benchNow();
+		for (int i = 0; i < messages; i++)
+		{
+			for (int m = 0; m < memberCrypto.size(); m++)
+			{
+				memberCrypto[m]->seal(message);
+			}
+		}
+		double perRecipient = (benchNow() - start) / 1000.0 / messages;
+
+		ChatCiphertext sealed;
+		start = benchNow();
+		keys.encryptForChat(chatID, members[0], message, sealed);
+		double distribution = (benchNow() - start) / 1000.0;
+
+		int senderMessages = 20000;
+		start = benchNow();
+		for (int i = 0; i < senderMessages; i++)
+		{
+			keys.encryptForChat(chatID, members[0], message, sealed);
+		}
+		double senderKey = (benchNow() - start) / 1000.0 / senderMessages;
+
+		QByteArray opened;
+		if (!keys.decryptForMember(sealed, members.last(), opened) || opened != message)
+		{
+			std::cout << "Error: a member could not decrypt the chat message" << std::endl;
+			return 1;
+		}
+
+		std::cout << std::left << std::setw(10) << sizes[s] << std::right << std::setw(22) << perRecipient
+			<< std::setw(22) << distribution << std::setw(22) << senderKey
+			<< std::setw(11) << perRecipient / senderKey << "x" << std::endl;
+	}
+
+	std::cout << keys.distributionsSealed() << " sender key copies distributed in total" << std::endl;
+	db.close();
+	return 0;
+}
@@ -0,0 +1,255 @@
+/**
+ * @file bench_server.cpp
+ * @brief Load-tests the chat server over loopback
+ *
+ * Starts a ChatServer on a free port and has client threads open and log in the requested
+ * number of connections, then has every connection fetch its roster over and over, one request
+ * outstanding at a time, for a fixed time. Reports the connections held and requests per second.
+ *
+ * Usage: benchmark.out server [connections] [seconds] [loops]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <chatserver.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+
+// Users the connections log in as; connection i uses user i % benchUsers
+static const int benchUsers = 1000;
+
+/**
+ * @brief Opens a connection to the server and sends its login request
+ * @param port The server's port
+ * @param user The number of the user to log in as
+ * @return The non-blocking socket, or -1 if it could not connect
+ */
+static int openClient(quint16 port, int user)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	QByteArray login = QString("LOGIN load%1 password%1\n").arg(user).toUtf8();
+	int on = 1;
+	if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+		|| send(fd, login.constData(), login.size(), MSG_NOSIGNAL) != login.size())
+	{
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+/**
+ * @brief Reads what a client connection has received
+ * @param fd The socket
+ * @return The number of complete lines received, or -1 if the connection closed
+ */
+static int readReplies(int fd)
+{
+	char buffer[65536];
+	int lines = 0;
+	while (true)
+	{
+		ssize_t received = read(fd, buffer, sizeof(buffer));
+		if (received > 0)
+		{
+			for (ssize_t i = 0; i < received; i++)
+			{
+				lines += buffer[i] == '\n' ? 1 : 0;
+			}
+			continue;
+		}
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? lines : -1;
+	}
+}
+
+/**
+ * @brief Runs the server load test
+ * @param args Optional connection count, seconds to run for and number of server event loops
+ * @return 0 on success
+ */
+int benchServer(const QStringList& args)
+{
+	int connections = args.size() > 0 ? args[0].toInt() : 10000;
+	int seconds = args.size() > 1 ? args[1].toInt() : 5;
+	int loops = args.size() > 2 ? args[2].toInt() : 0;
+	int clients = qMax(int(std::thread::hardware_concurrency()) / 2, 1);
+
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// Users in chats of ten, so every roster fetch has something to return
+	QString path = benchDatabase("server");
+	{
+		DbManager db(path, "bench-server-setup");
+		db.createUserTable();
+		db.createChatTables();
+		db.database().transaction();
+		for (int u = 0; u < benchUsers; u++)
+		{
+			db.addUser(QString("load%1").arg(u), QString("password%1").arg(u));
+		}
+		for (int c = 0; c < benchUsers / 10; c++)
+		{
+			QVector<QString> members;
+			for (int m = 0; m < 10; m++)
+			{
+				members.append(QString("load%1").arg(c * 10 + m));
+			}
+			db.addChat(c + 1, members[0], members);
+		}
+		db.database().commit();
+		db.close();
+	}
+
+	ChatServer server(path);
+	server.setLoginThrottle(false);
+	if (!server.start(0, loops))
+	{
+		std::cout << "Error: the server could not be started" << std::endl;
+		return 1;
+	}
+	quint16 port = server.port();
+
+	std::atomic<int> held(0);
+	std::atomic<int> clientsReady(0);
+	std::atomic<bool> go(false);
+	std::atomic<qint64> requests(0);
+	qint64 deadline = 0;
+	std::vector<std::thread> threads;
+	qint64 start = benchNow();
+	for (int t = 0; t < clients; t++)
+	{
+		threads.emplace_back([&, t]()
+		{
+			int epollFd = epoll_create1(EPOLL_CLOEXEC);
+			std::vector<int> fds;
+			for (int i = t; i < connections; i += clients)
+			{
+				int fd = openClient(port, i % benchUsers);
+				if (fd < 0)
+				{
+					break;
+				}
+				epoll_event event;
+				event.events = EPOLLIN | EPOLLET;
+				event.data.u32 = quint32(fds.size());
+				epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+				fds.push_back(fd);
+			}
+
+			// Wait for every login reply
+			std::vector<epoll_event> events(1024);
+			int waiting = int(fds.size());
+			while (waiting > 0)
+			{
+				int count = epoll_wait(epollFd, events.data(), int(events.size()), 10000);
+				if (count <= 0)
+				{
+					break;
+				}
+				for (int i = 0; i < count; i++)
+				{
+					int lines = readReplies(fds[events[i].data.u32]);
+					waiting -= lines < 0 ? 1 : lines;
+					held.fetch_add(qMax(lines, 0));
+				}
+			}
+
+			clientsReady.fetch_add(1);
+			while (!go.load())
+			{
+				std::this_thread::yield();
+			}
+
+			const char request[] = "ROSTER\n";
+			for (size_t i = 0; i < fds.size(); i++)
+			{
+				send(fds[i], request, sizeof(request) - 1, MSG_NOSIGNAL);
+			}
+			qint64 replies = 0;
+			while (benchNow() < deadline)
+			{
+				int count = epoll_wait(epollFd, events.data(), int(events.size()), 100);
+				for (int i = 0; i < count; i++)
+				{
+					int fd = fds[events[i].data.u32];
+					int lines = readReplies(fd);
+					for (int r = 0; r < lines; r++)
+					{
+						send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+					}
+					replies += qMax(lines, 0);
+				}
+			}
+			requests.fetch_add(replies);
+
+			for (size_t i = 0; i < fds.size(); i++)
+			{
+				close(fds[i]);
+			}
+			close(epollFd);
+		});
+	}
+
+	while (clientsReady.load() < clients)
+	{
+		std::this_thread::yield();
+	}
+	double connectSeconds = (benchNow() - start) / 1e9;
+	qint64 serverConnections = server.stats().connections;
+
+	deadline = benchNow() + qint64(seconds) * 1000000000;
+	go = true;
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	server.stop();
+
+	std::cout << std::fixed << std::setprecision(0);
+	std::cout << std::left << std::setw(28) << "connections requested" << std::right << std::setw(14) << connections << std::endl;
+	std::cout << std::left << std::setw(28) << "connections held" << std::right << std::setw(14) << serverConnections << std::endl;
+	std::cout << std::left << std::setw(28) << "logins/s" << std::right << std::setw(14) << held.load() / connectSeconds << std::endl;
+	std::cout << std::left << std::setw(28) << "roster requests/s" << std::right << std::setw(14) << requests.load() / double(seconds) << std::endl;
+
+	if (held.load() < connections)
+	{
+		std::cout << "Warning: only " << held.load() << " connections logged in; check the open file limit" << std::endl;
+	}
+	return 0;
+}
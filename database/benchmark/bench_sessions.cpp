@@ -0,0 +1,108 @@
+/**
+ * @file bench_sessions.cpp
+ * @brief Benchmarks session token checks against checking credentials in the database
+ *
+ * A set of users logs in once to get tokens. Then every request is authenticated either by
+ * calling checkUserInfo, as a server without sessions would, or by verifying the user's token,
+ * on one thread and on several threads sharing one SessionManager.
+ *
+ * Usage: benchmark.out sessions [users] [threads]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <sessionmanager.h>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Runs the session token benchmark
+ * @param args Optional user count and thread count
+ * @return 0 on success
+ */
+int benchSessions(const QStringList& args)
+{
+	int users = args.size() > 0 ? args[0].toInt() : 1000;
+	int threads = args.size() > 1 ? args[1].toInt() : int(std::thread::hardware_concurrency());
+	threads = qMax(threads, 1);
+	const int checks = 20000;
+	const int verifications = 2000000;
+
+	DbManager db(benchDatabase("sessions"), "bench-sessions");
+	db.createUserTable();
+	db.database().transaction();
+	for (int u = 0; u < users; u++)
+	{
+		db.addUser(QString("user%1").arg(u), QString("password%1").arg(u));
+	}
+	db.database().commit();
+
+	SessionManager sessions(db);
+	QVector<QByteArray> tokens;
+	for (int u = 0; u < users; u++)
+	{
+		tokens.append(sessions.login(QString("user%1").arg(u), QString("password%1").arg(u)));
+	}
+	sessions.revoke(tokens[0]);
+	tokens[0] = sessions.login("user0", "password0");
+
+	std::cout << std::fixed << std::setprecision(0);
+
+	qint64 start = benchNow();
+	for (int i = 0; i < checks; i++)
+	{
+		int u = i % users;
+		db.checkUserInfo(QString("user%1").arg(u), QString("password%1").arg(u));
+	}
+	double checkRate = checks / ((benchNow() - start) / 1e9);
+	std::cout << std::left << std::setw(36) << "checkUserInfo" << std::right << std::setw(14) << checkRate << " /s" << std::endl;
+
+	int failures = 0;
+	start = benchNow();
+	for (int i = 0; i < verifications; i++)
+	{
+		QString username;
+		failures += sessions.verify(tokens[i % users], username) ? 0 : 1;
+	}
+	double verifyRate = verifications / ((benchNow() - start) / 1e9);
+	std::cout << std::left << std::setw(36) << "token verify, 1 thread" << std::right << std::setw(14) << verifyRate
+		<< " /s (" << std::setprecision(1) << verifyRate / checkRate << "x)" << std::setprecision(0) << std::endl;
+
+	std::vector<std::thread> workers;
+	std::vector<int> workerFailures(threads, 0);
+	start = benchNow();
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&, t]()
+		{
+			for (int i = t; i < verifications; i += threads)
+			{
+				workerFailures[t] += sessions.verify(tokens[i % users]) ? 0 : 1;
+			}
+		});
+	}
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	double threadedRate = verifications / ((benchNow() - start) / 1e9);
+	for (int t = 0; t < threads; t++)
+	{
+		failures += workerFailures[t];
+	}
+	std::cout << std::left << std::setw(36) << QString("token verify, %1 threads").arg(threads).toStdString() << std::right
+		<< std::setw(14) << threadedRate << " /s" << std::endl;
+
+	if (failures > 0)
+	{
+		std::cout << "Error: " << failures << " valid tokens were rejected" << std::endl;
+		return 1;
+	}
+	db.close();
+	return 0;
+}
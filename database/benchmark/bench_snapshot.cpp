@@ -0,0 +1,118 @@
+/**
+ * @file bench_snapshot.cpp
+ * @brief Benchmarks cold start from a membership snapshot against warming up from SQLite
+ *
+ * A database with the requested number of chats and members is built and snapshotted.
+ * Each cold start opens a new DbManager and measures the time until membership for every
+ * active chat can be served: by re-querying chatusers for each chat (the old warm-up), or by
+ * mapping the snapshot and catching up from the change log. A few chats are changed after the
+ * snapshot is written so the catch-up path is exercised too.
+ *
+ * Usage: benchmark.out snapshot [chats] [members per chat] [users]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * @brief Runs the membership snapshot cold start benchmark
+ * @param args Optional chat count, members per chat and user count
+ * @return 0 on success
+ */
+int benchSnapshot(const QStringList& args)
+{
+	int chats = args.size() > 0 ? args[0].toInt() : 2000;
+	int membersPerChat = args.size() > 1 ? args[1].toInt() : 50;
+	int users = args.size() > 2 ? args[2].toInt() : 10000;
+	QString path = benchDatabase("snapshot");
+	QString snapshotPath = path + ".snap";
+
+	std::cout << "Building " << chats << " chats of " << membersPerChat << " members from " << users << " users" << std::endl;
+	{
+		DbManager db(path, "bench-snapshot");
+		db.createUserTable();
+		db.createChatTables();
+
+		QSqlDatabase connection = QSqlDatabase::database("bench-snapshot");
+		connection.transaction();
+		for (int u = 0; u < users; u++)
+		{
+			db.addUser(QString("user%1").arg(u), "password");
+		}
+		for (int c = 1; c <= chats; c++)
+		{
+			QVector<QString> members;
+			for (int m = 0; m < membersPerChat; m++)
+			{
+				members.append(QString("user%1").arg((c * 7919 + m * 104729) % users));
+			}
+			db.addChat(c, members[0], members);
+		}
+		connection.commit();
+
+		qint64 start = benchNow();
+		db.writeMembershipSnapshot(snapshotPath);
+		std::cout << "Snapshot written in " << (benchNow() - start) / 1000000.0 << " ms" << std::endl;
+
+		// Changes after the snapshot, which the cold start has to catch up on
+		for (int c = 1; c <= 10 && c <= chats; c++)
+		{
+			db.removeChat(c, db.getChatOwner(c));
+		}
+		db.close();
+	}
+	QSqlDatabase::removeDatabase("bench-snapshot");
+
+	std::cout << std::fixed << std::setprecision(2);
+
+	// Old cold start: every active chat is re-queried before fan-out can be served
+	{
+		qint64 start = benchNow();
+		DbManager db(path, "bench-warm");
+		qint64 members = 0;
+		for (int c = 1; c <= chats; c++)
+		{
+			members += db.getChatUsers(c).size();
+		}
+		std::cout << std::left << std::setw(36) << "Warm from SQLite" << std::right
+			<< std::setw(12) << (benchNow() - start) / 1000000.0 << " ms to serve all chats ("
+			<< members << " memberships)" << std::endl;
+		db.close();
+	}
+	QSqlDatabase::removeDatabase("bench-warm");
+
+	// New cold start: map the snapshot, catch up, and serve
+	{
+		qint64 start = benchNow();
+		DbManager db(path, "bench-mapped");
+		if (!db.loadMembershipSnapshot(snapshotPath))
+		{
+			std::cout << "Error: the snapshot could not be loaded" << std::endl;
+			return 1;
+		}
+		qint64 loaded = benchNow();
+		db.getChatUsers(chats);
+		qint64 first = benchNow();
+		qint64 members = 0;
+		for (int c = 1; c <= chats; c++)
+		{
+			members += db.getChatUsers(c).size();
+		}
+		qint64 all = benchNow();
+
+		std::cout << std::left << std::setw(36) << "Mapped snapshot + catch-up" << std::right
+			<< std::setw(12) << (loaded - start) / 1000000.0 << " ms to load" << std::endl;
+		std::cout << std::left << std::setw(36) << "  first request served after" << std::right
+			<< std::setw(12) << (first - start) / 1000000.0 << " ms" << std::endl;
+		std::cout << std::left << std::setw(36) << "  all chats served after" << std::right
+			<< std::setw(12) << (all - start) / 1000000.0 << " ms (" << members << " memberships)" << std::endl;
+		db.close();
+	}
+	QSqlDatabase::removeDatabase("bench-mapped");
+	return 0;
+}
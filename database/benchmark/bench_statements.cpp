@@ -0,0 +1,312 @@
+/**
+ * @file bench_statements.cpp
+ * @brief Benchmarks the per-call overhead of DbManager's point lookups against hand-written queries
+ *
+ * userExists, chatExists, getChatOwner and checkUserInfo are each timed five ways on the same
+ * database: as DbManager ran them before typed statements, with a QSqlQuery prepared for every
+ * call using named placeholders and counted by seeking to its last row; with one forward-only
+ * QSqlQuery prepared once and bound by position; through DbManager on the QtSql backend and on
+ * the sqlite3 backend; and as a hand-written sqlite3 statement prepared once, which is the least
+ * any lookup can cost. The last two columns show what DbManager adds to a lookup.
+ *
+ * Usage: benchmark.out statements [users] [calls]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <sqlite3.h>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+/**
+ * @brief Times a call
+ * @param calls The number of calls
+ * @param call The call, given its index
+ * @return The time per call in microseconds
+ */
+static double timeCalls(int calls, const std::function<void(int)>& call)
+{
+	call(0);
+	qint64 start = benchNow();
+	for (int i = 0; i < calls; i++)
+	{
+		call(i);
+	}
+	return (benchNow() - start) / 1000.0 / calls;
+}
+
+/**
+ * @brief Prints one row of the comparison
+ * @param label The row label
+ * @param micros The time per call in microseconds for each way of running the lookup
+ * @return void
+ */
+static void printRow(const std::string& label, const QVector<double>& micros)
+{
+	std::cout << std::left << std::setw(16) << label << std::right << std::setprecision(2);
+	for (double time : micros)
+	{
+		std::cout << std::setw(12) << time;
+	}
+	std::cout << std::endl;
+	return;
+}
+
+/**
+ * @brief Runs a hand-written sqlite3 lookup with one parameter
+ * @param statement The prepared statement
+ * @param text The text parameter, or nullptr to bind number instead
+ * @param number The integer parameter
+ * @param second A second text parameter, or nullptr if there is none
+ * @return boolean indicating whether there was a row
+ */
+static bool rawLookup(sqlite3_stmt* statement, const QByteArray* text, int number, const QByteArray* second)
+{
+	if (text)
+	{
+		sqlite3_bind_text(statement, 1, text->constData(), text->size(), SQLITE_STATIC);
+	}
+	else
+	{
+		sqlite3_bind_int(statement, 1, number);
+	}
+	if (second)
+	{
+		sqlite3_bind_text(statement, 2, second->constData(), second->size(), SQLITE_STATIC);
+	}
+	bool found = sqlite3_step(statement) == SQLITE_ROW;
+	sqlite3_reset(statement);
+	return found;
+}
+
+/**
+ * @brief Runs the statement overhead benchmark
+ * @param args Optional user count and number of calls per measurement
+ * @return 0 on success
+ */
+int benchStatements(const QStringList& args)
+{
+	int userCount = args.size() > 0 ? qMax(args[0].toInt(), 10) : 10000;
+	int calls = args.size() > 1 ? qMax(args[1].toInt(), 1) : 100000;
+	int chats = userCount / 10;
+
+	QString path = benchDatabase("statements");
+	QVector<QString> users;
+	QVector<QByteArray> utf8Users;
+	{
+		DbManager fill(path, "bench-statements-fill");
+		fill.createUserTable();
+		fill.createChatTables();
+		fill.database().transaction();
+		for (int u = 0; u < userCount; u++)
+		{
+			users.append(QString("member%1").arg(u));
+			utf8Users.append(users.last().toUtf8());
+			fill.addUser(users.last(), "password");
+		}
+		for (int c = 0; c < chats; c++)
+		{
+			QVector<QString> members;
+			members.append(users[c]);
+			fill.addChat(c + 1, users[c], members);
+		}
+		fill.database().commit();
+	}
+	QByteArray password("password");
+
+	DbManager qtsql(path, "bench-statements-qtsql", StorageKind::QtSql);
+	DbManager sqlite(path, "bench-statements-sqlite", StorageKind::Sqlite);
+	if (sqlite.storageKind() != StorageKind::Sqlite)
+	{
+		std::cout << "The connection has no sqlite3 handle, so the sqlite3 column would measure QtSql" << std::endl;
+		return 1;
+	}
+	QSqlDatabase db = qtsql.database();
+	sqlite3* connection = nullptr;
+	sqlite3_open_v2(QFile::encodeName(path).constData(), &connection, SQLITE_OPEN_READONLY, nullptr);
+	// Every way finishes its statements after each call, so none keeps a read transaction open between calls
+
+	qint64 found = 0;
+	std::cout << std::fixed << calls << " calls each, times in microseconds per call" << std::endl;
+	std::cout << std::left << std::setw(16) << "lookup" << std::right << std::setw(12) << "named" << std::setw(12) << "positional"
+		<< std::setw(12) << "QtSql" << std::setw(12) << "sqlite3" << std::setw(12) << "hand-made" << std::endl;
+
+	// userExists
+	{
+		QSqlQuery positional(db);
+		positional.setForwardOnly(true);
+		positional.prepare("SELECT username FROM userinfo WHERE username = ?");
+		sqlite3_stmt* raw = nullptr;
+		sqlite3_prepare_v2(connection, "SELECT username FROM userinfo WHERE username = ?", -1, &raw, nullptr);
+		QVector<double> micros;
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			QSqlQuery query(db);
+			query.prepare("SELECT username FROM userinfo WHERE username = (:inputusername)");
+			query.bindValue(":inputusername", users[i % userCount]);
+			found += query.exec() && qtsql.sqlSize(query) > 0;
+		}));
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			positional.bindValue(0, users[i % userCount]);
+			found += positional.exec() && positional.next();
+			positional.finish();
+		}));
+		micros.append(timeCalls(calls, [&](int i) { found += qtsql.userExists(users[i % userCount]); }));
+		micros.append(timeCalls(calls, [&](int i) { found += sqlite.userExists(users[i % userCount]); }));
+		micros.append(timeCalls(calls, [&](int i) { found += rawLookup(raw, &utf8Users[i % userCount], 0, nullptr); }));
+		printRow("userExists", micros);
+		sqlite3_finalize(raw);
+	}
+
+	// chatExists
+	{
+		QSqlQuery positional(db);
+		positional.setForwardOnly(true);
+		positional.prepare("SELECT chatid FROM chats WHERE chatid = ?");
+		sqlite3_stmt* raw = nullptr;
+		sqlite3_prepare_v2(connection, "SELECT chatid FROM chats WHERE chatid = ?", -1, &raw, nullptr);
+		QVector<double> micros;
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			QSqlQuery query(db);
+			query.prepare("SELECT * FROM chats WHERE chatid = (:chatID)");
+			query.bindValue(":chatID", 1 + i % chats);
+			found += query.exec() && qtsql.sqlSize(query) > 0;
+		}));
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			positional.bindValue(0, 1 + i % chats);
+			found += positional.exec() && positional.next();
+			positional.finish();
+		}));
+		micros.append(timeCalls(calls, [&](int i) { found += qtsql.chatExists(1 + i % chats); }));
+		micros.append(timeCalls(calls, [&](int i) { found += sqlite.chatExists(1 + i % chats); }));
+		micros.append(timeCalls(calls, [&](int i) { found += rawLookup(raw, nullptr, 1 + i % chats, nullptr); }));
+		printRow("chatExists", micros);
+		sqlite3_finalize(raw);
+	}
+
+	// getChatOwner, which checks that the chat exists first
+	{
+		QSqlQuery positionalExists(db);
+		positionalExists.setForwardOnly(true);
+		positionalExists.prepare("SELECT chatid FROM chats WHERE chatid = ?");
+		QSqlQuery positional(db);
+		positional.setForwardOnly(true);
+		positional.prepare("SELECT owner FROM chats WHERE chatid = ?");
+		sqlite3_stmt* rawExists = nullptr;
+		sqlite3_prepare_v2(connection, "SELECT chatid FROM chats WHERE chatid = ?", -1, &rawExists, nullptr);
+		sqlite3_stmt* raw = nullptr;
+		sqlite3_prepare_v2(connection, "SELECT owner FROM chats WHERE chatid = ?", -1, &raw, nullptr);
+		QVector<double> micros;
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			QSqlQuery exists(db);
+			exists.prepare("SELECT * FROM chats WHERE chatid = (:chatID)");
+			exists.bindValue(":chatID", 1 + i % chats);
+			if (exists.exec() && qtsql.sqlSize(exists) > 0)
+			{
+				QSqlQuery query(db);
+				query.prepare("SELECT owner FROM chats WHERE chatid = (:chatID)");
+				query.bindValue(":chatID", 1 + i % chats);
+				if (query.exec() && qtsql.sqlSize(query) > 0 && query.next())
+				{
+					found += query.value(0).toString().size();
+				}
+			}
+		}));
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			positionalExists.bindValue(0, 1 + i % chats);
+			if (positionalExists.exec() && positionalExists.next())
+			{
+				positional.bindValue(0, 1 + i % chats);
+				if (positional.exec() && positional.next())
+				{
+					found += positional.value(0).toString().size();
+				}
+				positional.finish();
+			}
+			positionalExists.finish();
+		}));
+		micros.append(timeCalls(calls, [&](int i) { found += qtsql.getChatOwner(1 + i % chats).size(); }));
+		micros.append(timeCalls(calls, [&](int i) { found += sqlite.getChatOwner(1 + i % chats).size(); }));
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			if (rawLookup(rawExists, nullptr, 1 + i % chats, nullptr))
+			{
+				sqlite3_bind_int(raw, 1, 1 + i % chats);
+				if (sqlite3_step(raw) == SQLITE_ROW)
+				{
+					found += QString::fromUtf8(reinterpret_cast<const char*>(sqlite3_column_text(raw, 0)), sqlite3_column_bytes(raw, 0)).size();
+				}
+				sqlite3_reset(raw);
+			}
+		}));
+		printRow("getChatOwner", micros);
+		sqlite3_finalize(rawExists);
+		sqlite3_finalize(raw);
+	}
+
+	// checkUserInfo, which checks that the user exists first
+	{
+		QSqlQuery positionalExists(db);
+		positionalExists.setForwardOnly(true);
+		positionalExists.prepare("SELECT username FROM userinfo WHERE username = ?");
+		QSqlQuery positional(db);
+		positional.setForwardOnly(true);
+		positional.prepare("SELECT username FROM userinfo WHERE username = ? AND password = ?");
+		sqlite3_stmt* rawExists = nullptr;
+		sqlite3_prepare_v2(connection, "SELECT username FROM userinfo WHERE username = ?", -1, &rawExists, nullptr);
+		sqlite3_stmt* raw = nullptr;
+		sqlite3_prepare_v2(connection, "SELECT username FROM userinfo WHERE username = ? AND password = ?", -1, &raw, nullptr);
+		QVector<double> micros;
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			QSqlQuery exists(db);
+			exists.prepare("SELECT username FROM userinfo WHERE username = (:inputusername)");
+			exists.bindValue(":inputusername", users[i % userCount]);
+			if (exists.exec() && qtsql.sqlSize(exists) > 0)
+			{
+				QSqlQuery query(db);
+				query.prepare("SELECT * FROM userinfo WHERE username = (:username) AND password = (:password)");
+				query.bindValue(":username", users[i % userCount]);
+				query.bindValue(":password", "password");
+				found += query.exec() && qtsql.sqlSize(query) > 0;
+			}
+		}));
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			positionalExists.bindValue(0, users[i % userCount]);
+			if (positionalExists.exec() && positionalExists.next())
+			{
+				positional.bindValue(0, users[i % userCount]);
+				positional.bindValue(1, "password");
+				found += positional.exec() && positional.next();
+				positional.finish();
+			}
+			positionalExists.finish();
+		}));
+		micros.append(timeCalls(calls, [&](int i) { found += qtsql.checkUserInfo(users[i % userCount], "password"); }));
+		micros.append(timeCalls(calls, [&](int i) { found += sqlite.checkUserInfo(users[i % userCount], "password"); }));
+		micros.append(timeCalls(calls, [&](int i)
+		{
+			if (rawLookup(rawExists, &utf8Users[i % userCount], 0, nullptr))
+			{
+				found += rawLookup(raw, &utf8Users[i % userCount], 0, &password);
+			}
+		}));
+		printRow("checkUserInfo", micros);
+		sqlite3_finalize(rawExists);
+		sqlite3_finalize(raw);
+	}
+
+	sqlite3_close(connection);
+	std::cout << "(" << found << " found)" << std::endl;
+	return 0;
+}
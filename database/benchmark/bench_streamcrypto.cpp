@@ -0,0 +1,140 @@
+/**
+ * @file bench_streamcrypto.cpp
+ * @brief Benchmarks streaming attachment encryption by number of worker threads
+ *
+ * A file is first sealed the old way, read into one buffer and sealed in one call on one core.
+ * It is then encrypted file to file and decrypted again with 1 to 16 worker threads, and single
+ * chunks are decrypted at random offsets as a seeking reader would.
+ *
+ * Usage: benchmark.out streamcrypto [file megabytes] [thread counts...]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <streamcrypto.h>
+#include <messagecrypto.h>
+#include <QFile>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+// Accepts and discards everything written to it
+class DiscardDevice : public QIODevice
+{
+	protected:
+		qint64 readData(char* data, qint64 maxSize) override
+		{
+			Q_UNUSED(data);
+			Q_UNUSED(maxSize);
+			return -1;
+		}
+
+		qint64 writeData(const char* data, qint64 maxSize) override
+		{
+			Q_UNUSED(data);
+			return maxSize;
+		}
+};
+
+/**
+ * @brief Runs the stream encryption benchmark
+ * @param args Optional file size in megabytes followed by thread counts
+ * @return 0 on success
+ */
+int benchStreamcrypto(const QStringList& args)
+{
+	qint64 megabytes = args.size() > 0 ? qMax(args[0].toInt(), 1) : 1024;
+	QVector<int> threadCounts;
+	for (int i = 1; i < args.size(); i++)
+	{
+		threadCounts.append(qMax(args[i].toInt(), 1));
+	}
+	if (threadCounts.isEmpty())
+	{
+		threadCounts << 1 << 2 << 4 << 8 << 16;
+	}
+
+	const QString plainPath = "bench_streamcrypto.plain";
+	const QString sealedPath = "bench_streamcrypto.sealed";
+	std::mt19937 random(42);
+	QByteArray block(1024 * 1024, '\0');
+	for (int i = 0; i < block.size(); i++)
+	{
+		block[i] = char(random());
+	}
+	QFile plain(plainPath);
+	if (!plain.open(QIODevice::WriteOnly))
+	{
+		return 1;
+	}
+	for (qint64 m = 0; m < megabytes; m++)
+	{
+		block[int(m % block.size())] = char(m);
+		plain.write(block);
+	}
+	plain.close();
+	qint64 bytes = megabytes * 1024 * 1024;
+	QByteArray key = MessageCrypto::generateKey();
+	std::cout << megabytes << " MB file, " << StreamCrypto::defaultChunkSize / 1024 << " KiB chunks, "
+		<< (MessageCrypto::preferredSuite() == CipherSuite::Aes256Gcm ? "AES-256-GCM" : "ChaCha20-Poly1305") << std::endl;
+
+	// The old way: the whole file in one buffer, sealed on one core
+	{
+		qint64 start = benchNow();
+		plain.open(QIODevice::ReadOnly);
+		QByteArray whole = plain.readAll();
+		plain.close();
+		MessageCrypto crypto(key);
+		QByteArray sealed = crypto.seal(whole);
+		double seconds = (benchNow() - start) / 1e9;
+		std::cout << std::fixed << std::setprecision(0) << "single buffer: " << bytes / seconds / 1e6 << " MB/s, "
+			<< (whole.size() + sealed.size()) / (1024 * 1024) << " MB held in memory" << std::endl << std::endl;
+	}
+
+	std::cout << std::left << std::setw(10) << "threads" << std::right << std::setw(18) << "encrypt MB/s"
+		<< std::setw(18) << "decrypt MB/s" << std::setw(20) << "chunk decrypt us" << std::endl;
+	bool ok = true;
+	for (int t = 0; t < threadCounts.size(); t++)
+	{
+		StreamCrypto crypto(key, threadCounts[t]);
+		QFile source(plainPath);
+		QFile sealed(sealedPath);
+		source.open(QIODevice::ReadOnly);
+		sealed.open(QIODevice::WriteOnly | QIODevice::Truncate);
+		qint64 start = benchNow();
+		ok = crypto.encrypt(source, sealed) && ok;
+		sealed.close();
+		double encryptSeconds = (benchNow() - start) / 1e9;
+
+		DiscardDevice sink;
+		sink.open(QIODevice::WriteOnly);
+		sealed.open(QIODevice::ReadOnly);
+		start = benchNow();
+		ok = crypto.decrypt(sealed, sink) && ok;
+		double decryptSeconds = (benchNow() - start) / 1e9;
+
+		const int lookups = 1000;
+		qint64 chunks = (bytes + StreamCrypto::defaultChunkSize - 1) / StreamCrypto::defaultChunkSize;
+		QByteArray chunk;
+		start = benchNow();
+		for (int i = 0; i < lookups; i++)
+		{
+			ok = crypto.decryptChunk(sealed, qint64(random() % chunks), chunk) && ok;
+		}
+		double lookupSeconds = (benchNow() - start) / 1e9;
+		sealed.close();
+
+		std::cout << std::left << std::setw(10) << threadCounts[t] << std::right << std::setprecision(0)
+			<< std::setw(18) << bytes / encryptSeconds / 1e6 << std::setw(18) << bytes / decryptSeconds / 1e6
+			<< std::setprecision(1) << std::setw(20) << lookupSeconds / lookups * 1e6 << std::endl;
+	}
+	if (!ok)
+	{
+		std::cout << "a stream failed to encrypt or decrypt" << std::endl;
+	}
+	QFile::remove(plainPath);
+	QFile::remove(sealedPath);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/**
+ * @file bench_throttle.cpp
+ * @brief Benchmarks the login throttle against a simulated credential-stuffing attack
+ *
+ * An attack of wrong-password logins against existing accounts is spread evenly over a few
+ * simulated minutes and comes from a small pool of addresses, as a botnet's would. One attempt
+ * in a hundred is instead a real user logging in from their own address. The attack is first
+ * run through the throttle alone on the simulated clock, to time a decision and see who gets
+ * through. It is then replayed through checkUserInfo as fast as one thread can issue it, on the
+ * throttle's real clock, with and without the throttle, counting the queries that reach SQLite.
+ *
+ * Usage: benchmark.out throttle [attempts] [source addresses] [targeted users] [seconds]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <loginthrottle.h>
+#include <sqlite3.h>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+// One login attempt of the simulated attack
+struct Attempt
+{
+	int user;
+	int source;		// -1 for a real user's own address
+	qint64 time;	// milliseconds into the attack
+};
+
+/**
+ * @brief Counts a statement SQLite is about to run
+ * @param type The trace event, always SQLITE_TRACE_STMT
+ * @param context The count
+ * @param statement The statement
+ * @param sql The statement's SQL
+ * @return 0, as SQLite requires
+ */
+static int countStatement(unsigned type, void* context, void* statement, void* sql)
+{
+	Q_UNUSED(type);
+	Q_UNUSED(statement);
+	Q_UNUSED(sql);
+	++*static_cast<qint64*>(context);
+	return 0;
+}
+
+/**
+ * @brief Runs the login throttle benchmark
+ * @param args Optional attempt count, attacker address count, targeted user count and attack length in seconds
+ * @return 0 on success
+ */
+int benchThrottle(const QStringList& args)
+{
+	int attempts = args.size() > 0 ? qMax(args[0].toInt(), 1) : 1000000;
+	int sourceCount = args.size() > 1 ? qMax(args[1].toInt(), 1) : 100;
+	int userCount = args.size() > 2 ? qMax(args[2].toInt(), 1) : 20000;
+	int seconds = args.size() > 3 ? qMax(args[3].toInt(), 1) : 300;
+
+	std::mt19937 random(42);
+	std::vector<Attempt> attack(attempts);
+	QVector<QString> usernames;
+	QVector<QString> sources;
+	QVector<QString> homes;	// each real user's own address
+	for (int u = 0; u < userCount; u++)
+	{
+		usernames.append(QString("user%1").arg(u));
+		homes.append(QString("10.%1.%2.%3").arg(u / 65536).arg(u / 256 % 256).arg(u % 256));
+	}
+	for (int s = 0; s < sourceCount; s++)
+	{
+		sources.append(QString("198.51.%1.%2").arg(s / 256).arg(s % 256));
+	}
+	for (int i = 0; i < attempts; i++)
+	{
+		attack[i].user = int(random() % quint32(userCount));
+		attack[i].source = i % 100 == 99 ? -1 : int(random() % quint32(sourceCount));
+		attack[i].time = qint64(i) * seconds * 1000 / attempts + 1;
+	}
+	std::cout << attempts << " attempts from " << sourceCount << " addresses against " << userCount
+		<< " users over " << seconds << " s" << std::endl << std::endl;
+
+	// The throttle alone
+	{
+		LoginThrottle throttle;
+		qint64 legitimate = 0;
+		qint64 legitimateRefused = 0;
+		qint64 start = benchNow();
+		for (int i = 0; i < attempts; i++)
+		{
+			const Attempt& attempt = attack[i];
+			bool allowed = throttle.allowLogin(usernames[attempt.user], attempt.source < 0 ? homes[attempt.user] : sources[attempt.source], attempt.time);
+			if (attempt.source < 0)
+			{
+				legitimate++;
+				legitimateRefused += allowed ? 0 : 1;
+			}
+		}
+		double elapsed = (benchNow() - start) / 1e9;
+		ThrottleStats stats = throttle.stats();
+		std::cout << std::fixed << std::setprecision(1) << "decision latency       " << elapsed * 1e9 / attempts << " ns" << std::endl;
+		std::cout << "allowed                " << stats.allowed << " (" << 100.0 * stats.allowed / attempts << "%)" << std::endl;
+		std::cout << "rejected by address    " << stats.sourceRejected << std::endl;
+		std::cout << "rejected by user       " << stats.userRejected << std::endl;
+		std::cout << "buckets evicted        " << stats.evicted << std::endl;
+		std::cout << "real logins refused    " << legitimateRefused << " of " << legitimate << std::endl << std::endl;
+	}
+
+	// Through checkUserInfo: each attempt that gets past the throttle costs userExists and the password check
+	QString path = benchDatabase("throttle");
+	DbManager db(path, "bench-throttle", StorageKind::Sqlite);
+	if (db.storageKind() != StorageKind::Sqlite)
+	{
+		std::cout << "The connection has no sqlite3 handle, so the queries reaching SQLite cannot be counted" << std::endl;
+		return 1;
+	}
+	sqlite3* connection = *static_cast<sqlite3* const*>(db.database().driver()->handle().constData());
+	db.createUserTable();
+	db.database().transaction();
+	for (int u = 0; u < userCount; u++)
+	{
+		db.addUser(usernames[u], "correct horse");
+	}
+	db.database().commit();
+
+	LoginThrottle throttle;
+	db.setThrottle(&throttle);
+	qint64 queries = 0;
+	sqlite3_trace_v2(connection, SQLITE_TRACE_STMT, countStatement, &queries);
+	qint64 start = benchNow();
+	for (int i = 0; i < attempts; i++)
+	{
+		const Attempt& attempt = attack[i];
+		QString source = attempt.source < 0 ? homes[attempt.user] : sources[attempt.source];
+		if (attempt.source < 0)
+		{
+			db.checkUserInfo(usernames[attempt.user], "correct horse", source);
+		}
+		else
+		{
+			db.checkUserInfo(usernames[attempt.user], "guess", source);
+		}
+	}
+	double throttled = (benchNow() - start) / 1e9;
+	qint64 throttledQueries = queries;
+
+	// Without the throttle every attempt queries; a sample is timed and scaled up
+	db.setThrottle(nullptr);
+	int sample = qMin(attempts, 100000);
+	queries = 0;
+	start = benchNow();
+	for (int i = 0; i < sample; i++)
+	{
+		db.checkUserInfo(usernames[attack[i].user], "guess", sources[attack[i].source < 0 ? 0 : attack[i].source]);
+	}
+	double unthrottled = (benchNow() - start) / 1e9 * attempts / sample;
+	qint64 unthrottledQueries = queries * attempts / sample;
+	sqlite3_trace_v2(connection, 0, nullptr, nullptr);
+
+	std::cout << std::setprecision(2) << "checkUserInfo, throttled      " << throttled << " s, " << throttledQueries << " queries" << std::endl;
+	std::cout << "checkUserInfo, unthrottled    " << unthrottled << " s, " << unthrottledQueries << " queries"
+		<< (sample < attempts ? " (scaled from a sample)" : "") << std::endl;
+	std::cout << std::setprecision(1) << "queries avoided               " << 100.0 * (1 - double(throttledQueries) / unthrottledQueries) << "%" << std::endl;
+	return 0;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file bench_usercache.cpp
+ * @brief Benchmarks the user cache against querying userinfo
+ *
+ * The cache is first filled with every user and its memory measured. Many threads then look
+ * users up and check passwords in it while one more thread keeps adding users, so readers run
+ * into writers. Finally each thread gets its own DbManager and runs userExists followed by
+ * checkUserInfo, as a login does, first straight against SQLite and then through a shared cache.
+ *
+ * Usage: benchmark.out usercache [users] [threads] [lookups per thread]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <usercache.h>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <functional>
+
+/**
+ * @brief Runs a function on several threads at once and times it
+ * @param threads The number of threads
+ * @param work The function, given the thread's index
+ * @return The elapsed time in seconds
+ */
+static double runThreads(int threads, const std::function<void(int)>& work)
+{
+	std::vector<std::thread> workers;
+	qint64 start = benchNow();
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back(work, t);
+	}
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	return (benchNow() - start) / 1e9;
+}
+
+/**
+ * @brief Runs the user cache benchmark
+ * @param args Optional user count, thread count and lookups per thread
+ * @return 0 on success
+ */
+int benchUsercache(const QStringList& args)
+{
+	int userCount = args.size() > 0 ? qMax(args[0].toInt(), 1) : 1000000;
+	int threads = args.size() > 1 ? qMax(args[1].toInt(), 1) : 32;
+	int lookups = args.size() > 2 ? qMax(args[2].toInt(), 1) : 200000;
+
+	QVector<QString> usernames;
+	for (int u = 0; u < userCount; u++)
+	{
+		usernames.append(QString("member%1").arg(u));
+	}
+
+	// Room for twice the users keeps probe windows from filling and evicting
+	UserCache cache(2 * userCount);
+	qint64 start = benchNow();
+	for (int u = 0; u < userCount; u++)
+	{
+		cache.storeUser(usernames[u], u + 1, "password");
+	}
+	double fillSeconds = (benchNow() - start) / 1e9;
+	int cached = 0;
+	for (int u = 0; u < userCount; u++)
+	{
+		cached += cache.lookup(usernames[u]) == CachedUser::Present ? 1 : 0;
+	}
+	std::cout << std::fixed << std::setprecision(1) << userCount << " users, " << cache.capacity() << " slots, "
+		<< cache.memoryUsage() / 1048576.0 << " MiB (" << cache.memoryUsage() * 1000000.0 / userCount / 1048576.0
+		<< " MiB per million users), " << 100.0 * cached / userCount << "% still cached after filling in "
+		<< fillSeconds * 1e9 / userCount << " ns each" << std::endl << std::endl;
+
+	// Readers against one writer adding users the readers never look up
+	std::atomic<bool> reading(true);
+	std::atomic<qint64> writes(0);
+	std::thread writer([&]()
+	{
+		qint64 n = 0;
+		while (reading.load(std::memory_order_relaxed))
+		{
+			cache.storeUser(QString("newcomer%1").arg(n++), userCount + n, "password");
+		}
+		writes.store(n);
+	});
+	std::atomic<qint64> found(0);
+	double lookupSeconds = runThreads(threads, [&](int t)
+	{
+		std::mt19937 random(t);
+		qint64 hits = 0;
+		for (int i = 0; i < lookups; i++)
+		{
+			hits += cache.lookup(usernames[int(random() % quint32(userCount))]) == CachedUser::Present ? 1 : 0;
+		}
+		found.fetch_add(hits);
+	});
+	double verifySeconds = runThreads(threads, [&](int t)
+	{
+		std::mt19937 random(t);
+		bool matches = false;
+		for (int i = 0; i < lookups / 10; i++)
+		{
+			cache.verify(usernames[int(random() % quint32(userCount))], "password", matches);
+		}
+	});
+	reading.store(false);
+	writer.join();
+
+	std::cout << std::left << std::setw(34) << "operation" << std::right << std::setw(14) << "per second" << std::setw(12) << "ns each" << std::endl;
+	qint64 lookupCount = qint64(threads) * lookups;
+	std::cout << std::left << std::setw(34) << QString("lookup, %1 threads").arg(threads).toStdString() << std::right << std::setprecision(0)
+		<< std::setw(14) << lookupCount / lookupSeconds << std::setprecision(1) << std::setw(12) << lookupSeconds * 1e9 / lookupCount << std::endl;
+	qint64 verifyCount = qint64(threads) * (lookups / 10);
+	std::cout << std::left << std::setw(34) << QString("verify password, %1 threads").arg(threads).toStdString() << std::right << std::setprecision(0)
+		<< std::setw(14) << verifyCount / verifySeconds << std::setprecision(1) << std::setw(12) << verifySeconds * 1e9 / verifyCount << std::endl;
+	std::cout << "  (" << writes.load() << " users added meanwhile, " << found.load() << " of " << lookupCount << " lookups hit)" << std::endl;
+
+	// Logins through DbManager, one connection per thread
+	int dbUsers = qMin(userCount, 20000);
+	int logins = qMax(lookups / 100, 1);
+	QString path = benchDatabase("usercache");
+	{
+		DbManager db(path);
+		db.createUserTable();
+		db.database().transaction();
+		for (int u = 0; u < dbUsers; u++)
+		{
+			db.addUser(usernames[u], "password");
+		}
+		db.database().commit();
+	}
+	for (int pass = 0; pass < 2; pass++)
+	{
+		UserCache shared;
+		double seconds = runThreads(threads, [&](int t)
+		{
+			DbManager db(path, QString("usercache-%1").arg(t));
+			db.setUserCache(pass == 1 ? &shared : nullptr);
+			std::mt19937 random(t);
+			for (int i = 0; i < logins; i++)
+			{
+				const QString& username = usernames[int(random() % quint32(dbUsers))];
+				if (db.userExists(username))
+				{
+					db.checkUserInfo(username, "password");
+				}
+			}
+		});
+		qint64 count = qint64(threads) * logins;
+		std::cout << std::left << std::setw(34) << (pass == 1 ? "userExists + checkUserInfo, cached" : "userExists + checkUserInfo, SQLite")
+			<< std::right << std::setprecision(0) << std::setw(14) << count / seconds << std::setprecision(1) << std::setw(12)
+			<< seconds * 1e9 / count << std::endl;
+	}
+	return 0;
+}
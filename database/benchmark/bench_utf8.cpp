@@ -0,0 +1,192 @@
+/**
+ * @file bench_utf8.cpp
+ * @brief Benchmarks DbManager's UTF-8 overloads against its QString methods on a roster-heavy workload
+ *
+ * Users in many large chats have their rosters read over and over, as the chat server does for
+ * the text ROSTER request: once with getUserChatInfo followed by toUtf8 for the wire, and once
+ * with getUserChatInfoUtf8, which never decodes the roster. Their chat lists and whether pairs
+ * of them share a chat are read through both APIs as well. Each is measured in CPU time and heap
+ * allocations per call on the sqlite3 backend, first from SQLite and then from a membership
+ * snapshot, where no query time hides what the conversions cost.
+ *
+ * Usage: benchmark.out utf8 [chats per user] [members per chat] [calls]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <time.h>
+
+/**
+ * @brief Gets the CPU time the calling thread has used
+ * @return The time in nanoseconds
+ */
+static qint64 threadCpuNow()
+{
+	timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Measures a call's CPU time and allocations, averaged over many calls
+ * @param calls The number of calls
+ * @param call The call, given its index
+ * @param micros Set to the CPU time per call in microseconds
+ * @param allocations Set to the allocations per call
+ * @return void
+ */
+static void measure(int calls, const std::function<void(int)>& call, double& micros, double& allocations)
+{
+	call(0);
+	qint64 allocated = benchHeap().allocations;
+	qint64 start = threadCpuNow();
+	for (int i = 0; i < calls; i++)
+	{
+		call(i);
+	}
+	micros = (threadCpuNow() - start) / 1000.0 / calls;
+	allocations = double(benchHeap().allocations - allocated) / calls;
+	return;
+}
+
+/**
+ * @brief Measures the QString and UTF-8 forms of a call and prints one row comparing them
+ * @param label The row label
+ * @param calls The number of calls
+ * @param qstring The call through the QString API
+ * @param utf8 The call through the UTF-8 API
+ * @return void
+ */
+static void compare(const std::string& label, int calls, const std::function<void(int)>& qstring, const std::function<void(int)>& utf8)
+{
+	double qstringMicros = 0;
+	double qstringAllocations = 0;
+	double utf8Micros = 0;
+	double utf8Allocations = 0;
+	measure(calls, qstring, qstringMicros, qstringAllocations);
+	measure(calls, utf8, utf8Micros, utf8Allocations);
+	std::cout << std::left << std::setw(34) << label << std::right << std::setprecision(1)
+		<< std::setw(11) << qstringMicros << std::setw(11) << utf8Micros
+		<< std::setw(10) << 100.0 * (qstringMicros - utf8Micros) / qstringMicros << "%";
+	if (benchHeap().counted)
+	{
+		std::cout << std::setw(16) << qstringAllocations << std::setw(14) << utf8Allocations;
+	}
+	std::cout << std::endl;
+	return;
+}
+
+/**
+ * @brief Runs the UTF-8 overload benchmark
+ * @param args Optional chats per roster user, members per chat and number of calls per measurement
+ * @return 0 on success
+ */
+int benchUtf8(const QStringList& args)
+{
+	int chatsPerUser = args.size() > 0 ? qMax(args[0].toInt(), 1) : 20;
+	int chatSize = args.size() > 1 ? qMax(args[1].toInt(), 2) : 50;
+	int calls = args.size() > 2 ? qMax(args[2].toInt(), 1) : 200;
+	int rosterUsers = 10;
+	int userCount = 2000;
+
+	QString path = benchDatabase("utf8");
+	DbManager db(path, "bench-utf8", StorageKind::Sqlite);
+	db.createUserTable();
+	db.createChatTables();
+	db.database().transaction();
+	QVector<QString> users;
+	QVector<QByteArray> utf8Users;
+	for (int u = 0; u < userCount; u++)
+	{
+		// Some names are not ASCII, so decoding them is not a straight copy
+		users.append(u % 4 == 0 ? QString::fromUtf8("us\xc3\xa9r%1").arg(u) : QString("member%1").arg(u));
+		utf8Users.append(users.last().toUtf8());
+		db.addUser(users.last(), "password");
+	}
+	int chatID = 1;
+	for (int r = 0; r < rosterUsers; r++)
+	{
+		for (int c = 0; c < chatsPerUser; c++)
+		{
+			QVector<QString> members;
+			members.append(users[r]);
+			for (int m = 1; m < chatSize; m++)
+			{
+				members.append(users[rosterUsers + (chatID * 131 + m * 17) % (userCount - rosterUsers)]);
+			}
+			db.addChat(chatID++, users[r], members);
+		}
+	}
+	db.database().commit();
+
+	qint64 seen = 0;
+	std::cout << std::fixed << rosterUsers << " users in " << chatsPerUser << " chats of " << chatSize << " members each" << std::endl;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			db.writeMembershipSnapshot(path + ".snap");
+			db.loadMembershipSnapshot(path + ".snap");
+		}
+		std::cout << (pass == 0 ? "From SQLite" : "From a membership snapshot") << std::endl;
+		std::cout << std::left << std::setw(34) << "call" << std::right << std::setw(11) << "QString us" << std::setw(11) << "UTF-8 us"
+			<< std::setw(11) << "CPU saved";
+		if (benchHeap().counted)
+		{
+			std::cout << std::setw(16) << "QString allocs" << std::setw(14) << "UTF-8 allocs";
+		}
+		std::cout << std::endl;
+
+		int rosterCalls = pass == 0 ? qMax(calls / 10, 1) : calls;
+		compare("text roster, ready for the wire", rosterCalls, [&](int i)
+		{
+			seen += db.getUserChatInfo(users[i % rosterUsers]).toUtf8().size();
+		}, [&](int i)
+		{
+			const QByteArray& user = utf8Users[i % rosterUsers];
+			seen += db.getUserChatInfoUtf8(Utf8View(user.constData(), user.size())).size();
+		});
+		compare("binary roster entries", rosterCalls, [&](int i)
+		{
+			db.forEachRosterEntry(users[i % rosterUsers], [&](int, Utf8View member)
+			{
+				seen += member.size();
+				return true;
+			});
+		}, [&](int i)
+		{
+			const QByteArray& user = utf8Users[i % rosterUsers];
+			db.forEachRosterEntry(Utf8View(user.constData(), user.size()), [&](int, Utf8View member)
+			{
+				seen += member.size();
+				return true;
+			});
+		});
+		compare("chats of a user", calls, [&](int i)
+		{
+			seen += db.getChatIdsUserIsIn(users[i % rosterUsers]).size();
+		}, [&](int i)
+		{
+			const QByteArray& user = utf8Users[i % rosterUsers];
+			seen += db.getChatIdsUserIsIn(Utf8View(user.constData(), user.size())).size();
+		});
+		compare("doUsersChat", calls, [&](int i)
+		{
+			seen += db.doUsersChat(users[i % rosterUsers], users[(i + 1) % rosterUsers]);
+		}, [&](int i)
+		{
+			const QByteArray& user1 = utf8Users[i % rosterUsers];
+			const QByteArray& user2 = utf8Users[(i + 1) % rosterUsers];
+			seen += db.doUsersChat(Utf8View(user1.constData(), user1.size()), Utf8View(user2.constData(), user2.size()));
+		});
+		std::cout << std::endl;
+	}
+	std::cout << "(" << seen << " bytes and results seen)" << std::endl;
+	return 0;
+}
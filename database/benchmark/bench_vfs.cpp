@@ -0,0 +1,108 @@
+/**
+ * @file bench_vfs.cpp
+ * @brief Benchmarks the encrypting VFS against the same VFS with encryption off
+ *
+ * Both runs go through EncryptedVfs so their I/O is counted the same way; the plain run is
+ * installed with no key and only passes calls through. Each run builds the same users and chats,
+ * then reopens the database and times userExists for every user and getChatUsers for every chat,
+ * first with a cold page cache and again with a warm one.
+ *
+ * Usage: benchmark.out vfs [users] [chats] [members per chat]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <encryptedvfs.h>
+#include <messagecrypto.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * @brief Runs the encrypted VFS benchmark
+ * @param args Optional user count, chat count and members per chat
+ * @return 0 on success
+ */
+int benchVfs(const QStringList& args)
+{
+	int users = args.size() > 0 ? args[0].toInt() : 20000;
+	int chats = args.size() > 1 ? args[1].toInt() : 2000;
+	int membersPerChat = args.size() > 2 ? args[2].toInt() : 20;
+	const char* vfsNames[] = { "benchplain", "benchcrypt" };
+
+	if (!EncryptedVfs::install(vfsNames[0], QByteArray()) || !EncryptedVfs::install(vfsNames[1], MessageCrypto::generateKey()))
+	{
+		std::cout << "Error: the VFSes could not be installed" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::left << std::setw(12) << "vfs" << std::right << std::setw(14) << "logical MB" << std::setw(14) << "disk MB"
+		<< std::setw(14) << "write amp" << std::setw(18) << "userExists/s" << std::setw(18) << "  (warm)"
+		<< std::setw(18) << "getChatUsers/s" << std::setw(18) << "  (warm)" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+
+	for (const char* vfsName : vfsNames)
+	{
+		QString path = EncryptedVfs::uri(benchDatabase(vfsName), vfsName);
+		QString connectionName = QString("bench-") + vfsName;
+		EncryptedVfs::resetStats(vfsName);
+		{
+			DbManager db(path, connectionName);
+			db.createUserTable();
+			db.createChatTables();
+			db.database().transaction();
+			for (int u = 0; u < users; u++)
+			{
+				db.addUser(QString("user%1").arg(u), "password");
+			}
+			db.database().commit();
+			for (int c = 1; c <= chats; c++)
+			{
+				QVector<QString> members;
+				for (int m = 0; m < membersPerChat; m++)
+				{
+					members.append(QString("user%1").arg((c * 7919 + m * 104729) % users));
+				}
+				db.addChat(c, members[0], members);
+			}
+			db.close();
+		}
+		QSqlDatabase::removeDatabase(connectionName);
+		EncryptedVfsStats written = EncryptedVfs::stats(vfsName);
+
+		double rates[4];
+		{
+			DbManager db(path, connectionName);
+			for (int pass = 0; pass < 2; pass++)
+			{
+				qint64 start = benchNow();
+				for (int u = 0; u < users; u++)
+				{
+					db.userExists(QString("user%1").arg(u));
+				}
+				rates[pass * 2] = users / ((benchNow() - start) / 1e9);
+
+				start = benchNow();
+				for (int c = 1; c <= chats; c++)
+				{
+					db.getChatUsers(c);
+				}
+				rates[pass * 2 + 1] = chats / ((benchNow() - start) / 1e9);
+			}
+			db.close();
+		}
+		QSqlDatabase::removeDatabase(connectionName);
+
+		std::cout << std::left << std::setw(12) << vfsName << std::right
+			<< std::setw(14) << written.logicalBytesWritten / 1048576.0 << std::setw(14) << written.diskBytesWritten / 1048576.0
+			<< std::setw(14) << double(written.diskBytesWritten) / qMax<qint64>(written.logicalBytesWritten, 1)
+			<< std::setw(18) << std::setprecision(0) << rates[0] << std::setw(18) << rates[2]
+			<< std::setw(18) << rates[1] << std::setw(18) << rates[3] << std::setprecision(2) << std::endl;
+	}
+
+	EncryptedVfsStats crypt = EncryptedVfs::stats(vfsNames[1]);
+	std::cout << crypt.unitsEncrypted << " units encrypted and " << crypt.unitsDecrypted << " decrypted by " << vfsNames[1] << std::endl;
+	return 0;
+}
@@ -0,0 +1,172 @@
+/**
+ * @file bench_visitors.cpp
+ * @brief Benchmarks visiting membership rows as they are stepped against building results first
+ *
+ * One very large chat is walked with getChatUsers, getChatUserList and forEachChatUser, and a
+ * user in many smaller chats has their roster walked by looping over getChatsUserIsIn and
+ * getChatUsers, as callers used to, and with forEachRosterEntry. Each is timed and its heap
+ * high-water mark above what was live before the call recorded, first from SQLite and then from
+ * a membership snapshot. Looking for one member and stopping shows what early exit saves.
+ *
+ * Usage: benchmark.out visitors [members] [calls]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+/**
+ * @brief Times a call and records the most heap it held at once, averaged over several calls
+ * @param label The row label
+ * @param calls The number of calls
+ * @param call The call
+ * @return void
+ */
+static void measure(const std::string& label, int calls, const std::function<void()>& call)
+{
+	call();
+	qint64 peak = 0;
+	qint64 start = benchNow();
+	for (int i = 0; i < calls; i++)
+	{
+		qint64 live = benchHeap().liveBytes;
+		benchResetPeak();
+		call();
+		peak = qMax(peak, benchHeap().peakBytes - live);
+	}
+	double millis = (benchNow() - start) / 1000000.0 / calls;
+	std::cout << std::left << std::setw(46) << label << std::right << std::setw(10) << std::setprecision(3) << millis;
+	if (benchHeap().counted)
+	{
+		std::cout << std::setw(14) << std::setprecision(1) << peak / 1024.0;
+	}
+	else
+	{
+		std::cout << std::setw(14) << "n/a";
+	}
+	std::cout << std::endl;
+	return;
+}
+
+/**
+ * @brief Runs the membership visitor benchmark
+ * @param args Optional member count for the large chat and number of calls per measurement
+ * @return 0 on success
+ */
+int benchVisitors(const QStringList& args)
+{
+	int memberCount = args.size() > 0 ? qMax(args[0].toInt(), 100) : 100000;
+	int calls = args.size() > 1 ? qMax(args[1].toInt(), 1) : 20;
+	int rosterChats = 100;
+	int rosterChatSize = 20;
+
+	QString path = benchDatabase("visitors");
+	DbManager db(path, "bench-visitors");
+	db.createUserTable();
+	db.createChatTables();
+	db.database().transaction();
+	QVector<QString> users;
+	for (int u = 0; u < memberCount; u++)
+	{
+		users.append(QString("member%1").arg(u));
+		db.addUser(users.last(), "password");
+	}
+	db.addChat(1, users[0], users);
+	// A user outside the large chat is in many smaller ones, for the roster
+	QString rosterUser = "roster";
+	db.addUser(rosterUser, "password");
+	for (int c = 0; c < rosterChats; c++)
+	{
+		QVector<QString> members;
+		members.append(rosterUser);
+		for (int m = 1; m < rosterChatSize; m++)
+		{
+			members.append(users[2 + (c * rosterChatSize + m) % (memberCount - 2)]);
+		}
+		db.addChat(100 + c, rosterUser, members);
+	}
+	db.database().commit();
+	QByteArray target = users[memberCount / 100].toUtf8();
+	Utf8View targetView(target.constData(), target.size());
+
+	qint64 walked = 0;
+	std::cout << std::fixed;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			db.writeMembershipSnapshot(path + ".snap");
+			db.loadMembershipSnapshot(path + ".snap");
+		}
+		std::cout << (pass == 0 ? "From SQLite" : "From a membership snapshot") << std::endl;
+		std::cout << std::left << std::setw(46) << "call" << std::right << std::setw(10) << "ms/call" << std::setw(14) << "peak KiB" << std::endl;
+		QString size = QString::number(memberCount);
+
+		measure(("getChatUsers, " + size + " members").toStdString(), calls, [&]()
+		{
+			QVector<QString> members = db.getChatUsers(1);
+			for (const QString& member : members)
+			{
+				walked += member.size();
+			}
+		});
+		measure(("getChatUserList, " + size + " members").toStdString(), calls, [&]()
+		{
+			UsernameList members = db.getChatUserList(1);
+			for (Utf8View member : members)
+			{
+				walked += member.size();
+			}
+		});
+		measure(("forEachChatUser, " + size + " members").toStdString(), calls, [&]()
+		{
+			db.forEachChatUser(1, [&](Utf8View member)
+			{
+				walked += member.size();
+				return true;
+			});
+		});
+		measure("getChatUsers, find the 1% member", calls, [&]()
+		{
+			walked += db.getChatUsers(1).indexOf(users[memberCount / 100]);
+		});
+		measure("forEachChatUser, stop at the 1% member", calls, [&]()
+		{
+			db.forEachChatUser(1, [&](Utf8View member)
+			{
+				walked++;
+				return member != targetView;
+			});
+		});
+
+		QString roster = QString("%1 chats of %2").arg(rosterChats).arg(rosterChatSize);
+		measure(("getChatsUserIsIn + getChatUsers, " + roster).toStdString(), calls, [&]()
+		{
+			QVector<int> chats = db.getChatsUserIsIn(rosterUser);
+			for (int chatID : chats)
+			{
+				QVector<QString> members = db.getChatUsers(chatID);
+				for (const QString& member : members)
+				{
+					walked += member != rosterUser ? member.size() : 0;
+				}
+			}
+		});
+		measure(("forEachRosterEntry, " + roster).toStdString(), calls, [&]()
+		{
+			db.forEachRosterEntry(rosterUser, [&](int, Utf8View member)
+			{
+				walked += member.size();
+				return true;
+			});
+		});
+		std::cout << std::endl;
+	}
+	std::cout << "(" << walked << " characters walked)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,286 @@
+/**
+ * @file bench_wire.cpp
+ * @brief Benchmarks the binary wire protocol's parser and pipelined requests over loopback
+ *
+ * First parses a buffer of mixed request frames in place, reading every field, to measure parser
+ * throughput. Then starts a ChatServer and has binary connections keep 1, 16 and 128 requests in
+ * flight each, reporting the operations completed per second at each pipeline depth.
+ *
+ * Usage: benchmark.out wire [connections] [seconds]
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+#include <dbmanager.h>
+#include <chatserver.h>
+#include <wireprotocol.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+
+/**
+ * @brief Parses every frame in a buffer and reads all of their fields
+ * @param buffer The frames
+ * @return The number of frames parsed
+ */
+static int parseAll(const QByteArray& buffer)
+{
+	int frames = 0;
+	int offset = 0;
+	WireFrame frame;
+	while (offset < buffer.size())
+	{
+		int size = WireParser::parse(buffer.constData() + offset, buffer.size() - offset, frame);
+		if (size <= 0)
+		{
+			break;
+		}
+		offset += size;
+		frames++;
+
+		WireReader reader(frame);
+		WireString first;
+		WireString second;
+		int chatID = 0;
+		switch (WireOp(frame.opcode))
+		{
+			case WireOp::Login:
+				reader.readString(first);
+				reader.readString(second);
+				break;
+			case WireOp::ChatUsers:
+				reader.readInt(chatID);
+				break;
+			case WireOp::Send:
+				reader.readInt(chatID);
+				reader.readString(first);
+				break;
+			default:
+				break;
+		}
+	}
+	return frames;
+}
+
+/**
+ * @brief Opens a binary connection to the server and logs it in
+ * @param port The server's port on the loopback interface
+ * @param username The user to log in as
+ * @param password The user's password
+ * @return The non-blocking socket, or -1 if it could not connect or log in
+ */
+int benchBinaryClient(quint16 port, const QString& username, const QString& password)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	WireWriter login(quint8(WireOp::Login), 1);
+	login.writeString(username);
+	login.writeString(password);
+	QByteArray request(1, wirePreface);
+	login.appendTo(request);
+
+	char reply[64];
+	int on = 1;
+	if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+		|| send(fd, request.constData(), request.size(), MSG_NOSIGNAL) != request.size()
+		|| recv(fd, reply, sizeof(reply), 0) < 4 || reply[3] != char(WireStatus::Ok))
+	{
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+/**
+ * @brief Runs the wire protocol benchmark
+ * @param args Optional connection count and seconds per pipeline depth
+ * @return 0 on success
+ */
+int benchWire(const QStringList& args)
+{
+	int connections = args.size() > 0 ? args[0].toInt() : 16;
+	int seconds = args.size() > 1 ? args[1].toInt() : 3;
+
+	// Parser throughput over a mix of logins, member lookups and 64-byte messages
+	QByteArray buffer;
+	QByteArray text(64, 'x');
+	const int frameCount = 1000000;
+	for (int i = 0; i < frameCount; i++)
+	{
+		WireOp op = i % 4 == 0 ? WireOp::Login : i % 4 == 1 ? WireOp::ChatUsers : WireOp::Send;
+		WireWriter writer(quint8(op), quint64(i + 1));
+		if (op == WireOp::Login)
+		{
+			writer.writeString(QByteArray("someuser"));
+			writer.writeString(QByteArray("password"));
+		}
+		else
+		{
+			writer.writeVarint(quint64(i % 1000 + 1));
+			if (op == WireOp::Send)
+			{
+				writer.writeString(text);
+			}
+		}
+		writer.appendTo(buffer);
+	}
+
+	qint64 start = benchNow();
+	int parsed = 0;
+	const int passes = 5;
+	for (int pass = 0; pass < passes; pass++)
+	{
+		parsed += parseAll(buffer);
+	}
+	double parseSeconds = (benchNow() - start) / 1e9;
+	std::cout << std::fixed << std::setprecision(0);
+	std::cout << std::left << std::setw(24) << "parse frames/s" << std::right << std::setw(14) << parsed / parseSeconds << std::endl;
+	std::cout << std::left << std::setw(24) << "parse MB/s" << std::right << std::setw(14)
+		<< double(buffer.size()) * passes / parseSeconds / 1e6 << std::endl;
+
+	// End to end: every connection keeps depth ChatExists requests in flight
+	QString path = benchDatabase("wire");
+	{
+		DbManager db(path, "bench-wire-setup");
+		db.createUserTable();
+		db.createChatTables();
+		db.database().transaction();
+		QVector<QString> members;
+		for (int u = 0; u < connections; u++)
+		{
+			members.append(QString("wire%1").arg(u));
+			db.addUser(members[u], "password");
+		}
+		db.addChat(1, members[0], members);
+		db.database().commit();
+		db.close();
+	}
+
+	ChatServer server(path);
+	server.setLoginThrottle(false);
+	if (!server.start(0))
+	{
+		std::cout << "Error: the server could not be started" << std::endl;
+		return 1;
+	}
+
+	std::vector<int> fds;
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	for (int c = 0; c < connections; c++)
+	{
+		int fd = benchBinaryClient(server.port(), QString("wire%1").arg(c), "password");
+		if (fd < 0)
+		{
+			std::cout << "Error: connection " << c << " could not log in" << std::endl;
+			server.stop();
+			return 1;
+		}
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u32 = quint32(fds.size());
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+		fds.push_back(fd);
+	}
+
+	WireWriter exists(quint8(WireOp::ChatExists), 2);
+	exists.writeVarint(1);
+	QByteArray request = exists.frame();
+
+	std::cout << std::left << std::setw(24) << "pipeline depth" << std::right << std::setw(14) << "ops/s" << std::endl;
+	const int depths[] = { 1, 16, 128 };
+	for (int depth : depths)
+	{
+		QByteArray burst;
+		for (int d = 0; d < depth; d++)
+		{
+			burst.append(request);
+		}
+		std::vector<QByteArray> pending(fds.size());
+		for (size_t c = 0; c < fds.size(); c++)
+		{
+			send(fds[c], burst.constData(), burst.size(), MSG_NOSIGNAL);
+		}
+
+		// Every reply is answered with a new request, and the last replies are collected after the clock stops
+		qint64 completed = 0;
+		qint64 outstanding = qint64(depth) * qint64(fds.size());
+		qint64 deadline = benchNow() + qint64(seconds) * 1000000000;
+		start = benchNow();
+		std::vector<epoll_event> events(256);
+		double runSeconds = 0;
+		while (outstanding > 0)
+		{
+			bool running = runSeconds == 0;
+			if (running && benchNow() >= deadline)
+			{
+				runSeconds = (benchNow() - start) / 1e9;
+				running = false;
+			}
+			int count = epoll_wait(epollFd, events.data(), int(events.size()), 100);
+			for (int i = 0; i < count; i++)
+			{
+				int c = int(events[i].data.u32);
+				char chunk[65536];
+				ssize_t received;
+				while ((received = read(fds[c], chunk, sizeof(chunk))) > 0)
+				{
+					pending[c].append(chunk, int(received));
+				}
+
+				int offset = 0;
+				int replies = 0;
+				WireFrame frame;
+				int size;
+				while ((size = WireParser::parse(pending[c].constData() + offset, pending[c].size() - offset, frame)) > 0)
+				{
+					offset += size;
+					replies++;
+				}
+				pending[c].remove(0, offset);
+				outstanding -= replies;
+				if (running)
+				{
+					completed += replies;
+					QByteArray next;
+					for (int r = 0; r < replies; r++)
+					{
+						next.append(request);
+					}
+					send(fds[c], next.constData(), next.size(), MSG_NOSIGNAL);
+					outstanding += replies;
+				}
+			}
+		}
+		std::cout << std::left << std::setw(24) << depth << std::right << std::setw(14) << completed / runSeconds << std::endl;
+	}
+
+	for (size_t c = 0; c < fds.size(); c++)
+	{
+		close(fds[c]);
+	}
+	close(epollFd);
+	server.stop();
+	return 0;
+}
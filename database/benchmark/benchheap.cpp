@@ -0,0 +1,121 @@
+/**
+ * @file benchheap.cpp
+ * @brief Counts the heap use of each benchmark thread by replacing malloc and friends
+ *
+ * The replacements are linked into the benchmark executable, so they count Qt's, SQLite's and
+ * operator new's allocations as well as the benchmarks' own; benchmarks read the counts through
+ * benchHeap(). Where the C library cannot be interposed this way nothing is counted.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <benchmarks.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+
+extern "C"
+{
+	void* __libc_malloc(size_t size);
+	void* __libc_calloc(size_t count, size_t size);
+	void* __libc_realloc(void* pointer, size_t size);
+	void __libc_free(void* pointer);
+}
+
+// Heap use by this thread; plain thread-locals need no allocation of their own
+static __thread qint64 allocationCount = 0;
+static __thread qint64 liveBytes = 0;
+static __thread qint64 peakBytes = 0;
+static const bool countingAllocations = true;
+
+/**
+ * @brief Records an allocation against the calling thread
+ * @param pointer The allocation, or nullptr if it failed
+ * @return The allocation
+ */
+static void* counted(void* pointer)
+{
+	allocationCount++;
+	if (pointer)
+	{
+		liveBytes += qint64(malloc_usable_size(pointer));
+		peakBytes = qMax(peakBytes, liveBytes);
+	}
+	return pointer;
+}
+
+/**
+ * @brief Counting replacement for malloc
+ * @param size The number of bytes
+ * @return The allocation
+ */
+extern "C" void* malloc(size_t size)
+{
+	return counted(__libc_malloc(size));
+}
+
+/**
+ * @brief Counting replacement for calloc
+ * @param count The number of elements
+ * @param size The size of each element
+ * @return The zeroed allocation
+ */
+extern "C" void* calloc(size_t count, size_t size)
+{
+	return counted(__libc_calloc(count, size));
+}
+
+/**
+ * @brief Counting replacement for realloc
+ * @param pointer The allocation to resize, or nullptr
+ * @param size The new number of bytes
+ * @return The resized allocation
+ */
+extern "C" void* realloc(void* pointer, size_t size)
+{
+	liveBytes -= pointer ? qint64(malloc_usable_size(pointer)) : 0;
+	return counted(__libc_realloc(pointer, size));
+}
+
+/**
+ * @brief Replacement for free, paired with the counting allocators
+ * @param pointer The allocation, or nullptr
+ * @return void
+ */
+extern "C" void free(void* pointer)
+{
+	liveBytes -= pointer ? qint64(malloc_usable_size(pointer)) : 0;
+	__libc_free(pointer);
+	return;
+}
+#else
+static qint64 allocationCount = 0;
+static qint64 liveBytes = 0;
+static qint64 peakBytes = 0;
+static const bool countingAllocations = false;
+#endif
+
+/**
+ * @brief Gets the calling thread's heap use so far
+ * @return The counts
+ */
+BenchHeap benchHeap()
+{
+	BenchHeap heap;
+	heap.counted = countingAllocations;
+	heap.allocations = allocationCount;
+	heap.liveBytes = liveBytes;
+	heap.peakBytes = peakBytes;
+	return heap;
+}
+
+/**
+ * @brief Starts a new high-water mark at the calling thread's current live bytes
+ * @return void
+ */
+void benchResetPeak()
+{
+	peakBytes = liveBytes;
+	return;
+}
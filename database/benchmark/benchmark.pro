@@ -0,0 +1,46 @@
+QT       += core sql
+QT       -= gui
+
+TARGET = benchmark.out
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+           benchheap.cpp \
+           bench_logging.cpp \
+           bench_snapshot.cpp \
+           bench_crypto.cpp \
+           bench_senderkeys.cpp \
+           bench_ratchettree.cpp \
+           bench_vfs.cpp \
+           bench_sessions.cpp \
+           bench_fanout.cpp \
+           bench_server.cpp \
+           bench_wire.cpp \
+           bench_groupsend.cpp \
+           bench_presence.cpp \
+           bench_inbox.cpp \
+           bench_compression.cpp \
+           bench_attachments.cpp \
+           bench_streamcrypto.cpp \
+           bench_fileio.cpp \
+           bench_throttle.cpp \
+           bench_usercache.cpp \
+           bench_resultsets.cpp \
+           bench_visitors.cpp \
+           bench_backends.cpp \
+           bench_statements.cpp \
+           bench_utf8.cpp \
+           ../server/chatserver.cpp \
+           ../server/wireprotocol.cpp
+
+HEADERS += benchmarks.h \
+           ../server/chatserver.h \
+           ../server/wireprotocol.h
+
+INCLUDEPATH += ../server
+
+include(../database.pri)
@@ -0,0 +1,87 @@
+/**
+ * @file benchmarks.h
+ * @brief This contains the prototypes for the database benchmarks and their shared helpers
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include <QString>
+#include <QStringList>
+#include <chrono>
+
+// Each benchmark takes the command line arguments that follow its name
+int benchLogging(const QStringList& args);
+int benchSnapshot(const QStringList& args);
+int benchCrypto(const QStringList& args);
+int benchSenderkeys(const QStringList& args);
+int benchRatchettree(const QStringList& args);
+int benchVfs(const QStringList& args);
+int benchSessions(const QStringList& args);
+int benchFanout(const QStringList& args);
+int benchServer(const QStringList& args);
+int benchWire(const QStringList& args);
+int benchGroupsend(const QStringList& args);
+int benchPresence(const QStringList& args);
+int benchInbox(const QStringList& args);
+int benchCompression(const QStringList& args);
+int benchAttachments(const QStringList& args);
+int benchStreamcrypto(const QStringList& args);
+int benchFileio(const QStringList& args);
+int benchThrottle(const QStringList& args);
+int benchUsercache(const QStringList& args);
+int benchResultsets(const QStringList& args);
+int benchVisitors(const QStringList& args);
+int benchBackends(const QStringList& args);
+int benchStatements(const QStringList& args);
+int benchUtf8(const QStringList& args);
+
+/**
+ * @brief Gets a monotonic timestamp for timing benchmark sections
+ * @return The current time in nanoseconds
+ */
+inline qint64 benchNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Gets a fresh database path for a benchmark, deleting any file left from an earlier run
+ * @param name A short name for the benchmark
+ * @return The path of the database file to use
+ */
+QString benchDatabase(const QString& name);
+
+/**
+ * @brief Opens a binary wire protocol connection to a chat server and logs it in
+ * @param port The server's port on the loopback interface
+ * @param username The user to log in as
+ * @param password The user's password
+ * @return The non-blocking socket, or -1 if it could not connect or log in
+ */
+int benchBinaryClient(quint16 port, const QString& username, const QString& password);
+
+// Heap use by the calling thread, as seen by the counting allocator in benchheap.cpp
+struct BenchHeap
+{
+	bool counted;		// false where malloc cannot be replaced, and everything else is 0
+	qint64 allocations;	// calls to malloc, calloc and realloc so far
+	qint64 liveBytes;	// bytes allocated and not yet freed by this thread
+	qint64 peakBytes;	// the most liveBytes has been since benchResetPeak()
+};
+
+/**
+ * @brief Gets the calling thread's heap use so far
+ * @return The counts
+ */
+BenchHeap benchHeap();
+
+/**
+ * @brief Starts a new high-water mark at the calling thread's current live bytes
+ * @return void
+ */
+void benchResetPeak();
+
+#endif	// BENCHMARKS_H
@@ -0,0 +1,80 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <benchmarks.h>
+#include <iostream>
+
+/**
+ * Benchmark driver for the database layer
+ * Usage: benchmark.out <benchmark> [arguments]
+ * Each benchmark creates its own database file in the current directory
+ */
+
+struct Benchmark
+{
+	const char* name;
+	int (*run)(const QStringList& args);
+	const char* description;
+};
+
+static const Benchmark benchmarks[] = {
+	{ "logging", benchLogging, "duplicate addUser flood with synchronous versus asynchronous logging" },
+	{ "snapshot", benchSnapshot, "cold start from a mapped membership snapshot versus warming from SQLite" },
+	{ "crypto", benchCrypto, "message sealing GB/s and messages/s per cipher suite and payload size" },
+	{ "senderkeys", benchSenderkeys, "Per-recipient sealing against per-chat sender keys by chat size" },
+	{ "ratchettree", benchRatchettree, "Tree-based group rekeying against flat rekeying by chat size" },
+	{ "vfs", benchVfs, "Encrypted VFS throughput and write amplification against plain I/O" },
+	{ "sessions", benchSessions, "Session token verification against checkUserInfo" },
+	{ "fanout", benchFanout, "Fan-out of chat messages to per-connection queues by chat size" },
+	{ "server", benchServer, "Chat server connections held and requests/s over loopback" },
+	{ "wire", benchWire, "Binary protocol parse throughput and pipelined ops/s over loopback" },
+	{ "groupsend", benchGroupsend, "Group message delivery with copied against shared writev frames" },
+	{ "presence", benchPresence, "Presence updates and online filtering across threads" },
+	{ "inbox", benchInbox, "Offline inbox drain latency for small to very large inboxes" },
+	{ "compression", benchCompression, "Compression ratio and speed with and without trained dictionaries" },
+	{ "attachments", benchAttachments, "Attachment ingest, deduplication and download on a forwarding-heavy workload" },
+	{ "streamcrypto", benchStreamcrypto, "Streaming attachment encryption MB/s by worker thread count" },
+	{ "fileio", benchFileio, "4 KiB random reads and 1 MiB writes: blocking, thread pool, io_uring" },
+	{ "throttle", benchThrottle, "credential-stuffing attack against the login throttle" },
+	{ "usercache", benchUsercache, "Lookups through the sharded user cache against userinfo queries" },
+	{ "resultsets", benchResultsets, "Arena-backed membership results against QVector<QString> results" },
+	{ "visitors", benchVisitors, "Membership visitors against building results on a very large chat" },
+	{ "backends", benchBackends, "Every public DbManager method on the QtSql and sqlite3 storage backends" },
+	{ "statements", benchStatements, "Per-call overhead of DbManager's point lookups against hand-written queries" },
+	{ "utf8", benchUtf8, "DbManager's UTF-8 overloads against its QString methods on a roster-heavy workload" },
+};
+
+/**
+ * @brief Gets a fresh database path for a benchmark, deleting any file left from an earlier run
+ * @param name A short name for the benchmark
+ * @return The path of the database file to use
+ */
+QString benchDatabase(const QString& name)
+{
+	QString path = QString("bench_%1.sqlite").arg(name);
+	QFile::remove(path);
+	return path;
+}
+
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = QCoreApplication::arguments();
+
+	if (args.size() >= 2)
+	{
+		for (const Benchmark& benchmark : benchmarks)
+		{
+			if (args[1] == benchmark.name)
+			{
+				return benchmark.run(args.mid(2));
+			}
+		}
+	}
+
+	std::cout << "Usage: benchmark.out <benchmark> [arguments]" << std::endl;
+	for (const Benchmark& benchmark : benchmarks)
+	{
+		std::cout << "  " << benchmark.name << ": " << benchmark.description << std::endl;
+	}
+	return 1;
+}
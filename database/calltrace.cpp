@@ -0,0 +1,299 @@
+/**
+ * @file calltrace.cpp
+ * @brief Records DbManager calls to a compact binary trace file
+ *
+ * Calls are pushed into a lock-free ring buffer by the thread making the call,
+ * and a background writer thread drains the ring into the trace file.
+ * If the writer falls behind and the ring fills up, records are dropped and
+ * counted rather than slowing down the database call that produced them.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <calltrace.h>
+#include <dblog.h>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <cstring>
+
+/**
+ * @brief Constructor for the trace recorder
+ * @param capacity The number of records the ring buffer can hold before records are dropped
+ */
+CallTraceRecorder::CallTraceRecorder(int capacity)
+	: ring(capacity), running(false), dropped(0)
+{
+}
+
+/**
+ * @brief Destructor for the trace recorder
+ * Stops recording so that everything still in the ring is written out
+ */
+CallTraceRecorder::~CallTraceRecorder()
+{
+	stop();
+}
+
+/**
+ * @brief Opens the trace file and starts the background writer
+ * A fresh random salt is chosen for every recording and never stored
+ * @param tracePath The path of the trace file to create
+ * @return boolean indicating whether recording was started
+ */
+bool CallTraceRecorder::start(const QString& tracePath)
+{
+	if (running.load())
+	{
+		DBLOG_ERROR("startRecording", DbErrorNone, 0, "a recording is already in progress", tracePath);
+		return false;
+	}
+
+	file.setFileName(tracePath);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	{
+		DBLOG_ERROR("startRecording", DbErrorIo, 0, "trace file could not be opened", file.errorString());
+		return false;
+	}
+
+	salt.resize(16);
+	QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(salt.data()), salt.size() / 4);
+
+	// Write the header: magic, version, record size
+	quint32 header[2] = { traceVersion, quint32(sizeof(TraceRecord)) };
+	file.write(traceMagic, sizeof(traceMagic));
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	dropped.store(0);
+	startTime = std::chrono::steady_clock::now();
+	running.store(true);
+	writer = std::thread(&CallTraceRecorder::writerLoop, this);
+	return true;
+}
+
+/**
+ * @brief Stops recording, flushes the remaining records and closes the trace file
+ * @return void
+ */
+void CallTraceRecorder::stop()
+{
+	if (!running.exchange(false))
+	{
+		return;
+	}
+
+	writer.join();
+	file.close();
+	salt.fill(0);
+
+	if (dropped.load() > 0)
+	{
+		DBLOG_WARNING("stopRecording", DbErrorNone, 0, "records were dropped because the buffer was full", QString::number(dropped.load()));
+	}
+	return;
+}
+
+/**
+ * @brief Checks if a recording is in progress
+ * @return boolean indicating whether calls are currently being recorded
+ */
+bool CallTraceRecorder::isRecording() const
+{
+	return running.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Hashes a username with the salt of the current recording
+ * @param username The username to be hashed
+ * @return The first 64 bits of the salted SHA-256 hash, or 0 for an empty username
+ */
+quint64 CallTraceRecorder::hashUsername(const QString& username) const
+{
+	if (username.isEmpty())
+	{
+		return 0;
+	}
+
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	hash.addData(salt);
+	hash.addData(username.toUtf8());
+	QByteArray digest = hash.result();
+
+	quint64 value = 0;
+	memcpy(&value, digest.constData(), sizeof(value));
+	// 0 is reserved for "no username"
+	return value ? value : 1;
+}
+
+/**
+ * @brief Gets the current time relative to the start of the recording
+ * @return The elapsed time in nanoseconds
+ */
+quint64 CallTraceRecorder::now() const
+{
+	return quint64(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count());
+}
+
+/**
+ * @brief Queues records for the writer thread
+ * The records are kept together in the trace; if they do not fit they are all dropped
+ * A count of 0 just marks one call as dropped
+ * @param records Pointer to the first record
+ * @param count The number of records
+ * @return boolean indicating whether the records were queued
+ */
+bool CallTraceRecorder::append(const TraceRecord* records, int count)
+{
+	if (!isRecording() || !ring.tryPush(records, count))
+	{
+		dropped.fetch_add(quint64(qMax(count, 1)), std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Gets the number of records lost because the ring buffer was full
+ * @return The number of dropped records in the current recording
+ */
+quint64 CallTraceRecorder::droppedRecords() const
+{
+	return dropped.load();
+}
+
+/**
+ * @brief The body of the writer thread
+ * Drains the ring in batches and writes each batch with a single call
+ * Keeps draining after stop() until the ring is empty
+ * @return void
+ */
+void CallTraceRecorder::writerLoop()
+{
+	const int batchSize = 1024;
+	QVector<TraceRecord> batch(batchSize);
+
+	for (;;)
+	{
+		bool stopping = !running.load(std::memory_order_acquire);
+		int count = 0;
+		while (count < batchSize && ring.tryPop(batch[count]))
+		{
+			count++;
+		}
+
+		if (count > 0)
+		{
+			file.write(reinterpret_cast<const char*>(batch.constData()), qint64(count) * sizeof(TraceRecord));
+		}
+		else if (stopping)
+		{
+			break;
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	file.flush();
+}
+
+/**
+ * @brief Fills in the fields known when the traced call starts
+ * @param op The method being traced
+ * @return void
+ */
+void TraceScope::begin(TraceOp op)
+{
+	memset(&record, 0, sizeof(record));
+	record.op = quint8(op);
+	record.timestampNs = recorder->now();
+}
+
+/**
+ * @brief Sets the username arguments of the traced call
+ * @param username1 The first username argument
+ * @param username2 The second username argument, if the method takes one
+ * @return void
+ */
+void TraceScope::setUsers(const QString& username1, const QString& username2)
+{
+	if (active)
+	{
+		record.user1 = recorder->hashUsername(username1);
+		record.user2 = recorder->hashUsername(username2);
+	}
+}
+
+/**
+ * @brief Sets the username arguments of the traced call from UTF-8, decoding them only while recording
+ * @param username1 The first username argument
+ * @param username2 The second username argument, if the method takes one
+ * @return void
+ */
+void TraceScope::setUsers(Utf8View username1, Utf8View username2)
+{
+	if (active)
+	{
+		record.user1 = recorder->hashUsername(username1.toString());
+		record.user2 = recorder->hashUsername(username2.toString());
+	}
+}
+
+/**
+ * @brief Sets the member list of a traced addChat call
+ * @param usernames The usernames of the chat members
+ * @return void
+ */
+void TraceScope::setMembers(const QVector<QString>& usernames)
+{
+	if (active)
+	{
+		members.reserve(usernames.size());
+		for (int i = 0; i < usernames.size(); i++)
+		{
+			members.append(recorder->hashUsername(usernames[i]));
+		}
+	}
+}
+
+/**
+ * @brief Appends the finished call, and any member records, to the trace
+ * @return void
+ */
+void TraceScope::commit()
+{
+	quint64 latency = recorder->now() - record.timestampNs;
+	record.latencyNs = latency > 0xFFFFFFFFull ? 0xFFFFFFFFu : quint32(latency);
+
+	if (members.isEmpty())
+	{
+		recorder->append(&record, 1);
+		return;
+	}
+
+	// Two member hashes fit in each continuation record
+	int extra = (members.size() + 1) / 2;
+	if (extra > 0xFFFF)
+	{
+		// Too many members to describe in one entry, so the call is counted as dropped
+		recorder->append(&record, 0);
+		return;
+	}
+	record.argCount = quint16(extra);
+
+	QVector<TraceRecord> records(extra + 1);
+	records[0] = record;
+	for (int i = 0; i < extra; i++)
+	{
+		TraceRecord& member = records[i + 1];
+		memset(&member, 0, sizeof(member));
+		member.op = quint8(TraceOp::ChatMember);
+		member.chatID = record.chatID;
+		member.user1 = members[2 * i];
+		if (2 * i + 1 < members.size())
+		{
+			member.user2 = members[2 * i + 1];
+		}
+	}
+	recorder->append(records.constData(), records.size());
+}
@@ -0,0 +1,131 @@
+/**
+ * @file calltrace.h
+ * @brief This contains the prototypes for recording DbManager call traces
+ *
+ * A trace file starts with a small header followed by fixed-size TraceRecord entries.
+ * Usernames are never written; each one is replaced by a salted hash so the same user
+ * always maps to the same value within a trace but cannot be recovered from it.
+ * addChat member lists follow their call record as ChatMember continuation records.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef CALLTRACE_H
+#define CALLTRACE_H
+
+#include <QString>
+#include <QVector>
+#include <QFile>
+#include <QByteArray>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mpscring.h>
+#include <resultset.h>
+
+// Identifies which DbManager method a trace record belongs to
+enum class TraceOp : quint8
+{
+	AddUser = 1,
+	UserExists,
+	CheckUserInfo,
+	AddChat,
+	RemoveChat,
+	ChatExists,
+	GetChatOwner,
+	DoUsersChat,
+	GetChatUsers,
+	GetChatsUserIsIn,
+	GetUserChatInfo,
+	ChatMember = 0xFF
+};
+
+// One on-disk trace entry (40 bytes, host byte order)
+struct TraceRecord
+{
+	quint64 timestampNs;	// Time the call started, relative to the start of recording
+	quint64 user1;			// Hash of the first username argument (0 if none)
+	quint64 user2;			// Hash of the second username argument (0 if none)
+	quint32 latencyNs;		// Time spent in the call, saturated at about 4 seconds
+	qint32 chatID;			// The chat ID argument (0 if none)
+	quint32 resultSize;		// Rows or characters returned, or 1/0 for boolean results
+	quint16 argCount;		// Number of ChatMember records that follow this one
+	quint8 op;				// A TraceOp value
+	quint8 reserved;
+};
+
+static const char traceMagic[8] = { 'D', 'B', 'T', 'R', 'A', 'C', 'E', '1' };
+static const quint32 traceVersion = 1;
+
+class CallTraceRecorder
+{
+	public:
+		explicit CallTraceRecorder(int capacity = 65536);
+		~CallTraceRecorder();
+		bool start(const QString& tracePath);
+		void stop();
+		bool isRecording() const;
+		quint64 hashUsername(const QString& username) const;
+		quint64 now() const;
+		bool append(const TraceRecord* records, int count);
+		quint64 droppedRecords() const;
+	private:
+		void writerLoop();
+		MpscRing<TraceRecord> ring;
+		QFile file;
+		QByteArray salt;
+		std::thread writer;
+		std::atomic<bool> running;
+		std::atomic<quint64> dropped;
+		std::chrono::steady_clock::time_point startTime;
+};
+
+/**
+ * @brief Records one DbManager call for the lifetime of the scope
+ * Construct at the top of a traced method and the call is appended to the trace when the scope ends.
+ * Calls made from inside another traced call are not recorded, so only the caller's request is replayed.
+ * When no recorder is attached every member is a cheap no-op.
+ */
+class TraceScope
+{
+	public:
+		TraceScope(CallTraceRecorder* recorder, int& depth, TraceOp op)
+			: recorder(recorder), depth(depth), active(false)
+		{
+			if (recorder)
+			{
+				active = (depth++ == 0);
+				if (active)
+				{
+					begin(op);
+				}
+			}
+		}
+		~TraceScope()
+		{
+			if (recorder)
+			{
+				--depth;
+				if (active)
+				{
+					commit();
+				}
+			}
+		}
+		void setChat(int chatID) { if (active) record.chatID = chatID; }
+		void setUsers(const QString& username1, const QString& username2 = QString());
+		void setUsers(Utf8View username1, Utf8View username2 = Utf8View());
+		void setMembers(const QVector<QString>& usernames);
+		void setResultSize(int size) { if (active) record.resultSize = quint32(size); }
+	private:
+		void begin(TraceOp op);
+		void commit();
+		CallTraceRecorder* recorder;
+		int& depth;
+		bool active;
+		TraceRecord record;
+		QVector<quint64> members;
+};
+
+#endif	// CALLTRACE_H
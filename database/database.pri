@@ -0,0 +1,61 @@
+# Database layer shared by the demo, the replay tool and anything else built on DbManager
+QT       += core sql
+QT       -= gui
+
+CONFIG   += c++14
+
+LIBS     += -lcrypto -lsqlite3 -lzstd
+
+# StorageKind::Sqlite calls SQLite on the QSQLITE driver's handle, which is only safe when Qt was
+# configured with -system-sqlite and so uses this same library
+# DEFINES  += DB_SYSTEM_SQLITE
+
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/dbmanager.cpp \
+           $$PWD/dblog.cpp \
+           $$PWD/encryptedvfs.cpp \
+           $$PWD/calltrace.cpp \
+           $$PWD/membershipsnapshot.cpp \
+           $$PWD/messagecrypto.cpp \
+           $$PWD/streamcrypto.cpp \
+           $$PWD/messagecompressor.cpp \
+           $$PWD/ratchettree.cpp \
+           $$PWD/sessionmanager.cpp \
+           $$PWD/presence.cpp \
+           $$PWD/loginthrottle.cpp \
+           $$PWD/usercache.cpp \
+           $$PWD/seededhash.cpp \
+           $$PWD/resultset.cpp \
+           $$PWD/storagebackend.cpp \
+           $$PWD/inbox.cpp \
+           $$PWD/fileio.cpp \
+           $$PWD/attachmentstore.cpp \
+           $$PWD/fanout.cpp \
+           $$PWD/senderkeys.cpp \
+           $$PWD/tracereplayer.cpp
+
+HEADERS += $$PWD/dbmanager.h \
+           $$PWD/mpscring.h \
+           $$PWD/dblog.h \
+           $$PWD/encryptedvfs.h \
+           $$PWD/calltrace.h \
+           $$PWD/membershipsnapshot.h \
+           $$PWD/messagecrypto.h \
+           $$PWD/streamcrypto.h \
+           $$PWD/messagecompressor.h \
+           $$PWD/ratchettree.h \
+           $$PWD/sessionmanager.h \
+           $$PWD/presence.h \
+           $$PWD/loginthrottle.h \
+           $$PWD/usercache.h \
+           $$PWD/seededhash.h \
+           $$PWD/resultset.h \
+           $$PWD/storagebackend.h \
+           $$PWD/typedquery.h \
+           $$PWD/inbox.h \
+           $$PWD/fileio.h \
+           $$PWD/attachmentstore.h \
+           $$PWD/fanout.h \
+           $$PWD/senderkeys.h \
+           $$PWD/tracereplayer.h
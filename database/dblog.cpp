@@ -0,0 +1,271 @@
+/**
+ * @file dblog.cpp
+ * @brief The asynchronous logger behind the DBLOG_* macros
+ *
+ * Entries are written one per line as key=value fields, for example:
+ * ts=1700000000000 level=ERROR method=addUser code=4 chatid=0 msg="this user already exists"
+ * A suppressed=n field is added when the call site's rate limiter dropped messages before this one.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <dblog.h>
+#include <QDateTime>
+#include <cstring>
+
+/**
+ * @brief Decides whether the call site may log now
+ * @param suppressed Receives the number of messages dropped at this site since the last one allowed
+ * @return boolean indicating whether the message should be logged
+ */
+bool LogRateLimiter::allow(quint32& suppressed)
+{
+	qint64 now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	qint64 start = windowStart.load(std::memory_order_relaxed);
+
+	// Start a new one-second window; only the thread that wins the exchange resets the count
+	if (now - start >= 1000 && windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed))
+	{
+		count.store(0, std::memory_order_relaxed);
+	}
+
+	if (count.fetch_add(1, std::memory_order_relaxed) < DBLOG_SITE_RATE)
+	{
+		suppressed = suppressedCount.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+
+	suppressedCount.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+/**
+ * @brief Gets the process-wide logger
+ * @return The logger instance
+ */
+AsyncLogger& AsyncLogger::instance()
+{
+	static AsyncLogger logger;
+	return logger;
+}
+
+/**
+ * @brief Constructor for the logger
+ * The flushing thread is not started until the first entry is logged
+ */
+AsyncLogger::AsyncLogger()
+	: ring(8192), started(false), running(false), synchronous(false), dropped(0), pushed(0), written(0), output(stderr)
+{
+}
+
+/**
+ * @brief Destructor for the logger
+ * Stops the flushing thread after it has written everything still queued
+ */
+AsyncLogger::~AsyncLogger()
+{
+	if (started.load())
+	{
+		running.store(false);
+		flusher.join();
+	}
+}
+
+/**
+ * @brief Queues a log entry, or writes it immediately in synchronous mode
+ * Normally called through the DBLOG_* macros rather than directly
+ * @param level The DBLOG_LEVEL_* level of the entry
+ * @param method The name of the method logging the entry (a string literal)
+ * @param code A DbError code
+ * @param chatID The chat the entry concerns, or 0
+ * @param message A fixed description of the event (a string literal)
+ * @param detail Variable detail such as a query error, truncated to fit the entry
+ * @param suppressed The number of messages the call site's rate limiter dropped before this one
+ * @return void
+ */
+void AsyncLogger::log(int level, const char* method, int code, int chatID, const char* message, const QString& detail, quint32 suppressed)
+{
+	LogEntry entry;
+	entry.timestampMs = QDateTime::currentMSecsSinceEpoch();
+	entry.method = method;
+	entry.message = message;
+	entry.level = level;
+	entry.code = code;
+	entry.chatID = chatID;
+	entry.suppressed = suppressed;
+	entry.detail[0] = '\0';
+
+	if (!detail.isEmpty())
+	{
+		QByteArray utf8 = detail.toUtf8();
+		int length = qMin(utf8.size(), int(sizeof(entry.detail)) - 1);
+		memcpy(entry.detail, utf8.constData(), length);
+		entry.detail[length] = '\0';
+	}
+
+	if (synchronous.load(std::memory_order_relaxed))
+	{
+		writeEntry(entry);
+		return;
+	}
+
+	start();
+	if (ring.tryPush(entry))
+	{
+		pushed.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	return;
+}
+
+/**
+ * @brief Sets where log lines are written
+ * @param stream An open stdio stream; stderr by default
+ * @return void
+ */
+void AsyncLogger::setOutput(FILE* stream)
+{
+	flush();
+	output = stream;
+	return;
+}
+
+/**
+ * @brief Switches between asynchronous logging and writing each entry on the calling thread
+ * Synchronous mode also bypasses rate limiting; it reproduces the old qDebug behaviour for comparison
+ * @param enabled true to format and write entries on the calling thread
+ * @return void
+ */
+void AsyncLogger::setSynchronous(bool enabled)
+{
+	flush();
+	synchronous.store(enabled);
+	return;
+}
+
+/**
+ * @brief Checks if the logger is in synchronous mode
+ * @return boolean indicating whether entries are written on the calling thread
+ */
+bool AsyncLogger::isSynchronous() const
+{
+	return synchronous.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Waits until every entry queued so far has been written
+ * @return void
+ */
+void AsyncLogger::flush()
+{
+	if (!started.load())
+	{
+		return;
+	}
+
+	quint64 target = pushed.load();
+	while (written.load() < target)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	fflush(output);
+	return;
+}
+
+/**
+ * @brief Gets the number of entries lost because the ring buffer was full
+ * @return The number of dropped entries
+ */
+quint64 AsyncLogger::droppedEntries() const
+{
+	return dropped.load();
+}
+
+/**
+ * @brief Starts the flushing thread if it is not already running
+ * @return void
+ */
+void AsyncLogger::start()
+{
+	if (started.load(std::memory_order_acquire))
+	{
+		return;
+	}
+
+	bool expected = false;
+	if (started.compare_exchange_strong(expected, true))
+	{
+		running.store(true);
+		flusher = std::thread(&AsyncLogger::flusherLoop, this);
+	}
+	return;
+}
+
+/**
+ * @brief The body of the flushing thread
+ * Writes entries as they arrive and flushes the stream whenever the ring runs dry
+ * @return void
+ */
+void AsyncLogger::flusherLoop()
+{
+	LogEntry entry;
+	for (;;)
+	{
+		bool stopping = !running.load(std::memory_order_acquire);
+		int count = 0;
+		while (ring.tryPop(entry))
+		{
+			writeEntry(entry);
+			written.fetch_add(1, std::memory_order_relaxed);
+			count++;
+		}
+
+		if (count > 0)
+		{
+			fflush(output);
+		}
+		else if (stopping)
+		{
+			break;
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	if (dropped.load() > 0)
+	{
+		fprintf(output, "level=WARNING method=AsyncLogger msg=\"log entries dropped\" count=%llu\n", static_cast<unsigned long long>(dropped.load()));
+		fflush(output);
+	}
+}
+
+/**
+ * @brief Formats one entry as a line of key=value fields
+ * @param entry The entry to be written
+ * @return void
+ */
+void AsyncLogger::writeEntry(const LogEntry& entry)
+{
+	static const char* levelNames[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+	const char* levelName = (entry.level >= 0 && entry.level <= 3) ? levelNames[entry.level] : "UNKNOWN";
+
+	fprintf(output, "ts=%lld level=%s method=%s code=%d chatid=%d msg=\"%s\"",
+		static_cast<long long>(entry.timestampMs), levelName, entry.method, entry.code, entry.chatID, entry.message);
+
+	if (entry.detail[0] != '\0')
+	{
+		fprintf(output, " detail=\"%s\"", entry.detail);
+	}
+	if (entry.suppressed > 0)
+	{
+		fprintf(output, " suppressed=%u", entry.suppressed);
+	}
+	fputc('\n', output);
+	return;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file dblog.h
+ * @brief This contains the asynchronous, rate-limited logger used on the database hot paths
+ *
+ * Log calls go through the DBLOG_* macros. A call below DBLOG_MIN_LEVEL compiles to nothing.
+ * Otherwise the call site's own rate limiter is consulted, and only then are the arguments
+ * evaluated and a fixed-size entry pushed onto a lock-free ring buffer. A background thread
+ * formats the entries and writes them out, so the caller never waits on string formatting or I/O.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef DBLOG_H
+#define DBLOG_H
+
+#include <QString>
+#include <QByteArray>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <mpscring.h>
+
+// Log levels, lowest first
+#define DBLOG_LEVEL_DEBUG 0
+#define DBLOG_LEVEL_INFO 1
+#define DBLOG_LEVEL_WARNING 2
+#define DBLOG_LEVEL_ERROR 3
+
+// Calls below this level are removed at compile time (override with DEFINES += DBLOG_MIN_LEVEL=n)
+#ifndef DBLOG_MIN_LEVEL
+#define DBLOG_MIN_LEVEL DBLOG_LEVEL_INFO
+#endif
+
+// How many messages per second each call site may log before it is rate limited
+#ifndef DBLOG_SITE_RATE
+#define DBLOG_SITE_RATE 10
+#endif
+
+// Error codes attached to database log entries
+enum DbError
+{
+	DbErrorNone = 0,
+	DbErrorConnection,
+	DbErrorTableExists,
+	DbErrorQuery,
+	DbErrorUserExists,
+	DbErrorUserMissing,
+	DbErrorChatExists,
+	DbErrorChatMissing,
+	DbErrorNotOwner,
+	DbErrorCrypto,
+	DbErrorCompression,
+	DbErrorAttachment,
+	DbErrorIo,
+	DbErrorThrottled
+};
+
+// One queued log entry; method and message must be string literals
+struct LogEntry
+{
+	qint64 timestampMs;
+	const char* method;
+	const char* message;
+	qint32 level;
+	qint32 code;
+	qint32 chatID;
+	quint32 suppressed;
+	char detail[96];
+};
+
+/**
+ * @brief Limits how often a single call site may log
+ * Allows DBLOG_SITE_RATE messages in each one-second window and counts the rest,
+ * so the next message that gets through can say how many were suppressed.
+ * Constant-initialised, so a static instance at each call site costs no guard check.
+ */
+class LogRateLimiter
+{
+	public:
+		constexpr LogRateLimiter()
+			: windowStart(0), count(0), suppressedCount(0)
+		{
+		}
+		bool allow(quint32& suppressed);
+	private:
+		std::atomic<qint64> windowStart;
+		std::atomic<int> count;
+		std::atomic<quint32> suppressedCount;
+};
+
+class AsyncLogger
+{
+	public:
+		static AsyncLogger& instance();
+		~AsyncLogger();
+		void log(int level, const char* method, int code, int chatID, const char* message, const QString& detail, quint32 suppressed);
+		void setOutput(FILE* stream);
+		void setSynchronous(bool enabled);
+		bool isSynchronous() const;
+		void flush();
+		quint64 droppedEntries() const;
+	private:
+		AsyncLogger();
+		void start();
+		void flusherLoop();
+		void writeEntry(const LogEntry& entry);
+		MpscRing<LogEntry> ring;
+		std::thread flusher;
+		std::atomic<bool> started;
+		std::atomic<bool> running;
+		std::atomic<bool> synchronous;
+		std::atomic<quint64> dropped;
+		std::atomic<quint64> pushed;
+		std::atomic<quint64> written;
+		FILE* output;
+};
+
+#define DBLOG(level, method, code, chatID, message, detail) \
+	do \
+	{ \
+		if (level >= DBLOG_MIN_LEVEL) \
+		{ \
+			static LogRateLimiter dblogSiteLimiter; \
+			quint32 dblogSuppressed = 0; \
+			if (dblogSiteLimiter.allow(dblogSuppressed) || AsyncLogger::instance().isSynchronous()) \
+			{ \
+				AsyncLogger::instance().log(level, method, code, chatID, message, detail, dblogSuppressed); \
+			} \
+		} \
+	} while (0)
+
+#define DBLOG_DEBUG(method, code, chatID, message, detail) DBLOG(DBLOG_LEVEL_DEBUG, method, code, chatID, message, detail)
+#define DBLOG_INFO(method, code, chatID, message, detail) DBLOG(DBLOG_LEVEL_INFO, method, code, chatID, message, detail)
+#define DBLOG_WARNING(method, code, chatID, message, detail) DBLOG(DBLOG_LEVEL_WARNING, method, code, chatID, message, detail)
+#define DBLOG_ERROR(method, code, chatID, message, detail) DBLOG(DBLOG_LEVEL_ERROR, method, code, chatID, message, detail)
+
+#endif	// DBLOG_H
@@ -7,12 +7,37 @@
  * 2nd table called chats--just the chat ID numbers.
  * 3rd table called chatusers--each row contains a chat ID and a username of
  * a user in that chat. 
+ * 4th table called membershiplog--one row per chat created or removed, used to
+ * bring a membership snapshot up to date.
  *
  * @author mdolan2
  * @bug No known bugs.
  */
  
 #include <dbmanager.h>
+#include <presence.h>
+#include <loginthrottle.h>
+#include <usercache.h>
+#include <typedquery.h>
+
+// Every statement DbManager runs, with the types of its parameters and of its result columns
+static constexpr Statement<QueryParams<>, QueryColumns<>> createMembershipLog("CREATE TABLE IF NOT EXISTS membershiplog(seq INTEGER PRIMARY KEY AUTOINCREMENT, chatid INTEGER NOT NULL);");
+static constexpr Statement<QueryParams<int>, QueryColumns<>> insertMembershipChange("INSERT INTO membershiplog (chatid) VALUES (?)");
+static constexpr Statement<QueryParams<>, QueryColumns<>> createUserInfo("CREATE TABLE userinfo(username VARCHAR(20) PRIMARY KEY, password VARCHAR(20));");
+static constexpr Statement<QueryParams<QueryText, QueryText>, QueryColumns<>> insertUser("INSERT INTO userinfo VALUES (?, ?)");
+static constexpr Statement<QueryParams<QueryText>, QueryColumns<QString>> selectUser("SELECT username FROM userinfo WHERE username = ?");
+static constexpr Statement<QueryParams<QueryText>, QueryColumns<qint64, QString>> selectUserRecord("SELECT rowid, password FROM userinfo WHERE username = ?");
+static constexpr Statement<QueryParams<QueryText, QueryText>, QueryColumns<QString>> selectUserWithPassword("SELECT username FROM userinfo WHERE username = ? AND password = ?");
+static constexpr Statement<QueryParams<>, QueryColumns<>> createChats("CREATE TABLE chats(chatid INTEGER PRIMARY KEY, owner VARCHAR(20) NOT NULL, FOREIGN KEY(owner) references userinfo(username));");
+static constexpr Statement<QueryParams<>, QueryColumns<>> createChatUsers("CREATE TABLE chatusers(rowid INTEGER PRIMARY KEY, chatid INTEGER, username VARCHAR(20) NOT NULL, FOREIGN KEY(chatid) references chats(chatid), FOREIGN KEY(username) references userinfo(username));");
+static constexpr Statement<QueryParams<int, QueryText>, QueryColumns<>> insertChat("INSERT INTO chats (chatid, owner) VALUES (?, ?)");
+static constexpr Statement<QueryParams<int, QueryText>, QueryColumns<>> insertChatUser("INSERT INTO chatusers (chatid, username) VALUES (?, ?)");
+static constexpr Statement<QueryParams<int>, QueryColumns<>> deleteChat("DELETE FROM chats WHERE chatid = ?");
+static constexpr Statement<QueryParams<int>, QueryColumns<>> deleteChatUsers("DELETE FROM chatusers WHERE chatid = ?");
+static constexpr Statement<QueryParams<int>, QueryColumns<int>> selectChat("SELECT chatid FROM chats WHERE chatid = ?");
+static constexpr Statement<QueryParams<int>, QueryColumns<QString>> selectChatOwner("SELECT owner FROM chats WHERE chatid = ?");
+static constexpr Statement<QueryParams<int>, QueryColumns<Utf8View>> selectChatUsers("SELECT username FROM chatusers WHERE chatid = ?");
+static constexpr Statement<QueryParams<QueryText>, QueryColumns<int>> selectChatsOfUser("SELECT chatid FROM chatusers WHERE username = ?");
 
 /**
  * @brief Constructor for the database manager
@@ -21,13 +46,44 @@
  */
 
 DbManager::DbManager()
+	: DbManager("DB.sqlite")
 {
-   db = QSqlDatabase::addDatabase("QSQLITE");
-   db.setDatabaseName("DB.sqlite");
+}
+
+/**
+ * @brief Constructor for a database manager on a specific database file
+ * Each thread that uses the database needs its own DbManager with its own connection name
+ * @param databasePath The path of the SQLite database file, or a file: URI such as one from EncryptedVfs::uri()
+ * @param connectionName The Qt connection name to register; the default connection is used if empty
+ * @param storageKind Whether statements run through QtSql or straight on the sqlite3 C API; see storagebackend.h before choosing Sqlite
+ */
+DbManager::DbManager(const QString& databasePath, const QString& connectionName, StorageKind storageKind)
+	: traceDepth(0), snapshotInterval(0), changesSinceSnapshot(0), membershipOwned(false), snapshotStale(false), presence(nullptr), throttle(nullptr), users(nullptr)
+{
+   if (connectionName.isEmpty())
+   {
+      db = QSqlDatabase::addDatabase("QSQLITE");
+   }
+   else
+   {
+      db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+   }
+   db.setDatabaseName(databasePath);
+   // Other connections, such as the chat server's workers, may hold the write lock briefly
+   db.setConnectOptions("QSQLITE_OPEN_URI;QSQLITE_BUSY_TIMEOUT=5000");
 
    if (!db.open())
    {
-      qDebug() << "Error: connection with database failed";
+      DBLOG_ERROR("DbManager", DbErrorConnection, 0, "connection with database failed", db.lastError().text());
+      // Statements still need somewhere to fail, and only QtSql can run without a handle
+      storage.reset(StorageBackend::create(StorageKind::QtSql, db));
+   }
+   else
+   {
+      storage.reset(StorageBackend::create(storageKind, db));
+      // Every membership change is logged so that membership snapshots can catch up
+      auto query = createMembershipLog.prepare(*storage);
+      query.exec();
    }
 }
 
@@ -37,7 +93,10 @@ DbManager::DbManager()
  */
 DbManager::~DbManager()
 {
-	if (db.isOpen())
+	stopRecording();
+
+	// Prepared statements must be finalized before their connection is closed
+	if (storage->release() && db.isOpen())
 	{
 		db.close();
 	}
@@ -52,16 +111,280 @@ bool DbManager::isOpen() const
 	return db.isOpen();
 }
 
+/**
+ * @brief Gets the connection this database manager uses
+ * Lets modules that keep their own tables, such as the sender keys, share the connection
+ * @return The database connection
+ */
+QSqlDatabase DbManager::database() const
+{
+	return db;
+}
+
+/**
+ * @brief Starts a transaction that takes the write lock up front
+ * A deferred transaction that reads before it writes can fail with SQLITE_BUSY when it upgrades,
+ * after its reads are done; this one waits out the busy timeout at the start instead.
+ * Finish it with database().commit() or database().rollback()
+ * @return boolean indicating whether the transaction started
+ */
+bool DbManager::beginImmediate()
+{
+	QSqlQuery query(db);
+	if (!query.exec("BEGIN IMMEDIATE"))
+	{
+		DBLOG_ERROR("beginImmediate", DbErrorQuery, 0, "write transaction could not be started", query.lastError().text());
+		return false;
+	}
+	return true;
+}
+
 /**
  * @brief Closes the database
+ * Later statements go through QtSql, which fails them cleanly instead of using the closed handle.
+ * The database stays open if a statement is still being stepped, as when a forEach visitor calls close().
  * @return void
  */
 void DbManager::close()
 {
+	if (!storage->release())
+	{
+		return;
+	}
 	db.close();
+	storage.reset(StorageBackend::create(StorageKind::QtSql, db));
+	return;
+}
+
+/**
+ * @brief Gets the backend this database manager runs its statements on
+ * @return The storage kind, QtSql if Sqlite was asked for but the connection had no sqlite3 handle
+ */
+StorageKind DbManager::storageKind() const
+{
+	return storage->kind();
+}
+
+/**
+ * @brief Starts recording every API call made through this database manager
+ * Each call is written to the trace with hashed usernames, its timestamp, latency and result size
+ * Calls made internally by other methods (such as addUser checking userExists) are not recorded
+ * @param tracePath The path of the trace file to create
+ * @return boolean indicating whether recording was started
+ */
+bool DbManager::startRecording(const QString& tracePath)
+{
+	stopRecording();
+	recorder.reset(new CallTraceRecorder());
+
+	if (!recorder->start(tracePath))
+	{
+		recorder.reset();
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Stops recording and closes the trace file
+ * Does nothing if no recording is in progress
+ * @return void
+ */
+void DbManager::stopRecording()
+{
+	// Destroying the recorder flushes and closes the trace
+	recorder.reset();
+	return;
+}
+
+/**
+ * @brief Writes a snapshot of the chat membership graph that can be mapped at startup
+ * @param path The path of the snapshot file
+ * @return boolean indicating whether the snapshot was written
+ */
+bool DbManager::writeMembershipSnapshot(const QString& path)
+{
+	return MembershipSnapshot::write(db, path);
+}
+
+/**
+ * @brief Serves membership reads from a snapshot file instead of the chatusers table
+ * Maps the snapshot, then applies every change logged since it was written
+ * Once loaded, chatExists, getChatUsers, getChatsUserIsIn and doUsersChat no longer query SQLite
+ * Changes made through this DbManager are applied immediately; changes made through
+ * other connections are picked up by refreshMembership()
+ * @param path The path of the snapshot file
+ * @return boolean indicating whether the snapshot was loaded
+ */
+bool DbManager::loadMembershipSnapshot(const QString& path)
+{
+	QScopedPointer<MembershipSnapshot> loaded(new MembershipSnapshot());
+	if (!loaded->load(path) || !loaded->catchUp(db))
+	{
+		return false;
+	}
+	snapshot.reset(loaded.take());
+	snapshotStale = false;
+	return true;
+}
+
+/**
+ * @brief Writes and reloads the membership snapshot after every given number of chat changes
+ * @param path The path of the snapshot file
+ * @param changes The number of addChat/removeChat calls between snapshots; 0 turns this off
+ * @return void
+ */
+void DbManager::setSnapshotInterval(const QString& path, int changes)
+{
+	snapshotPath = path;
+	snapshotInterval = changes;
+	changesSinceSnapshot = 0;
+	return;
+}
+
+/**
+ * @brief Applies membership changes made through other connections to the loaded snapshot
+ * Also call it after committing a transaction that added or removed chats; until then
+ * membership reads go to the tables, since the snapshot cannot tell whether it will commit.
+ * @return boolean indicating whether the snapshot is loaded and up to date
+ */
+bool DbManager::refreshMembership()
+{
+	if (!snapshot || !snapshot->catchUp(db))
+	{
+		return false;
+	}
+	snapshotStale = false;
+	return true;
+}
+
+/**
+ * @brief Sets the registry getOnlineChatUsers checks members against
+ * The registry is not owned and may be shared by the DbManagers of several threads
+ * @param registry The presence registry, or nullptr to stop using one
+ * @return void
+ */
+void DbManager::setPresence(const PresenceRegistry* registry)
+{
+	presence = registry;
+	return;
+}
+
+/**
+ * @brief Sets the throttle addUser and checkUserInfo take attempts from before querying
+ * The throttle is not owned and may be shared by the DbManagers of several threads
+ * @param loginThrottle The throttle, or nullptr to stop throttling
+ * @return void
+ */
+void DbManager::setThrottle(LoginThrottle* loginThrottle)
+{
+	throttle = loginThrottle;
 	return;
 }
 
+/**
+ * @brief Sets the cache userExists and checkUserInfo look users up in before querying userinfo
+ * The cache is not owned and may be shared by the DbManagers of several threads. Every
+ * DbManager that writes userinfo must use it, or users it adds stay cached as missing. Nothing
+ * read or written inside a caller's open transaction is cached, so rolling it back needs no
+ * cache upkeep.
+ * @param cache The user cache, or nullptr to stop using one
+ * @return void
+ */
+void DbManager::setUserCache(UserCache* cache)
+{
+	users = cache;
+	return;
+}
+
+/**
+ * @brief Starts the transaction that holds a membership change and its log row
+ * BEGIN fails inside a caller's own transaction, and the change then joins it; either way the
+ * change runs under a savepoint so it can be rolled back on its own
+ * @return boolean indicating whether the transaction started
+ */
+bool DbManager::beginMembershipChange()
+{
+	QSqlQuery query(db);
+	membershipOwned = query.exec("BEGIN");
+	if (!query.exec("SAVEPOINT membershipchange"))
+	{
+		DBLOG_ERROR("beginMembershipChange", DbErrorQuery, 0, "membership change could not be started", query.lastError().text());
+		if (membershipOwned)
+		{
+			query.exec("ROLLBACK");
+		}
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Records that a chat's membership changed and commits the change together with its log row
+ * If nothing was changed or the change cannot be logged, the transaction is rolled back, so a
+ * change is never seen without the log row snapshot readers catch up from.
+ * If the change began its own transaction, the loaded snapshot catches up once it commits and a
+ * new one is written when the interval is reached. Inside a caller's transaction the snapshot is
+ * marked stale instead, as nothing is known to be committed until refreshMembership().
+ * @param chatID An integer representing the chat ID number
+ * @param changed Whether the chat's tables were changed
+ * @return boolean indicating whether the change and its log row were committed
+ */
+bool DbManager::commitMembershipChange(int chatID, bool changed)
+{
+	bool logged = false;
+	if (changed)
+	{
+		auto query = insertMembershipChange.prepare(*storage);
+		logged = query.exec(chatID);
+		if (!logged)
+		{
+			DBLOG_ERROR("commitMembershipChange", DbErrorQuery, chatID, "membership change could not be logged", query.lastError());
+		}
+	}
+
+	// RELEASE is always attempted, so a failed ROLLBACK TO does not leave the savepoint open
+	QSqlQuery finish(db);
+	bool rolledBack = logged || finish.exec("ROLLBACK TO membershipchange");
+	bool released = finish.exec("RELEASE membershipchange");
+	bool committed = released && (!membershipOwned || finish.exec("COMMIT"));
+	if (!rolledBack || !committed)
+	{
+		DBLOG_ERROR("commitMembershipChange", DbErrorQuery, chatID, "membership change could not be committed", finish.lastError().text());
+		if (membershipOwned && !committed)
+		{
+			finish.exec("ROLLBACK");
+		}
+		return false;
+	}
+	if (!logged)
+	{
+		return false;
+	}
+
+	if (!membershipOwned)
+	{
+		snapshotStale = !snapshot.isNull();
+		changesSinceSnapshot++;
+		return true;
+	}
+
+	if (snapshot)
+	{
+		snapshotStale = !snapshot->catchUp(db);
+	}
+
+	if (snapshotInterval > 0 && ++changesSinceSnapshot >= snapshotInterval)
+	{
+		changesSinceSnapshot = 0;
+		if (writeMembershipSnapshot(snapshotPath) && snapshot)
+		{
+			loadMembershipSnapshot(snapshotPath);
+		}
+	}
+	return true;
+}
+
 /**
  * @brief Determines the size of a QSqlQuery
  * Moves from the first query entry to the last and records this index
@@ -94,12 +417,11 @@ bool DbManager::createUserTable()
 	bool success = false;
 	
 	// Create the userinfo table
-	QSqlQuery query(db);
-	query.prepare("CREATE TABLE userinfo(username VARCHAR(20) PRIMARY KEY, password VARCHAR(20));");
+	auto query = createUserInfo.prepare(*storage);
 	
 	if (!query.exec())
 	{
-		qDebug() << "Couldn't create the table 'userinfo': one might already exist.";
+		DBLOG_WARNING("createUserTable", DbErrorTableExists, 0, "couldn't create the table 'userinfo': one might already exist", query.lastError());
 	}
 	else
 	{
@@ -112,36 +434,56 @@ bool DbManager::createUserTable()
 /**
  * @brief Adds a user to the userinfo table
  * Checks if the user already exists in the table, and if not runs an SQL query to add them
+ * If a throttle is set and the source has made too many attempts, fails without querying
  * @param username A QString of the username to be entered
  * @param password A QString of the user's password to be entered
+ * @param source The address the request came from, or an empty QString if it is not known
  * @return boolean indicating whether the user was successfully added to the table
  */
-bool DbManager::addUser(const QString& username, const QString& password)
+bool DbManager::addUser(const QString& username, const QString& password, const QString& source)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::AddUser);
+	trace.setUsers(username);
 	bool success = false;
 	
+	if (throttle && !throttle->allowRegistration(source))
+	{
+		DBLOG_WARNING("addUser", DbErrorThrottled, 0, "too many registration attempts", source);
+	}
 	// Make sure user doesn't already exist
-	if (userExists(username))
+	else if (userExists(username))
 	{
-		qDebug() << "Error: this user already exists";
+		DBLOG_ERROR("addUser", DbErrorUserExists, 0, "this user already exists", QString());
 	}
 	else
 	{
 		// Add the user to the userinfo table
-		QSqlQuery query(db);
-		query.prepare("INSERT INTO userinfo VALUES (:username, :password)");
-		query.bindValue(":username", username);
-		query.bindValue(":password", password);
+		auto query = insertUser.prepare(*storage);
 	
-		if (!query.exec())
+		if (!query.exec(username, password))
 		{
-			qDebug() << "addUser error: " << query.lastError();
+			DBLOG_ERROR("addUser", DbErrorQuery, 0, "query error", query.lastError());
+			if (users)
+			{
+				users->invalidate(username);
+			}
 		}
 		else
 		{
+			// Inside a caller's transaction the user exists only if it commits, so it is looked up again later
 			success = true;
+			qint64 id = query.lastInsertId();
+			if (users && storage->inTransaction())
+			{
+				users->invalidate(username);
+			}
+			else if (users)
+			{
+				users->storeUser(username, id, password);
+			}
 		}
 	}
+	trace.setResultSize(success ? 1 : 0);
 	return success;
 }
 
@@ -149,65 +491,139 @@ bool DbManager::addUser(const QString& username, const QString& password)
  * @brief Checks whether a username already exists in the userinfo table
  * Runs an SQL query on the userinfo table using the given username and assesses whether the result is empty
  * If the query result is empty then the user does not exist in the table
+ * With a user cache set, the query only runs if the user is not cached, and caches the answer
  * @param inputusername A QString of the username to be checked
  * @return boolean indicating whether the user exists in the table
  */
 bool DbManager::userExists(const QString& inputusername)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::UserExists);
+	trace.setUsers(inputusername);
 	bool exists = false;
 	
+	if (users)
+	{
+		CachedUser cached = users->lookup(inputusername);
+		exists = (cached == CachedUser::Unknown ? loadUser(inputusername) : cached) == CachedUser::Present;
+		trace.setResultSize(exists ? 1 : 0);
+		return exists;
+	}
+
 	// See if the given username is already in the userinfo table
-	QSqlQuery query(db);
-	query.prepare("SELECT username FROM userinfo WHERE username = (:inputusername)");
-	query.bindValue(":inputusername", inputusername);
+	auto query = selectUser.prepare(*storage);
 	
-	if (query.exec())
+	if (query.exec(inputusername))
 	{
-		// If the user is already in the table the size of the query result will be greater than 0
-		if (sqlSize(query) > 0)
-		{
-			exists = true;
-		}
+		// If the user is already in the table the query result will have a row
+		exists = query.next();
 	}
 	
+	trace.setResultSize(exists ? 1 : 0);
 	return exists;
 }
 
+/**
+ * @brief Checks whether a username given as UTF-8 exists in the userinfo table, as userExists does
+ * The name is bound as it is; with a user cache set it is decoded, since the cache is keyed by QString
+ * @param inputusername The username encoded as UTF-8
+ * @return boolean indicating whether the user exists in the table
+ */
+bool DbManager::userExists(Utf8View inputusername)
+{
+	if (users)
+	{
+		return userExists(inputusername.toString());
+	}
+
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::UserExists);
+	trace.setUsers(inputusername);
+	auto query = selectUser.prepare(*storage);
+	bool exists = query.exec(inputusername) && query.next();
+	trace.setResultSize(exists ? 1 : 0);
+	return exists;
+}
+
+/**
+ * @brief Reads a user's userinfo row into the user cache
+ * The row is not cached while a transaction is open, since the transaction may yet roll back
+ * @param username The username
+ * @return Whether the user is present or missing, or Unknown if the query failed
+ */
+CachedUser DbManager::loadUser(const QString& username)
+{
+	bool found = false;
+	qint64 id = 0;
+	QString password;
+	{
+		auto query = selectUserRecord.prepare(*storage);
+		if (!query.exec(username))
+		{
+			DBLOG_ERROR("userExists", DbErrorQuery, 0, "user could not be looked up", query.lastError());
+			return CachedUser::Unknown;
+		}
+		found = query.next();
+		if (found)
+		{
+			id = query.column<0>();
+			password = query.column<1>();
+		}
+	}
+
+	if (storage->inTransaction())
+	{
+		return found ? CachedUser::Present : CachedUser::Missing;
+	}
+	if (!found)
+	{
+		users->storeMissing(username);
+		return CachedUser::Missing;
+	}
+	users->storeUser(username, id, password);
+	return CachedUser::Present;
+}
+
 /**
  * @brief Checks if the given username and password match each other according to the userinfo table
  * Runs a query to find rows in the userinfo table with the given username and password
  * If the query result is empty then the username and password do not go together
  * Used for log-ins
+ * If a throttle is set and the user or the source has made too many attempts, fails without querying
+ * With a user cache set, the password is checked against the cached record that userExists loads
  * @param username The username to be checked
  * @param password The password to be checked
+ * @param source The address the request came from, or an empty QString if it is not known
  * @return boolean indicating whether the username and password correspond to the same row in the table
  */
-bool DbManager::checkUserInfo(const QString& username, const QString& password)
+bool DbManager::checkUserInfo(const QString& username, const QString& password, const QString& source)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::CheckUserInfo);
+	trace.setUsers(username);
 	bool success = false;
 	
+	if (throttle && !throttle->allowLogin(username, source))
+	{
+		DBLOG_WARNING("checkUserInfo", DbErrorThrottled, 0, "too many login attempts", source);
+	}
 	// Make sure the user exists first
-	if (!userExists(username))
+	else if (!userExists(username))
 	{
-		qDebug() << "Error: this user does not exist";
+		DBLOG_ERROR("checkUserInfo", DbErrorUserMissing, 0, "this user does not exist", QString());
 	}
-	else
+	else if (!users || users->verify(username, password, success) != CachedUser::Present)
 	{
 		// See if the given username and password match a row in the userinfo table
-		QSqlQuery query(db);
-		query.prepare("SELECT * FROM userinfo WHERE username = (:username) AND password = (:password)");
-		query.bindValue(":username", username);
-		query.bindValue(":password", password);
+		auto query = selectUserWithPassword.prepare(*storage);
 	
-		if (!query.exec())
+		if (!query.exec(username, password))
 		{
-			qDebug() << "Chat's users could not be retrieved: " << query.lastError();	
+			DBLOG_ERROR("checkUserInfo", DbErrorQuery, 0, "user information could not be checked", query.lastError());
 		}
-		else if (sqlSize(query) > 0) // The result is not empty, so username and password match a row
+		else if (query.next()) // The result is not empty, so username and password match a row
 		{
 			success = true;
 		}
 	}
+	trace.setResultSize(success ? 1 : 0);
 	return success;
 }
 
@@ -225,22 +641,20 @@ bool DbManager::createChatTables()
 	bool success = false;
 	
 	// Create the chats table
-	QSqlQuery query1(db);
-	query1.prepare("CREATE TABLE chats(chatid INTEGER PRIMARY KEY, owner VARCHAR(20) NOT NULL, FOREIGN KEY(owner) references userinfo(username));");
+	auto query1 = createChats.prepare(*storage);
 	
 	if (!query1.exec())
 	{
-		qDebug() << "Couldn't create the table 'chats': one might already exist.";
+		DBLOG_WARNING("createChatTables", DbErrorTableExists, 0, "couldn't create the table 'chats': one might already exist", query1.lastError());
 	}
 	else
 	{
 		// Create the chatusers table
-		QSqlQuery query2(db);
-		query2.prepare("CREATE TABLE chatusers(rowid INTEGER PRIMARY KEY, chatid INTEGER, username VARCHAR(20) NOT NULL, FOREIGN KEY(chatid) references chats(chatid), FOREIGN KEY(username) references userinfo(username));");
+		auto query2 = createChatUsers.prepare(*storage);
 	
 		if (!query2.exec())
 		{
-			qDebug() << "Couldn't create the table 'chatusers': one might already exist.";
+			DBLOG_WARNING("createChatTables", DbErrorTableExists, 0, "couldn't create the table 'chatusers': one might already exist", query2.lastError());
 		}
 		else
 		{
@@ -260,45 +674,44 @@ bool DbManager::createChatTables()
  */
 bool DbManager::addChat(int chatID, const QString& username, QVector<QString> userVector)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::AddChat);
+	trace.setChat(chatID);
+	trace.setUsers(username);
+	trace.setMembers(userVector);
 	bool success = false;
 	
 	// Make sure this chat doesn't already exist
 	if (chatExists(chatID))
 	{
-		qDebug() << "addChat Error: a chat with this ID already exists";
+		DBLOG_ERROR("addChat", DbErrorChatExists, chatID, "a chat with this ID already exists", QString());
 	}
 	else
 	{
 		// Make sure the user who is the owner already exists
 		if (!userExists(username))
 		{
-			qDebug() << "addChat Error: the specified owner user does not exist";
+			DBLOG_ERROR("addChat", DbErrorUserMissing, chatID, "the specified owner user does not exist", QString());
 		}
-		else
+		else if (beginMembershipChange())
 		{
 			// Add the chat information to the chats table
-			QSqlQuery query(db);
-			query.prepare("INSERT INTO chats (chatid, owner) VALUES (:chatID, :username)");
-			query.bindValue(":chatID", chatID);
-			query.bindValue(":username", username);
+			auto query = insertChat.prepare(*storage);
+			bool created = query.exec(chatID, username);
 	
-			if (!query.exec())
+			if (!created)
 			{
-				qDebug() << "addChat query error: " << query.lastError();
+				DBLOG_ERROR("addChat", DbErrorQuery, chatID, "query error", query.lastError());
 			}
 			else
 			{
 				// Place all the users from the userVector into the chatusers table for this chat
+				auto query1 = insertChatUser.prepare(*storage);
 				for (int i=0; i < userVector.size(); i++)
 				{
-					QSqlQuery query1(db);
-					query1.prepare("INSERT INTO chatusers (chatid, username) VALUES (:chatID, :username)");
-					query1.bindValue(":chatID", chatID);
-					query1.bindValue(":username", userVector[i]);
 	
-					if (!query1.exec())
+					if (!query1.exec(chatID, userVector[i]))
 					{
-						qDebug() << "addChat query error: " << query1.lastError();
+						DBLOG_ERROR("addChat", DbErrorQuery, chatID, "query error", query1.lastError());
 					}
 					else
 					{
@@ -310,9 +723,16 @@ bool DbManager::addChat(int chatID, const QString& username, QVector<QString> us
 					}
 				}
 			}
+
+			// The chat exists now, even if some members could not be added, and is logged in the same transaction
+			if (!commitMembershipChange(chatID, created))
+			{
+				success = false;
+			}
 		}
 		
 	}
+	trace.setResultSize(success ? 1 : 0);
 	return success;
 }
 
@@ -326,6 +746,9 @@ bool DbManager::addChat(int chatID, const QString& username, QVector<QString> us
  */
 bool DbManager::removeChat(int chatID, const QString& username)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::RemoveChat);
+	trace.setChat(chatID);
+	trace.setUsers(username);
 	bool success = false;
 	
 	// Make sure that this chat exists
@@ -334,44 +757,48 @@ bool DbManager::removeChat(int chatID, const QString& username)
 		QString chatOwner = getChatOwner(chatID);
 		
 		// Make sure that it is the chat's owner who is calling for the deletion
-		if (chatOwner == username)
+		if (chatOwner == username && beginMembershipChange())
 		{
 			// Delete the chat from the chats table
-			QSqlQuery queryDelete(db);
-			queryDelete.prepare("DELETE FROM chats WHERE chatid = (:chatID)");
-			queryDelete.bindValue(":chatID", chatID);
+			auto queryDelete = deleteChat.prepare(*storage);
+			bool deleted = queryDelete.exec(chatID);
 		
-			if (!queryDelete.exec())
+			if (!deleted)
 			{
-				qDebug() << "Remove chat failed: " << queryDelete.lastError();
+				DBLOG_ERROR("removeChat", DbErrorQuery, chatID, "remove chat failed", queryDelete.lastError());
 			}
 			else
 			{
 				// Delete all instances of the chat from the chatusers table
-				QSqlQuery queryDelete1(db);
-				queryDelete1.prepare("DELETE FROM chatusers WHERE chatid = (:chatID)");
-				queryDelete1.bindValue(":chatID", chatID);
+				auto queryDelete1 = deleteChatUsers.prepare(*storage);
 			
-				if (!queryDelete1.exec())
+				if (!queryDelete1.exec(chatID))
 				{
-					qDebug() << "Remove chat failed: " << queryDelete.lastError();
+					DBLOG_ERROR("removeChat", DbErrorQuery, chatID, "remove chat failed", queryDelete1.lastError());
 				}
 				else
 				{
 					success = true;
 				}
 			}
+
+			// Logged in the same transaction as the deletion
+			if (!commitMembershipChange(chatID, deleted))
+			{
+				success = false;
+			}
 		}
-		else
+		else if (chatOwner != username)
 		{
-			qDebug() << "Remove chat failed: this user is not the chat owner and does not have permission to delete it";
+			DBLOG_ERROR("removeChat", DbErrorNotOwner, chatID, "this user is not the chat owner and does not have permission to delete it", QString());
 		}
 	}
 	else
 	{
-		qDebug() << "Remove chat failed: this chat does not exist";
+		DBLOG_ERROR("removeChat", DbErrorChatMissing, chatID, "this chat does not exist", QString());
 	}
 	
+	trace.setResultSize(success ? 1 : 0);
 	return success;
 }
 
@@ -383,22 +810,27 @@ bool DbManager::removeChat(int chatID, const QString& username)
  */
 bool DbManager::chatExists(int chatID)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::ChatExists);
+	trace.setChat(chatID);
 	bool exists = false;
 	
+	if (snapshot && !snapshotStale)
+	{
+		exists = snapshot->chatExists(chatID);
+		trace.setResultSize(exists ? 1 : 0);
+		return exists;
+	}
+	
 	// See if a chat with the given ID number is in the chats table
-	QSqlQuery query(db);
-	query.prepare("SELECT * FROM chats WHERE chatid = (:chatID)");
-	query.bindValue(":chatID", chatID);
+	auto query = selectChat.prepare(*storage);
 	
-	if (query.exec())
+	if (query.exec(chatID))
 	{
-		// If there is a chat with the given ID number the query result size will be greater than 0
-		if (sqlSize(query) > 0)
-		{
-			exists = true;
-		}
+		// If there is a chat with the given ID number the query result will have a row
+		exists = query.next();
 	}
 	
+	trace.setResultSize(exists ? 1 : 0);
 	return exists;
 }
 
@@ -410,6 +842,8 @@ bool DbManager::chatExists(int chatID)
  */
 QString DbManager::getChatOwner(int chatID)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatOwner);
+	trace.setChat(chatID);
 	QString chatOwner(QString::null);
 	
 	// Make sure this chat exists
@@ -419,23 +853,22 @@ QString DbManager::getChatOwner(int chatID)
 	}
 	
 	// Retrieve the owner for the chat with the given ID number
-	QSqlQuery query(db);
-	query.prepare("SELECT owner FROM chats WHERE chatid = (:chatID)");
-	query.bindValue(":chatID", chatID);
+	auto query = selectChatOwner.prepare(*storage);
 	
-	if (!query.exec())
+	if (!query.exec(chatID))
 	{
-		qDebug() << "Chat owner could not be retrieved: " << query.lastError();	
+		DBLOG_ERROR("getChatOwner", DbErrorQuery, chatID, "chat owner could not be retrieved", query.lastError());
 	}
-	else if (sqlSize(query) > 0)
+	else
 	{
 		while (query.next())
 		{
-			chatOwner = query.value(0).toString();
+			chatOwner = query.column<0>();
 
 		}
 	}
 
+	trace.setResultSize(chatOwner.size());
 	return chatOwner;
 }
 
@@ -448,36 +881,47 @@ QString DbManager::getChatOwner(int chatID)
  */
 bool DbManager::doUsersChat(const QString& inputusername1, const QString& inputusername2)
 {
+	QByteArray utf8User1 = inputusername1.toUtf8();
+	QByteArray utf8User2 = inputusername2.toUtf8();
+	return doUsersChat(Utf8View(utf8User1.constData(), utf8User1.size()), Utf8View(utf8User2.constData(), utf8User2.size()));
+}
+
+/**
+ * @brief Checks if two users given as UTF-8 are in the same chat
+ * Collects the chats user1 is in, then steps through user2's chats until one of them matches
+ * @param inputusername1 The first username encoded as UTF-8
+ * @param inputusername2 The second username encoded as UTF-8
+ * @return boolean indicating whether the two users are in the same chat
+ */
+bool DbManager::doUsersChat(Utf8View inputusername1, Utf8View inputusername2)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::DoUsersChat);
+	trace.setUsers(inputusername1, inputusername2);
+	
 	// Get the chats that user1 is in
-	QSqlQuery query1(db);
-	query1.prepare("SELECT chatid FROM chatusers WHERE username = (:inputusername1)");
-	query1.bindValue(":inputusername1", inputusername1);
+	QVector<int> chats1;
+	forEachChatOfUser(inputusername1, [&chats1](int chatID)
+	{
+		chats1.append(chatID);
+		return true;
+	});
 	
-	if (query1.exec() && (sqlSize(query1) > 0))
+	// If one of user2's chat ID numbers matches then the users are in the same chat
+	bool shared = false;
+	if (!chats1.isEmpty())
 	{
-		// Get the chats that user2 is in
-		QSqlQuery query2(db);
-		query2.prepare("SELECT chatid FROM chatusers WHERE username = (:inputusername2)");
-		query2.bindValue(":inputusername2", inputusername2);
-		
-		if (query2.exec() && (sqlSize(query2) > 0))
+		forEachChatOfUser(inputusername2, [&chats1, &shared](int chatID)
 		{
-			// Iterate through user1's chats
-			while (query1.next())
-			{
-				// Iterate through user2's chats
-				while (query2.next())
-				{
-					// If the chat ID numbers match then the users are in the same chat
-					if (query1.value(0).toString() == query2.value(0).toString())
-					{
-						return true;
-					}
-				}
-			}
-		}
+			shared = chats1.contains(chatID);
+			return !shared;
+		});
+	}
+	
+	if (shared)
+	{
+		trace.setResultSize(1);
 	}
-	return false;
+	return shared;
 }
 
 /**
@@ -487,6 +931,16 @@ bool DbManager::doUsersChat(const QString& inputusername1, const QString& inputu
  */
 QVector<QString> DbManager::getChatUsers(int chatID)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatUsers);
+	trace.setChat(chatID);
+	
+	if (snapshot && !snapshotStale)
+	{
+		QVector<QString> chatUsersVector = snapshot->chatUsers(chatID);
+		trace.setResultSize(chatUsersVector.size());
+		return chatUsersVector;
+	}
+	
 	// Make sure the chat exists
 	if (!chatExists(chatID))
 	{
@@ -495,27 +949,42 @@ QVector<QString> DbManager::getChatUsers(int chatID)
 	
 	// Retrieve the usernames of all users in the chat with the given chatID
 	QVector<QString> chatUsersVector;
-	QSqlQuery query(db);
-	query.prepare("SELECT username FROM chatusers WHERE chatid = (:chatID)");
-	query.bindValue(":chatID", chatID);
+	auto query = selectChatUsers.prepare(*storage);
 	
-	if (!query.exec())
+	if (!query.exec(chatID))
 	{
-		qDebug() << "Chat's users could not be retrieved: " << query.lastError();	
+		DBLOG_ERROR("getChatUsers", DbErrorQuery, chatID, "chat's users could not be retrieved", query.lastError());
 	}
-	else if (sqlSize(query) > 0)
+	else
 	{
 		while (query.next())
 		{
 			// Put each username in the QVector<QString>
-			QString user = query.value(0).toString();
+			QString user = query.column<0>().toString();
 			chatUsersVector.append(user);
 		}
 	}
 	
+	trace.setResultSize(chatUsersVector.size());
 	return chatUsersVector;
 }
 
+/**
+ * @brief Gets the users in the chat with the given chatID who are online
+ * Membership is read as by getChatUsers and then checked against the registry from setPresence
+ * @param chatID An integer representing the chat ID number
+ * @return QVector<QString> containing the usernames of the online members
+ */
+QVector<QString> DbManager::getOnlineChatUsers(int chatID)
+{
+	if (!presence)
+	{
+		DBLOG_WARNING("getOnlineChatUsers", DbErrorConnection, chatID, "no presence registry has been set", QString());
+		return QVector<QString>();
+	}
+	return presence->filterOnline(getChatUsers(chatID));
+}
+
 /**
  * @brief Gets all of the chat ID numbers for the chats to which the given user belongs
  * @param inputusername The username for which we are retrieving the chats
@@ -523,6 +992,17 @@ QVector<QString> DbManager::getChatUsers(int chatID)
  */
 QVector<int> DbManager::getChatsUserIsIn(const QString& inputusername)
 {
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatsUserIsIn);
+	trace.setUsers(inputusername);
+	
+	if (snapshot && !snapshotStale)
+	{
+		// A user who is in no chats gets an empty result whether or not they exist
+		QVector<int> chatsUserIsInVector = snapshot->chatsUserIsIn(inputusername);
+		trace.setResultSize(chatsUserIsInVector.size());
+		return chatsUserIsInVector;
+	}
+	
 	// Make sure the user exists
 	if (!userExists(inputusername))
 	{
@@ -531,27 +1011,254 @@ QVector<int> DbManager::getChatsUserIsIn(const QString& inputusername)
 	
 	// Retrieve the chat ID numbers for the chats in which the given username appears
 	QVector<int> chatsUserIsInVector;
-	QSqlQuery query(db);
-	query.prepare("SELECT chatid FROM chatusers WHERE username = (:inputusername)");
-	query.bindValue(":inputusername", inputusername);
+	auto query = selectChatsOfUser.prepare(*storage);
 	
-	if (!query.exec())
+	if (!query.exec(inputusername))
 	{
-		qDebug() << "Users's chats could not be retrieved: " << query.lastError();
+		DBLOG_ERROR("getChatsUserIsIn", DbErrorQuery, 0, "user's chats could not be retrieved", query.lastError());
 	}
-	else if (sqlSize(query) > 0)
+	else
 	{
 		while (query.next())
 		{
 			// Place the chat ID numbers in the QVector<int>
-			int chatNum = query.value(0).toInt();
+			int chatNum = query.column<0>();
 			chatsUserIsInVector.append(chatNum);
 		}
 	}
 	
+	trace.setResultSize(chatsUserIsInVector.size());
 	return chatsUserIsInVector;
 }
 
+/**
+ * @brief Gets the usernames in the chat with the given chat ID, as getChatUsers does, without a QString per member
+ * @param chatID An integer representing the chat ID number
+ * @return UsernameList of the members, empty if the chat does not exist
+ */
+UsernameList DbManager::getChatUserList(int chatID)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatUsers);
+	trace.setChat(chatID);
+	ResultArena* arena = ResultArena::acquire();
+	UsernameList members(arena);
+	
+	if (snapshot && !snapshotStale)
+	{
+		snapshot->chatUsers(chatID, *arena);
+	}
+	else if (chatExists(chatID))
+	{
+		auto query = selectChatUsers.prepare(*storage);
+		bool stepped = query.exec(chatID);
+		while (stepped && query.next())
+		{
+			Utf8View username = query.column<0>();
+			arena->appendText(username.data(), username.size());
+		}
+		if (!stepped || !query.lastError().isEmpty())
+		{
+			DBLOG_ERROR("getChatUserList", DbErrorQuery, chatID, "chat's users could not be retrieved", query.lastError());
+		}
+	}
+	
+	trace.setResultSize(members.size());
+	return members;
+}
+
+/**
+ * @brief Gets the chat ID numbers of the chats the given user is in, as getChatsUserIsIn does, into a pooled arena
+ * @param inputusername The username for which we are retrieving the chats
+ * @return ChatIdList of the chat ID numbers, empty if the user is in no chats
+ */
+ChatIdList DbManager::getChatIdsUserIsIn(const QString& inputusername)
+{
+	QByteArray utf8 = inputusername.toUtf8();
+	return getChatIdsUserIsIn(Utf8View(utf8.constData(), utf8.size()));
+}
+
+/**
+ * @brief Gets the chat ID numbers of the chats a user given as UTF-8 is in, into a pooled arena
+ * @param inputusername The username encoded as UTF-8
+ * @return ChatIdList of the chat ID numbers, empty if the user is in no chats
+ */
+ChatIdList DbManager::getChatIdsUserIsIn(Utf8View inputusername)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatsUserIsIn);
+	trace.setUsers(inputusername);
+	ResultArena* arena = ResultArena::acquire();
+	ChatIdList chats(arena);
+	
+	if (snapshot && !snapshotStale)
+	{
+		snapshot->forEachChatOfUser(inputusername, [arena](int chatID)
+		{
+			arena->appendId(chatID);
+			return true;
+		});
+	}
+	else if (userExists(inputusername))
+	{
+		auto query = selectChatsOfUser.prepare(*storage);
+		bool stepped = query.exec(inputusername);
+		while (stepped && query.next())
+		{
+			arena->appendId(query.column<0>());
+		}
+		if (!stepped || !query.lastError().isEmpty())
+		{
+			DBLOG_ERROR("getChatIdsUserIsIn", DbErrorQuery, 0, "user's chats could not be retrieved", query.lastError());
+		}
+	}
+	
+	trace.setResultSize(chats.size());
+	return chats;
+}
+
+/**
+ * @brief Calls a visitor with the username of each member of a chat while the query steps, without building a result
+ * A chat that does not exist has no members, so it is not looked up first as getChatUsers does
+ * @param chatID An integer representing the chat ID number
+ * @param visit The visitor, which returns false to stop; its view is only valid during the call
+ * @return boolean indicating whether every member was visited, false if the visitor stopped or the query failed
+ */
+bool DbManager::forEachChatUser(int chatID, const UsernameVisitor& visit)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatUsers);
+	trace.setChat(chatID);
+	int visited = 0;
+	bool complete = true;
+	
+	if (snapshot && !snapshotStale)
+	{
+		complete = snapshot->forEachChatUser(chatID, [&](Utf8View username)
+		{
+			visited++;
+			return visit(username);
+		});
+	}
+	else
+	{
+		auto query = selectChatUsers.prepare(*storage);
+		bool stepped = query.exec(chatID);
+		while (stepped && complete && query.next())
+		{
+			visited++;
+			complete = visit(query.column<0>());
+		}
+		if (!stepped || !query.lastError().isEmpty())
+		{
+			DBLOG_ERROR("forEachChatUser", DbErrorQuery, chatID, "chat's users could not be retrieved", query.lastError());
+			complete = false;
+		}
+	}
+	
+	trace.setResultSize(visited);
+	return complete;
+}
+
+/**
+ * @brief Calls a visitor with each chat ID number of the chats a user is in while the query steps
+ * A user who does not exist is in no chats, so they are not looked up first as getChatsUserIsIn does
+ * @param inputusername The username for which we are retrieving the chats
+ * @param visit The visitor, which returns false to stop
+ * @return boolean indicating whether every chat was visited, false if the visitor stopped or the query failed
+ */
+bool DbManager::forEachChatOfUser(const QString& inputusername, const ChatIdVisitor& visit)
+{
+	QByteArray utf8 = inputusername.toUtf8();
+	return forEachChatOfUser(Utf8View(utf8.constData(), utf8.size()), visit);
+}
+
+/**
+ * @brief Calls a visitor with each chat ID number of the chats a user given as UTF-8 is in while the query steps
+ * @param inputusername The username encoded as UTF-8
+ * @param visit The visitor, which returns false to stop
+ * @return boolean indicating whether every chat was visited, false if the visitor stopped or the query failed
+ */
+bool DbManager::forEachChatOfUser(Utf8View inputusername, const ChatIdVisitor& visit)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetChatsUserIsIn);
+	trace.setUsers(inputusername);
+	int visited = 0;
+	bool complete = true;
+	
+	if (snapshot && !snapshotStale)
+	{
+		complete = snapshot->forEachChatOfUser(inputusername, [&](int chatID)
+		{
+			visited++;
+			return visit(chatID);
+		});
+	}
+	else
+	{
+		auto query = selectChatsOfUser.prepare(*storage);
+		bool stepped = query.exec(inputusername);
+		while (stepped && complete && query.next())
+		{
+			visited++;
+			complete = visit(query.column<0>());
+		}
+		if (!stepped || !query.lastError().isEmpty())
+		{
+			DBLOG_ERROR("forEachChatOfUser", DbErrorQuery, 0, "user's chats could not be retrieved", query.lastError());
+			complete = false;
+		}
+	}
+	
+	trace.setResultSize(visited);
+	return complete;
+}
+
+/**
+ * @brief Calls a visitor with each chat ID and username pair getUserChatInfo would list, without building the string
+ * Each of the user's chats is stepped through while the query for the user's chats is still open
+ * @param inputusername The username for which we are collecting information
+ * @param visit The visitor, which returns false to stop; its view is only valid during the call
+ * @return boolean indicating whether every entry was visited, false if the visitor stopped or a query failed
+ */
+bool DbManager::forEachRosterEntry(const QString& inputusername, const RosterVisitor& visit)
+{
+	QByteArray utf8 = inputusername.toUtf8();
+	return forEachRosterEntry(Utf8View(utf8.constData(), utf8.size()), visit);
+}
+
+/**
+ * @brief Calls a visitor with each chat ID and username pair in the roster of a user given as UTF-8
+ * The user's own name is compared and every other name passed on as bytes, so nothing is decoded
+ * @param inputusername The username encoded as UTF-8
+ * @param visit The visitor, which returns false to stop; its view is only valid during the call
+ * @return boolean indicating whether every entry was visited, false if the visitor stopped or a query failed
+ */
+bool DbManager::forEachRosterEntry(Utf8View inputusername, const RosterVisitor& visit)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetUserChatInfo);
+	trace.setUsers(inputusername);
+	int visited = 0;
+	bool stopped = false;
+	bool failed = false;
+	
+	bool complete = forEachChatOfUser(inputusername, [&](int chatID)
+	{
+		bool chatComplete = forEachChatUser(chatID, [&](Utf8View username)
+		{
+			if (username == inputusername)
+			{
+				return true;
+			}
+			visited++;
+			stopped = !visit(chatID, username);
+			return !stopped;
+		});
+		failed = failed || (!chatComplete && !stopped);
+		return !stopped;
+	});
+	
+	trace.setResultSize(visited);
+	return complete && !stopped && !failed;
+}
+
 /**
  * @brief Gets all the information about the chats to which the given user belongs
  * Runs queries to gather all of the chats to which the user belongs and all of the other users in those chats
@@ -562,46 +1269,47 @@ QVector<int> DbManager::getChatsUserIsIn(const QString& inputusername)
  */
 QString DbManager::getUserChatInfo(const QString& inputusername)
 {
-	QString temp = "";
-	// Used to check if this is the first item in the string
-	int flag = 0;
-	// The chat ID numbers for the chats to which the given user belongs
-	QVector<int> chatsUserIsIn = getChatsUserIsIn(inputusername);
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetUserChatInfo);
+	trace.setUsers(inputusername);
+	// The text is built as UTF-8 straight from the rows as they are stepped and decoded once at the end
+	QByteArray utf8 = inputusername.toUtf8();
+	QString temp = QString::fromUtf8(getUserChatInfoUtf8(Utf8View(utf8.constData(), utf8.size())));
+	if (temp.isNull())
+	{
+		// A user in no chats gets an empty string, as before, rather than a null one
+		temp = "";
+	}
+	trace.setResultSize(temp.size());
+	return temp;
+}
+
+/**
+ * @brief Gets the information getUserChatInfo gives for a user given as UTF-8, as UTF-8
+ * The text is built from the rows as they are stepped and never decoded, so it can go straight to the wire
+ * @param inputusername The username encoded as UTF-8
+ * @return QByteArray containing the chat ID numbers and usernames separated by commas
+ */
+QByteArray DbManager::getUserChatInfoUtf8(Utf8View inputusername)
+{
+	TraceScope trace(recorder.data(), traceDepth, TraceOp::GetUserChatInfo);
+	trace.setUsers(inputusername);
+	QByteArray info;
 	
-	// If the user is in any chats
-	if (!chatsUserIsIn.empty())
+	forEachRosterEntry(inputusername, [&info](int tempChatID, Utf8View tempUser)
 	{
-		// An iterator to go through the chat ID numbers
-		QVectorIterator<int> itChatIDs(chatsUserIsIn);
-		while (itChatIDs.hasNext())
+		if (!info.isEmpty())
 		{
-			int tempChatID = itChatIDs.next();
-			// The users in the current chat
-			QVector<QString> users = getChatUsers(tempChatID);
-			// An iterator to go through the chat users
-			QVectorIterator<QString> itUsers(users);
-			
-			while (itUsers.hasNext())
-			{
-				QString tempUser = itUsers.next();
-				if (tempUser != inputusername)
-				{
-					if (flag == 1)
-					{
-						// This is not the first item, so put a comma before the text
-						temp.append(",");
-					}
-					
-					// Add the chat ID number to the string
-					temp.append(QString::number(tempChatID));
-					temp.append(",");
-					// Add the username to the string
-					temp.append(tempUser);
-					flag = 1;
-				}
-			}
+			// This is not the first item, so put a comma before the text
+			info.append(',');
 		}
-	}
+		
+		// Add the chat ID number and then the username
+		info.append(QByteArray::number(tempChatID));
+		info.append(',');
+		info.append(tempUser.data(), tempUser.size());
+		return true;
+	});
 	
-	return temp;
+	trace.setResultSize(info.size());
+	return info;
 }
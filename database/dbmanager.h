@@ -14,30 +14,81 @@
 #include <QtSql>
 #include <QDebug>
 #include <QVector>
+#include <QScopedPointer>
+#include <calltrace.h>
+#include <dblog.h>
+#include <membershipsnapshot.h>
+#include <resultset.h>
+#include <storagebackend.h>
+
+class PresenceRegistry;
+class LoginThrottle;
+class UserCache;
+enum class CachedUser : quint8;
 
 class DbManager
 {
     public:
 		DbManager();
+		DbManager(const QString& databasePath, const QString& connectionName = QString(), StorageKind storageKind = StorageKind::QtSql);
 		~DbManager();
 		bool isOpen() const;
+		QSqlDatabase database() const;
+		bool beginImmediate();
 		void close();
+		StorageKind storageKind() const;
 		int sqlSize(QSqlQuery query);
 		bool createUserTable();
-		bool addUser(const QString& username, const QString& password);
+		bool addUser(const QString& username, const QString& password, const QString& source = QString());
 		bool userExists(const QString& inputusername);
-		bool checkUserInfo(const QString& username, const QString& password);
+		bool userExists(Utf8View inputusername);
+		bool checkUserInfo(const QString& username, const QString& password, const QString& source = QString());
 		bool createChatTables();
 		bool addChat(int chatID, const QString& username, QVector<QString> userVector);
 		bool removeChat(int chatID, const QString& username);
 		bool chatExists(int chatID);
 		QString getChatOwner(int chatID);
 		bool doUsersChat(const QString& inputusername1, const QString& inputusername2);
+		bool doUsersChat(Utf8View inputusername1, Utf8View inputusername2);
 		QVector<QString> getChatUsers(int chatID);
+		QVector<QString> getOnlineChatUsers(int chatID);
 		QVector<int> getChatsUserIsIn(const QString& inputusername);
+		UsernameList getChatUserList(int chatID);
+		ChatIdList getChatIdsUserIsIn(const QString& inputusername);
+		ChatIdList getChatIdsUserIsIn(Utf8View inputusername);
+		bool forEachChatUser(int chatID, const UsernameVisitor& visit);
+		bool forEachChatOfUser(const QString& inputusername, const ChatIdVisitor& visit);
+		bool forEachChatOfUser(Utf8View inputusername, const ChatIdVisitor& visit);
+		bool forEachRosterEntry(const QString& inputusername, const RosterVisitor& visit);
+		bool forEachRosterEntry(Utf8View inputusername, const RosterVisitor& visit);
 		QString getUserChatInfo(const QString& inputusername);
+		QByteArray getUserChatInfoUtf8(Utf8View inputusername);
+		bool startRecording(const QString& tracePath);
+		void stopRecording();
+		bool writeMembershipSnapshot(const QString& path);
+		bool loadMembershipSnapshot(const QString& path);
+		void setSnapshotInterval(const QString& path, int changes);
+		bool refreshMembership();
+		void setPresence(const PresenceRegistry* registry);
+		void setThrottle(LoginThrottle* loginThrottle);
+		void setUserCache(UserCache* cache);
 	private:
+		bool beginMembershipChange();
+		bool commitMembershipChange(int chatID, bool changed);
+		CachedUser loadUser(const QString& username);
 		QSqlDatabase db;
+		QScopedPointer<StorageBackend> storage;
+		QScopedPointer<CallTraceRecorder> recorder;
+		int traceDepth;
+		QScopedPointer<MembershipSnapshot> snapshot;
+		QString snapshotPath;
+		int snapshotInterval;
+		int changesSinceSnapshot;
+		bool membershipOwned;	// beginMembershipChange started the transaction rather than joining a caller's
+		bool snapshotStale;		// a change inside a caller's transaction has not been applied to the snapshot
+		const PresenceRegistry* presence;
+		LoginThrottle* throttle;
+		UserCache* users;
 };
 
 #endif	// DBMANAGER_H
@@ -0,0 +1,1340 @@
+/**
+ * @file encryptedvfs.cpp
+ * @brief An SQLite VFS that encrypts the database, its journals and its temporary files
+ *
+ * Every call is forwarded to the default VFS; reads are decrypted after they return and writes
+ * are encrypted into a per-file scratch buffer first. The main database is handled in whole
+ * 4 KB units. With SQLite's default 4 KB pages every read and write is exactly one unit; smaller
+ * writes read, decrypt and re-encrypt the units they touch. A unit at the end of the file may be
+ * shorter than 4 KB, and is encrypted at its actual length.
+ *
+ * Journals, WAL files and temporary files are XTS-encrypted in units too, with the unit's offset
+ * and the file's random nonce as the tweak, so bytes SQLite overwrites are encrypted again as
+ * a whole unit rather than under a reused keystream. A WAL's units are its 32-byte header and then
+ * one per frame, so a frame is never re-encrypted once written; other files use 512-byte units,
+ * decrypted, merged and re-encrypted when a write covers only part of one. A unit at the end of
+ * a file shorter than one AES block is encrypted with a small Feistel network instead.
+ *
+ * Journals, WAL files and super-journals start with an 8-byte random nonce that SQLite never
+ * sees; offsets and sizes are shifted past it. A fresh nonce is written when the file is created
+ * or emptied and when a WAL restarts. Temporary files keep their nonce in memory, since nothing
+ * else reads them.
+ *
+ * Memory-mapped I/O is not offered (the io methods stop at version 2), so SQLite cannot read the
+ * ciphertext directly from the page cache of the operating system.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <encryptedvfs.h>
+#include <dblog.h>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QUrl>
+#include <sqlite3.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+// A WAL's header, which is one unit; each frame after it, a header and a page, is another
+static const int walHeaderSize = 32;
+static const int walFrameHeaderSize = 24;
+
+// The unit journals and temporary files are cut into; SQLite writes them a few bytes at a time
+static const int streamUnitSize = 512;
+
+// One registered VFS; pAppData of the sqlite3_vfs points back at it
+struct VfsState
+{
+	sqlite3_vfs vfs;
+	sqlite3_vfs* real;
+	QByteArray name;
+	bool encrypted;
+	unsigned char xtsKey[64];
+	std::atomic<qint64> logicalBytesRead;
+	std::atomic<qint64> logicalBytesWritten;
+	std::atomic<qint64> diskBytesRead;
+	std::atomic<qint64> diskBytesWritten;
+	std::atomic<qint64> unitsEncrypted;
+	std::atomic<qint64> unitsDecrypted;
+};
+
+// An open file; the default VFS's own file structure follows it in the same allocation
+struct CryptFile
+{
+	sqlite3_file base;
+	sqlite3_file* real;
+	VfsState* state;
+	bool pageMode;
+	bool persisted;		// the nonce is stored in a header at the start of the file
+	bool wal;
+	bool haveNonce;
+	qint64 frameSize;	// a WAL's frame header and page, from its header; 0 until it is known
+	unsigned char nonce[8];
+	EVP_CIPHER_CTX* encryptCtx;
+	EVP_CIPHER_CTX* decryptCtx;
+	unsigned char* scratch;
+	int scratchSize;
+};
+
+/**
+ * @brief Gets the table of installed VFSes
+ * @return The registry, keyed by VFS name
+ */
+static QHash<QString, VfsState*>& registry()
+{
+	static QHash<QString, VfsState*> vfses;
+	return vfses;
+}
+
+/**
+ * @brief Gets the mutex guarding the registry
+ * @return The mutex
+ */
+static QMutex& registryMutex()
+{
+	static QMutex mutex;
+	return mutex;
+}
+
+/**
+ * @brief Derives a 32-byte subkey so the XTS halves and the journal key are all different
+ * @param key The database key
+ * @param label What the subkey is used for
+ * @param out Receives the 32-byte subkey
+ * @return void
+ */
+static void deriveKey(const QByteArray& key, const char* label, unsigned char* out)
+{
+	QByteArray derived = QCryptographicHash::hash(key + QByteArray(label), QCryptographicHash::Sha256);
+	memcpy(out, derived.constData(), 32);
+	derived.fill(0);
+	return;
+}
+
+/**
+ * @brief Gets the number of bytes in front of what SQLite sees of a file
+ * @param file The open file
+ * @return The size of the nonce header, or 0 if the file has none
+ */
+static qint64 headerSize(CryptFile* file)
+{
+	return file->persisted ? qint64(sizeof(file->nonce)) : 0;
+}
+
+/**
+ * @brief Gives a file a fresh random nonce, and writes it to the file's header if it has one
+ * @param file The open file
+ * @return The SQLite result code
+ */
+static int startNonce(CryptFile* file)
+{
+	if (RAND_bytes(file->nonce, sizeof(file->nonce)) != 1)
+	{
+		file->haveNonce = false;
+		return SQLITE_IOERR_WRITE;
+	}
+	file->haveNonce = true;
+	if (!file->persisted)
+	{
+		return SQLITE_OK;
+	}
+	file->state->diskBytesWritten += sizeof(file->nonce);
+	return file->real->pMethods->xWrite(file->real, file->nonce, sizeof(file->nonce), 0);
+}
+
+/**
+ * @brief Makes sure a file's scratch buffer holds at least the given number of bytes
+ * @param file The open file
+ * @param size The number of bytes needed
+ * @return The scratch buffer, or nullptr if it could not be grown
+ */
+static unsigned char* scratchFor(CryptFile* file, int size)
+{
+	if (size > file->scratchSize)
+	{
+		unsigned char* grown = static_cast<unsigned char*>(realloc(file->scratch, size));
+		if (!grown)
+		{
+			return nullptr;
+		}
+		file->scratch = grown;
+		file->scratchSize = size;
+	}
+	return file->scratch;
+}
+
+/**
+ * @brief Encrypts or decrypts a unit shorter than one AES block, which XTS cannot take
+ * A ten-round Feistel network over the unit's two halves, as in FF1, with AES-XTS under the
+ * unit's tweak as the round function. Like XTS it is a permutation of the unit, so rewriting a
+ * short unit at the end of a file never reuses a keystream.
+ * @param file The open file
+ * @param encrypt True to encrypt, false to decrypt
+ * @param tweak The unit's 16-byte tweak
+ * @param in The input bytes
+ * @param out The output bytes, which may be the same buffer as the input
+ * @param length The length of the unit, from 1 to 15
+ * @return boolean indicating whether the unit was processed
+ */
+static bool shortUnit(CryptFile* file, bool encrypt, const unsigned char* tweak, const unsigned char* in, unsigned char* out, int length)
+{
+	static const int rounds = 10;
+
+	// Each half is length nibbles, so both fit in 60 bits
+	quint64 mask = (quint64(1) << (4 * length)) - 1;
+	quint64 halves[2] = { 0, 0 };
+	for (int i = 0; i < 2 * length; i++)
+	{
+		quint64& half = halves[i < length ? 0 : 1];
+		half = (half << 4) | ((in[i / 2] >> (i % 2 == 0 ? 4 : 0)) & 0x0F);
+	}
+
+	for (int i = 0; i < rounds; i++)
+	{
+		int round = encrypt ? i : rounds - 1 - i;
+		quint64 kept = encrypt ? halves[1] : halves[0];
+		unsigned char block[16] = { 0 };
+		for (int j = 0; j < 8; j++)
+		{
+			block[j] = static_cast<unsigned char>(kept >> (8 * j));
+		}
+		block[8] = static_cast<unsigned char>(round);
+		block[9] = static_cast<unsigned char>(length);
+
+		int outLength = 0;
+		if (EVP_CipherInit_ex(file->encryptCtx, nullptr, nullptr, nullptr, tweak, 1) != 1
+			|| EVP_CipherUpdate(file->encryptCtx, block, &outLength, block, sizeof(block)) != 1)
+		{
+			return false;
+		}
+		quint64 mixed = 0;
+		for (int j = 0; j < 8; j++)
+		{
+			mixed |= quint64(block[j]) << (8 * j);
+		}
+		mixed &= mask;
+
+		// (left, right) becomes (right, left ^ F(right)), and back again when decrypting
+		if (encrypt)
+		{
+			quint64 left = halves[0];
+			halves[0] = halves[1];
+			halves[1] = left ^ mixed;
+		}
+		else
+		{
+			quint64 right = halves[1];
+			halves[1] = halves[0];
+			halves[0] = right ^ mixed;
+		}
+	}
+
+	for (int i = 0; i < 2 * length; i++)
+	{
+		int position = i < length ? i : i - length;
+		int nibble = int(halves[i < length ? 0 : 1] >> (4 * (length - 1 - position))) & 0x0F;
+		out[i / 2] = static_cast<unsigned char>(i % 2 == 0 ? nibble << 4 : (out[i / 2] | nibble));
+	}
+	return true;
+}
+
+/**
+ * @brief Encrypts or decrypts one unit of a file with AES-256-XTS
+ * @param file The open file
+ * @param encrypt True to encrypt, false to decrypt
+ * @param unit The unit number in a database, or the unit's offset in any other file, used as the tweak
+ * @param in The input bytes
+ * @param out The output bytes, which may be the same buffer as the input
+ * @param length The length of the unit
+ * @return boolean indicating whether the unit was processed
+ */
+static bool xtsUnit(CryptFile* file, bool encrypt, qint64 unit, const unsigned char* in, unsigned char* out, int length)
+{
+	// The main database's nonce is all zero, so its tweak is the unit number alone
+	unsigned char tweak[16] = { 0 };
+	for (int i = 0; i < 8; i++)
+	{
+		tweak[i] = static_cast<unsigned char>(quint64(unit) >> (8 * i));
+	}
+	memcpy(tweak + 8, file->nonce, sizeof(file->nonce));
+
+	// XTS needs at least one full block; only the end of a journal or temporary file is ever shorter
+	EVP_CIPHER_CTX* ctx = encrypt ? file->encryptCtx : file->decryptCtx;
+	int outLength = 0;
+	bool ok = length < 16 ? shortUnit(file, encrypt, tweak, in, out, length)
+		: EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, tweak, encrypt ? 1 : 0) == 1
+		&& EVP_CipherUpdate(ctx, out, &outLength, in, length) == 1;
+	if (ok)
+	{
+		(encrypt ? file->state->unitsEncrypted : file->state->unitsDecrypted)++;
+	}
+	return ok;
+}
+
+/**
+ * @brief Gets the frame size a WAL header records
+ * @param header The WAL's 32-byte header, decrypted
+ * @return The size of a frame header and its page, or 0 if the page size is not valid
+ */
+static qint64 walFrameSize(const unsigned char* header)
+{
+	quint32 pageSize = (quint32(header[8]) << 24) | (quint32(header[9]) << 16) | (quint32(header[10]) << 8) | quint32(header[11]);
+	if (pageSize < 512 || pageSize > 65536 || (pageSize & (pageSize - 1)) != 0)
+	{
+		return 0;
+	}
+	return walFrameHeaderSize + qint64(pageSize);
+}
+
+/**
+ * @brief Reads a file's nonce from its header, which another connection may have rewritten
+ * A WAL's own header is read in the same call, since where its frames start depends on the
+ * page size it records
+ * @param file The open file, which has a header
+ * @return The SQLite result code; a file too short to have a header is left without a nonce
+ */
+static int loadNonce(CryptFile* file)
+{
+	unsigned char header[sizeof(file->nonce) + walHeaderSize];
+	int length = file->wal ? int(sizeof(header)) : int(sizeof(file->nonce));
+	int rc = file->real->pMethods->xRead(file->real, header, length, 0);
+	file->state->diskBytesRead += length;
+	if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+	{
+		file->haveNonce = false;
+		return rc;
+	}
+
+	sqlite3_int64 size = 0;
+	file->haveNonce = rc == SQLITE_OK
+		|| (file->real->pMethods->xFileSize(file->real, &size) == SQLITE_OK && size >= qint64(sizeof(file->nonce)));
+	if (file->haveNonce)
+	{
+		memcpy(file->nonce, header, sizeof(file->nonce));
+	}
+	file->frameSize = 0;
+	if (file->wal && rc == SQLITE_OK)
+	{
+		unsigned char* walHeader = header + sizeof(file->nonce);
+		if (!xtsUnit(file, false, 0, walHeader, walHeader, walHeaderSize))
+		{
+			return SQLITE_IOERR_READ;
+		}
+		file->frameSize = walFrameSize(walHeader);
+	}
+	return SQLITE_OK;
+}
+
+/**
+ * @brief Finds the unit of a journal, WAL or temporary file that holds an offset
+ * A WAL's header is one unit and each frame after it another, so appending a frame never
+ * re-encrypts a committed frame that other connections may be reading. Other files are cut into
+ * streamUnitSize units.
+ * @param file The open file
+ * @param offset The offset, not counting the nonce header
+ * @param size The size of the file, where its last unit ends
+ * @param start Receives the offset of the unit
+ * @param end Receives the end of the unit, at most size
+ * @return void
+ */
+static void streamUnit(CryptFile* file, qint64 offset, qint64 size, qint64& start, qint64& end)
+{
+	qint64 base = 0;
+	qint64 unit = streamUnitSize;
+	if (file->wal && offset < walHeaderSize)
+	{
+		unit = walHeaderSize;
+	}
+	else if (file->wal)
+	{
+		base = walHeaderSize;
+		unit = file->frameSize > 0 ? file->frameSize : streamUnitSize;
+	}
+	start = base + (offset - base) / unit * unit;
+	end = qMin(start + unit, size);
+	return;
+}
+
+/**
+ * @brief Encrypts or decrypts whole units of a journal, WAL or temporary file in place
+ * Each unit's tweak is its offset with the file's nonce
+ * @param file The open file
+ * @param encrypt True to encrypt, false to decrypt
+ * @param data The bytes from first to last
+ * @param first The offset of the first unit
+ * @param last The end of the last unit
+ * @param size The size of the file the units were or will be written at
+ * @return boolean indicating whether every unit was processed
+ */
+static bool cryptStream(CryptFile* file, bool encrypt, unsigned char* data, qint64 first, qint64 last, qint64 size)
+{
+	qint64 start = first;
+	while (start < last)
+	{
+		qint64 unitStart = 0;
+		qint64 end = 0;
+		streamUnit(file, start, size, unitStart, end);
+		end = qMin(end, last);
+		if (!xtsUnit(file, encrypt, unitStart, data + (start - first), data + (start - first), int(end - start)))
+		{
+			return false;
+		}
+		start = end;
+	}
+	return true;
+}
+
+/**
+ * @brief Brings a journal or WAL's nonce up to date before a write, starting a new one if the write begins a new use of the file
+ * A WAL's header is only written when the WAL starts or restarts. A journal keeps its nonce until
+ * it is emptied, since a unit rewritten under the same tweak leaks no more than which of its
+ * blocks changed.
+ * @param file The open file, which has a header
+ * @param offset The offset being written, not counting the nonce header
+ * @return The SQLite result code
+ */
+static int prepareNonce(CryptFile* file, qint64 offset)
+{
+	if (offset == 0 && file->wal)
+	{
+		return startNonce(file);
+	}
+	if (offset == 0 || file->wal || !file->haveNonce)
+	{
+		int rc = loadNonce(file);
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+	}
+	if (!file->haveNonce)
+	{
+		return startNonce(file);
+	}
+	return SQLITE_OK;
+}
+
+/**
+ * @brief Gets the size of the underlying file as SQLite sees it
+ * @param file The open file
+ * @return The size in bytes without the nonce header, or 0 if it could not be read
+ */
+static qint64 realSize(CryptFile* file)
+{
+	sqlite3_int64 size = 0;
+	if (file->real->pMethods->xFileSize(file->real, &size) != SQLITE_OK)
+	{
+		return 0;
+	}
+	return qMax<qint64>(0, size - headerSize(file));
+}
+
+/**
+ * @brief Reads whole units of the main database and decrypts them in place
+ * @param file The open file
+ * @param data The buffer to read into
+ * @param first The offset of the first unit
+ * @param span The number of bytes to read, a multiple of unitSize
+ * @param size Receives the size of the file if the read was short, otherwise the end of the span
+ * @return The SQLite result code of the read
+ */
+static int readUnits(CryptFile* file, unsigned char* data, qint64 first, int span, qint64& size)
+{
+	int rc = file->real->pMethods->xRead(file->real, data, span, first);
+	file->state->diskBytesRead += span;
+	if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+	{
+		return rc;
+	}
+
+	size = rc == SQLITE_IOERR_SHORT_READ ? realSize(file) : first + span;
+	for (qint64 unitStart = first; unitStart < first + span && unitStart < size; unitStart += EncryptedVfs::unitSize)
+	{
+		int length = int(qMin<qint64>(EncryptedVfs::unitSize, size - unitStart));
+		unsigned char* unit = data + (unitStart - first);
+		if (!xtsUnit(file, false, unitStart / EncryptedVfs::unitSize, unit, unit, length))
+		{
+			return SQLITE_IOERR_READ;
+		}
+	}
+	return rc;
+}
+
+/**
+ * @brief Reads and decrypts part of a journal, WAL or temporary file
+ * Every unit the range touches is read whole, since each is encrypted as one XTS unit
+ * @param file The open file, which has a nonce
+ * @param out Receives the plaintext
+ * @param amount The number of bytes to read
+ * @param offset The offset to read from, not counting the nonce header
+ * @return The SQLite result code; SQLITE_IOERR_SHORT_READ if the file ended first
+ */
+static int readStream(CryptFile* file, unsigned char* out, int amount, qint64 offset)
+{
+	qint64 size = realSize(file);
+	int valid = int(qBound<qint64>(0, size - offset, qint64(amount)));
+	if (valid > 0)
+	{
+		qint64 first = 0;
+		qint64 last = 0;
+		qint64 unused = 0;
+		streamUnit(file, offset, size, first, unused);
+		streamUnit(file, offset + valid - 1, size, unused, last);
+		unsigned char* data = scratchFor(file, int(last - first));
+		if (!data)
+		{
+			return SQLITE_IOERR_NOMEM;
+		}
+		int rc = file->real->pMethods->xRead(file->real, data, int(last - first), first + headerSize(file));
+		file->state->diskBytesRead += last - first;
+		if (rc != SQLITE_OK)
+		{
+			return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_IOERR_READ : rc;
+		}
+		if (!cryptStream(file, false, data, first, last, size))
+		{
+			return SQLITE_IOERR_READ;
+		}
+		memcpy(out, data + (offset - first), valid);
+	}
+	memset(out + valid, 0, amount - valid);
+	return valid < amount ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+}
+
+/**
+ * @brief Encrypts and writes part of a journal, WAL or temporary file
+ * The units the write touches are decrypted at the lengths they had, merged with the new bytes
+ * and encrypted again at their new lengths
+ * @param file The open file, which has a nonce
+ * @param in The plaintext
+ * @param amount The number of bytes to write
+ * @param offset The offset to write at, not counting the nonce header
+ * @return The SQLite result code
+ */
+static int writeStream(CryptFile* file, const unsigned char* in, int amount, qint64 offset)
+{
+	qint64 size = realSize(file);
+	qint64 grown = qMax(size, offset + amount);
+	qint64 first = 0;
+	qint64 last = 0;
+	qint64 unused = 0;
+	streamUnit(file, offset, grown, first, unused);
+	streamUnit(file, offset + amount - 1, grown, unused, last);
+	unsigned char* data = scratchFor(file, int(last - first));
+	if (!data)
+	{
+		return SQLITE_IOERR_NOMEM;
+	}
+
+	qint64 kept = qMin(last, size);
+	if (kept > first)
+	{
+		int rc = file->real->pMethods->xRead(file->real, data, int(kept - first), first + headerSize(file));
+		file->state->diskBytesRead += kept - first;
+		if (rc != SQLITE_OK)
+		{
+			return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_IOERR_WRITE : rc;
+		}
+		if (!cryptStream(file, false, data, first, kept, size))
+		{
+			return SQLITE_IOERR_WRITE;
+		}
+	}
+	qint64 filled = qMax(first, kept);
+	if (filled < offset)
+	{
+		memset(data + (filled - first), 0, offset - filled);
+	}
+	memcpy(data + (offset - first), in, amount);
+	if (!cryptStream(file, true, data, first, last, grown))
+	{
+		return SQLITE_IOERR_WRITE;
+	}
+	file->state->diskBytesWritten += last - first;
+	return file->real->pMethods->xWrite(file->real, data, int(last - first), first + headerSize(file));
+}
+
+/**
+ * @brief Truncates a journal, WAL or temporary file, re-encrypting a unit cut part way through
+ * @param file The open file, which has a nonce
+ * @param size The new size, greater than 0
+ * @return The SQLite result code
+ */
+static int truncateStream(CryptFile* file, qint64 size)
+{
+	qint64 oldSize = realSize(file);
+	qint64 start = 0;
+	qint64 end = 0;
+	streamUnit(file, size - 1, oldSize, start, end);
+	if (size < oldSize && end > size)
+	{
+		unsigned char* data = scratchFor(file, int(end - start));
+		if (!data)
+		{
+			return SQLITE_IOERR_NOMEM;
+		}
+		int rc = file->real->pMethods->xRead(file->real, data, int(end - start), start + headerSize(file));
+		file->state->diskBytesRead += end - start;
+		if (rc != SQLITE_OK)
+		{
+			return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_IOERR_TRUNCATE : rc;
+		}
+		if (!cryptStream(file, false, data, start, end, oldSize) || !cryptStream(file, true, data, start, size, size))
+		{
+			return SQLITE_IOERR_TRUNCATE;
+		}
+		file->state->diskBytesWritten += size - start;
+		rc = file->real->pMethods->xWrite(file->real, data, int(size - start), start + headerSize(file));
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+	}
+	return file->real->pMethods->xTruncate(file->real, size + headerSize(file));
+}
+
+/**
+ * @brief Closes a file and frees its cipher contexts
+ * @param sqlFile The open file
+ * @return The SQLite result code
+ */
+static int cryptClose(sqlite3_file* sqlFile)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	int rc = file->real->pMethods->xClose(file->real);
+	EVP_CIPHER_CTX_free(file->encryptCtx);
+	EVP_CIPHER_CTX_free(file->decryptCtx);
+	free(file->scratch);
+	file->encryptCtx = nullptr;
+	file->decryptCtx = nullptr;
+	file->scratch = nullptr;
+	return rc;
+}
+
+/**
+ * @brief Reads and decrypts part of a file
+ * @param sqlFile The open file
+ * @param buffer Receives the plaintext
+ * @param amount The number of bytes to read
+ * @param offset The file offset to read from
+ * @return The SQLite result code; SQLITE_IOERR_SHORT_READ if the file ended first
+ */
+static int cryptRead(sqlite3_file* sqlFile, void* buffer, int amount, sqlite3_int64 offset)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	VfsState* state = file->state;
+	unsigned char* out = static_cast<unsigned char*>(buffer);
+	state->logicalBytesRead += amount;
+
+	if (!state->encrypted)
+	{
+		state->diskBytesRead += amount;
+		return file->real->pMethods->xRead(file->real, buffer, amount, offset);
+	}
+
+	if (!file->pageMode)
+	{
+		// SQLite reads a journal's header first, and a WAL can be restarted by any connection
+		if (file->persisted && (offset == 0 || file->wal || !file->haveNonce))
+		{
+			int rc = loadNonce(file);
+			if (rc != SQLITE_OK)
+			{
+				return rc;
+			}
+		}
+		if (!file->haveNonce)
+		{
+			memset(out, 0, amount);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return readStream(file, out, amount, offset);
+	}
+
+	qint64 first = offset / EncryptedVfs::unitSize * EncryptedVfs::unitSize;
+	qint64 last = (offset + amount + EncryptedVfs::unitSize - 1) / EncryptedVfs::unitSize * EncryptedVfs::unitSize;
+	int span = int(last - first);
+	bool direct = first == offset && span == amount;
+	unsigned char* data = direct ? out : scratchFor(file, span);
+	if (!data)
+	{
+		return SQLITE_IOERR_NOMEM;
+	}
+
+	qint64 size = 0;
+	int rc = readUnits(file, data, first, span, size);
+	if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+	{
+		return rc;
+	}
+	if (!direct)
+	{
+		memcpy(out, data + (offset - first), amount);
+	}
+	if (rc == SQLITE_IOERR_SHORT_READ)
+	{
+		int valid = int(qBound<qint64>(0, size - offset, amount));
+		memset(out + valid, 0, amount - valid);
+	}
+	return rc;
+}
+
+/**
+ * @brief Encrypts and writes part of a file
+ * @param sqlFile The open file
+ * @param buffer The plaintext
+ * @param amount The number of bytes to write
+ * @param offset The file offset to write at
+ * @return The SQLite result code
+ */
+static int cryptWrite(sqlite3_file* sqlFile, const void* buffer, int amount, sqlite3_int64 offset)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	VfsState* state = file->state;
+	const unsigned char* in = static_cast<const unsigned char*>(buffer);
+	state->logicalBytesWritten += amount;
+
+	if (!state->encrypted)
+	{
+		state->diskBytesWritten += amount;
+		return file->real->pMethods->xWrite(file->real, buffer, amount, offset);
+	}
+
+	if (!file->pageMode)
+	{
+		int rc = file->persisted ? prepareNonce(file, offset) : SQLITE_OK;
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		if (file->wal && offset == 0 && amount >= walHeaderSize)
+		{
+			file->frameSize = walFrameSize(in);
+		}
+		return writeStream(file, in, amount, offset);
+	}
+
+	qint64 first = offset / EncryptedVfs::unitSize * EncryptedVfs::unitSize;
+	qint64 last = (offset + amount + EncryptedVfs::unitSize - 1) / EncryptedVfs::unitSize * EncryptedVfs::unitSize;
+	int span = int(last - first);
+	unsigned char* data = scratchFor(file, span);
+	if (!data)
+	{
+		return SQLITE_IOERR_NOMEM;
+	}
+
+	qint64 end = last;
+	if (first == offset && span == amount)
+	{
+		// Whole units, which is every write with the default page size
+		for (int done = 0; done < span; done += EncryptedVfs::unitSize)
+		{
+			if (!xtsUnit(file, true, (first + done) / EncryptedVfs::unitSize, in + done, data + done, EncryptedVfs::unitSize))
+			{
+				return SQLITE_IOERR_WRITE;
+			}
+		}
+	}
+	else
+	{
+		// Part of a unit: decrypt what is there, merge the new bytes, and re-encrypt at the new length
+		qint64 size = 0;
+		int rc = readUnits(file, data, first, span, size);
+		if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+		{
+			return rc;
+		}
+		memcpy(data + (offset - first), in, amount);
+		end = qMin(last, qMax(size, offset + amount));
+		for (qint64 unitStart = first; unitStart < end; unitStart += EncryptedVfs::unitSize)
+		{
+			int length = int(qMin<qint64>(EncryptedVfs::unitSize, end - unitStart));
+			unsigned char* unit = data + (unitStart - first);
+			if (!xtsUnit(file, true, unitStart / EncryptedVfs::unitSize, unit, unit, length))
+			{
+				return SQLITE_IOERR_WRITE;
+			}
+		}
+	}
+
+	state->diskBytesWritten += end - first;
+	return file->real->pMethods->xWrite(file->real, data, int(end - first), first);
+}
+
+/**
+ * @brief Truncates a file
+ * A file truncated to nothing gets a new nonce when it is next written. A unit cut part way
+ * through is re-encrypted at its new length, since XTS ciphertext depends on it.
+ * @param sqlFile The open file
+ * @param size The new size
+ * @return The SQLite result code
+ */
+static int cryptTruncate(sqlite3_file* sqlFile, sqlite3_int64 size)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	if (!file->state->encrypted)
+	{
+		return file->real->pMethods->xTruncate(file->real, size);
+	}
+
+	if (!file->pageMode)
+	{
+		if (size == 0)
+		{
+			if (file->persisted)
+			{
+				file->haveNonce = false;
+				return file->real->pMethods->xTruncate(file->real, 0);
+			}
+			int rc = startNonce(file);
+			return rc == SQLITE_OK ? file->real->pMethods->xTruncate(file->real, 0) : rc;
+		}
+		return truncateStream(file, size);
+	}
+
+	qint64 first = size / EncryptedVfs::unitSize * EncryptedVfs::unitSize;
+	int length = int(size - first);
+	if (length == 0 || realSize(file) <= first)
+	{
+		return file->real->pMethods->xTruncate(file->real, size);
+	}
+
+	unsigned char* data = scratchFor(file, EncryptedVfs::unitSize);
+	if (!data)
+	{
+		return SQLITE_IOERR_NOMEM;
+	}
+	qint64 oldSize = 0;
+	int rc = readUnits(file, data, first, EncryptedVfs::unitSize, oldSize);
+	if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+	{
+		return rc;
+	}
+	if (oldSize - first < length)
+	{
+		memset(data + (oldSize - first), 0, length - (oldSize - first));
+	}
+	if (!xtsUnit(file, true, first / EncryptedVfs::unitSize, data, data, length))
+	{
+		return SQLITE_IOERR_TRUNCATE;
+	}
+	file->state->diskBytesWritten += length;
+	rc = file->real->pMethods->xWrite(file->real, data, length, first);
+	return rc == SQLITE_OK ? file->real->pMethods->xTruncate(file->real, size) : rc;
+}
+
+/**
+ * @brief Flushes a file to disk
+ * @param sqlFile The open file
+ * @param flags The SQLite sync flags
+ * @return The SQLite result code
+ */
+static int cryptSync(sqlite3_file* sqlFile, int flags)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xSync(file->real, flags);
+}
+
+/**
+ * @brief Gets the size of a file
+ * @param sqlFile The open file
+ * @param size Receives the size
+ * @return The SQLite result code
+ */
+static int cryptFileSize(sqlite3_file* sqlFile, sqlite3_int64* size)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	int rc = file->real->pMethods->xFileSize(file->real, size);
+	if (rc == SQLITE_OK && file->persisted)
+	{
+		*size = qMax<sqlite3_int64>(0, *size - headerSize(file));
+	}
+	return rc;
+}
+
+/**
+ * @brief Takes a file lock
+ * @param sqlFile The open file
+ * @param lock The lock level
+ * @return The SQLite result code
+ */
+static int cryptLock(sqlite3_file* sqlFile, int lock)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xLock(file->real, lock);
+}
+
+/**
+ * @brief Releases a file lock
+ * @param sqlFile The open file
+ * @param lock The lock level to drop to
+ * @return The SQLite result code
+ */
+static int cryptUnlock(sqlite3_file* sqlFile, int lock)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xUnlock(file->real, lock);
+}
+
+/**
+ * @brief Checks whether another connection holds a reserved lock
+ * @param sqlFile The open file
+ * @param reserved Receives the answer
+ * @return The SQLite result code
+ */
+static int cryptCheckReservedLock(sqlite3_file* sqlFile, int* reserved)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xCheckReservedLock(file->real, reserved);
+}
+
+/**
+ * @brief Passes a file control through to the default VFS
+ * @param sqlFile The open file
+ * @param op The file control opcode
+ * @param arg The opcode's argument
+ * @return The SQLite result code
+ */
+static int cryptFileControl(sqlite3_file* sqlFile, int op, void* arg)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xFileControl(file->real, op, arg);
+}
+
+/**
+ * @brief Gets the sector size of a file
+ * @param sqlFile The open file
+ * @return The sector size in bytes
+ */
+static int cryptSectorSize(sqlite3_file* sqlFile)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xSectorSize(file->real);
+}
+
+/**
+ * @brief Gets the device characteristics of a file
+ * @param sqlFile The open file
+ * @return The SQLITE_IOCAP flags
+ */
+static int cryptDeviceCharacteristics(sqlite3_file* sqlFile)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xDeviceCharacteristics(file->real);
+}
+
+/**
+ * @brief Maps a region of the WAL index; the index holds no row data, so it is not encrypted
+ * @param sqlFile The open file
+ * @param region The region number
+ * @param size The region size
+ * @param extend Whether the region may be created
+ * @param mapped Receives the mapping
+ * @return The SQLite result code
+ */
+static int cryptShmMap(sqlite3_file* sqlFile, int region, int size, int extend, void volatile** mapped)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xShmMap(file->real, region, size, extend, mapped);
+}
+
+/**
+ * @brief Locks slots of the WAL index
+ * @param sqlFile The open file
+ * @param offset The first slot
+ * @param count The number of slots
+ * @param flags The SQLITE_SHM flags
+ * @return The SQLite result code
+ */
+static int cryptShmLock(sqlite3_file* sqlFile, int offset, int count, int flags)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xShmLock(file->real, offset, count, flags);
+}
+
+/**
+ * @brief Orders memory accesses to the WAL index
+ * @param sqlFile The open file
+ * @return void
+ */
+static void cryptShmBarrier(sqlite3_file* sqlFile)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	file->real->pMethods->xShmBarrier(file->real);
+	return;
+}
+
+/**
+ * @brief Unmaps the WAL index
+ * @param sqlFile The open file
+ * @param deleteFlag Whether the index file should be deleted
+ * @return The SQLite result code
+ */
+static int cryptShmUnmap(sqlite3_file* sqlFile, int deleteFlag)
+{
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	return file->real->pMethods->xShmUnmap(file->real, deleteFlag);
+}
+
+static const sqlite3_io_methods cryptMethods1 = {
+	1, cryptClose, cryptRead, cryptWrite, cryptTruncate, cryptSync, cryptFileSize, cryptLock, cryptUnlock,
+	cryptCheckReservedLock, cryptFileControl, cryptSectorSize, cryptDeviceCharacteristics,
+	nullptr, nullptr, nullptr, nullptr, nullptr, nullptr
+};
+
+static const sqlite3_io_methods cryptMethods2 = {
+	2, cryptClose, cryptRead, cryptWrite, cryptTruncate, cryptSync, cryptFileSize, cryptLock, cryptUnlock,
+	cryptCheckReservedLock, cryptFileControl, cryptSectorSize, cryptDeviceCharacteristics,
+	cryptShmMap, cryptShmLock, cryptShmBarrier, cryptShmUnmap, nullptr, nullptr
+};
+
+/**
+ * @brief Opens a file through the default VFS and sets up its ciphers
+ * @param vfs This VFS
+ * @param name The file name, or nullptr for a temporary file
+ * @param sqlFile The file structure to fill in
+ * @param flags The SQLITE_OPEN flags
+ * @param outFlags Receives the flags the file was opened with
+ * @return The SQLite result code
+ */
+static int cryptOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* sqlFile, int flags, int* outFlags)
+{
+	VfsState* state = static_cast<VfsState*>(vfs->pAppData);
+	CryptFile* file = reinterpret_cast<CryptFile*>(sqlFile);
+	memset(file, 0, sizeof(CryptFile));
+	file->real = reinterpret_cast<sqlite3_file*>(file + 1);
+	file->state = state;
+	file->pageMode = (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TRANSIENT_DB)) != 0;
+	file->persisted = state->encrypted && (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL | SQLITE_OPEN_MASTER_JOURNAL)) != 0;
+	file->wal = (flags & SQLITE_OPEN_WAL) != 0;
+
+	int rc = state->real->xOpen(state->real, name, file->real, flags, outFlags);
+	if (rc != SQLITE_OK)
+	{
+		return rc;
+	}
+
+	if (state->encrypted)
+	{
+		file->encryptCtx = EVP_CIPHER_CTX_new();
+		file->decryptCtx = EVP_CIPHER_CTX_new();
+		bool ok = file->encryptCtx && file->decryptCtx;
+		// Temporary files get a nonce now; the main database keeps a zero nonce, and files with a header read theirs when used
+		if (ok && !file->persisted && (flags & SQLITE_OPEN_MAIN_DB) == 0)
+		{
+			ok = startNonce(file) == SQLITE_OK;
+		}
+		if (ok)
+		{
+			ok = EVP_EncryptInit_ex(file->encryptCtx, EVP_aes_256_xts(), nullptr, state->xtsKey, nullptr) == 1
+				&& EVP_DecryptInit_ex(file->decryptCtx, EVP_aes_256_xts(), nullptr, state->xtsKey, nullptr) == 1;
+		}
+
+		if (!ok)
+		{
+			DBLOG_ERROR("EncryptedVfs", DbErrorCrypto, 0, "file ciphers could not be initialised", QString(name));
+			file->real->pMethods->xClose(file->real);
+			EVP_CIPHER_CTX_free(file->encryptCtx);
+			EVP_CIPHER_CTX_free(file->decryptCtx);
+			return SQLITE_CANTOPEN;
+		}
+	}
+
+	sqlFile->pMethods = file->real->pMethods->iVersion >= 2 ? &cryptMethods2 : &cryptMethods1;
+	return SQLITE_OK;
+}
+
+/**
+ * @brief Gets the default VFS this VFS forwards to
+ * @param vfs This VFS
+ * @return The default VFS
+ */
+static sqlite3_vfs* realVfs(sqlite3_vfs* vfs)
+{
+	return static_cast<VfsState*>(vfs->pAppData)->real;
+}
+
+/**
+ * @brief Deletes a file
+ * @param vfs This VFS
+ * @param name The file name
+ * @param syncDir Whether the directory should be synced afterwards
+ * @return The SQLite result code
+ */
+static int cryptDelete(sqlite3_vfs* vfs, const char* name, int syncDir)
+{
+	return realVfs(vfs)->xDelete(realVfs(vfs), name, syncDir);
+}
+
+/**
+ * @brief Checks whether a file exists or can be accessed
+ * @param vfs This VFS
+ * @param name The file name
+ * @param flags The SQLITE_ACCESS flag to check
+ * @param result Receives the answer
+ * @return The SQLite result code
+ */
+static int cryptAccess(sqlite3_vfs* vfs, const char* name, int flags, int* result)
+{
+	return realVfs(vfs)->xAccess(realVfs(vfs), name, flags, result);
+}
+
+/**
+ * @brief Expands a file name to a full path
+ * @param vfs This VFS
+ * @param name The file name
+ * @param size The size of the output buffer
+ * @param out Receives the full path
+ * @return The SQLite result code
+ */
+static int cryptFullPathname(sqlite3_vfs* vfs, const char* name, int size, char* out)
+{
+	return realVfs(vfs)->xFullPathname(realVfs(vfs), name, size, out);
+}
+
+/**
+ * @brief Opens a shared library for an SQLite extension
+ * @param vfs This VFS
+ * @param name The library file name
+ * @return The library handle
+ */
+static void* cryptDlOpen(sqlite3_vfs* vfs, const char* name)
+{
+	return realVfs(vfs)->xDlOpen(realVfs(vfs), name);
+}
+
+/**
+ * @brief Gets the last shared library error
+ * @param vfs This VFS
+ * @param size The size of the output buffer
+ * @param out Receives the error message
+ * @return void
+ */
+static void cryptDlError(sqlite3_vfs* vfs, int size, char* out)
+{
+	realVfs(vfs)->xDlError(realVfs(vfs), size, out);
+	return;
+}
+
+/**
+ * @brief Finds a symbol in a shared library
+ * @param vfs This VFS
+ * @param library The library handle
+ * @param symbol The symbol name
+ * @return The symbol's address
+ */
+static void (*cryptDlSym(sqlite3_vfs* vfs, void* library, const char* symbol))(void)
+{
+	return realVfs(vfs)->xDlSym(realVfs(vfs), library, symbol);
+}
+
+/**
+ * @brief Closes a shared library
+ * @param vfs This VFS
+ * @param library The library handle
+ * @return void
+ */
+static void cryptDlClose(sqlite3_vfs* vfs, void* library)
+{
+	realVfs(vfs)->xDlClose(realVfs(vfs), library);
+	return;
+}
+
+/**
+ * @brief Fills a buffer with random bytes for SQLite's PRNG seed
+ * @param vfs This VFS
+ * @param size The number of bytes
+ * @param out Receives the bytes
+ * @return The number of bytes written
+ */
+static int cryptRandomness(sqlite3_vfs* vfs, int size, char* out)
+{
+	return realVfs(vfs)->xRandomness(realVfs(vfs), size, out);
+}
+
+/**
+ * @brief Sleeps for a number of microseconds
+ * @param vfs This VFS
+ * @param microseconds The time to sleep
+ * @return The time actually slept
+ */
+static int cryptSleep(sqlite3_vfs* vfs, int microseconds)
+{
+	return realVfs(vfs)->xSleep(realVfs(vfs), microseconds);
+}
+
+/**
+ * @brief Gets the current time as a Julian day number
+ * @param vfs This VFS
+ * @param now Receives the time
+ * @return The SQLite result code
+ */
+static int cryptCurrentTime(sqlite3_vfs* vfs, double* now)
+{
+	return realVfs(vfs)->xCurrentTime(realVfs(vfs), now);
+}
+
+/**
+ * @brief Gets the last operating system error
+ * @param vfs This VFS
+ * @param size The size of the output buffer
+ * @param out Receives the error message
+ * @return The error code
+ */
+static int cryptGetLastError(sqlite3_vfs* vfs, int size, char* out)
+{
+	return realVfs(vfs)->xGetLastError ? realVfs(vfs)->xGetLastError(realVfs(vfs), size, out) : 0;
+}
+
+/**
+ * @brief Gets the current time in milliseconds since the Julian epoch
+ * @param vfs This VFS
+ * @param now Receives the time
+ * @return The SQLite result code
+ */
+static int cryptCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* now)
+{
+	if (realVfs(vfs)->iVersion >= 2 && realVfs(vfs)->xCurrentTimeInt64)
+	{
+		return realVfs(vfs)->xCurrentTimeInt64(realVfs(vfs), now);
+	}
+	double days = 0;
+	int rc = realVfs(vfs)->xCurrentTime(realVfs(vfs), &days);
+	*now = sqlite3_int64(days * 86400000.0);
+	return rc;
+}
+
+/**
+ * @brief Registers a VFS that encrypts every file with the given key
+ * The VFS stays registered for the life of the process; a name can only be installed once
+ * @param name The VFS name to use in database URIs
+ * @param key A 32-byte key, or an empty QByteArray for a pass-through VFS that only counts I/O
+ * @return boolean indicating whether the VFS was registered
+ */
+bool EncryptedVfs::install(const QString& name, const QByteArray& key)
+{
+	QMutexLocker locker(&registryMutex());
+	if (registry().contains(name))
+	{
+		DBLOG_WARNING("EncryptedVfs", DbErrorConnection, 0, "a VFS with this name is already installed", name);
+		return false;
+	}
+	if (!key.isEmpty() && key.size() != 32)
+	{
+		DBLOG_ERROR("EncryptedVfs", DbErrorCrypto, 0, "keys must be 32 bytes", name);
+		return false;
+	}
+
+	sqlite3_vfs* real = sqlite3_vfs_find(nullptr);
+	if (!real)
+	{
+		DBLOG_ERROR("EncryptedVfs", DbErrorConnection, 0, "SQLite has no default VFS", name);
+		return false;
+	}
+
+	VfsState* state = new VfsState();
+	state->real = real;
+	state->name = name.toUtf8();
+	state->encrypted = !key.isEmpty();
+	if (state->encrypted)
+	{
+		deriveKey(key, "dbcrypt-xts-data", state->xtsKey);
+		deriveKey(key, "dbcrypt-xts-tweak", state->xtsKey + 32);
+	}
+	state->logicalBytesRead = 0;
+	state->logicalBytesWritten = 0;
+	state->diskBytesRead = 0;
+	state->diskBytesWritten = 0;
+	state->unitsEncrypted = 0;
+	state->unitsDecrypted = 0;
+
+	sqlite3_vfs& vfs = state->vfs;
+	memset(&vfs, 0, sizeof(vfs));
+	vfs.iVersion = 2;
+	vfs.szOsFile = int(sizeof(CryptFile)) + real->szOsFile;
+	vfs.mxPathname = real->mxPathname;
+	vfs.zName = state->name.constData();
+	vfs.pAppData = state;
+	vfs.xOpen = cryptOpen;
+	vfs.xDelete = cryptDelete;
+	vfs.xAccess = cryptAccess;
+	vfs.xFullPathname = cryptFullPathname;
+	vfs.xDlOpen = cryptDlOpen;
+	vfs.xDlError = cryptDlError;
+	vfs.xDlSym = cryptDlSym;
+	vfs.xDlClose = cryptDlClose;
+	vfs.xRandomness = cryptRandomness;
+	vfs.xSleep = cryptSleep;
+	vfs.xCurrentTime = cryptCurrentTime;
+	vfs.xGetLastError = cryptGetLastError;
+	vfs.xCurrentTimeInt64 = cryptCurrentTimeInt64;
+
+	if (sqlite3_vfs_register(&vfs, 0) != SQLITE_OK)
+	{
+		DBLOG_ERROR("EncryptedVfs", DbErrorConnection, 0, "VFS could not be registered", name);
+		delete state;
+		return false;
+	}
+	registry().insert(name, state);
+	return true;
+}
+
+/**
+ * @brief Builds the database path that opens a file through a VFS
+ * @param path The path of the database file
+ * @param vfsName The name the VFS was installed under
+ * @return An SQLite URI to pass to DbManager as the database path
+ */
+QString EncryptedVfs::uri(const QString& path, const QString& vfsName)
+{
+	return QString("file:") + QString::fromLatin1(QUrl::toPercentEncoding(path, "/")) + "?vfs=" + vfsName;
+}
+
+/**
+ * @brief Gets the I/O counters of an installed VFS
+ * @param name The name the VFS was installed under
+ * @return The counters, all zero if no such VFS is installed
+ */
+EncryptedVfsStats EncryptedVfs::stats(const QString& name)
+{
+	QMutexLocker locker(&registryMutex());
+	EncryptedVfsStats result = { 0, 0, 0, 0, 0, 0 };
+	VfsState* state = registry().value(name, nullptr);
+	if (state)
+	{
+		result.logicalBytesRead = state->logicalBytesRead;
+		result.logicalBytesWritten = state->logicalBytesWritten;
+		result.diskBytesRead = state->diskBytesRead;
+		result.diskBytesWritten = state->diskBytesWritten;
+		result.unitsEncrypted = state->unitsEncrypted;
+		result.unitsDecrypted = state->unitsDecrypted;
+	}
+	return result;
+}
+
+/**
+ * @brief Sets the I/O counters of an installed VFS back to zero
+ * @param name The name the VFS was installed under
+ * @return void
+ */
+void EncryptedVfs::resetStats(const QString& name)
+{
+	QMutexLocker locker(&registryMutex());
+	VfsState* state = registry().value(name, nullptr);
+	if (state)
+	{
+		state->logicalBytesRead = 0;
+		state->logicalBytesWritten = 0;
+		state->diskBytesRead = 0;
+		state->diskBytesWritten = 0;
+		state->unitsEncrypted = 0;
+		state->unitsDecrypted = 0;
+	}
+	return;
+}
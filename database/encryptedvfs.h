@@ -0,0 +1,55 @@
+/**
+ * @file encryptedvfs.h
+ * @brief This contains the prototypes for the encrypting SQLite VFS
+ *
+ * The VFS sits between SQLite's pager and the operating system's VFS, so everything SQLite
+ * writes to disk is encrypted and everything it reads back is decrypted. The main database file
+ * is encrypted in 4 KB units with AES-256-XTS, using the unit number as the tweak, so ciphertext
+ * is the same size as plaintext and a page can be read or written on its own. Temporary databases
+ * are encrypted the same way with a random per-file tweak. Journals, WAL files and other temporary
+ * files are AES-256-XTS encrypted in units of their own: one per WAL frame, since other
+ * connections read committed frames while new ones are appended, and 512 bytes elsewhere. Their
+ * tweaks combine the unit's offset with a random nonce, which a journal or WAL stores in a small
+ * header. Overwritten bytes are re-encrypted with their whole unit, never under a reused
+ * keystream. AES-NI is used through OpenSSL when the CPU has it.
+ *
+ * Decrypted pages are cached by SQLite's own page cache (PRAGMA cache_size), which sits above
+ * the VFS, so a page that stays cached is only decrypted once.
+ *
+ * A database is opened through the VFS by passing EncryptedVfs::uri() as the database path.
+ * The QSQLITE driver must be linked against the same SQLite library as this file (Qt built
+ * with -system-sqlite), otherwise the VFS is registered in a different copy of SQLite.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef ENCRYPTEDVFS_H
+#define ENCRYPTEDVFS_H
+
+#include <QString>
+#include <QByteArray>
+
+// Bytes SQLite asked for against bytes that reached the disk; the ratio is the write amplification
+struct EncryptedVfsStats
+{
+	qint64 logicalBytesRead;
+	qint64 logicalBytesWritten;
+	qint64 diskBytesRead;
+	qint64 diskBytesWritten;
+	qint64 unitsEncrypted;
+	qint64 unitsDecrypted;
+};
+
+class EncryptedVfs
+{
+	public:
+		static const int unitSize = 4096;
+
+		static bool install(const QString& name, const QByteArray& key);
+		static QString uri(const QString& path, const QString& vfsName);
+		static EncryptedVfsStats stats(const QString& name);
+		static void resetStats(const QString& name);
+};
+
+#endif	// ENCRYPTEDVFS_H
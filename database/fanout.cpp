@@ -0,0 +1,432 @@
+/**
+ * @file fanout.cpp
+ * @brief Resolves chat members to connections and pushes shared messages into their queues
+ *
+ * A message starts with one reference per target queue plus one for the sender, so a send
+ * makes a single atomic add up front instead of one per recipient; queues that are full or
+ * closed hand their reference straight back.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <fanout.h>
+#include <dbmanager.h>
+#include <mpscring.h>
+#include <QReadLocker>
+#include <QWriteLocker>
+
+// A connection's outbound queue and whether a wakeup is already on its way
+struct FanoutEngine::Connection
+{
+	int id;
+	QString username;
+	MpscRing<FanoutMessage*> queue;
+	std::atomic<bool> wakePending;
+	std::atomic<bool> closed;
+
+	Connection(int id, const QString& username, int capacity)
+		: id(id), username(username), queue(capacity), wakePending(false), closed(false)
+	{
+	}
+
+	~Connection()
+	{
+		FanoutMessage* message;
+		while (queue.tryPop(message))
+		{
+			message->release();
+		}
+	}
+};
+
+// The connections a chat's messages go to, dropped when a member's connections change
+struct FanoutEngine::ChatRoute
+{
+	QVector<QSharedPointer<Connection> > targets;
+	QVector<QString> offline;	// members with no connection
+};
+
+/**
+ * @brief Constructor for a shared message
+ * @param chatID An integer representing the chat ID number
+ * @param payload The message bytes; QByteArray's implicit sharing means they are not copied
+ * @param references The number of references the message starts with
+ */
+FanoutMessage::FanoutMessage(int chatID, const QByteArray& payload, const QByteArray& alternate, int references)
+	: references(references), chat(chatID), data(payload), alternateData(alternate)
+{
+}
+
+/**
+ * @brief Adds references to the message
+ * @param count The number of references to add
+ * @return void
+ */
+void FanoutMessage::retain(int count)
+{
+	references.fetch_add(count, std::memory_order_relaxed);
+	return;
+}
+
+/**
+ * @brief Drops one reference, freeing the message when it was the last
+ * @return void
+ */
+void FanoutMessage::release()
+{
+	if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		delete this;
+	}
+	return;
+}
+
+/**
+ * @brief Gets the chat the message was sent to
+ * @return The chat ID
+ */
+int FanoutMessage::chatID() const
+{
+	return chat;
+}
+
+/**
+ * @brief Gets the message bytes
+ * @return The payload
+ */
+const QByteArray& FanoutMessage::payload() const
+{
+	return data;
+}
+
+/**
+ * @brief Gets the message in the other form the sender built it in, for connections that cannot take the payload as it is
+ * @return The alternate bytes, or an empty QByteArray if the sender gave none
+ */
+const QByteArray& FanoutMessage::alternate() const
+{
+	return alternateData;
+}
+
+/**
+ * @brief Constructor for a fan-out engine
+ * @param queueCapacity The number of messages each connection can have waiting
+ */
+FanoutEngine::FanoutEngine(int queueCapacity)
+	: queueCapacity(queueCapacity), nextConnectionID(1),
+	messageCount(0), deliveryCount(0), droppedCount(0), wakeupCount(0)
+{
+}
+
+/**
+ * @brief Destructor for the fan-out engine
+ * Messages still queued are released along with their connections
+ */
+FanoutEngine::~FanoutEngine()
+{
+}
+
+/**
+ * @brief Sets the function told which connections have new messages
+ * Must be set before any messages are sent
+ * @param handler The wake handler
+ * @return void
+ */
+void FanoutEngine::setWakeHandler(const FanoutWakeHandler& handler)
+{
+	wakeHandler = handler;
+	return;
+}
+
+/**
+ * @brief Registers a connection for a logged-in user
+ * A user may have several connections, and every one of them receives the user's chat messages
+ * @param username The user the connection belongs to
+ * @return The connection ID
+ */
+int FanoutEngine::addConnection(const QString& username)
+{
+	QWriteLocker locker(&connectionLock);
+	int id = nextConnectionID++;
+	connections.insert(id, QSharedPointer<Connection>(new Connection(id, username, queueCapacity)));
+	users.setOnline(username, id);
+	dropRoutes(username);
+	return id;
+}
+
+/**
+ * @brief Unregisters a connection; messages already queued for it are discarded
+ * @param connectionID The connection ID
+ * @return void
+ */
+void FanoutEngine::removeConnection(int connectionID)
+{
+	QWriteLocker locker(&connectionLock);
+	QSharedPointer<Connection> connection = connections.take(connectionID);
+	if (connection)
+	{
+		connection->closed = true;
+		users.setOffline(connection->username, connectionID);
+		dropRoutes(connection->username);
+	}
+	return;
+}
+
+/**
+ * @brief Forgets the cached members of a chat so they are read again on its next send
+ * Members being read while this runs are used for that one call but not cached.
+ * @param chatID An integer representing the chat ID number
+ * @return void
+ */
+void FanoutEngine::invalidateChat(int chatID)
+{
+	QWriteLocker locker(&routeLock);
+	chatEpochs[chatID]++;
+	routes.remove(chatID);
+	QVector<QString> members = chatMembers.take(chatID);
+	for (int i = 0; i < members.size(); i++)
+	{
+		QHash<QString, QSet<int> >::iterator chats = memberChats.find(members[i]);
+		if (chats != memberChats.end())
+		{
+			chats.value().remove(chatID);
+			if (chats.value().isEmpty())
+			{
+				memberChats.erase(chats);
+			}
+		}
+	}
+	return;
+}
+
+/**
+ * @brief Checks whether a user is a member of a chat, using the cached members when there are any
+ * @param manager The calling thread's database manager, used if the members are not cached
+ * @param chatID An integer representing the chat ID number
+ * @param username The username
+ * @return boolean indicating whether the user is in the chat
+ */
+bool FanoutEngine::isMember(DbManager& manager, int chatID, const QString& username)
+{
+	quint64 epoch = 0;
+	{
+		QReadLocker locker(&routeLock);
+		QHash<int, QVector<QString> >::const_iterator found = chatMembers.constFind(chatID);
+		if (found != chatMembers.constEnd())
+		{
+			return found.value().contains(username);
+		}
+		epoch = chatEpochs.value(chatID);
+	}
+
+	QVector<QString> members = manager.getChatUsers(chatID);
+	QWriteLocker locker(&routeLock);
+	if (chatEpochs.value(chatID) == epoch)
+	{
+		chatMembers.insert(chatID, members);
+	}
+	return members.contains(username);
+}
+
+/**
+ * @brief Sends a message to every connection of every member of a chat
+ * @param manager The calling thread's database manager, used if the members are not cached
+ * @param chatID An integer representing the chat ID number
+ * @param payload The message bytes
+ * @param offline If not nullptr, receives the members who have no connection to deliver to
+ * @param alternate The message in another form, built once here rather than by every connection that needs it
+ * @return The number of queues the message was delivered to; full queues drop it
+ */
+int FanoutEngine::send(DbManager& manager, int chatID, const QByteArray& payload, QVector<QString>* offline, const QByteArray& alternate)
+{
+	QSharedPointer<const ChatRoute> chatRoute = route(manager, chatID);
+	if (offline)
+	{
+		*offline = chatRoute->offline;
+	}
+	int targetCount = chatRoute->targets.size();
+	messageCount.fetch_add(1, std::memory_order_relaxed);
+	if (targetCount == 0)
+	{
+		return 0;
+	}
+
+	FanoutMessage* message = new FanoutMessage(chatID, payload, alternate, targetCount + 1);
+	QVector<int> ready;
+	int delivered = 0;
+	for (int i = 0; i < targetCount; i++)
+	{
+		Connection* connection = chatRoute->targets[i].data();
+		if (connection->closed.load(std::memory_order_relaxed) || !connection->queue.tryPush(message))
+		{
+			message->release();
+			continue;
+		}
+		delivered++;
+
+		// Only the push that finds no wakeup pending sends one
+		if (!connection->wakePending.load(std::memory_order_relaxed) && !connection->wakePending.exchange(true, std::memory_order_acq_rel))
+		{
+			ready.append(connection->id);
+		}
+	}
+	message->release();
+
+	deliveryCount.fetch_add(delivered, std::memory_order_relaxed);
+	droppedCount.fetch_add(targetCount - delivered, std::memory_order_relaxed);
+	if (!ready.isEmpty())
+	{
+		wakeupCount.fetch_add(ready.size(), std::memory_order_relaxed);
+		if (wakeHandler)
+		{
+			wakeHandler(ready);
+		}
+	}
+	return delivered;
+}
+
+/**
+ * @brief Takes the queued messages of a connection
+ * Only one thread may drain a given connection at a time. The caller owns one reference to each
+ * message it receives and must release() it once written. If maxMessages were returned there may
+ * be more waiting, and the connection will not be woken again for them.
+ * @param connectionID The connection ID
+ * @param messages Receives the messages in the order they were queued
+ * @param maxMessages The most messages to take, or 0 for all of them
+ * @return The number of messages taken
+ */
+int FanoutEngine::drain(int connectionID, QVector<FanoutMessage*>& messages, int maxMessages)
+{
+	QSharedPointer<Connection> connection;
+	{
+		QReadLocker locker(&connectionLock);
+		connection = connections.value(connectionID);
+	}
+	if (!connection)
+	{
+		return 0;
+	}
+
+	// Cleared before popping, so a message pushed after the last pop always sends a new wakeup
+	connection->wakePending.store(false, std::memory_order_release);
+	int count = 0;
+	FanoutMessage* message;
+	while ((maxMessages <= 0 || count < maxMessages) && connection->queue.tryPop(message))
+	{
+		messages.append(message);
+		count++;
+	}
+	return count;
+}
+
+/**
+ * @brief Gets the engine's counters
+ * @return Messages sent, queue deliveries, deliveries dropped on full queues and wakeups sent
+ */
+FanoutStats FanoutEngine::stats() const
+{
+	FanoutStats result;
+	result.messages = messageCount.load(std::memory_order_relaxed);
+	result.deliveries = deliveryCount.load(std::memory_order_relaxed);
+	result.dropped = droppedCount.load(std::memory_order_relaxed);
+	result.wakeups = wakeupCount.load(std::memory_order_relaxed);
+	return result;
+}
+
+/**
+ * @brief Gets the registry of users with connections to the engine
+ * Connections are registered under their fan-out connection IDs
+ * @return The presence registry
+ */
+const PresenceRegistry& FanoutEngine::presence() const
+{
+	return users;
+}
+
+/**
+ * @brief Gets the connections a chat's messages go to, rebuilding them if a member's connections have changed
+ * The route is built and cached under connectionLock, so a connection added or removed meanwhile
+ * finds it cached and drops it
+ * @param manager The calling thread's database manager, used if the members are not cached
+ * @param chatID An integer representing the chat ID number
+ * @return The route, which has no targets if the chat does not exist
+ */
+QSharedPointer<const FanoutEngine::ChatRoute> FanoutEngine::route(DbManager& manager, int chatID)
+{
+	QVector<QString> members;
+	bool haveMembers = false;
+	quint64 epoch = 0;
+	{
+		QReadLocker locker(&routeLock);
+		QSharedPointer<const ChatRoute> cached = routes.value(chatID);
+		if (cached)
+		{
+			return cached;
+		}
+		QHash<int, QVector<QString> >::const_iterator found = chatMembers.constFind(chatID);
+		if (found != chatMembers.constEnd())
+		{
+			members = found.value();
+			haveMembers = true;
+		}
+		epoch = chatEpochs.value(chatID);
+	}
+
+	if (!haveMembers)
+	{
+		members = manager.getChatUsers(chatID);
+	}
+
+	QSharedPointer<ChatRoute> rebuilt(new ChatRoute());
+	QReadLocker connectionLocker(&connectionLock);
+	for (int i = 0; i < members.size(); i++)
+	{
+		QVector<int> ids = users.connections(members[i]);
+		if (ids.isEmpty())
+		{
+			rebuilt->offline.append(members[i]);
+		}
+		for (int j = 0; j < ids.size(); j++)
+		{
+			rebuilt->targets.append(connections.value(ids[j]));
+		}
+	}
+
+	// An invalidateChat since the members were read means they may be stale; use them once only
+	QWriteLocker locker(&routeLock);
+	if (chatEpochs.value(chatID) == epoch)
+	{
+		if (!haveMembers)
+		{
+			chatMembers.insert(chatID, members);
+			for (int i = 0; i < members.size(); i++)
+			{
+				memberChats[members[i]].insert(chatID);
+			}
+		}
+		routes.insert(chatID, rebuilt);
+	}
+	return rebuilt;
+}
+
+/**
+ * @brief Forgets the cached routes of every chat a user is a member of, after the user's connections changed
+ * Called with connectionLock held for writing
+ * @param username The user
+ * @return void
+ */
+void FanoutEngine::dropRoutes(const QString& username)
+{
+	QWriteLocker locker(&routeLock);
+	QHash<QString, QSet<int> >::const_iterator chats = memberChats.constFind(username);
+	if (chats == memberChats.constEnd())
+	{
+		return;
+	}
+	for (int chatID : chats.value())
+	{
+		routes.remove(chatID);
+	}
+	return;
+}
@@ -0,0 +1,108 @@
+/**
+ * @file fanout.h
+ * @brief This contains the prototypes for the chat message fan-out engine
+ *
+ * Sending a message to a chat creates one reference-counted FanoutMessage and pushes a pointer
+ * to it into the outbound queue of every connection of every member, so the payload is never
+ * copied per recipient. Each connection's queue is a lock-free MpscRing that any number of
+ * sending threads can push into while the connection's writer drains it.
+ *
+ * A connection is woken at most once until it next drains its queue, and all of the wakeups
+ * caused by one send are handed to the wake handler together, so a large group send costs one
+ * handler call rather than one per member.
+ *
+ * Chat members are read once through the calling thread's DbManager and cached with the resolved
+ * connections; call invalidateChat() after a chat's membership changes. A user's connections
+ * coming and going rebuild the routes of that user's chats only. The engine holds no
+ * database connection of its own, since a QSqlDatabase may only be used by the thread that opened it. Members are resolved to connections
+ * through the engine's PresenceRegistry, so offline members cost one lookup and no storage access.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <presence.h>
+#include <atomic>
+#include <functional>
+
+class DbManager;
+
+// One message shared by every queue it was delivered to; freed when the last queue releases it
+class FanoutMessage
+{
+	public:
+		FanoutMessage(int chatID, const QByteArray& payload, const QByteArray& alternate, int references);
+		void retain(int count = 1);
+		void release();
+		int chatID() const;
+		const QByteArray& payload() const;
+		const QByteArray& alternate() const;
+	private:
+		~FanoutMessage() = default;
+		Q_DISABLE_COPY(FanoutMessage)
+		std::atomic<int> references;
+		int chat;
+		QByteArray data;
+		QByteArray alternateData;
+};
+
+// Called on the sending thread with the connections that became ready; must be thread-safe
+typedef std::function<void(const QVector<int>& connectionIDs)> FanoutWakeHandler;
+
+struct FanoutStats
+{
+	qint64 messages;
+	qint64 deliveries;
+	qint64 dropped;
+	qint64 wakeups;
+};
+
+class FanoutEngine
+{
+	public:
+		explicit FanoutEngine(int queueCapacity = 256);
+		~FanoutEngine();
+		void setWakeHandler(const FanoutWakeHandler& handler);
+		int addConnection(const QString& username);
+		void removeConnection(int connectionID);
+		void invalidateChat(int chatID);
+		bool isMember(DbManager& manager, int chatID, const QString& username);
+		int send(DbManager& manager, int chatID, const QByteArray& payload, QVector<QString>* offline = nullptr,
+			const QByteArray& alternate = QByteArray());
+		int drain(int connectionID, QVector<FanoutMessage*>& messages, int maxMessages = 0);
+		FanoutStats stats() const;
+		const PresenceRegistry& presence() const;
+	private:
+		Q_DISABLE_COPY(FanoutEngine)
+		struct Connection;
+		struct ChatRoute;
+		QSharedPointer<const ChatRoute> route(DbManager& manager, int chatID);
+		void dropRoutes(const QString& username);
+		int queueCapacity;
+		QReadWriteLock connectionLock;
+		QHash<int, QSharedPointer<Connection> > connections;
+		PresenceRegistry users;	// username -> the user's connection ids
+		int nextConnectionID;
+		QReadWriteLock routeLock;
+		QHash<int, QSharedPointer<const ChatRoute> > routes;
+		QHash<int, QVector<QString> > chatMembers;
+		QHash<QString, QSet<int> > memberChats;	// username -> the chats whose members are cached with them
+		QHash<int, quint64> chatEpochs;	// bumped by invalidateChat, so members read before it are not cached
+		FanoutWakeHandler wakeHandler;
+		std::atomic<qint64> messageCount;
+		std::atomic<qint64> deliveryCount;
+		std::atomic<qint64> droppedCount;
+		std::atomic<qint64> wakeupCount;
+};
+
+#endif	// FANOUT_H
@@ -0,0 +1,605 @@
+/**
+ * @file fileio.cpp
+ * @brief Runs batches of file reads, writes and syncs through io_uring or a thread pool
+ *
+ * The io_uring backend maps the submission and completion rings itself and talks to the kernel
+ * with io_uring_setup, io_uring_enter and io_uring_register. Each round fills the submission
+ * ring with as many requests as fit, then one io_uring_enter submits them and waits for at least
+ * one completion. Requests that transferred fewer bytes than asked are queued again for the rest.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <fileio.h>
+#include <dblog.h>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+/**
+ * @brief Works out how far a request has to go after part of it completed
+ * @param request The request
+ * @param done The bytes transferred so far
+ * @param result The result of the latest attempt
+ * @return boolean indicating whether the request is finished, successfully or not
+ */
+static bool finishAttempt(IoRequest& request, int& done, int result)
+{
+	if (result < 0)
+	{
+		request.result = result;
+		return true;
+	}
+	if (request.op == IoOp::Sync)
+	{
+		request.result = 0;
+		return true;
+	}
+	done += result;
+	if (result == 0 || done >= request.length)
+	{
+		// A read of nothing is the end of the file; a write of nothing is an error
+		request.result = (result == 0 && request.op == IoOp::Write && done < request.length) ? -EIO : done;
+		return true;
+	}
+	return false;
+}
+
+// Batches run on io_uring
+class UringFileIo : public FileIo
+{
+	public:
+		static UringFileIo* open(int bufferCount, int bufferSize);
+		~UringFileIo() override;
+		const char* name() const override;
+		bool run(IoRequest* requests, int count) override;
+	private:
+		UringFileIo(int bufferCount, int bufferSize);
+		bool runPhase(IoRequest* requests, int count, bool syncs);
+		int ringFd;
+		unsigned sqEntries;
+		unsigned cqEntries;
+		void* sqRing;
+		size_t sqRingSize;
+		void* cqRing;
+		size_t cqRingSize;
+		io_uring_sqe* sqes;
+		size_t sqesSize;
+		unsigned* sqHead;
+		unsigned* sqTail;
+		unsigned sqMask;
+		unsigned* sqArray;
+		unsigned* cqHead;
+		unsigned* cqTail;
+		unsigned cqMask;
+		io_uring_cqe* cqes;
+		bool fixedBuffers;
+		QMutex mutex;
+		std::vector<int> progress;
+		std::vector<int> retry;
+};
+
+// Batches run with pread/pwrite on a pool of threads
+class ThreadPoolFileIo : public FileIo
+{
+	public:
+		ThreadPoolFileIo(int bufferCount, int bufferSize, int threads);
+		~ThreadPoolFileIo() override;
+		const char* name() const override;
+		bool run(IoRequest* requests, int count) override;
+	private:
+		void workerLoop();
+		QMutex batchMutex;
+		QMutex queueMutex;
+		QWaitCondition workAvailable;
+		QWaitCondition batchFinished;
+		QQueue<IoRequest*> queue;
+		int outstanding;
+		bool stopping;
+		std::vector<std::thread> workers;
+};
+
+/**
+ * @brief Creates a file I/O backend
+ * @param bufferCount The number of buffers to allocate, and register with io_uring
+ * @param bufferSize The size of each buffer in bytes
+ * @param backend The backend to use; Automatic prefers io_uring
+ * @return The backend, owned by the caller
+ */
+FileIo* FileIo::create(int bufferCount, int bufferSize, FileIoBackend backend)
+{
+	if (backend != FileIoBackend::ThreadPool)
+	{
+		UringFileIo* uring = UringFileIo::open(bufferCount, bufferSize);
+		if (uring)
+		{
+			return uring;
+		}
+		DBLOG_INFO("FileIo", DbErrorIo, 0, "io_uring is not available, using the thread pool", QString());
+	}
+	return new ThreadPoolFileIo(bufferCount, bufferSize, defaultThreads);
+}
+
+/**
+ * @brief Constructor for the buffers every backend owns
+ * @param bufferCount The number of buffers
+ * @param bufferSize The size of each buffer in bytes
+ */
+FileIo::FileIo(int bufferCount, int bufferSize)
+	: bytesPerBuffer(bufferSize)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	size_t alignedSize = (size_t(qMax(bufferSize, 1)) + pageSize - 1) / pageSize * pageSize;
+	for (int i = 0; i < bufferCount; i++)
+	{
+		buffers.push_back(static_cast<char*>(aligned_alloc(pageSize, alignedSize)));
+	}
+}
+
+/**
+ * @brief Destructor for a backend, which frees its buffers
+ */
+FileIo::~FileIo()
+{
+	for (size_t i = 0; i < buffers.size(); i++)
+	{
+		free(buffers[i]);
+	}
+}
+
+/**
+ * @brief Gets one of the backend's buffers
+ * @param index The buffer's index
+ * @return The buffer
+ */
+char* FileIo::buffer(int index) const
+{
+	return buffers[index];
+}
+
+/**
+ * @brief Gets the number of buffers the backend owns
+ * @return The number of buffers
+ */
+int FileIo::bufferCount() const
+{
+	return int(buffers.size());
+}
+
+/**
+ * @brief Gets the size of the backend's buffers
+ * @return The size in bytes
+ */
+int FileIo::bufferSize() const
+{
+	return bytesPerBuffer;
+}
+
+/**
+ * @brief Builds a read request
+ * @param fd The file descriptor
+ * @param offset The file offset to read from
+ * @param data Where to read to
+ * @param length The number of bytes to read
+ * @param buffer The index of the backend buffer data points into, or -1
+ * @return The request
+ */
+IoRequest FileIo::read(int fd, qint64 offset, char* data, int length, int buffer)
+{
+	IoRequest request = { IoOp::Read, fd, offset, data, length, buffer, notRun };
+	return request;
+}
+
+/**
+ * @brief Builds a write request
+ * @param fd The file descriptor
+ * @param offset The file offset to write at
+ * @param data The bytes to write
+ * @param length The number of bytes to write
+ * @param buffer The index of the backend buffer data points into, or -1
+ * @return The request
+ */
+IoRequest FileIo::write(int fd, qint64 offset, const char* data, int length, int buffer)
+{
+	IoRequest request = { IoOp::Write, fd, offset, const_cast<char*>(data), length, buffer, notRun };
+	return request;
+}
+
+/**
+ * @brief Builds a request that syncs a file's data after the batch's reads and writes
+ * @param fd The file descriptor
+ * @return The request
+ */
+IoRequest FileIo::sync(int fd)
+{
+	IoRequest request = { IoOp::Sync, fd, 0, nullptr, 0, -1, notRun };
+	return request;
+}
+
+/**
+ * @brief Sets up an io_uring instance with its rings mapped and its buffers registered
+ * @param bufferCount The number of buffers
+ * @param bufferSize The size of each buffer in bytes
+ * @return The backend, or nullptr if io_uring is unavailable
+ */
+UringFileIo* UringFileIo::open(int bufferCount, int bufferSize)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = int(syscall(__NR_io_uring_setup, defaultQueueDepth, &params));
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+
+	// IORING_OP_READ and IORING_OP_WRITE arrived with IORING_FEAT_RW_CUR_POS in 5.6
+	if (!(params.features & IORING_FEAT_RW_CUR_POS))
+	{
+		::close(fd);
+		return nullptr;
+	}
+
+	UringFileIo* io = new UringFileIo(bufferCount, bufferSize);
+	io->ringFd = fd;
+	io->sqEntries = params.sq_entries;
+	io->cqEntries = params.cq_entries;
+	io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMap)
+	{
+		io->sqRingSize = io->cqRingSize = qMax(io->sqRingSize, io->cqRingSize);
+	}
+
+	io->sqRing = mmap(nullptr, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	io->cqRing = singleMap ? io->sqRing
+		: mmap(nullptr, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	io->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (io->sqRing == MAP_FAILED || io->cqRing == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		DBLOG_WARNING("FileIo", DbErrorIo, 0, "io_uring rings could not be mapped", QString::number(errno));
+		io->sqRing = io->sqRing == MAP_FAILED ? nullptr : io->sqRing;
+		io->cqRing = io->cqRing == MAP_FAILED ? nullptr : io->cqRing;
+		io->sqes = sqes == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqes);
+		delete io;
+		return nullptr;
+	}
+	io->sqes = static_cast<io_uring_sqe*>(sqes);
+
+	char* sq = static_cast<char*>(io->sqRing);
+	char* cq = static_cast<char*>(io->cqRing);
+	io->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	io->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	io->sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	io->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	io->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	io->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	io->cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	io->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	// Registration pins the buffers, which RLIMIT_MEMLOCK can refuse; plain reads and writes still work
+	if (bufferCount > 0)
+	{
+		std::vector<iovec> vectors(bufferCount);
+		for (int i = 0; i < bufferCount; i++)
+		{
+			vectors[i].iov_base = io->buffers[i];
+			vectors[i].iov_len = size_t(bufferSize);
+		}
+		io->fixedBuffers = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, vectors.data(), unsigned(bufferCount)) == 0;
+		if (!io->fixedBuffers)
+		{
+			DBLOG_WARNING("FileIo", DbErrorIo, 0, "io_uring buffers could not be registered", QString::number(errno));
+		}
+	}
+	return io;
+}
+
+/**
+ * @brief Constructor for the io_uring backend; open() does the setup
+ * @param bufferCount The number of buffers
+ * @param bufferSize The size of each buffer in bytes
+ */
+UringFileIo::UringFileIo(int bufferCount, int bufferSize)
+	: FileIo(bufferCount, bufferSize), ringFd(-1), sqRing(nullptr), cqRing(nullptr), sqes(nullptr), fixedBuffers(false)
+{
+}
+
+/**
+ * @brief Destructor for the io_uring backend, which unmaps the rings and closes the instance
+ */
+UringFileIo::~UringFileIo()
+{
+	if (sqes)
+	{
+		munmap(sqes, sqesSize);
+	}
+	if (cqRing && cqRing != sqRing)
+	{
+		munmap(cqRing, cqRingSize);
+	}
+	if (sqRing)
+	{
+		munmap(sqRing, sqRingSize);
+	}
+	if (ringFd >= 0)
+	{
+		::close(ringFd);
+	}
+}
+
+/**
+ * @brief Gets the backend's name
+ * @return "io_uring"
+ */
+const char* UringFileIo::name() const
+{
+	return "io_uring";
+}
+
+/**
+ * @brief Runs a batch: its reads and writes first, then its syncs
+ * @param requests The requests, whose results are filled in
+ * @param count The number of requests
+ * @return boolean indicating whether every request succeeded
+ */
+bool UringFileIo::run(IoRequest* requests, int count)
+{
+	QMutexLocker locker(&mutex);
+	for (int i = 0; i < count; i++)
+	{
+		requests[i].result = notRun;
+	}
+	bool ok = runPhase(requests, count, false);
+	return runPhase(requests, count, true) && ok;
+}
+
+/**
+ * @brief Runs either the syncs of a batch or everything else, keeping the rings as full as possible
+ * @param requests The requests
+ * @param count The number of requests
+ * @param syncs Whether to run the syncs rather than the reads and writes
+ * @return boolean indicating whether every request run succeeded
+ */
+bool UringFileIo::runPhase(IoRequest* requests, int count, bool syncs)
+{
+	progress.assign(count, 0);
+	retry.clear();
+	int next = 0;
+	unsigned inFlight = 0;
+	bool ok = true;
+	while (true)
+	{
+		// Fill the submission ring, requests that need another attempt first. Entries published
+		// earlier but not yet consumed, as when io_uring_enter was interrupted, stay in the ring
+		// and are submitted along with the new ones
+		unsigned tail = *sqTail;
+		unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		while (tail - head < sqEntries && inFlight + (tail - head) < cqEntries)
+		{
+			int index;
+			if (!retry.empty())
+			{
+				index = retry.back();
+				retry.pop_back();
+			}
+			else
+			{
+				while (next < count && (requests[next].op == IoOp::Sync) != syncs)
+				{
+					next++;
+				}
+				if (next >= count)
+				{
+					break;
+				}
+				index = next++;
+			}
+
+			IoRequest& request = requests[index];
+			int done = progress[index];
+			io_uring_sqe* sqe = &sqes[tail & sqMask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->fd = request.fd;
+			sqe->user_data = quint64(index);
+			if (request.op == IoOp::Sync)
+			{
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			}
+			else
+			{
+				bool fixed = fixedBuffers && request.buffer >= 0;
+				sqe->opcode = request.op == IoOp::Read ? (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ)
+					: (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE);
+				sqe->off = quint64(request.offset + done);
+				sqe->addr = quint64(reinterpret_cast<quintptr>(request.data + done));
+				sqe->len = unsigned(request.length - done);
+				sqe->buf_index = fixed ? quint16(request.buffer) : 0;
+			}
+			sqArray[tail & sqMask] = tail & sqMask;
+			tail++;
+		}
+		__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+		unsigned unsubmitted = tail - head;
+		if (unsubmitted == 0 && inFlight == 0)
+		{
+			break;
+		}
+
+		int entered = int(syscall(__NR_io_uring_enter, ringFd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (entered < 0 && errno != EINTR)
+		{
+			// The ring is unusable; report every unfinished request as failed
+			int error = errno;
+			DBLOG_ERROR("FileIo", DbErrorIo, 0, "io_uring_enter failed", QString::number(error));
+			for (int i = 0; i < count; i++)
+			{
+				if ((requests[i].op == IoOp::Sync) == syncs && i >= next)
+				{
+					requests[i].result = -error;
+				}
+			}
+			return false;
+		}
+		inFlight += entered > 0 ? unsigned(entered) : 0;
+
+		unsigned cqHeadValue = *cqHead;
+		unsigned cqTailValue = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		while (cqHeadValue != cqTailValue)
+		{
+			io_uring_cqe* cqe = &cqes[cqHeadValue & cqMask];
+			int index = int(cqe->user_data);
+			if (finishAttempt(requests[index], progress[index], cqe->res))
+			{
+				ok = ok && requests[index].result >= 0;
+			}
+			else
+			{
+				retry.push_back(index);
+			}
+			cqHeadValue++;
+			inFlight--;
+		}
+		__atomic_store_n(cqHead, cqHeadValue, __ATOMIC_RELEASE);
+	}
+	return ok;
+}
+
+/**
+ * @brief Constructor for the thread-pool backend, which starts its threads
+ * @param bufferCount The number of buffers
+ * @param bufferSize The size of each buffer in bytes
+ * @param threads The number of I/O threads
+ */
+ThreadPoolFileIo::ThreadPoolFileIo(int bufferCount, int bufferSize, int threads)
+	: FileIo(bufferCount, bufferSize), outstanding(0), stopping(false)
+{
+	for (int i = 0; i < qMax(threads, 1); i++)
+	{
+		workers.emplace_back(&ThreadPoolFileIo::workerLoop, this);
+	}
+}
+
+/**
+ * @brief Destructor for the thread-pool backend, which stops its threads
+ */
+ThreadPoolFileIo::~ThreadPoolFileIo()
+{
+	{
+		QMutexLocker locker(&queueMutex);
+		stopping = true;
+		workAvailable.wakeAll();
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+}
+
+/**
+ * @brief Gets the backend's name
+ * @return "thread pool"
+ */
+const char* ThreadPoolFileIo::name() const
+{
+	return "thread pool";
+}
+
+/**
+ * @brief Runs a batch on the pool: its reads and writes first, then its syncs
+ * @param requests The requests, whose results are filled in
+ * @param count The number of requests
+ * @return boolean indicating whether every request succeeded
+ */
+bool ThreadPoolFileIo::run(IoRequest* requests, int count)
+{
+	QMutexLocker batch(&batchMutex);
+	for (int phase = 0; phase < 2; phase++)
+	{
+		QMutexLocker locker(&queueMutex);
+		for (int i = 0; i < count; i++)
+		{
+			if ((requests[i].op == IoOp::Sync) == (phase == 1))
+			{
+				queue.enqueue(&requests[i]);
+				outstanding++;
+			}
+		}
+		workAvailable.wakeAll();
+		while (outstanding > 0)
+		{
+			batchFinished.wait(&queueMutex);
+		}
+	}
+
+	bool ok = true;
+	for (int i = 0; i < count; i++)
+	{
+		ok = ok && requests[i].result >= 0;
+	}
+	return ok;
+}
+
+/**
+ * @brief The body of an I/O thread: runs queued requests with blocking calls
+ * @return void
+ */
+void ThreadPoolFileIo::workerLoop()
+{
+	QMutexLocker locker(&queueMutex);
+	while (!stopping)
+	{
+		if (queue.isEmpty())
+		{
+			workAvailable.wait(&queueMutex);
+			continue;
+		}
+		IoRequest* request = queue.dequeue();
+		locker.unlock();
+
+		int done = 0;
+		bool finished = false;
+		while (!finished)
+		{
+			ssize_t result;
+			if (request->op == IoOp::Sync)
+			{
+				result = fdatasync(request->fd);
+			}
+			else if (request->op == IoOp::Read)
+			{
+				result = pread(request->fd, request->data + done, size_t(request->length - done), request->offset + done);
+			}
+			else
+			{
+				result = pwrite(request->fd, request->data + done, size_t(request->length - done), request->offset + done);
+			}
+			if (result < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			finished = finishAttempt(*request, done, result < 0 ? -errno : int(result));
+		}
+
+		locker.relock();
+		if (--outstanding == 0)
+		{
+			batchFinished.wakeAll();
+		}
+	}
+	return;
+}
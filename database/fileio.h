@@ -0,0 +1,84 @@
+/**
+ * @file fileio.h
+ * @brief This contains the prototypes for the batched file I/O backends
+ *
+ * File storage kept next to DB.sqlite, such as the attachment store's chunk files, does its reads,
+ * writes and syncs through a FileIo. Requests are handed over in batches: the io_uring backend
+ * queues a whole batch in its submission ring and enters the kernel once to submit it and reap
+ * completions, instead of making one blocking system call per request. Where io_uring is not
+ * available (kernels before 5.6, or seccomp policies that block it) a thread-pool backend runs
+ * the requests with pread/pwrite on a few threads, so a batch still overlaps its I/O.
+ *
+ * Each FileIo owns a set of page-aligned buffers. The io_uring backend registers them with the
+ * kernel, so requests into them (buffer >= 0) skip pinning and unpinning pages on every I/O.
+ *
+ * In a batch, syncs run only after every read and write of the batch has completed, so a batch
+ * can write files and sync them. A FileIo can be shared between threads, but batches from
+ * different threads then run one at a time; give busy threads their own.
+ *
+ * The io_uring backend uses the raw system calls rather than liburing, so it has no dependencies.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <QtGlobal>
+#include <vector>
+#include <cerrno>
+
+enum class IoOp : quint8
+{
+	Read,
+	Write,
+	Sync	// fdatasync
+};
+
+enum class FileIoBackend : quint8
+{
+	Automatic,	// io_uring if the kernel allows it, the thread pool otherwise
+	Uring,
+	ThreadPool
+};
+
+// One request in a batch; result is filled in when the batch completes
+struct IoRequest
+{
+	IoOp op;
+	int fd;
+	qint64 offset;
+	char* data;
+	int length;
+	int buffer;		// index of the FileIo buffer data points into, or -1
+	int result;		// bytes transferred (short only for reads at end of file), -errno, or FileIo::notRun
+};
+
+class FileIo
+{
+	public:
+		static const int defaultQueueDepth = 64;
+		static const int defaultThreads = 4;
+		// The result of a request that has not run, as when its batch failed before reaching it
+		static const int notRun = -ECANCELED;
+
+		static FileIo* create(int bufferCount = 0, int bufferSize = 0, FileIoBackend backend = FileIoBackend::Automatic);
+		virtual ~FileIo();
+		virtual const char* name() const = 0;
+		virtual bool run(IoRequest* requests, int count) = 0;
+		char* buffer(int index) const;
+		int bufferCount() const;
+		int bufferSize() const;
+		static IoRequest read(int fd, qint64 offset, char* data, int length, int buffer = -1);
+		static IoRequest write(int fd, qint64 offset, const char* data, int length, int buffer = -1);
+		static IoRequest sync(int fd);
+	protected:
+		FileIo(int bufferCount, int bufferSize);
+		std::vector<char*> buffers;
+		int bytesPerBuffer;
+	private:
+		Q_DISABLE_COPY(FileIo)
+};
+
+#endif	// FILEIO_H
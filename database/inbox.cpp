@@ -0,0 +1,265 @@
+/**
+ * @file inbox.cpp
+ * @brief Stores messages for offline chat members and hands them over at their next login
+ *
+ * Sequence numbers are allocated per inbox inside the INSERT itself, from the largest one
+ * already in the recipient's range, so several connections can store into the same inbox.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <inbox.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <QDateTime>
+
+/**
+ * @brief Constructor for an inbox store
+ * @param manager The database manager whose connection is used
+ * @param capacity The most messages one inbox holds
+ * @param lifetimeSeconds How long a message waits before it is discarded
+ */
+InboxStore::InboxStore(DbManager& manager, int capacity, int lifetimeSeconds)
+	: manager(manager), capacity(capacity), lifetime(lifetimeSeconds)
+{
+}
+
+/**
+ * @brief Creates the inbox table if it does not exist
+ * @return boolean indicating whether the table is ready
+ */
+bool InboxStore::createTables()
+{
+	QSqlQuery query(manager.database());
+	bool ok = query.exec("CREATE TABLE IF NOT EXISTS inbox(username TEXT NOT NULL, seq INTEGER NOT NULL, chatid INTEGER NOT NULL, "
+		"sender TEXT NOT NULL, queued INTEGER NOT NULL, payload BLOB NOT NULL, PRIMARY KEY (username, seq)) WITHOUT ROWID;");
+	if (!ok)
+	{
+		DBLOG_ERROR("createTables", DbErrorQuery, 0, "inbox table could not be created", query.lastError().text());
+	}
+	return ok;
+}
+
+/**
+ * @brief Queues a chat message in the inboxes of members who are offline
+ * Inboxes that go over capacity lose their oldest messages. The rows are written under a savepoint,
+ * so inside a caller's transaction they are kept or lost with it and nothing is committed here.
+ * @param chatID An integer representing the chat ID number
+ * @param sender The username of the member who sent the message
+ * @param payload The message bytes
+ * @param recipients The members to queue the message for
+ * @return The number of inboxes the message was queued in, or -1 on error
+ */
+int InboxStore::store(int chatID, const QString& sender, const QByteArray& payload, const QVector<QString>& recipients)
+{
+	if (recipients.isEmpty())
+	{
+		return 0;
+	}
+
+	QSqlDatabase db = manager.database();
+	QSqlQuery savepoint(db);
+	bool owned = savepoint.exec("BEGIN");
+	if (!savepoint.exec("SAVEPOINT inboxstore"))
+	{
+		DBLOG_ERROR("store", DbErrorQuery, chatID, "inbox write could not be started", savepoint.lastError().text());
+		if (owned)
+		{
+			savepoint.exec("ROLLBACK");
+		}
+		return -1;
+	}
+	QSqlQuery insert(db);
+	insert.prepare("INSERT INTO inbox (username, seq, chatid, sender, queued, payload) "
+		"SELECT :username, COALESCE(MAX(seq), 0) + 1, :chatID, :sender, :queued, :payload FROM inbox WHERE username = :recipient");
+	QSqlQuery trim(db);
+	trim.prepare("DELETE FROM inbox WHERE username = :username AND seq <= "
+		"(SELECT seq FROM inbox WHERE username = :recipient ORDER BY seq DESC LIMIT 1 OFFSET :capacity)");
+
+	qint64 now = QDateTime::currentSecsSinceEpoch();
+	bool ok = true;
+	for (int i = 0; ok && i < recipients.size(); i++)
+	{
+		insert.bindValue(":username", recipients[i]);
+		insert.bindValue(":chatID", chatID);
+		insert.bindValue(":sender", sender);
+		insert.bindValue(":queued", now);
+		insert.bindValue(":payload", payload);
+		insert.bindValue(":recipient", recipients[i]);
+		ok = insert.exec();
+		if (!ok)
+		{
+			DBLOG_ERROR("store", DbErrorQuery, chatID, "message could not be queued", insert.lastError().text());
+			break;
+		}
+
+		trim.bindValue(":username", recipients[i]);
+		trim.bindValue(":recipient", recipients[i]);
+		trim.bindValue(":capacity", capacity);
+		ok = trim.exec();
+		if (!ok)
+		{
+			DBLOG_ERROR("store", DbErrorQuery, chatID, "inbox could not be trimmed", trim.lastError().text());
+		}
+	}
+
+	insert.finish();
+	trim.finish();
+
+	// RELEASE is always attempted, so a failed ROLLBACK TO does not leave the savepoint open
+	bool rolledBack = ok || savepoint.exec("ROLLBACK TO inboxstore");
+	bool released = savepoint.exec("RELEASE inboxstore");
+	bool committed = released && (!owned || savepoint.exec("COMMIT"));
+	if (!rolledBack || !committed)
+	{
+		DBLOG_ERROR("store", DbErrorQuery, chatID, "inbox write could not be finished", savepoint.lastError().text());
+		if (owned)
+		{
+			savepoint.exec("ROLLBACK");
+		}
+		return -1;
+	}
+	return ok ? recipients.size() : -1;
+}
+
+/**
+ * @brief Takes the messages waiting in a user's inbox, oldest first
+ * Expired messages in the range read are deleted without being returned. The transaction takes
+ * the write lock before reading, so a concurrent store cannot make the delete fail with
+ * SQLITE_BUSY after the messages have been read.
+ * @param username The username
+ * @param maxMessages The most messages to take, or 0 for all of them
+ * @return The messages, which are no longer in the inbox
+ */
+QVector<InboxMessage> InboxStore::drain(const QString& username, int maxMessages)
+{
+	QSqlDatabase db = manager.database();
+	if (!manager.beginImmediate())
+	{
+		return QVector<InboxMessage>();
+	}
+
+	qint64 lastSeq = 0;
+	QVector<InboxMessage> messages = peek(username, maxMessages, &lastSeq);
+	if (lastSeq > 0 && !remove(username, lastSeq))
+	{
+		db.rollback();
+		return QVector<InboxMessage>();
+	}
+	if (!db.commit())
+	{
+		DBLOG_ERROR("drain", DbErrorQuery, 0, "drained messages could not be deleted", db.lastError().text());
+		db.rollback();
+		return QVector<InboxMessage>();
+	}
+	return messages;
+}
+
+/**
+ * @brief Reads the messages waiting in a user's inbox, oldest first, without removing them
+ * Expired messages are skipped but still count towards lastSeq, so remove() clears them too
+ * @param username The username
+ * @param maxMessages The most messages to read, or 0 for all of them
+ * @param lastSeq If not nullptr, receives the sequence number of the last message read, or 0 if none were
+ * @return The messages that have not expired
+ */
+QVector<InboxMessage> InboxStore::peek(const QString& username, int maxMessages, qint64* lastSeq)
+{
+	QVector<InboxMessage> messages;
+	if (lastSeq)
+	{
+		*lastSeq = 0;
+	}
+
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT seq, chatid, sender, queued, payload FROM inbox WHERE username = :username ORDER BY seq LIMIT :limit");
+	query.bindValue(":username", username);
+	query.bindValue(":limit", maxMessages > 0 ? maxMessages : -1);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("peek", DbErrorQuery, 0, "inbox could not be read", query.lastError().text());
+		return messages;
+	}
+
+	qint64 cutoff = QDateTime::currentSecsSinceEpoch() - lifetime;
+	qint64 seq = 0;
+	while (query.next())
+	{
+		seq = query.value(0).toLongLong();
+		if (query.value(3).toLongLong() < cutoff)
+		{
+			continue;
+		}
+		InboxMessage message;
+		message.seq = seq;
+		message.chatID = query.value(1).toInt();
+		message.sender = query.value(2).toString();
+		message.queued = query.value(3).toLongLong();
+		message.payload = query.value(4).toByteArray();
+		messages.append(message);
+	}
+	if (lastSeq)
+	{
+		*lastSeq = seq;
+	}
+	return messages;
+}
+
+/**
+ * @brief Deletes the messages at the front of a user's inbox
+ * @param username The username
+ * @param throughSeq The sequence number of the last message to delete, as returned by peek()
+ * @return boolean indicating whether the messages were deleted
+ */
+bool InboxStore::remove(const QString& username, qint64 throughSeq)
+{
+	QSqlQuery query(manager.database());
+	query.prepare("DELETE FROM inbox WHERE username = :username AND seq <= :lastSeq");
+	query.bindValue(":username", username);
+	query.bindValue(":lastSeq", throughSeq);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("remove", DbErrorQuery, 0, "delivered messages could not be deleted", query.lastError().text());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Counts the messages waiting in a user's inbox, including expired ones not yet removed
+ * @param username The username
+ * @return The number of messages, or -1 on error
+ */
+int InboxStore::pending(const QString& username)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT COUNT(*) FROM inbox WHERE username = :username");
+	query.bindValue(":username", username);
+	if (!query.exec() || !query.next())
+	{
+		DBLOG_ERROR("pending", DbErrorQuery, 0, "inbox could not be counted", query.lastError().text());
+		return -1;
+	}
+	return query.value(0).toInt();
+}
+
+/**
+ * @brief Deletes expired messages from every inbox
+ * Drains already skip expired messages; this reclaims the space of users who stay away
+ * @return The number of messages deleted, or -1 on error
+ */
+int InboxStore::purgeExpired()
+{
+	QSqlQuery query(manager.database());
+	query.prepare("DELETE FROM inbox WHERE queued < :cutoff");
+	query.bindValue(":cutoff", QDateTime::currentSecsSinceEpoch() - lifetime);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("purgeExpired", DbErrorQuery, 0, "expired messages could not be deleted", query.lastError().text());
+		return -1;
+	}
+	return query.numRowsAffected();
+}
@@ -0,0 +1,65 @@
+/**
+ * @file inbox.h
+ * @brief This contains the prototypes for the offline message inbox
+ *
+ * Messages sent to a chat while some of its members have no connection are kept in those
+ * members' inboxes until they next log in. The inbox table is clustered on (username, seq),
+ * so a user's waiting messages are one contiguous range: a drain is a single indexed range
+ * read followed by a single range delete, however many messages are waiting.
+ *
+ * drain() delivers at most once: the messages it returns are already gone from the inbox, so
+ * any that the caller then fails to deliver are lost. A caller that can tell when messages have
+ * reached the user reads them with peek() and deletes them with remove() afterwards instead,
+ * which delivers at least once.
+ *
+ * Each inbox holds at most capacity messages, the oldest being dropped to make room, and
+ * messages older than the lifetime are discarded instead of delivered.
+ *
+ * Table:
+ * inbox--one row per waiting message: recipient, sequence number within the recipient's
+ * inbox, chat ID, sender, the time it was queued and the message bytes.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef INBOX_H
+#define INBOX_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+
+class DbManager;
+
+// A message waiting for a user who was offline when it was sent
+struct InboxMessage
+{
+	qint64 seq;
+	int chatID;
+	QString sender;
+	qint64 queued;	// seconds since the Unix epoch
+	QByteArray payload;
+};
+
+class InboxStore
+{
+	public:
+		static const int defaultCapacity = 1000;
+		static const int defaultLifetime = 7 * 24 * 3600;
+
+		explicit InboxStore(DbManager& manager, int capacity = defaultCapacity, int lifetimeSeconds = defaultLifetime);
+		bool createTables();
+		int store(int chatID, const QString& sender, const QByteArray& payload, const QVector<QString>& recipients);
+		QVector<InboxMessage> drain(const QString& username, int maxMessages = 0);
+		QVector<InboxMessage> peek(const QString& username, int maxMessages = 0, qint64* lastSeq = nullptr);
+		bool remove(const QString& username, qint64 throughSeq);
+		int pending(const QString& username);
+		int purgeExpired();
+	private:
+		DbManager& manager;
+		int capacity;
+		int lifetime;
+};
+
+#endif	// INBOX_H
@@ -0,0 +1,234 @@
+/**
+ * @file loginthrottle.cpp
+ * @brief Throttles login and registration attempts with lock-free token buckets
+ *
+ * A slot holds a 24-bit tag from the key's hash and, below it, the 40-bit time in milliseconds
+ * at which the bucket will be full again. Taking a token moves that time one refill interval
+ * later, starting from now if it has already passed; the attempt is allowed if the time then
+ * ends up no more than a burst of intervals ahead of now.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <loginthrottle.h>
+#include <seededhash.h>
+#include <chrono>
+#include <random>
+
+static const int timeBits = 40;
+static const quint64 timeMask = (quint64(1) << timeBits) - 1;
+
+// One cache line of buckets
+struct alignas(64) LoginThrottle::Shard
+{
+	std::atomic<quint64> slots[shardSize];
+
+	Shard()
+	{
+		for (int i = 0; i < shardSize; i++)
+		{
+			slots[i].store(0, std::memory_order_relaxed);
+		}
+	}
+};
+
+// The buckets of one kind of key, all refilling at the same rate
+struct LoginThrottle::Table
+{
+	Shard* shards;
+	quint64 mask;
+	qint64 interval;	// milliseconds to refill one token
+	qint64 tolerance;	// how far ahead of now a bucket's full time may be after an attempt
+
+	Table(const ThrottlePolicy& policy, int shardCount)
+	{
+		int count = 1;
+		while (count < shardCount)
+		{
+			count <<= 1;
+		}
+		shards = new Shard[count];
+		mask = quint64(count - 1);
+		interval = policy.perMinute > 0 ? qMax<qint64>(60000 / policy.perMinute, 1) : 60000;
+		tolerance = interval * (policy.burst > 0 ? policy.burst : 1);
+	}
+
+	~Table()
+	{
+		delete[] shards;
+	}
+};
+
+/**
+ * @brief Gets the milliseconds of a monotonic clock
+ * @return The time in milliseconds
+ */
+static qint64 steadyMilliseconds()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Constructor for a throttle with full buckets
+ * @param userPolicy How many attempts each username is allowed
+ * @param sourcePolicy How many attempts each source address is allowed
+ * @param shards The number of shards in each table, rounded up to a power of two
+ */
+LoginThrottle::LoginThrottle(const ThrottlePolicy& userPolicy, const ThrottlePolicy& sourcePolicy, int shards)
+	: users(new Table(userPolicy, shards)), sources(new Table(sourcePolicy, shards)),
+	epoch(steadyMilliseconds()), allowed(0), userRejected(0), sourceRejected(0), evicted(0)
+{
+	std::random_device random;
+	seed = (quint64(random()) << 32) | random();
+}
+
+/**
+ * @brief Destructor for the throttle
+ */
+LoginThrottle::~LoginThrottle()
+{
+	delete users;
+	delete sources;
+}
+
+/**
+ * @brief Takes a login attempt's tokens, from its source and then its username
+ * @param username The username being logged in to
+ * @param source The address the attempt came from, or an empty QString if it is not known
+ * @return boolean indicating whether the attempt may go ahead
+ */
+bool LoginThrottle::allowLogin(const QString& username, const QString& source)
+{
+	return allowLogin(username, source, now());
+}
+
+/**
+ * @brief Takes a login attempt's tokens at a given time, as a replay or simulation would
+ * @param username The username being logged in to
+ * @param source The address the attempt came from, or an empty QString if it is not known
+ * @param now The time of the attempt on the clock of now()
+ * @return boolean indicating whether the attempt may go ahead
+ */
+bool LoginThrottle::allowLogin(const QString& username, const QString& source, qint64 now)
+{
+	if (!source.isEmpty() && !take(*sources, source, now))
+	{
+		sourceRejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	if (!take(*users, username, now))
+	{
+		userRejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	allowed.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * @brief Takes a registration attempt's token from its source
+ * @param source The address the attempt came from, or an empty QString if it is not known
+ * @return boolean indicating whether the attempt may go ahead
+ */
+bool LoginThrottle::allowRegistration(const QString& source)
+{
+	return allowRegistration(source, now());
+}
+
+/**
+ * @brief Takes a registration attempt's token from its source at a given time
+ * @param source The address the attempt came from, or an empty QString if it is not known
+ * @param now The time of the attempt on the clock of now()
+ * @return boolean indicating whether the attempt may go ahead
+ */
+bool LoginThrottle::allowRegistration(const QString& source, qint64 now)
+{
+	if (!source.isEmpty() && !take(*sources, source, now))
+	{
+		sourceRejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	allowed.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * @brief Gets the throttle's clock
+ * @return Milliseconds since the throttle was created, starting at 1
+ */
+qint64 LoginThrottle::now() const
+{
+	return steadyMilliseconds() - epoch + 1;
+}
+
+/**
+ * @brief Gets how many attempts have been allowed and rejected
+ * @return The counts
+ */
+ThrottleStats LoginThrottle::stats() const
+{
+	ThrottleStats result;
+	result.allowed = allowed.load(std::memory_order_relaxed);
+	result.userRejected = userRejected.load(std::memory_order_relaxed);
+	result.sourceRejected = sourceRejected.load(std::memory_order_relaxed);
+	result.evicted = evicted.load(std::memory_order_relaxed);
+	return result;
+}
+
+/**
+ * @brief Takes one token from a key's bucket
+ * @param table The table holding the key's bucket
+ * @param key The username or source
+ * @param now The time of the attempt
+ * @return boolean indicating whether the bucket had a token
+ */
+bool LoginThrottle::take(Table& table, const QString& key, qint64 now)
+{
+	quint64 hash = seededHash(key, seed);
+	Shard& shard = table.shards[hash & table.mask];
+	quint64 tag = hash >> timeBits;
+	tag = tag ? tag : 1;
+
+	while (true)
+	{
+		// The key's own slot, else the first slot whose bucket is full, else the one closest to full
+		int match = -1;
+		int empty = -1;
+		int fullest = 0;
+		quint64 values[shardSize];
+		for (int i = 0; i < shardSize && match < 0; i++)
+		{
+			values[i] = shard.slots[i].load(std::memory_order_acquire);
+			if (values[i] >> timeBits == tag)
+			{
+				match = i;
+			}
+			else if (empty < 0 && qint64(values[i] & timeMask) <= now)
+			{
+				empty = i;
+			}
+			else if ((values[i] & timeMask) < (values[fullest] & timeMask))
+			{
+				fullest = i;
+			}
+		}
+
+		int index = match >= 0 ? match : (empty >= 0 ? empty : fullest);
+		quint64 current = values[index];
+		qint64 full = match >= 0 ? qMax(qint64(current & timeMask), now) : now;
+		if (full + table.interval - now > table.tolerance)
+		{
+			return false;
+		}
+		quint64 next = (tag << timeBits) | (quint64(full + table.interval) & timeMask);
+		if (shard.slots[index].compare_exchange_weak(current, next, std::memory_order_acq_rel))
+		{
+			if (match < 0 && empty < 0)
+			{
+				evicted.fetch_add(1, std::memory_order_relaxed);
+			}
+			return true;
+		}
+	}
+}
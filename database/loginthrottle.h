@@ -0,0 +1,75 @@
+/**
+ * @file loginthrottle.h
+ * @brief This contains the prototypes for the in-memory login and registration throttle
+ *
+ * Every username and every source address has a token bucket. An attempt takes a token from
+ * its source's bucket and then from its user's, and is rejected if either is empty, before the
+ * database is touched. Buckets refill lazily: each one is stored as the time at which it will
+ * next be completely full (the GCRA form of a token bucket), so an attempt is one compare and
+ * swap on one 64-bit word and nothing runs in the background.
+ *
+ * Buckets live in fixed-size tables of shardSize-slot shards, each shard one cache line. A key
+ * is only ever stored in the shard its hash picks, with the top bits of the hash as a tag, so
+ * memory never grows however many names an attacker tries. A new key takes an empty slot or
+ * one whose bucket has refilled, which is the same as a bucket nobody has used; if none is left
+ * it evicts the bucket closest to full. The hash is seeded per throttle, so colliding names
+ * cannot be precomputed.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef LOGINTHROTTLE_H
+#define LOGINTHROTTLE_H
+
+#include <QString>
+#include <atomic>
+
+// How many attempts a bucket allows
+struct ThrottlePolicy
+{
+	int burst;		// attempts allowed in a row from a full bucket
+	int perMinute;	// attempts a minute once the burst is used up
+
+	ThrottlePolicy(int burst, int perMinute) : burst(burst), perMinute(perMinute) {}
+};
+
+struct ThrottleStats
+{
+	qint64 allowed;
+	qint64 userRejected;	// rejected because the username's bucket was empty
+	qint64 sourceRejected;	// rejected because the source's bucket was empty
+	qint64 evicted;			// buckets that had not refilled but lost their slot to a new key
+};
+
+class LoginThrottle
+{
+	public:
+		static const int shardSize = 8;
+		static const int defaultShards = 8192;	// 64K buckets, 512 KiB per table
+
+		LoginThrottle(const ThrottlePolicy& userPolicy = ThrottlePolicy(5, 6),
+			const ThrottlePolicy& sourcePolicy = ThrottlePolicy(20, 120), int shards = defaultShards);
+		~LoginThrottle();
+		bool allowLogin(const QString& username, const QString& source);
+		bool allowLogin(const QString& username, const QString& source, qint64 now);
+		bool allowRegistration(const QString& source);
+		bool allowRegistration(const QString& source, qint64 now);
+		qint64 now() const;
+		ThrottleStats stats() const;
+	private:
+		Q_DISABLE_COPY(LoginThrottle)
+		struct Shard;
+		struct Table;
+		bool take(Table& table, const QString& key, qint64 now);
+		Table* users;
+		Table* sources;
+		quint64 seed;
+		qint64 epoch;
+		std::atomic<qint64> allowed;
+		std::atomic<qint64> userRejected;
+		std::atomic<qint64> sourceRejected;
+		std::atomic<qint64> evicted;
+};
+
+#endif	// LOGINTHROTTLE_H
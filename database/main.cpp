@@ -52,7 +52,7 @@ int main()
 			std::cout << "Success: incorrect username and password combination correctly identified" << std::endl;
 		}
 		
-		// This should print a qDebug statement and the statement below should not print
+		// This should log an error through DBLOG and the statement below should not print
 		if (db.checkUserInfo("Ted", "passwordtest"))
 		{
 			std::cout << "Error, non-existent user accepted" << std::endl;
@@ -73,7 +73,7 @@ int main()
 		chat2.append("Harry");
 		
 		// Try creating a chat with a non-existent user
-		// Should print an error via qDebug
+		// Should log an error through DBLOG
 		db.addChat(1, "Nick", chat1);
 		
 		// Bob is the owner of chat1
@@ -180,7 +180,7 @@ int main()
 		}
 		
 		// Try removing a chat by a user that is not the owner
-		// Should print an error via qDebug
+		// Should log an error through DBLOG
 		db.removeChat(1, "Harry");
 		
 		// Delete chat1 using the proper owner
@@ -229,4 +229,4 @@ int main()
 	QSqlDatabase::removeDatabase("DB.sqlite");
 	
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
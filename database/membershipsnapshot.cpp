@@ -0,0 +1,700 @@
+/**
+ * @file membershipsnapshot.cpp
+ * @brief Writes, maps and searches the chat membership snapshot
+ *
+ * The file layout after the SnapshotHeader is:
+ * chatIDs[chatCount], chatOffsets[chatCount + 1], chatMembers[membershipCount],
+ * userStringOffsets[userCount + 1], userChatOffsets[userCount + 1], userChats[membershipCount],
+ * then stringBytes bytes of UTF-8 usernames.
+ * Members and chats are stored in chatusers row order, matching what the SQL queries return.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <membershipsnapshot.h>
+#include <dblog.h>
+#include <QSaveFile>
+#include <algorithm>
+#include <cstring>
+
+/**
+ * @brief Checks that an offset array starts at zero, never decreases and ends at its array's size
+ * @param offsets The offsets, count + 1 of them
+ * @param count The number of ranges the offsets describe
+ * @param total The size of the array the offsets index
+ * @return boolean indicating whether every range lies inside the array
+ */
+static bool offsetsValid(const quint32* offsets, quint32 count, quint32 total)
+{
+	if (offsets[0] != 0 || offsets[count] != total)
+	{
+		return false;
+	}
+	for (quint32 i = 0; i < count; i++)
+	{
+		if (offsets[i + 1] < offsets[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Constructor for an empty, unloaded snapshot
+ */
+MembershipSnapshot::MembershipSnapshot()
+	: base(nullptr), header(nullptr), appliedSeq(0)
+{
+}
+
+/**
+ * @brief Destructor for the snapshot
+ * Unmaps the snapshot file if one is loaded
+ */
+MembershipSnapshot::~MembershipSnapshot()
+{
+	unload();
+}
+
+/**
+ * @brief Writes a snapshot of the current membership graph
+ * The tables are read under one savepoint so the snapshot matches the change sequence it records;
+ * a savepoint never commits a transaction the caller has open, though the caller's uncommitted
+ * changes are then read too
+ * The file is written to a temporary name and renamed, so readers never see a partial snapshot
+ * @param db The database connection to read from
+ * @param path The path of the snapshot file
+ * @return boolean indicating whether the snapshot was written
+ */
+bool MembershipSnapshot::write(QSqlDatabase db, const QString& path)
+{
+	QVector<qint32> chats;
+	QVector<QPair<qint32, QByteArray> > rows;
+	quint64 changeSeq = 0;
+
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	bool ok = query.exec("SAVEPOINT membershipsnapshot") && query.exec("SELECT COALESCE(MAX(seq), 0) FROM membershiplog") && query.next();
+	if (ok)
+	{
+		changeSeq = quint64(query.value(0).toLongLong());
+		ok = query.exec("SELECT chatid FROM chats ORDER BY chatid");
+	}
+	if (ok)
+	{
+		while (query.next())
+		{
+			chats.append(query.value(0).toInt());
+		}
+		ok = query.exec("SELECT chatid, username FROM chatusers ORDER BY rowid");
+	}
+	if (ok)
+	{
+		while (query.next())
+		{
+			rows.append(qMakePair(qint32(query.value(0).toInt()), query.value(1).toString().toUtf8()));
+		}
+	}
+	if (!ok)
+	{
+		DBLOG_ERROR("writeMembershipSnapshot", DbErrorQuery, 0, "membership could not be read", query.lastError().text());
+	}
+	query.finish();
+	QSqlQuery finish(db);
+	finish.exec("RELEASE membershipsnapshot");
+	if (!ok)
+	{
+		return false;
+	}
+
+	// Number the users in UTF-8 byte order so they can be binary searched
+	QVector<QByteArray> names;
+	{
+		QSet<QByteArray> seen;
+		for (int i = 0; i < rows.size(); i++)
+		{
+			if (!seen.contains(rows[i].second))
+			{
+				seen.insert(rows[i].second);
+				names.append(rows[i].second);
+			}
+		}
+	}
+	std::sort(names.begin(), names.end());
+	QHash<QByteArray, quint32> userIndex;
+	for (int i = 0; i < names.size(); i++)
+	{
+		userIndex.insert(names[i], quint32(i));
+	}
+
+	QHash<qint32, int> chatIndex;
+	for (int i = 0; i < chats.size(); i++)
+	{
+		chatIndex.insert(chats[i], i);
+	}
+
+	// Count the entries in each row so the offsets can be laid out in one pass
+	QVector<quint32> chatOffsets(chats.size() + 1, 0);
+	QVector<quint32> userChatOffsets(names.size() + 1, 0);
+	QVector<QPair<int, quint32> > members;
+	members.reserve(rows.size());
+	for (int i = 0; i < rows.size(); i++)
+	{
+		QHash<qint32, int>::const_iterator chat = chatIndex.constFind(rows[i].first);
+		if (chat == chatIndex.constEnd())
+		{
+			// A chatusers row for a chat that no longer exists
+			continue;
+		}
+		quint32 user = userIndex.value(rows[i].second);
+		members.append(qMakePair(chat.value(), user));
+		chatOffsets[chat.value() + 1]++;
+		userChatOffsets[user + 1]++;
+	}
+	for (int i = 0; i < chats.size(); i++)
+	{
+		chatOffsets[i + 1] += chatOffsets[i];
+	}
+	for (int i = 0; i < names.size(); i++)
+	{
+		userChatOffsets[i + 1] += userChatOffsets[i];
+	}
+
+	QVector<quint32> chatMembers(members.size());
+	QVector<qint32> userChats(members.size());
+	{
+		QVector<quint32> chatFill = chatOffsets.mid(0, chats.size());
+		QVector<quint32> userFill = userChatOffsets.mid(0, names.size());
+		for (int i = 0; i < members.size(); i++)
+		{
+			chatMembers[chatFill[members[i].first]++] = members[i].second;
+			userChats[userFill[members[i].second]++] = chats[members[i].first];
+		}
+	}
+
+	QVector<quint32> userStringOffsets(names.size() + 1, 0);
+	QByteArray strings;
+	for (int i = 0; i < names.size(); i++)
+	{
+		strings.append(names[i]);
+		userStringOffsets[i + 1] = quint32(strings.size());
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = snapshotVersion;
+	header.changeSeq = changeSeq;
+	header.chatCount = quint32(chats.size());
+	header.userCount = quint32(names.size());
+	header.membershipCount = quint32(members.size());
+	header.stringBytes = quint32(strings.size());
+
+	QSaveFile out(path);
+	if (!out.open(QIODevice::WriteOnly))
+	{
+		DBLOG_ERROR("writeMembershipSnapshot", DbErrorQuery, 0, "snapshot file could not be created", out.errorString());
+		return false;
+	}
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(chats.constData()), chats.size() * sizeof(qint32));
+	out.write(reinterpret_cast<const char*>(chatOffsets.constData()), chatOffsets.size() * sizeof(quint32));
+	out.write(reinterpret_cast<const char*>(chatMembers.constData()), chatMembers.size() * sizeof(quint32));
+	out.write(reinterpret_cast<const char*>(userStringOffsets.constData()), userStringOffsets.size() * sizeof(quint32));
+	out.write(reinterpret_cast<const char*>(userChatOffsets.constData()), userChatOffsets.size() * sizeof(quint32));
+	out.write(reinterpret_cast<const char*>(userChats.constData()), userChats.size() * sizeof(qint32));
+	out.write(strings);
+	return out.commit();
+}
+
+/**
+ * @brief Maps a snapshot file and checks that it is complete
+ * Every offset and index is checked once here, so a damaged file is refused rather than read
+ * out of bounds later. Any overlay from a previous snapshot is discarded
+ * @param path The path of the snapshot file
+ * @return boolean indicating whether the snapshot is ready to serve reads
+ */
+bool MembershipSnapshot::load(const QString& path)
+{
+	unload();
+
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		return false;
+	}
+
+	qint64 size = file.size();
+	if (size < qint64(sizeof(SnapshotHeader)))
+	{
+		unload();
+		return false;
+	}
+
+	base = file.map(0, size);
+	if (!base)
+	{
+		unload();
+		return false;
+	}
+
+	header = reinterpret_cast<const SnapshotHeader*>(base);
+	if (memcmp(header->magic, snapshotMagic, sizeof(header->magic)) != 0 || header->version != snapshotVersion)
+	{
+		DBLOG_ERROR("loadMembershipSnapshot", DbErrorQuery, 0, "unsupported snapshot file", path);
+		unload();
+		return false;
+	}
+
+	// Every array must fit inside the file
+	quint64 words = quint64(header->chatCount) * 2 + 1
+		+ quint64(header->membershipCount) * 2
+		+ (quint64(header->userCount) + 1) * 2;
+	if (sizeof(SnapshotHeader) + words * 4 + header->stringBytes > quint64(size))
+	{
+		DBLOG_ERROR("loadMembershipSnapshot", DbErrorQuery, 0, "snapshot file is truncated", path);
+		unload();
+		return false;
+	}
+
+	const quint32* next = reinterpret_cast<const quint32*>(base + sizeof(SnapshotHeader));
+	chatIDs = reinterpret_cast<const qint32*>(next);
+	next += header->chatCount;
+	chatOffsets = next;
+	next += header->chatCount + 1;
+	chatMembers = next;
+	next += header->membershipCount;
+	userStringOffsets = next;
+	next += header->userCount + 1;
+	userChatOffsets = next;
+	next += header->userCount + 1;
+	userChats = reinterpret_cast<const qint32*>(next);
+	next += header->membershipCount;
+	strings = reinterpret_cast<const char*>(next);
+
+	bool valid = offsetsValid(chatOffsets, header->chatCount, header->membershipCount)
+		&& offsetsValid(userChatOffsets, header->userCount, header->membershipCount)
+		&& offsetsValid(userStringOffsets, header->userCount, header->stringBytes);
+	for (quint32 i = 1; valid && i < header->chatCount; i++)
+	{
+		valid = chatIDs[i - 1] < chatIDs[i];
+	}
+	for (quint32 i = 0; valid && i < header->membershipCount; i++)
+	{
+		valid = chatMembers[i] < header->userCount && findChat(userChats[i]) >= 0;
+	}
+	if (!valid)
+	{
+		DBLOG_ERROR("loadMembershipSnapshot", DbErrorQuery, 0, "snapshot file is corrupt", path);
+		unload();
+		return false;
+	}
+
+	appliedSeq = qint64(header->changeSeq);
+	return true;
+}
+
+/**
+ * @brief Applies every membership change logged after the snapshot (or the last catch-up)
+ * Each changed chat is re-read from the chats and chatusers tables into the overlay
+ * @param db The database connection to read from
+ * @return boolean indicating whether the overlay is up to date
+ */
+bool MembershipSnapshot::catchUp(QSqlDatabase db)
+{
+	if (!isLoaded())
+	{
+		return false;
+	}
+
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	query.prepare("SELECT seq, chatid FROM membershiplog WHERE seq > (:seq) ORDER BY seq");
+	query.bindValue(":seq", appliedSeq);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("refreshMembership", DbErrorQuery, 0, "membership log could not be read", query.lastError().text());
+		return false;
+	}
+
+	QVector<int> changed;
+	QSet<int> seen;
+	qint64 lastSeq = appliedSeq;
+	while (query.next())
+	{
+		lastSeq = query.value(0).toLongLong();
+		int chatID = query.value(1).toInt();
+		if (!seen.contains(chatID))
+		{
+			seen.insert(chatID);
+			changed.append(chatID);
+		}
+	}
+
+	for (int i = 0; i < changed.size(); i++)
+	{
+		QSqlQuery chatQuery(db);
+		chatQuery.setForwardOnly(true);
+		chatQuery.prepare("SELECT chatid FROM chats WHERE chatid = (:chatID)");
+		chatQuery.bindValue(":chatID", changed[i]);
+		if (!chatQuery.exec())
+		{
+			return false;
+		}
+		bool exists = chatQuery.next();
+
+		QVector<QString> members;
+		if (exists)
+		{
+			QSqlQuery memberQuery(db);
+			memberQuery.setForwardOnly(true);
+			memberQuery.prepare("SELECT username FROM chatusers WHERE chatid = (:chatID) ORDER BY rowid");
+			memberQuery.bindValue(":chatID", changed[i]);
+			if (!memberQuery.exec())
+			{
+				return false;
+			}
+			while (memberQuery.next())
+			{
+				members.append(memberQuery.value(0).toString());
+			}
+		}
+		applyChat(changed[i], exists, members);
+	}
+
+	appliedSeq = lastSeq;
+	return true;
+}
+
+/**
+ * @brief Unmaps the snapshot file and clears the overlay
+ * @return void
+ */
+void MembershipSnapshot::unload()
+{
+	if (base)
+	{
+		file.unmap(base);
+	}
+	file.close();
+	base = nullptr;
+	header = nullptr;
+	appliedSeq = 0;
+	overlayChats.clear();
+	overlayRemoved.clear();
+	overlayUserChats.clear();
+	return;
+}
+
+/**
+ * @brief Checks if a snapshot is mapped
+ * @return boolean indicating whether reads can be served from the snapshot
+ */
+bool MembershipSnapshot::isLoaded() const
+{
+	return header != nullptr;
+}
+
+/**
+ * @brief Gets the last membershiplog sequence number reflected in the snapshot and overlay
+ * @return The change sequence number
+ */
+qint64 MembershipSnapshot::changeSeq() const
+{
+	return appliedSeq;
+}
+
+/**
+ * @brief Checks if a chat exists according to the snapshot and overlay
+ * @param chatID An integer representing the chat ID number
+ * @return boolean indicating whether the chat exists
+ */
+bool MembershipSnapshot::chatExists(int chatID) const
+{
+	if (overlayChats.contains(chatID))
+	{
+		return true;
+	}
+	if (overlayRemoved.contains(chatID))
+	{
+		return false;
+	}
+	return findChat(chatID) >= 0;
+}
+
+/**
+ * @brief Gets the usernames of the members of a chat
+ * @param chatID An integer representing the chat ID number
+ * @return QVector<QString> of the members, empty if the chat does not exist
+ */
+QVector<QString> MembershipSnapshot::chatUsers(int chatID) const
+{
+	QHash<int, QVector<QString> >::const_iterator overlay = overlayChats.constFind(chatID);
+	if (overlay != overlayChats.constEnd())
+	{
+		return overlay.value();
+	}
+
+	QVector<QString> users;
+	int chat = overlayRemoved.contains(chatID) ? -1 : findChat(chatID);
+	if (chat >= 0)
+	{
+		users.reserve(int(chatOffsets[chat + 1] - chatOffsets[chat]));
+		for (quint32 i = chatOffsets[chat]; i < chatOffsets[chat + 1]; i++)
+		{
+			users.append(userName(chatMembers[i]));
+		}
+	}
+	return users;
+}
+
+/**
+ * @brief Gets the chat ID numbers of the chats a user is in
+ * @param username The username for which we are retrieving the chats
+ * @return QVector<int> of chat ID numbers, empty if the user is in no chats
+ */
+QVector<int> MembershipSnapshot::chatsUserIsIn(const QString& username) const
+{
+	QVector<int> chats;
+	QByteArray utf8 = username.toUtf8();
+	int user = findUser(Utf8View(utf8.constData(), utf8.size()));
+	if (user >= 0)
+	{
+		for (quint32 i = userChatOffsets[user]; i < userChatOffsets[user + 1]; i++)
+		{
+			// Chats in the overlay are answered from the overlay instead
+			int chatID = userChats[i];
+			if (!overlayChats.contains(chatID) && !overlayRemoved.contains(chatID))
+			{
+				chats.append(chatID);
+			}
+		}
+	}
+	chats.append(overlayUserChats.value(username));
+	return chats;
+}
+
+/**
+ * @brief Appends the usernames of the members of a chat to an arena
+ * Names are copied straight from the mapped string table, without being decoded
+ * @param chatID An integer representing the chat ID number
+ * @param arena The arena, which gets nothing if the chat does not exist
+ * @return void
+ */
+void MembershipSnapshot::chatUsers(int chatID, ResultArena& arena) const
+{
+	forEachChatUser(chatID, [&arena](Utf8View username)
+	{
+		arena.appendText(username.data(), username.size());
+		return true;
+	});
+	return;
+}
+
+/**
+ * @brief Appends the chat ID numbers of the chats a user is in to an arena
+ * @param username The username for which we are retrieving the chats
+ * @param arena The arena, which gets nothing if the user is in no chats
+ * @return void
+ */
+void MembershipSnapshot::chatsUserIsIn(const QString& username, ResultArena& arena) const
+{
+	forEachChatOfUser(username, [&arena](int chatID)
+	{
+		arena.appendId(chatID);
+		return true;
+	});
+	return;
+}
+
+/**
+ * @brief Calls a visitor with the username of each member of a chat, in the order chatUsers returns them
+ * @param chatID An integer representing the chat ID number
+ * @param visit The visitor, which returns false to stop
+ * @return boolean indicating whether every member was visited
+ */
+bool MembershipSnapshot::forEachChatUser(int chatID, const UsernameVisitor& visit) const
+{
+	QHash<int, QVector<QString> >::const_iterator overlay = overlayChats.constFind(chatID);
+	if (overlay != overlayChats.constEnd())
+	{
+		for (int i = 0; i < overlay.value().size(); i++)
+		{
+			QByteArray username = overlay.value()[i].toUtf8();
+			if (!visit(Utf8View(username.constData(), username.size())))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	int chat = overlayRemoved.contains(chatID) ? -1 : findChat(chatID);
+	if (chat >= 0)
+	{
+		for (quint32 i = chatOffsets[chat]; i < chatOffsets[chat + 1]; i++)
+		{
+			// Names are passed straight from the mapped string table
+			quint32 user = chatMembers[i];
+			if (!visit(Utf8View(strings + userStringOffsets[user], int(userStringOffsets[user + 1] - userStringOffsets[user]))))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Calls a visitor with each chat ID number of the chats a user is in, in the order chatsUserIsIn returns them
+ * @param username The username for which we are retrieving the chats
+ * @param visit The visitor, which returns false to stop
+ * @return boolean indicating whether every chat was visited
+ */
+bool MembershipSnapshot::forEachChatOfUser(const QString& username, const ChatIdVisitor& visit) const
+{
+	QByteArray utf8 = username.toUtf8();
+	return forEachChatOfUser(Utf8View(utf8.constData(), utf8.size()), visit);
+}
+
+/**
+ * @brief Calls a visitor with each chat ID number of the chats a user is in, looking the user up by their UTF-8 name
+ * @param username The username encoded as UTF-8
+ * @param visit The visitor, which returns false to stop
+ * @return boolean indicating whether every chat was visited
+ */
+bool MembershipSnapshot::forEachChatOfUser(Utf8View username, const ChatIdVisitor& visit) const
+{
+	int user = findUser(username);
+	if (user >= 0)
+	{
+		for (quint32 i = userChatOffsets[user]; i < userChatOffsets[user + 1]; i++)
+		{
+			// Chats in the overlay are answered from the overlay instead
+			int chatID = userChats[i];
+			if (!overlayChats.contains(chatID) && !overlayRemoved.contains(chatID) && !visit(chatID))
+			{
+				return false;
+			}
+		}
+	}
+	// The overlay is keyed by QString, so the name is only decoded if there is an overlay to search
+	QHash<QString, QVector<int> >::const_iterator overlay = overlayUserChats.isEmpty() ? overlayUserChats.constEnd() : overlayUserChats.constFind(username.toString());
+	if (overlay != overlayUserChats.constEnd())
+	{
+		for (int i = 0; i < overlay.value().size(); i++)
+		{
+			if (!visit(overlay.value()[i]))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Binary searches the sorted chat IDs
+ * @param chatID An integer representing the chat ID number
+ * @return The index of the chat in the snapshot, or -1 if it is not there
+ */
+int MembershipSnapshot::findChat(int chatID) const
+{
+	if (!header)
+	{
+		return -1;
+	}
+	const qint32* end = chatIDs + header->chatCount;
+	const qint32* found = std::lower_bound(chatIDs, end, qint32(chatID));
+	return (found != end && *found == chatID) ? int(found - chatIDs) : -1;
+}
+
+/**
+ * @brief Binary searches the sorted usernames
+ * @param utf8 The username encoded as UTF-8
+ * @return The index of the user in the snapshot, or -1 if it is not there
+ */
+int MembershipSnapshot::findUser(Utf8View utf8) const
+{
+	if (!header)
+	{
+		return -1;
+	}
+
+	int low = 0;
+	int high = int(header->userCount) - 1;
+	while (low <= high)
+	{
+		int mid = low + (high - low) / 2;
+		const char* name = strings + userStringOffsets[mid];
+		int length = int(userStringOffsets[mid + 1] - userStringOffsets[mid]);
+		int cmp = memcmp(name, utf8.data(), size_t(qMin(length, utf8.size())));
+		if (cmp == 0)
+		{
+			cmp = length - utf8.size();
+		}
+
+		if (cmp == 0)
+		{
+			return mid;
+		}
+		else if (cmp < 0)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Decodes a username from the string table
+ * @param index The index of the user in the snapshot
+ * @return The username
+ */
+QString MembershipSnapshot::userName(quint32 index) const
+{
+	return QString::fromUtf8(strings + userStringOffsets[index], int(userStringOffsets[index + 1] - userStringOffsets[index]));
+}
+
+/**
+ * @brief Records the current state of one chat in the overlay
+ * @param chatID An integer representing the chat ID number
+ * @param exists Whether the chat still exists
+ * @param members The chat's members if it exists
+ * @return void
+ */
+void MembershipSnapshot::applyChat(int chatID, bool exists, const QVector<QString>& members)
+{
+	// Take the chat out of the reverse index before re-adding it with its new members
+	QVector<QString> previous = overlayChats.take(chatID);
+	for (int i = 0; i < previous.size(); i++)
+	{
+		QVector<int>& chats = overlayUserChats[previous[i]];
+		chats.removeAll(chatID);
+		if (chats.isEmpty())
+		{
+			overlayUserChats.remove(previous[i]);
+		}
+	}
+
+	if (exists)
+	{
+		overlayRemoved.remove(chatID);
+		overlayChats.insert(chatID, members);
+		for (int i = 0; i < members.size(); i++)
+		{
+			overlayUserChats[members[i]].append(chatID);
+		}
+	}
+	else
+	{
+		overlayRemoved.insert(chatID);
+	}
+	return;
+}
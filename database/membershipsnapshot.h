@@ -0,0 +1,85 @@
+/**
+ * @file membershipsnapshot.h
+ * @brief This contains the prototypes for the memory-mapped chat membership snapshot
+ *
+ * A snapshot holds the whole membership graph in compressed sparse row form:
+ * the sorted chat IDs with an offsets array into a flat list of member indices, the
+ * usernames sorted by their UTF-8 bytes with an offsets array into a flat list of chat IDs,
+ * and one string table for the usernames. All arrays are 32-bit, so the file can be
+ * mapped and searched in place without being parsed.
+ *
+ * Chats changed after the snapshot was taken are kept in a small overlay that is filled
+ * from the membershiplog table, and the overlay always wins over the mapped arrays.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef MEMBERSHIPSNAPSHOT_H
+#define MEMBERSHIPSNAPSHOT_H
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QFile>
+#include <QtSql>
+#include <resultset.h>
+
+static const char snapshotMagic[8] = { 'D', 'B', 'M', 'S', 'N', 'A', 'P', '1' };
+static const quint32 snapshotVersion = 1;
+
+// The fixed header at the start of a snapshot file
+struct SnapshotHeader
+{
+	char magic[8];
+	quint32 version;
+	quint32 reserved;
+	quint64 changeSeq;			// The last membershiplog sequence number included
+	quint32 chatCount;
+	quint32 userCount;
+	quint32 membershipCount;
+	quint32 stringBytes;
+};
+
+class MembershipSnapshot
+{
+	public:
+		MembershipSnapshot();
+		~MembershipSnapshot();
+		static bool write(QSqlDatabase db, const QString& path);
+		bool load(const QString& path);
+		bool catchUp(QSqlDatabase db);
+		void unload();
+		bool isLoaded() const;
+		qint64 changeSeq() const;
+		bool chatExists(int chatID) const;
+		QVector<QString> chatUsers(int chatID) const;
+		QVector<int> chatsUserIsIn(const QString& username) const;
+		void chatUsers(int chatID, ResultArena& arena) const;
+		void chatsUserIsIn(const QString& username, ResultArena& arena) const;
+		bool forEachChatUser(int chatID, const UsernameVisitor& visit) const;
+		bool forEachChatOfUser(const QString& username, const ChatIdVisitor& visit) const;
+		bool forEachChatOfUser(Utf8View username, const ChatIdVisitor& visit) const;
+	private:
+		int findChat(int chatID) const;
+		int findUser(Utf8View utf8) const;
+		QString userName(quint32 index) const;
+		void applyChat(int chatID, bool exists, const QVector<QString>& members);
+		QFile file;
+		uchar* base;
+		const SnapshotHeader* header;
+		const qint32* chatIDs;
+		const quint32* chatOffsets;
+		const quint32* chatMembers;
+		const quint32* userStringOffsets;
+		const quint32* userChatOffsets;
+		const qint32* userChats;
+		const char* strings;
+		qint64 appliedSeq;
+		QHash<int, QVector<QString> > overlayChats;			// Chats added or changed since the snapshot, with their members
+		QSet<int> overlayRemoved;							// Chats removed since the snapshot
+		QHash<QString, QVector<int> > overlayUserChats;		// The overlay chats each user is in
+};
+
+#endif	// MEMBERSHIPSNAPSHOT_H
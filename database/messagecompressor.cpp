@@ -0,0 +1,582 @@
+/**
+ * @file messagecompressor.cpp
+ * @brief Compresses chat messages with zstd against per-chat dictionaries and trains the dictionaries
+ *
+ * Every thread keeps its own zstd contexts, so compressing from many threads at once shares
+ * nothing but the read-locked dictionary table. Frames are written without zstd's checksum
+ * and dictionary ID fields: the ciphertext is authenticated anyway and the dictionary ID is
+ * already in the message header, which saves several bytes on every short message.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <messagecompressor.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <messagecrypto.h>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QMutexLocker>
+#include <zstd.h>
+#include <zdict.h>
+#include <vector>
+
+// A trained dictionary, digested once for compressing and once for decompressing
+struct MessageCompressor::Dictionary
+{
+	quint32 id;
+	int chatID;
+	ZSTD_CDict* compress;
+	ZSTD_DDict* decompress;
+
+	Dictionary(quint32 id, int chatID, const QByteArray& data, int level)
+		: id(id), chatID(chatID), compress(ZSTD_createCDict(data.constData(), data.size(), level)),
+		decompress(ZSTD_createDDict(data.constData(), data.size()))
+	{
+	}
+
+	~Dictionary()
+	{
+		ZSTD_freeCDict(compress);
+		ZSTD_freeDDict(decompress);
+	}
+};
+
+// The recent messages of one chat, kept in a ring, and how many arrived since its last training
+struct MessageCompressor::SampleSet
+{
+	QVector<QByteArray> messages;
+	int next;
+	int sinceTraining;
+	bool trained;
+	qint64 bytes;
+	quint64 lastUsed;
+
+	SampleSet() : next(0), sinceTraining(0), trained(false), bytes(0), lastUsed(0) {}
+};
+
+// zstd contexts for the calling thread
+struct ZstdContexts
+{
+	ZSTD_CCtx* compress;
+	ZSTD_DCtx* decompress;
+
+	ZstdContexts() : compress(ZSTD_createCCtx()), decompress(ZSTD_createDCtx()) {}
+	~ZstdContexts()
+	{
+		ZSTD_freeCCtx(compress);
+		ZSTD_freeDCtx(decompress);
+	}
+};
+
+static thread_local ZstdContexts contexts;
+
+/**
+ * @brief Constructor for a message compressor
+ * Dictionaries already in the database are not used until loadDictionaries() is called
+ * @param manager The database manager whose connection stores and loads dictionaries
+ * @param dictionaryKey A 32-byte key the stored dictionaries are sealed under
+ * @param level The zstd compression level
+ */
+MessageCompressor::MessageCompressor(DbManager& manager, const QByteArray& dictionaryKey, int level)
+	: manager(manager), dictionaryKey(dictionaryKey), level(level), sampledBytes(0), sampleClock(0), trainerStopping(false)
+{
+	if (dictionaryKey.size() != MessageCrypto::keySize)
+	{
+		DBLOG_ERROR("MessageCompressor", DbErrorCrypto, 0, "dictionary keys must be 32 bytes, so no dictionaries will be trained or loaded", QString());
+	}
+}
+
+/**
+ * @brief Destructor for the message compressor, which stops the background trainer
+ */
+MessageCompressor::~MessageCompressor()
+{
+	stopTraining();
+	qDeleteAll(samples);
+}
+
+/**
+ * @brief Creates the dictionaries table if it does not exist
+ * @return boolean indicating whether the table is ready
+ */
+bool MessageCompressor::createTables()
+{
+	QSqlQuery query(manager.database());
+	bool ok = query.exec("CREATE TABLE IF NOT EXISTS dictionaries(dictid INTEGER PRIMARY KEY AUTOINCREMENT, chatid INTEGER NOT NULL, "
+		"created INTEGER NOT NULL, samples INTEGER NOT NULL, dictionary BLOB NOT NULL);")
+		&& query.exec("CREATE INDEX IF NOT EXISTS dictionaries_chat ON dictionaries(chatid, dictid);");
+	if (!ok)
+	{
+		DBLOG_ERROR("createTables", DbErrorQuery, 0, "dictionaries table could not be created", query.lastError().text());
+	}
+	return ok;
+}
+
+/**
+ * @brief Starts compressing with the newest stored dictionary of every chat
+ * @return boolean indicating whether the dictionaries were read
+ */
+bool MessageCompressor::loadDictionaries()
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	if (!query.exec("SELECT dictid, chatid, dictionary FROM dictionaries WHERE dictid IN (SELECT MAX(dictid) FROM dictionaries GROUP BY chatid)"))
+	{
+		DBLOG_ERROR("loadDictionaries", DbErrorQuery, 0, "dictionaries could not be read", query.lastError().text());
+		return false;
+	}
+	while (query.next())
+	{
+		int chatID = query.value(1).toInt();
+		QSharedPointer<const Dictionary> dictionary = openDictionary(quint32(query.value(0).toLongLong()), chatID, query.value(2).toByteArray());
+		if (dictionary)
+		{
+			install(chatID, dictionary);
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Compresses a message for a chat and records it as a training sample
+ * @param chatID An integer representing the chat ID number
+ * @param message The message
+ * @return The compressed message, which is never more than one byte longer than the message
+ */
+QByteArray MessageCompressor::compress(int chatID, const QByteArray& message)
+{
+	QSharedPointer<const Dictionary> dictionary;
+	{
+		QReadLocker locker(&dictionaryLock);
+		dictionary = current.value(chatID);
+	}
+
+	int headerSize = dictionary ? 5 : 1;
+	QByteArray compressed(headerSize + int(ZSTD_compressBound(message.size())), Qt::Uninitialized);
+	ZSTD_CCtx* cctx = contexts.compress;
+	ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 0);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0);
+	ZSTD_CCtx_refCDict(cctx, dictionary ? dictionary->compress : nullptr);
+	size_t size = ZSTD_compress2(cctx, compressed.data() + headerSize, compressed.size() - headerSize, message.constData(), message.size());
+
+	if (ZSTD_isError(size) || headerSize + int(size) > message.size())
+	{
+		compressed.resize(1 + message.size());
+		compressed[0] = char(CompressionFormat::Stored);
+		memcpy(compressed.data() + 1, message.constData(), message.size());
+	}
+	else
+	{
+		compressed.resize(headerSize + int(size));
+		compressed[0] = char(dictionary ? CompressionFormat::Dictionary : CompressionFormat::Plain);
+		if (dictionary)
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				compressed[1 + i] = char((dictionary->id >> (24 - 8 * i)) & 0xff);
+			}
+		}
+	}
+
+	// Long messages compress well alone and would crowd out the short ones dictionaries are for
+	if (message.size() > maxSampleBytes / maxSamples)
+	{
+		return compressed;
+	}
+
+	// QByteArray is implicitly shared, so keeping the sample copies nothing
+	QMutexLocker locker(&sampleMutex);
+	SampleSet*& set = samples[chatID];
+	if (!set)
+	{
+		set = new SampleSet();
+	}
+	if (set->messages.size() < maxSamples)
+	{
+		set->messages.append(message);
+	}
+	else
+	{
+		set->bytes -= set->messages[set->next].size();
+		sampledBytes -= set->messages[set->next].size();
+		set->messages[set->next] = message;
+		set->next = (set->next + 1) % maxSamples;
+	}
+	set->bytes += message.size();
+	sampledBytes += message.size();
+	set->sinceTraining++;
+	set->lastUsed = ++sampleClock;
+	if (samples.size() > maxSampledChats || sampledBytes > maxSampleBytes)
+	{
+		dropSamples(chatID);
+	}
+	return compressed;
+}
+
+/**
+ * @brief Restores a message produced by compress(), loading any dictionary it needs on the calling thread
+ * @param chatID An integer representing the chat ID number the message was sent in
+ * @param compressed The compressed message
+ * @param message Receives the message
+ * @return boolean indicating whether the message was well formed and its dictionary was found
+ */
+bool MessageCompressor::decompress(int chatID, const QByteArray& compressed, QByteArray& message)
+{
+	return decompress(manager, chatID, compressed, message);
+}
+
+/**
+ * @brief Restores a message produced by compress()
+ * Dictionaries that are no longer current are loaded from the database the first time they are needed
+ * @param db The database manager to load dictionaries through, owned by the calling thread
+ * @param chatID An integer representing the chat ID number the message was sent in
+ * @param compressed The compressed message
+ * @param message Receives the message
+ * @return boolean indicating whether the message was well formed and its dictionary was found for the chat
+ */
+bool MessageCompressor::decompress(DbManager& db, int chatID, const QByteArray& compressed, QByteArray& message)
+{
+	if (compressed.isEmpty())
+	{
+		return false;
+	}
+	CompressionFormat format = CompressionFormat(quint8(compressed[0]));
+	if (format == CompressionFormat::Stored)
+	{
+		message = compressed.mid(1);
+		return true;
+	}
+
+	int headerSize = format == CompressionFormat::Dictionary ? 5 : 1;
+	if ((format != CompressionFormat::Plain && format != CompressionFormat::Dictionary) || compressed.size() < headerSize)
+	{
+		DBLOG_WARNING("decompress", DbErrorCompression, 0, "unknown compressed message format", QString());
+		return false;
+	}
+
+	QSharedPointer<const Dictionary> dictionary;
+	if (format == CompressionFormat::Dictionary)
+	{
+		quint32 dictionaryID = 0;
+		for (int i = 1; i < 5; i++)
+		{
+			dictionaryID = (dictionaryID << 8) | quint8(compressed[i]);
+		}
+		dictionary = loadDictionary(db, dictionaryID, chatID);
+		if (!dictionary)
+		{
+			return false;
+		}
+	}
+
+	const char* frame = compressed.constData() + headerSize;
+	size_t frameSize = compressed.size() - headerSize;
+	unsigned long long size = ZSTD_getFrameContentSize(frame, frameSize);
+	if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > quint64(maxMessageSize))
+	{
+		DBLOG_WARNING("decompress", DbErrorCompression, 0, "compressed message has no valid size", QString());
+		return false;
+	}
+
+	message.resize(int(size));
+	size_t written = dictionary
+		? ZSTD_decompress_usingDDict(contexts.decompress, message.data(), message.size(), frame, frameSize, dictionary->decompress)
+		: ZSTD_decompressDCtx(contexts.decompress, message.data(), message.size(), frame, frameSize);
+	if (ZSTD_isError(written) || written != size)
+	{
+		DBLOG_WARNING("decompress", DbErrorCompression, 0, "compressed message is corrupt",
+			QString(ZSTD_isError(written) ? ZSTD_getErrorName(written) : "size mismatch"));
+		message.clear();
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Gets the dictionary compress() currently uses for a chat
+ * @param chatID An integer representing the chat ID number
+ * @return The dictionary's ID, or 0 if the chat's messages are compressed without one
+ */
+quint32 MessageCompressor::dictionaryFor(int chatID)
+{
+	QReadLocker locker(&dictionaryLock);
+	QSharedPointer<const Dictionary> dictionary = current.value(chatID);
+	return dictionary ? dictionary->id : 0;
+}
+
+/**
+ * @brief Trains new dictionaries for every chat whose traffic has grown enough, on the calling thread
+ * @return The number of dictionaries trained
+ */
+int MessageCompressor::retrain()
+{
+	return retrain(manager);
+}
+
+/**
+ * @brief Starts a thread that calls retrain() periodically on its own database connection
+ * @param intervalSeconds How long the thread waits between rounds of training
+ * @return void
+ */
+void MessageCompressor::startTraining(int intervalSeconds)
+{
+	if (trainer.joinable())
+	{
+		return;
+	}
+	trainerStopping = false;
+	trainer = std::thread(&MessageCompressor::trainerLoop, this, intervalSeconds);
+	return;
+}
+
+/**
+ * @brief Stops the background trainer, waiting for a round of training in progress to finish
+ * @return void
+ */
+void MessageCompressor::stopTraining()
+{
+	if (!trainer.joinable())
+	{
+		return;
+	}
+	{
+		QMutexLocker locker(&trainerMutex);
+		trainerStopping = true;
+		trainerWake.wakeAll();
+	}
+	trainer.join();
+	return;
+}
+
+/**
+ * @brief Trains and stores new dictionaries for the chats that are due
+ * A chat is due once it has minSamples messages and no dictionary, or retrainAfter messages
+ * since its last one. Training runs without holding any lock compress() needs.
+ * @param db The database manager to store the dictionaries through, owned by the calling thread
+ * @return The number of dictionaries trained
+ */
+int MessageCompressor::retrain(DbManager& db)
+{
+	if (dictionaryKey.size() != MessageCrypto::keySize)
+	{
+		return 0;
+	}
+
+	QVector<QPair<int, QVector<QByteArray> > > due;
+	{
+		QMutexLocker locker(&sampleMutex);
+		for (QHash<int, SampleSet*>::iterator it = samples.begin(); it != samples.end(); ++it)
+		{
+			SampleSet* set = it.value();
+			if (set->messages.size() >= minSamples && set->sinceTraining >= (set->trained ? retrainAfter : minSamples))
+			{
+				due.append(qMakePair(it.key(), set->messages));
+				set->sinceTraining = 0;
+				set->trained = true;
+			}
+		}
+	}
+
+	int trained = 0;
+	QByteArray buffer(dictionarySize, Qt::Uninitialized);
+	for (int d = 0; d < due.size(); d++)
+	{
+		const QVector<QByteArray>& messages = due[d].second;
+		QByteArray joined;
+		std::vector<size_t> sizes;
+		sizes.reserve(messages.size());
+		for (int i = 0; i < messages.size(); i++)
+		{
+			joined.append(messages[i]);
+			sizes.push_back(size_t(messages[i].size()));
+		}
+
+		size_t size = ZDICT_trainFromBuffer(buffer.data(), buffer.size(), joined.constData(), sizes.data(), unsigned(sizes.size()));
+		if (ZDICT_isError(size))
+		{
+			// Usually too little distinct text to learn from yet; the chat is tried again later
+			DBLOG_WARNING("retrain", DbErrorCompression, due[d].first, "dictionary could not be trained", QString(ZDICT_getErrorName(size)));
+			continue;
+		}
+		QByteArray dictionary = buffer.left(int(size));
+		MessageCrypto crypto(chatKey(due[d].first));
+		QByteArray sealed = crypto.seal(dictionary, QByteArray::number(due[d].first));
+		if (sealed.isEmpty())
+		{
+			DBLOG_ERROR("retrain", DbErrorCrypto, due[d].first, "dictionary could not be sealed", QString());
+			continue;
+		}
+
+		QSqlQuery query(db.database());
+		query.prepare("INSERT INTO dictionaries (chatid, created, samples, dictionary) VALUES (:chatID, :created, :samples, :dictionary)");
+		query.bindValue(":chatID", due[d].first);
+		query.bindValue(":created", QDateTime::currentSecsSinceEpoch());
+		query.bindValue(":samples", messages.size());
+		query.bindValue(":dictionary", sealed);
+		if (!query.exec())
+		{
+			DBLOG_ERROR("retrain", DbErrorQuery, due[d].first, "dictionary could not be stored", query.lastError().text());
+			continue;
+		}
+		install(due[d].first, QSharedPointer<const Dictionary>(new Dictionary(quint32(query.lastInsertId().toLongLong()), due[d].first, dictionary, level)));
+		trained++;
+	}
+	return trained;
+}
+
+/**
+ * @brief Gets a chat's dictionary by its ID, loading it from the database if it has not been used yet
+ * A message naming another chat's dictionary is refused, since no dictionary is shared between chats
+ * @param db The database manager to load the dictionary through, owned by the calling thread
+ * @param dictionaryID The dictionary's ID
+ * @param chatID An integer representing the chat ID number the dictionary must belong to
+ * @return The dictionary, or a null pointer if the chat has no such dictionary
+ */
+QSharedPointer<const MessageCompressor::Dictionary> MessageCompressor::loadDictionary(DbManager& db, quint32 dictionaryID, int chatID)
+{
+	{
+		QReadLocker locker(&dictionaryLock);
+		QSharedPointer<const Dictionary> dictionary = byID.value(dictionaryID);
+		if (dictionary && dictionary->chatID == chatID)
+		{
+			return dictionary;
+		}
+		if (dictionary)
+		{
+			DBLOG_WARNING("decompress", DbErrorCompression, chatID, "message refers to another chat's dictionary", QString::number(qint64(dictionaryID)));
+			return QSharedPointer<const Dictionary>();
+		}
+	}
+
+	QSqlQuery query(db.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT chatid, dictionary FROM dictionaries WHERE dictid = (:dictID)");
+	query.bindValue(":dictID", qint64(dictionaryID));
+	if (!query.exec() || !query.next())
+	{
+		DBLOG_WARNING("decompress", DbErrorCompression, chatID, "message refers to a missing dictionary", QString::number(qint64(dictionaryID)));
+		return QSharedPointer<const Dictionary>();
+	}
+	if (query.value(0).toInt() != chatID)
+	{
+		DBLOG_WARNING("decompress", DbErrorCompression, chatID, "message refers to another chat's dictionary", QString::number(qint64(dictionaryID)));
+		return QSharedPointer<const Dictionary>();
+	}
+
+	QSharedPointer<const Dictionary> dictionary = openDictionary(dictionaryID, chatID, query.value(1).toByteArray());
+	if (!dictionary)
+	{
+		return dictionary;
+	}
+	QWriteLocker locker(&dictionaryLock);
+	byID.insert(dictionaryID, dictionary);
+	return dictionary;
+}
+
+/**
+ * @brief Opens a stored dictionary and digests it
+ * @param dictionaryID The dictionary's ID
+ * @param chatID An integer representing the chat ID number it was trained for
+ * @param sealed The dictionary as stored
+ * @return The dictionary, or a null pointer if it failed authentication
+ */
+QSharedPointer<const MessageCompressor::Dictionary> MessageCompressor::openDictionary(quint32 dictionaryID, int chatID, const QByteArray& sealed)
+{
+	if (dictionaryKey.size() != MessageCrypto::keySize)
+	{
+		return QSharedPointer<const Dictionary>();
+	}
+	MessageCrypto crypto(chatKey(chatID));
+	QByteArray data;
+	if (!crypto.open(sealed, data, QByteArray::number(chatID)))
+	{
+		DBLOG_ERROR("loadDictionary", DbErrorCrypto, chatID, "stored dictionary failed authentication", QString::number(qint64(dictionaryID)));
+		return QSharedPointer<const Dictionary>();
+	}
+	QSharedPointer<const Dictionary> dictionary(new Dictionary(dictionaryID, chatID, data, level));
+	data.fill(0);
+	return dictionary;
+}
+
+/**
+ * @brief Derives the key a chat's dictionaries are sealed under
+ * @param chatID An integer representing the chat ID number
+ * @return The 32-byte key
+ */
+QByteArray MessageCompressor::chatKey(int chatID) const
+{
+	return QCryptographicHash::hash(dictionaryKey + QByteArray("dictionary:") + QByteArray::number(chatID), QCryptographicHash::Sha256);
+}
+
+/**
+ * @brief Drops the samples of the least recently active chats until the sample limits are met again
+ * Called with sampleMutex held
+ * @param keepChatID The chat that was just sampled, which is never dropped
+ * @return void
+ */
+void MessageCompressor::dropSamples(int keepChatID)
+{
+	while (samples.size() > 1 && (samples.size() > maxSampledChats || sampledBytes > maxSampleBytes))
+	{
+		QHash<int, SampleSet*>::iterator oldest = samples.end();
+		for (QHash<int, SampleSet*>::iterator it = samples.begin(); it != samples.end(); ++it)
+		{
+			if (it.key() != keepChatID && (oldest == samples.end() || it.value()->lastUsed < oldest.value()->lastUsed))
+			{
+				oldest = it;
+			}
+		}
+		sampledBytes -= oldest.value()->bytes;
+		delete oldest.value();
+		samples.erase(oldest);
+	}
+	return;
+}
+
+/**
+ * @brief Makes a dictionary the one compress() uses for a chat
+ * @param chatID An integer representing the chat ID number
+ * @param dictionary The dictionary
+ * @return void
+ */
+void MessageCompressor::install(int chatID, const QSharedPointer<const Dictionary>& dictionary)
+{
+	if (!dictionary->compress || !dictionary->decompress)
+	{
+		DBLOG_ERROR("install", DbErrorCompression, chatID, "dictionary could not be loaded", QString());
+		return;
+	}
+	QWriteLocker locker(&dictionaryLock);
+	current.insert(chatID, dictionary);
+	byID.insert(dictionary->id, dictionary);
+	return;
+}
+
+/**
+ * @brief The body of the background trainer
+ * @param intervalSeconds How long to wait between rounds of training
+ * @return void
+ */
+void MessageCompressor::trainerLoop(int intervalSeconds)
+{
+	DbManager db(manager.database().databaseName(), QString("compression-trainer-%1").arg(quintptr(this)));
+	QMutexLocker locker(&trainerMutex);
+	while (!trainerStopping)
+	{
+		trainerWake.wait(&trainerMutex, quint64(intervalSeconds) * 1000);
+		if (trainerStopping)
+		{
+			break;
+		}
+		locker.unlock();
+		retrain(db);
+		locker.relock();
+	}
+	return;
+}
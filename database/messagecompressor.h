@@ -0,0 +1,109 @@
+/**
+ * @file messagecompressor.h
+ * @brief This contains the prototypes for chat message compression with trained dictionaries
+ *
+ * Chat messages are short and share most of their vocabulary with earlier messages in the same
+ * chat, so they are compressed with zstd against a dictionary trained on recent traffic. Each
+ * chat with enough traffic gets its own dictionary, trained only on that chat's messages; quieter
+ * chats are compressed without one. Messages are compressed before they are encrypted, so a
+ * dictionary built from other chats would let their content change this chat's ciphertext
+ * lengths, and no dictionary is ever shared between chats.
+ *
+ * A compressed message starts with a format byte:
+ *   [0][message]						stored, when compression would not make it smaller
+ *   [1][zstd frame]					compressed without a dictionary
+ *   [2][dictionary id:4][zstd frame]	compressed with the dictionary of that id (big-endian)
+ * Dictionaries are never deleted, so every message can be decompressed for as long as it is kept.
+ *
+ * compress() keeps a sample of the recent messages of the most recently active chats, within a
+ * fixed memory budget. retrain(), or the background trainer started with startTraining(), trains
+ * new dictionaries for chats whose traffic has grown enough and stores them in the dictionaries
+ * table. Dictionaries are loaded through a DbManager the calling thread owns, so decompress() takes
+ * one when it is called away from the thread that owns the compressor's.
+ *
+ * Dictionaries are made of fragments of the messages they were trained on, so each one is sealed
+ * with MessageCrypto before it is stored, under a key derived from the compressor's dictionary
+ * key and the chat's ID.
+ *
+ * Table:
+ * dictionaries--one row per trained dictionary: its id, the chat it was trained for, when it was
+ * trained, the number of samples and the sealed dictionary.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef MESSAGECOMPRESSOR_H
+#define MESSAGECOMPRESSOR_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <atomic>
+#include <thread>
+
+class DbManager;
+
+enum class CompressionFormat : quint8
+{
+	Stored = 0,
+	Plain = 1,
+	Dictionary = 2
+};
+
+class MessageCompressor
+{
+	public:
+		static const int defaultLevel = 3;
+		static const int dictionarySize = 16384;
+		static const int minSamples = 256;			// messages a chat needs before its first dictionary
+		static const int retrainAfter = 4096;		// new messages before a dictionary is retrained
+		static const int maxSamples = 8192;			// recent messages kept for each chat
+		static const int maxSampledChats = 1024;	// chats sampled at once; the least recently active is dropped first
+		static const int maxSampleBytes = 64 << 20;	// message bytes sampled across every chat; messages over maxSampleBytes / maxSamples are not sampled
+		static const int maxMessageSize = 1 << 20;	// largest message decompress() will produce
+
+		MessageCompressor(DbManager& manager, const QByteArray& dictionaryKey, int level = defaultLevel);
+		~MessageCompressor();
+		bool createTables();
+		bool loadDictionaries();
+		QByteArray compress(int chatID, const QByteArray& message);
+		bool decompress(int chatID, const QByteArray& compressed, QByteArray& message);
+		bool decompress(DbManager& db, int chatID, const QByteArray& compressed, QByteArray& message);
+		quint32 dictionaryFor(int chatID);
+		int retrain();
+		void startTraining(int intervalSeconds = 60);
+		void stopTraining();
+	private:
+		Q_DISABLE_COPY(MessageCompressor)
+		struct Dictionary;
+		struct SampleSet;
+		int retrain(DbManager& db);
+		QSharedPointer<const Dictionary> loadDictionary(DbManager& db, quint32 dictionaryID, int chatID);
+		QSharedPointer<const Dictionary> openDictionary(quint32 dictionaryID, int chatID, const QByteArray& sealed);
+		QByteArray chatKey(int chatID) const;
+		void dropSamples(int keepChatID);
+		void install(int chatID, const QSharedPointer<const Dictionary>& dictionary);
+		void trainerLoop(int intervalSeconds);
+		DbManager& manager;
+		QByteArray dictionaryKey;
+		int level;
+		QReadWriteLock dictionaryLock;
+		QHash<int, QSharedPointer<const Dictionary> > current;		// chat ID -> the dictionary compress() uses
+		QHash<quint32, QSharedPointer<const Dictionary> > byID;		// every dictionary loaded so far
+		QMutex sampleMutex;
+		QHash<int, SampleSet*> samples;
+		qint64 sampledBytes;
+		quint64 sampleClock;
+		QMutex trainerMutex;
+		QWaitCondition trainerWake;
+		bool trainerStopping;
+		std::thread trainer;
+};
+
+#endif	// MESSAGECOMPRESSOR_H
@@ -0,0 +1,307 @@
+/**
+ * @file messagecrypto.cpp
+ * @brief AEAD sealing and opening of chat messages
+ *
+ * Each MessageCrypto keeps its OpenSSL contexts keyed for its whole lifetime, so sealing a
+ * message only sets a new nonce instead of repeating the key schedule. Every nonce is 96 random
+ * bits, so the many instances that share a key (one per SenderKeyManager, one per ratchet-tree
+ * update, new ones after every restart) never have to coordinate; the chance of two messages
+ * sharing a nonce stays negligible until a key has sealed billions of messages. Nonces are drawn
+ * from OpenSSL's generator 64 at a time to keep the generator off the per-message path.
+ *
+ * @author mdolan2
+ * @bug A MessageCrypto is not thread-safe; use one per thread.
+ */
+
+#include <messagecrypto.h>
+#include <dblog.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cstring>
+
+/**
+ * @brief Gets the OpenSSL cipher for a suite
+ * @param suite The cipher suite
+ * @return The OpenSSL cipher
+ */
+static const EVP_CIPHER* cipherFor(CipherSuite suite)
+{
+	return suite == CipherSuite::Aes256Gcm ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+}
+
+/**
+ * @brief Constructor for a message encryption engine using the fastest suite for this CPU
+ * @param key A 32-byte key
+ */
+MessageCrypto::MessageCrypto(const QByteArray& key)
+	: MessageCrypto(key, preferredSuite())
+{
+}
+
+/**
+ * @brief Constructor for a message encryption engine using a specific suite for sealing
+ * @param key A 32-byte key
+ * @param suite The suite new messages are sealed with
+ */
+MessageCrypto::MessageCrypto(const QByteArray& key, CipherSuite suite)
+	: key(key), cipherSuite(suite), encryptCtx(nullptr), nonceStockUsed(sizeof(nonceStock))
+{
+	decryptCtx[0] = nullptr;
+	decryptCtx[1] = nullptr;
+
+	if (key.size() != keySize)
+	{
+		DBLOG_ERROR("MessageCrypto", DbErrorCrypto, 0, "keys must be 32 bytes", QString());
+		return;
+	}
+
+	encryptCtx = EVP_CIPHER_CTX_new();
+	if (!encryptCtx || EVP_EncryptInit_ex(encryptCtx, cipherFor(suite), nullptr, reinterpret_cast<const unsigned char*>(key.constData()), nullptr) != 1)
+	{
+		DBLOG_ERROR("MessageCrypto", DbErrorCrypto, 0, "cipher could not be initialised", QString());
+		EVP_CIPHER_CTX_free(encryptCtx);
+		encryptCtx = nullptr;
+	}
+}
+
+/**
+ * @brief Destructor for the message encryption engine
+ * Frees the OpenSSL contexts, which also erases the expanded keys
+ */
+MessageCrypto::~MessageCrypto()
+{
+	EVP_CIPHER_CTX_free(encryptCtx);
+	EVP_CIPHER_CTX_free(decryptCtx[0]);
+	EVP_CIPHER_CTX_free(decryptCtx[1]);
+	key.fill(0);
+}
+
+/**
+ * @brief Checks if the CPU can run AES-GCM in hardware
+ * @return boolean indicating whether the AES and PCLMULQDQ instructions are available
+ */
+bool MessageCrypto::hasAesHardware()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * @brief Picks the suite to seal with on this CPU
+ * AES-GCM is fastest with hardware support; without it ChaCha20-Poly1305 is both faster and constant-time
+ * @return The preferred cipher suite
+ */
+CipherSuite MessageCrypto::preferredSuite()
+{
+	static const CipherSuite suite = hasAesHardware() ? CipherSuite::Aes256Gcm : CipherSuite::ChaCha20Poly1305;
+	return suite;
+}
+
+/**
+ * @brief Generates a new random key
+ * @return A 32-byte key from the system's secure random number generator
+ */
+QByteArray MessageCrypto::generateKey()
+{
+	QByteArray newKey(keySize, '\0');
+	RAND_bytes(reinterpret_cast<unsigned char*>(newKey.data()), keySize);
+	return newKey;
+}
+
+/**
+ * @brief Gets the suite this engine seals messages with
+ * @return The cipher suite
+ */
+CipherSuite MessageCrypto::suite() const
+{
+	return cipherSuite;
+}
+
+/**
+ * @brief Encrypts and authenticates one message
+ * @param plaintext The message to be sealed
+ * @param associatedData Data that is authenticated but not encrypted, such as a chat ID
+ * @return The sealed message, or an empty QByteArray if sealing failed
+ */
+QByteArray MessageCrypto::seal(const QByteArray& plaintext, const QByteArray& associatedData)
+{
+	QByteArray sealed(plaintext.size() + overhead, '\0');
+	if (!sealInto(plaintext.constData(), plaintext.size(), associatedData, sealed.data()))
+	{
+		return QByteArray();
+	}
+	return sealed;
+}
+
+/**
+ * @brief Checks and decrypts one sealed message
+ * @param sealed The sealed message
+ * @param plaintext Receives the decrypted message
+ * @param associatedData The same associated data the message was sealed with
+ * @return boolean indicating whether the message was authentic and decrypted
+ */
+bool MessageCrypto::open(const QByteArray& sealed, QByteArray& plaintext, const QByteArray& associatedData)
+{
+	if (sealed.size() < overhead)
+	{
+		return false;
+	}
+
+	CipherSuite messageSuite = CipherSuite(quint8(sealed.at(0)));
+	EVP_CIPHER_CTX* ctx = decryptContext(messageSuite);
+	if (!ctx)
+	{
+		return false;
+	}
+
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(sealed.constData());
+	int length = sealed.size() - overhead;
+	int outLength = 0;
+	plaintext.resize(length);
+	unsigned char* out = reinterpret_cast<unsigned char*>(plaintext.data());
+
+	bool ok = EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, in + 1) == 1
+		&& EVP_DecryptUpdate(ctx, nullptr, &outLength, in, headerSize) == 1
+		&& (associatedData.isEmpty() || EVP_DecryptUpdate(ctx, nullptr, &outLength,
+			reinterpret_cast<const unsigned char*>(associatedData.constData()), associatedData.size()) == 1)
+		&& EVP_DecryptUpdate(ctx, out, &outLength, in + headerSize, length) == 1
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, tagSize, const_cast<unsigned char*>(in + headerSize + length)) == 1
+		&& EVP_DecryptFinal_ex(ctx, out + outLength, &outLength) == 1;
+
+	if (!ok)
+	{
+		plaintext.fill(0);
+		plaintext.clear();
+	}
+	return ok;
+}
+
+/**
+ * @brief Seals many messages in one call
+ * The messages are written back to back into one buffer, and the keyed context is reused for every message
+ * @param plaintexts The messages to be sealed
+ * @param sealed Receives the sealed messages; its capacity is reused from earlier calls
+ * @param offsets Receives the start of each sealed message, plus a final entry for the end of the last one
+ * @param associatedData Associated data shared by all of the messages
+ * @return boolean indicating whether every message was sealed
+ */
+bool MessageCrypto::sealBatch(const QVector<QByteArray>& plaintexts, QByteArray& sealed, QVector<int>& offsets, const QByteArray& associatedData)
+{
+	offsets.resize(plaintexts.size() + 1);
+	int total = 0;
+	for (int i = 0; i < plaintexts.size(); i++)
+	{
+		offsets[i] = total;
+		total += plaintexts[i].size() + overhead;
+	}
+	offsets[plaintexts.size()] = total;
+	sealed.resize(total);
+
+	char* out = sealed.data();
+	for (int i = 0; i < plaintexts.size(); i++)
+	{
+		if (!sealInto(plaintexts[i].constData(), plaintexts[i].size(), associatedData, out + offsets[i]))
+		{
+			sealed.clear();
+			offsets.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Opens a buffer of messages sealed by sealBatch
+ * @param sealed The sealed messages, back to back
+ * @param offsets The offsets produced by sealBatch
+ * @param plaintexts Receives the decrypted messages in the same order
+ * @param associatedData Associated data shared by all of the messages
+ * @return boolean indicating whether every message was authentic
+ */
+bool MessageCrypto::openBatch(const QByteArray& sealed, const QVector<int>& offsets, QVector<QByteArray>& plaintexts, const QByteArray& associatedData)
+{
+	int count = qMax(offsets.size() - 1, 0);
+	plaintexts.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		if (offsets[i] < 0 || offsets[i + 1] > sealed.size() || offsets[i + 1] < offsets[i]
+			|| !open(sealed.mid(offsets[i], offsets[i + 1] - offsets[i]), plaintexts[i], associatedData))
+		{
+			plaintexts.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Seals one message into a buffer of exactly length + overhead bytes
+ * @param plaintext Pointer to the message
+ * @param length The length of the message
+ * @param associatedData Data that is authenticated but not encrypted
+ * @param out The output buffer
+ * @return boolean indicating whether the message was sealed
+ */
+bool MessageCrypto::sealInto(const char* plaintext, int length, const QByteArray& associatedData, char* out)
+{
+	if (!encryptCtx)
+	{
+		return false;
+	}
+
+	if (nonceStockUsed == int(sizeof(nonceStock)))
+	{
+		if (RAND_bytes(nonceStock, sizeof(nonceStock)) != 1)
+		{
+			DBLOG_ERROR("MessageCrypto", DbErrorCrypto, 0, "no random bytes for nonces", QString());
+			return false;
+		}
+		nonceStockUsed = 0;
+	}
+
+	unsigned char* header = reinterpret_cast<unsigned char*>(out);
+	header[0] = quint8(cipherSuite);
+	memcpy(header + 1, nonceStock + nonceStockUsed, nonceSize);
+	nonceStockUsed += nonceSize;
+
+	int outLength = 0;
+	unsigned char* body = header + headerSize;
+	bool ok = EVP_EncryptInit_ex(encryptCtx, nullptr, nullptr, nullptr, header + 1) == 1
+		&& EVP_EncryptUpdate(encryptCtx, nullptr, &outLength, header, headerSize) == 1
+		&& (associatedData.isEmpty() || EVP_EncryptUpdate(encryptCtx, nullptr, &outLength,
+			reinterpret_cast<const unsigned char*>(associatedData.constData()), associatedData.size()) == 1)
+		&& EVP_EncryptUpdate(encryptCtx, body, &outLength, reinterpret_cast<const unsigned char*>(plaintext), length) == 1
+		&& EVP_EncryptFinal_ex(encryptCtx, body + outLength, &outLength) == 1
+		&& EVP_CIPHER_CTX_ctrl(encryptCtx, EVP_CTRL_AEAD_GET_TAG, tagSize, body + length) == 1;
+	return ok;
+}
+
+/**
+ * @brief Gets the keyed decryption context for a suite, creating it the first time
+ * @param messageSuite The suite read from a sealed message
+ * @return The context, or nullptr if the suite is unknown or the key is invalid
+ */
+EVP_CIPHER_CTX* MessageCrypto::decryptContext(CipherSuite messageSuite)
+{
+	if (key.size() != keySize || (messageSuite != CipherSuite::Aes256Gcm && messageSuite != CipherSuite::ChaCha20Poly1305))
+	{
+		return nullptr;
+	}
+
+	EVP_CIPHER_CTX*& ctx = decryptCtx[messageSuite == CipherSuite::Aes256Gcm ? 0 : 1];
+	if (!ctx)
+	{
+		ctx = EVP_CIPHER_CTX_new();
+		if (ctx && EVP_DecryptInit_ex(ctx, cipherFor(messageSuite), nullptr, reinterpret_cast<const unsigned char*>(key.constData()), nullptr) != 1)
+		{
+			EVP_CIPHER_CTX_free(ctx);
+			ctx = nullptr;
+		}
+	}
+	return ctx;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file messagecrypto.h
+ * @brief This contains the prototypes for the chat message encryption engine
+ *
+ * Messages are sealed with an AEAD cipher: AES-256-GCM when the CPU has AES and carry-less
+ * multiply instructions, ChaCha20-Poly1305 otherwise. The implementations come from OpenSSL's
+ * libcrypto, which uses AES-NI/VAES for GCM and SIMD code paths for ChaCha20-Poly1305.
+ *
+ * A sealed message is laid out as [suite:1][nonce:12][ciphertext][tag:16]. The suite byte and
+ * nonce are authenticated along with any associated data, so any message can be opened by any
+ * MessageCrypto holding the same key, whichever suite it seals with itself.
+ *
+ * The batch API writes all of the sealed messages back to back into one caller-owned buffer,
+ * which keeps its capacity between calls, so sealing a batch makes no per-message allocations.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef MESSAGECRYPTO_H
+#define MESSAGECRYPTO_H
+
+#include <QByteArray>
+#include <QVector>
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+// The AEAD algorithms a message can be sealed with; the value is stored in the first byte
+enum class CipherSuite : quint8
+{
+	Aes256Gcm = 1,
+	ChaCha20Poly1305 = 2
+};
+
+class MessageCrypto
+{
+	public:
+		static const int keySize = 32;
+		static const int nonceSize = 12;
+		static const int tagSize = 16;
+		static const int headerSize = 1 + nonceSize;
+		static const int overhead = headerSize + tagSize;
+
+		explicit MessageCrypto(const QByteArray& key);
+		MessageCrypto(const QByteArray& key, CipherSuite suite);
+		~MessageCrypto();
+		static bool hasAesHardware();
+		static CipherSuite preferredSuite();
+		static QByteArray generateKey();
+		CipherSuite suite() const;
+		QByteArray seal(const QByteArray& plaintext, const QByteArray& associatedData = QByteArray());
+		bool open(const QByteArray& sealed, QByteArray& plaintext, const QByteArray& associatedData = QByteArray());
+		bool sealBatch(const QVector<QByteArray>& plaintexts, QByteArray& sealed, QVector<int>& offsets, const QByteArray& associatedData = QByteArray());
+		bool openBatch(const QByteArray& sealed, const QVector<int>& offsets, QVector<QByteArray>& plaintexts, const QByteArray& associatedData = QByteArray());
+	private:
+		Q_DISABLE_COPY(MessageCrypto)
+		bool sealInto(const char* plaintext, int length, const QByteArray& associatedData, char* out);
+		EVP_CIPHER_CTX* decryptContext(CipherSuite messageSuite);
+		QByteArray key;
+		CipherSuite cipherSuite;
+		EVP_CIPHER_CTX* encryptCtx;
+		EVP_CIPHER_CTX* decryptCtx[2];
+		unsigned char nonceStock[64 * nonceSize];	// random nonces drawn ahead of use
+		int nonceStockUsed;
+};
+
+#endif	// MESSAGECRYPTO_H
@@ -0,0 +1,152 @@
+/**
+ * @file mpscring.h
+ * @brief A bounded, lock-free, multi-producer single-consumer ring buffer
+ *
+ * Each slot carries a sequence number that tells producers and the consumer
+ * whose turn it is to touch that slot, so neither side ever takes a lock.
+ * Producers may reserve several consecutive slots in one step, which keeps
+ * multi-record entries (such as a traced addChat and its member list) together.
+ * When the ring is full a push fails instead of blocking the caller.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef MPSCRING_H
+#define MPSCRING_H
+
+#include <QtGlobal>
+#include <atomic>
+#include <memory>
+
+template <typename T>
+class MpscRing
+{
+	public:
+		/**
+		 * @brief Constructor for the ring buffer
+		 * @param requestedCapacity The minimum number of slots, rounded up to a power of two
+		 */
+		explicit MpscRing(int requestedCapacity)
+		{
+			size = 1;
+			while (size < quint64(requestedCapacity))
+			{
+				size <<= 1;
+			}
+			mask = size - 1;
+			slots.reset(new Slot[size]);
+			for (quint64 i = 0; i < size; i++)
+			{
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+			}
+			head.store(0, std::memory_order_relaxed);
+			tail.store(0, std::memory_order_relaxed);
+		}
+
+		/**
+		 * @brief Pushes a single item onto the ring
+		 * @param item The item to be copied into the ring
+		 * @return boolean indicating whether there was room for the item
+		 */
+		bool tryPush(const T& item)
+		{
+			return tryPush(&item, 1);
+		}
+
+		/**
+		 * @brief Pushes several items into consecutive slots of the ring
+		 * The consumer will see the items in order with no other producer's items between them
+		 * @param items Pointer to the first of the items to be copied into the ring
+		 * @param count The number of items
+		 * @return boolean indicating whether there was room for all of the items (nothing is pushed otherwise)
+		 */
+		bool tryPush(const T* items, int count)
+		{
+			if (count <= 0 || quint64(count) > size)
+			{
+				return false;
+			}
+
+			quint64 pos = head.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				// The consumer frees slots in order, so if the last slot of the range is free the rest are too
+				quint64 lastPos = pos + count - 1;
+				quint64 seq = slots[lastPos & mask].sequence.load(std::memory_order_acquire);
+				qint64 diff = qint64(seq) - qint64(lastPos);
+
+				if (diff == 0)
+				{
+					if (head.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+					{
+						break;
+					}
+				}
+				else if (diff < 0)
+				{
+					// The consumer has not caught up yet, so the ring is full
+					return false;
+				}
+				else
+				{
+					// Another producer claimed these slots first
+					pos = head.load(std::memory_order_relaxed);
+				}
+			}
+
+			for (int i = 0; i < count; i++)
+			{
+				Slot& slot = slots[(pos + i) & mask];
+				slot.value = items[i];
+				slot.sequence.store(pos + i + 1, std::memory_order_release);
+			}
+			return true;
+		}
+
+		/**
+		 * @brief Pops the oldest item from the ring
+		 * Must only be called from the single consumer thread
+		 * @param item Receives the popped item
+		 * @return boolean indicating whether an item was available
+		 */
+		bool tryPop(T& item)
+		{
+			quint64 pos = tail.load(std::memory_order_relaxed);
+			Slot& slot = slots[pos & mask];
+
+			if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+			{
+				return false;
+			}
+
+			item = slot.value;
+			slot.sequence.store(pos + size, std::memory_order_release);
+			tail.store(pos + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		/**
+		 * @brief Gets the number of slots in the ring
+		 * @return The capacity of the ring
+		 */
+		int capacity() const
+		{
+			return int(size);
+		}
+
+	private:
+		struct Slot
+		{
+			std::atomic<quint64> sequence;
+			T value;
+		};
+
+		std::unique_ptr<Slot[]> slots;
+		quint64 size;
+		quint64 mask;
+		alignas(64) std::atomic<quint64> head;
+		alignas(64) std::atomic<quint64> tail;
+};
+
+#endif	// MPSCRING_H
@@ -0,0 +1,169 @@
+/**
+ * @file presence.cpp
+ * @brief Tracks which users have open connections, sharded by username
+ *
+ * Offline users keep their entry so their last-seen time can still be read.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <presence.h>
+#include <QDateTime>
+#include <QReadLocker>
+#include <QWriteLocker>
+
+// A user's open connections and when they last connected or disconnected
+struct PresenceRegistry::Entry
+{
+	QVector<int> handles;
+	qint64 lastSeen;
+
+	Entry() : lastSeen(0) {}
+};
+
+// One lock and table per shard, each on its own cache lines so their locks do not share one
+struct alignas(64) PresenceRegistry::Shard
+{
+	QReadWriteLock lock;
+	QHash<QString, Entry> users;
+};
+
+/**
+ * @brief Constructor for an empty presence registry
+ */
+PresenceRegistry::PresenceRegistry()
+	: shards(new Shard[shardCount]), online(0)
+{
+}
+
+/**
+ * @brief Destructor for the presence registry
+ */
+PresenceRegistry::~PresenceRegistry()
+{
+	delete[] shards;
+}
+
+/**
+ * @brief Records that a user opened a connection
+ * @param username The username
+ * @param handle The connection's handle, such as its fan-out connection ID
+ * @return void
+ */
+void PresenceRegistry::setOnline(const QString& username, int handle)
+{
+	Shard& shard = shardFor(username);
+	QWriteLocker locker(&shard.lock);
+	Entry& entry = shard.users[username];
+	if (entry.handles.isEmpty())
+	{
+		online.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (!entry.handles.contains(handle))
+	{
+		entry.handles.append(handle);
+	}
+	entry.lastSeen = QDateTime::currentMSecsSinceEpoch();
+	return;
+}
+
+/**
+ * @brief Records that one of a user's connections closed; the user stays online while any remain
+ * @param username The username
+ * @param handle The handle given to setOnline()
+ * @return void
+ */
+void PresenceRegistry::setOffline(const QString& username, int handle)
+{
+	Shard& shard = shardFor(username);
+	QWriteLocker locker(&shard.lock);
+	QHash<QString, Entry>::iterator found = shard.users.find(username);
+	if (found == shard.users.end() || !found.value().handles.removeOne(handle))
+	{
+		return;
+	}
+	if (found.value().handles.isEmpty())
+	{
+		online.fetch_sub(1, std::memory_order_relaxed);
+	}
+	found.value().lastSeen = QDateTime::currentMSecsSinceEpoch();
+	return;
+}
+
+/**
+ * @brief Checks whether a user has any open connection
+ * @param username The username
+ * @return boolean indicating whether the user is online
+ */
+bool PresenceRegistry::isOnline(const QString& username) const
+{
+	Shard& shard = shardFor(username);
+	QReadLocker locker(&shard.lock);
+	QHash<QString, Entry>::const_iterator found = shard.users.constFind(username);
+	return found != shard.users.constEnd() && !found.value().handles.isEmpty();
+}
+
+/**
+ * @brief Gets the handles of a user's open connections
+ * @param username The username
+ * @return The handles in the order the connections were opened, empty if the user is offline
+ */
+QVector<int> PresenceRegistry::connections(const QString& username) const
+{
+	Shard& shard = shardFor(username);
+	QReadLocker locker(&shard.lock);
+	QHash<QString, Entry>::const_iterator found = shard.users.constFind(username);
+	return found != shard.users.constEnd() ? found.value().handles : QVector<int>();
+}
+
+/**
+ * @brief Gets when a user last opened or closed a connection
+ * @param username The username
+ * @return Milliseconds since the Unix epoch, or 0 if the user has not been seen
+ */
+qint64 PresenceRegistry::lastSeen(const QString& username) const
+{
+	Shard& shard = shardFor(username);
+	QReadLocker locker(&shard.lock);
+	QHash<QString, Entry>::const_iterator found = shard.users.constFind(username);
+	return found != shard.users.constEnd() ? found.value().lastSeen : 0;
+}
+
+/**
+ * @brief Keeps the users that are online
+ * @param usernames The users to check, such as a chat's members
+ * @return The online users, in the order given
+ */
+QVector<QString> PresenceRegistry::filterOnline(const QVector<QString>& usernames) const
+{
+	QVector<QString> result;
+	for (int i = 0; i < usernames.size(); i++)
+	{
+		if (isOnline(usernames[i]))
+		{
+			result.append(usernames[i]);
+		}
+	}
+	return result;
+}
+
+/**
+ * @brief Gets the number of users with at least one open connection
+ * @return The number of online users
+ */
+int PresenceRegistry::onlineCount() const
+{
+	return online.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Gets the shard a user belongs to
+ * @param username The username
+ * @return The shard
+ */
+PresenceRegistry::Shard& PresenceRegistry::shardFor(const QString& username) const
+{
+	// The top bits of a multiplicative mix, so the shard does not depend on the bits QHash buckets by
+	return shards[(qHash(username) * 2654435761u) >> (32 - shardBits)];
+}
@@ -0,0 +1,51 @@
+/**
+ * @file presence.h
+ * @brief This contains the prototypes for the in-memory presence registry
+ *
+ * The registry records which users are online: for every user it holds the handles of their
+ * open connections and the time they were last seen connecting or disconnecting. Users are
+ * spread over shardCount shards by the hash of their name, and each shard has its own lock
+ * and hash table, so updates for different users rarely contend and a lookup is one hash
+ * probe under a read lock.
+ *
+ * Membership still comes from the database; DbManager::getOnlineChatUsers() intersects a chat's
+ * members with the registry.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QReadWriteLock>
+#include <atomic>
+
+class PresenceRegistry
+{
+	public:
+		static const int shardBits = 6;
+		static const int shardCount = 1 << shardBits;
+
+		PresenceRegistry();
+		~PresenceRegistry();
+		void setOnline(const QString& username, int handle);
+		void setOffline(const QString& username, int handle);
+		bool isOnline(const QString& username) const;
+		QVector<int> connections(const QString& username) const;
+		qint64 lastSeen(const QString& username) const;
+		QVector<QString> filterOnline(const QVector<QString>& usernames) const;
+		int onlineCount() const;
+	private:
+		Q_DISABLE_COPY(PresenceRegistry)
+		struct Entry;
+		struct Shard;
+		Shard& shardFor(const QString& username) const;
+		Shard* shards;
+		std::atomic<int> online;
+};
+
+#endif	// PRESENCE_H
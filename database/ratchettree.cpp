@@ -0,0 +1,679 @@
+/**
+ * @file ratchettree.cpp
+ * @brief Builds and rekeys the per-chat group key trees
+ *
+ * A node's key is blank (NULL) when no member sits below it. When a leaf changes, every node on
+ * its path to the root gets a fresh key sealed under each non-blank child, which is at most two
+ * encryptions per level. A removed member never knew the copath keys the new path keys are sealed
+ * under, so they cannot follow the tree past their old leaf.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <ratchettree.h>
+#include <dbmanager.h>
+#include <senderkeys.h>
+#include <messagecrypto.h>
+#include <dblog.h>
+
+/**
+ * @brief Gets the level of a node; leaves are level 0
+ * @param node The node number
+ * @return The number of trailing one bits in the node number
+ */
+static int nodeLevel(int node)
+{
+	int level = 0;
+	while ((node >> level) & 1)
+	{
+		level++;
+	}
+	return level;
+}
+
+/**
+ * @brief Gets the parent of a node
+ * @param node The node number, which must not be the root
+ * @return The parent's node number
+ */
+static int nodeParent(int node)
+{
+	int level = nodeLevel(node);
+	int side = (node >> (level + 1)) & 1;
+	return (node | (1 << level)) ^ (side << (level + 1));
+}
+
+/**
+ * @brief Gets the other child of a node's parent
+ * @param node The node number, which must not be the root
+ * @return The sibling's node number
+ */
+static int nodeSibling(int node)
+{
+	int parent = nodeParent(node);
+	int level = nodeLevel(parent);
+	return node < parent ? parent ^ (3 << (level - 1)) : parent ^ (1 << (level - 1));
+}
+
+/**
+ * @brief Builds the associated data that binds a sealed node key to its place in the tree
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The tree epoch the key was sealed in
+ * @param node The node whose key is sealed
+ * @param child The child whose key seals it, or -1 for a leaf key sealed to its member
+ * @return The associated data
+ */
+static QByteArray treeData(int chatID, qint64 epoch, int node, int child)
+{
+	return QByteArray::number(chatID) + ':' + QByteArray::number(epoch) + ':' + QByteArray::number(node) + ':' + QByteArray::number(child);
+}
+
+/**
+ * @brief Constructor for a group key tree manager
+ * @param manager The database manager whose connection and chats are used
+ * @param userKeys The source of each member's long-term key, used to deliver their leaf key
+ */
+RatchetTreeManager::RatchetTreeManager(DbManager& manager, SenderKeyManager& userKeys)
+	: manager(manager), userKeys(userKeys), encryptions(0), updateBytes(0)
+{
+}
+
+/**
+ * @brief Creates the grouptrees, treenodes and treeupdates tables if they do not exist
+ * @return boolean indicating whether the tables are ready
+ */
+bool RatchetTreeManager::createTables()
+{
+	QSqlQuery query(manager.database());
+	bool ok = query.exec("CREATE TABLE IF NOT EXISTS grouptrees(chatid INTEGER PRIMARY KEY, epoch INTEGER NOT NULL, "
+			"leafcount INTEGER NOT NULL, nextleaf INTEGER NOT NULL);")
+		&& query.exec("CREATE TABLE IF NOT EXISTS treenodes(chatid INTEGER NOT NULL, node INTEGER NOT NULL, key BLOB, member TEXT, "
+			"PRIMARY KEY (chatid, node));")
+		&& query.exec("CREATE INDEX IF NOT EXISTS treenodes_member ON treenodes(chatid, member);")
+		&& query.exec("CREATE INDEX IF NOT EXISTS treenodes_blank ON treenodes(chatid, node) WHERE key IS NULL;")
+		&& query.exec("CREATE TABLE IF NOT EXISTS treeupdates(chatid INTEGER NOT NULL, epoch INTEGER NOT NULL, node INTEGER NOT NULL, "
+			"childnode INTEGER NOT NULL, sealedkey BLOB NOT NULL, PRIMARY KEY (chatid, node, childnode, epoch));");
+
+	if (!ok)
+	{
+		DBLOG_ERROR("createTables", DbErrorQuery, 0, "group tree tables could not be created", query.lastError().text());
+	}
+	return ok;
+}
+
+/**
+ * @brief Builds the key tree for an existing chat from its current members
+ * This seals every key in the tree once, so it costs O(n); later changes cost O(log n)
+ * @param chatID An integer representing the chat ID number
+ * @return boolean indicating whether the tree was built
+ */
+bool RatchetTreeManager::createGroup(int chatID)
+{
+	qint64 epoch = 0;
+	int leafCount = 0;
+	int nextLeaf = 0;
+	if (readTree(chatID, epoch, leafCount, nextLeaf))
+	{
+		DBLOG_WARNING("createGroup", DbErrorChatExists, chatID, "chat already has a group tree", QString());
+		return false;
+	}
+
+	QVector<QString> members = manager.getChatUsers(chatID);
+	if (members.isEmpty())
+	{
+		DBLOG_WARNING("createGroup", DbErrorChatMissing, chatID, "chat does not exist or has no members", QString());
+		return false;
+	}
+
+	leafCount = 1;
+	while (leafCount < members.size())
+	{
+		leafCount *= 2;
+	}
+	epoch = 1;
+	encryptions = 0;
+	updateBytes = 0;
+
+	QSqlDatabase db = manager.database();
+	db.transaction();
+	QVector<QByteArray> keys(2 * leafCount - 1);
+	bool ok = true;
+	for (int i = 0; ok && i < members.size(); i++)
+	{
+		keys[2 * i] = MessageCrypto::generateKey();
+		ok = setNode(chatID, 2 * i, keys[2 * i], members[i])
+			&& sealUpdate(chatID, epoch, 2 * i, -1, keys[2 * i], userKeys.userKey(members[i]));
+	}
+
+	// Fill in the parents one level at a time
+	for (int level = 1; ok && (1 << level) <= leafCount; level++)
+	{
+		for (int node = (1 << level) - 1; ok && node < keys.size(); node += 1 << (level + 1))
+		{
+			int left = node ^ (1 << (level - 1));
+			int right = node ^ (3 << (level - 1));
+			if (keys[left].isEmpty() && keys[right].isEmpty())
+			{
+				continue;
+			}
+
+			keys[node] = MessageCrypto::generateKey();
+			ok = setNode(chatID, node, keys[node], QString())
+				&& (keys[left].isEmpty() || sealUpdate(chatID, epoch, node, left, keys[node], keys[left]))
+				&& (keys[right].isEmpty() || sealUpdate(chatID, epoch, node, right, keys[node], keys[right]));
+		}
+	}
+	ok = ok && writeTree(chatID, epoch, leafCount, members.size());
+
+	for (int i = 0; i < keys.size(); i++)
+	{
+		keys[i].fill(0);
+	}
+	if (!ok)
+	{
+		db.rollback();
+		return false;
+	}
+	return db.commit();
+}
+
+/**
+ * @brief Deletes a chat's key tree and its sealed updates
+ * @param chatID An integer representing the chat ID number
+ * @return boolean indicating whether the tree was deleted
+ */
+bool RatchetTreeManager::deleteGroup(int chatID)
+{
+	QSqlDatabase db = manager.database();
+	db.transaction();
+	QSqlQuery query(db);
+	bool ok = true;
+	const char* statements[] = { "DELETE FROM grouptrees WHERE chatid = (:chatID)",
+		"DELETE FROM treenodes WHERE chatid = (:chatID)",
+		"DELETE FROM treeupdates WHERE chatid = (:chatID)" };
+	for (const char* statement : statements)
+	{
+		query.prepare(statement);
+		query.bindValue(":chatID", chatID);
+		ok = ok && query.exec();
+	}
+
+	if (!ok)
+	{
+		DBLOG_ERROR("deleteGroup", DbErrorQuery, chatID, "group tree could not be deleted", query.lastError().text());
+		db.rollback();
+		return false;
+	}
+	return db.commit();
+}
+
+/**
+ * @brief Adds a member to a chat's key tree
+ * The member takes a blank leaf, or the next unused one, doubling the tree when it is full
+ * @param chatID An integer representing the chat ID number
+ * @param username The username of the new member
+ * @return boolean indicating whether the member was added and the path rekeyed
+ */
+bool RatchetTreeManager::addMember(int chatID, const QString& username)
+{
+	qint64 epoch = 0;
+	int leafCount = 0;
+	int nextLeaf = 0;
+	if (!readTree(chatID, epoch, leafCount, nextLeaf))
+	{
+		DBLOG_WARNING("addMember", DbErrorChatMissing, chatID, "chat has no group tree", QString());
+		return false;
+	}
+	if (memberLeaf(chatID, username) >= 0)
+	{
+		DBLOG_WARNING("addMember", DbErrorUserExists, chatID, "user is already in the group tree", username);
+		return false;
+	}
+
+	QByteArray userKey = userKeys.userKey(username);
+	if (userKey.isEmpty())
+	{
+		return false;
+	}
+
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT node FROM treenodes WHERE chatid = (:chatID) AND key IS NULL AND node % 2 = 0 LIMIT 1");
+	query.bindValue(":chatID", chatID);
+	int leaf;
+	if (query.exec() && query.next())
+	{
+		leaf = query.value(0).toInt();
+	}
+	else
+	{
+		leaf = 2 * nextLeaf++;
+		while (nextLeaf > leafCount)
+		{
+			leafCount *= 2;
+		}
+	}
+	query.finish();
+
+	epoch++;
+	encryptions = 0;
+	updateBytes = 0;
+	QByteArray leafKey = MessageCrypto::generateKey();
+
+	QSqlDatabase db = manager.database();
+	db.transaction();
+	bool ok = setNode(chatID, leaf, leafKey, username)
+		&& sealUpdate(chatID, epoch, leaf, -1, leafKey, userKey)
+		&& rekeyPath(chatID, epoch, leafCount, leaf, leafKey)
+		&& writeTree(chatID, epoch, leafCount, nextLeaf)
+		&& pruneUpdates(chatID, epoch, leafCount, leaf);
+	leafKey.fill(0);
+
+	if (!ok)
+	{
+		db.rollback();
+		return false;
+	}
+	return db.commit();
+}
+
+/**
+ * @brief Removes a member from a chat's key tree
+ * Blanks the member's leaf and rekeys its path, so the group key changes and the member cannot learn the new one
+ * @param chatID An integer representing the chat ID number
+ * @param username The username of the member leaving
+ * @return boolean indicating whether the member was removed and the path rekeyed
+ */
+bool RatchetTreeManager::removeMember(int chatID, const QString& username)
+{
+	qint64 epoch = 0;
+	int leafCount = 0;
+	int nextLeaf = 0;
+	if (!readTree(chatID, epoch, leafCount, nextLeaf))
+	{
+		DBLOG_WARNING("removeMember", DbErrorChatMissing, chatID, "chat has no group tree", QString());
+		return false;
+	}
+
+	int leaf = memberLeaf(chatID, username);
+	if (leaf < 0)
+	{
+		DBLOG_WARNING("removeMember", DbErrorUserMissing, chatID, "user is not in the group tree", username);
+		return false;
+	}
+
+	epoch++;
+	encryptions = 0;
+	updateBytes = 0;
+
+	QSqlDatabase db = manager.database();
+	db.transaction();
+	bool ok = setNode(chatID, leaf, QByteArray(), QString())
+		&& rekeyPath(chatID, epoch, leafCount, leaf, QByteArray())
+		&& writeTree(chatID, epoch, leafCount, nextLeaf)
+		&& pruneUpdates(chatID, epoch, leafCount, leaf);
+
+	if (!ok)
+	{
+		db.rollback();
+		return false;
+	}
+	return db.commit();
+}
+
+/**
+ * @brief Gets the epoch of a chat's key tree, which increases with every membership change
+ * @param chatID An integer representing the chat ID number
+ * @return The epoch, or -1 if the chat has no tree
+ */
+qint64 RatchetTreeManager::treeEpoch(int chatID)
+{
+	qint64 epoch = 0;
+	int leafCount = 0;
+	int nextLeaf = 0;
+	return readTree(chatID, epoch, leafCount, nextLeaf) ? epoch : -1;
+}
+
+/**
+ * @brief Gets a chat's current group key, which is the key at the root of its tree
+ * @param chatID An integer representing the chat ID number
+ * @return The group key, or an empty QByteArray if the chat has no members in its tree
+ */
+QByteArray RatchetTreeManager::groupKey(int chatID)
+{
+	qint64 epoch = 0;
+	int leafCount = 0;
+	int nextLeaf = 0;
+	if (!readTree(chatID, epoch, leafCount, nextLeaf))
+	{
+		return QByteArray();
+	}
+	return nodeKey(chatID, leafCount - 1);
+}
+
+/**
+ * @brief Derives the group key the way the given member's client would
+ * Opens the member's leaf key with their user key, then each sealed key on the path up to the root
+ * @param chatID An integer representing the chat ID number
+ * @param username The username of the member
+ * @return The group key, or an empty QByteArray if the member cannot derive it
+ */
+QByteArray RatchetTreeManager::memberGroupKey(int chatID, const QString& username)
+{
+	qint64 epoch = 0;
+	int leafCount = 0;
+	int nextLeaf = 0;
+	int leaf = memberLeaf(chatID, username);
+	if (leaf < 0 || !readTree(chatID, epoch, leafCount, nextLeaf))
+	{
+		return QByteArray();
+	}
+
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT epoch, sealedkey FROM treeupdates WHERE chatid = (:chatID) AND node = (:node) AND childnode = (:child) "
+		"ORDER BY epoch DESC LIMIT 1");
+
+	QByteArray key = userKeys.userKey(username);
+	int node = leaf;
+	int child = -1;
+	while (true)
+	{
+		query.bindValue(":chatID", chatID);
+		query.bindValue(":node", node);
+		query.bindValue(":child", child);
+		QByteArray opened;
+		if (key.isEmpty() || !query.exec() || !query.next())
+		{
+			return QByteArray();
+		}
+
+		MessageCrypto crypto(key);
+		if (!crypto.open(query.value(1).toByteArray(), opened, treeData(chatID, query.value(0).toLongLong(), node, child)))
+		{
+			return QByteArray();
+		}
+		key.fill(0);
+		key = opened;
+
+		if (node == leafCount - 1)
+		{
+			return key;
+		}
+		child = node;
+		node = nodeParent(node);
+	}
+}
+
+/**
+ * @brief Gets the approximate size of a chat's stored tree
+ * @param chatID An integer representing the chat ID number
+ * @return The bytes of node numbers, keys and member names in treenodes and of sealed keys in treeupdates for the chat
+ */
+qint64 RatchetTreeManager::stateSize(int chatID)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT COALESCE(SUM(8 + IFNULL(LENGTH(key), 0) + IFNULL(LENGTH(CAST(member AS BLOB)), 0)), 0) "
+		"FROM treenodes WHERE chatid = (:chatID)");
+	query.bindValue(":chatID", chatID);
+	if (!query.exec() || !query.next())
+	{
+		return -1;
+	}
+	qint64 size = query.value(0).toLongLong();
+	query.finish();
+
+	query.prepare("SELECT COALESCE(SUM(16 + LENGTH(sealedkey)), 0) FROM treeupdates WHERE chatid = (:chatID)");
+	query.bindValue(":chatID", chatID);
+	if (!query.exec() || !query.next())
+	{
+		return -1;
+	}
+	return size + query.value(0).toLongLong();
+}
+
+/**
+ * @brief Gets the number of keys sealed by the last createGroup, addMember or removeMember
+ * @return The number of encryptions
+ */
+int RatchetTreeManager::lastEncryptions() const
+{
+	return encryptions;
+}
+
+/**
+ * @brief Gets the size of the sealed keys written by the last createGroup, addMember or removeMember
+ * This is what the members have to download to follow the change
+ * @return The number of bytes
+ */
+qint64 RatchetTreeManager::lastUpdateBytes() const
+{
+	return updateBytes;
+}
+
+/**
+ * @brief Reads a chat's row from grouptrees
+ * @param chatID An integer representing the chat ID number
+ * @param epoch Receives the tree epoch
+ * @param leafCount Receives the number of leaves the tree has room for
+ * @param nextLeaf Receives the index of the first leaf that has never been used
+ * @return boolean indicating whether the chat has a tree
+ */
+bool RatchetTreeManager::readTree(int chatID, qint64& epoch, int& leafCount, int& nextLeaf)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT epoch, leafcount, nextleaf FROM grouptrees WHERE chatid = (:chatID)");
+	query.bindValue(":chatID", chatID);
+	if (!query.exec() || !query.next())
+	{
+		return false;
+	}
+	epoch = query.value(0).toLongLong();
+	leafCount = query.value(1).toInt();
+	nextLeaf = query.value(2).toInt();
+	return true;
+}
+
+/**
+ * @brief Writes a chat's row in grouptrees
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The tree epoch
+ * @param leafCount The number of leaves the tree has room for
+ * @param nextLeaf The index of the first leaf that has never been used
+ * @return boolean indicating whether the row was written
+ */
+bool RatchetTreeManager::writeTree(int chatID, qint64 epoch, int leafCount, int nextLeaf)
+{
+	QSqlQuery query(manager.database());
+	query.prepare("INSERT OR REPLACE INTO grouptrees (chatid, epoch, leafcount, nextleaf) VALUES (:chatID, :epoch, :leafCount, :nextLeaf)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":epoch", epoch);
+	query.bindValue(":leafCount", leafCount);
+	query.bindValue(":nextLeaf", nextLeaf);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("writeTree", DbErrorQuery, chatID, "group tree could not be written", query.lastError().text());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Deletes the sealed keys on a rekeyed path that were replaced at the current epoch
+ * Every node on the path got a new key, or was blanked, so its rows from earlier epochs hold keys
+ * no member can use any more
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The tree epoch of the change
+ * @param leafCount The number of leaves the tree has room for
+ * @param leaf The leaf that changed
+ * @return boolean indicating whether the stale rows were deleted
+ */
+bool RatchetTreeManager::pruneUpdates(int chatID, qint64 epoch, int leafCount, int leaf)
+{
+	QSqlQuery query(manager.database());
+	query.prepare("DELETE FROM treeupdates WHERE chatid = (:chatID) AND node = (:node) AND epoch < (:epoch)");
+	int root = leafCount - 1;
+	int node = leaf;
+	while (true)
+	{
+		query.bindValue(":chatID", chatID);
+		query.bindValue(":node", node);
+		query.bindValue(":epoch", epoch);
+		if (!query.exec())
+		{
+			DBLOG_ERROR("pruneUpdates", DbErrorQuery, chatID, "stale tree keys could not be deleted", query.lastError().text());
+			return false;
+		}
+		if (node == root)
+		{
+			return true;
+		}
+		node = nodeParent(node);
+	}
+}
+
+/**
+ * @brief Finds the leaf a member sits at
+ * @param chatID An integer representing the chat ID number
+ * @param username The username of the member
+ * @return The leaf's node number, or -1 if the member is not in the tree
+ */
+int RatchetTreeManager::memberLeaf(int chatID, const QString& username)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT node FROM treenodes WHERE chatid = (:chatID) AND member = (:username)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":username", username);
+	if (!query.exec() || !query.next())
+	{
+		return -1;
+	}
+	return query.value(0).toInt();
+}
+
+/**
+ * @brief Reads the key of one node
+ * @param chatID An integer representing the chat ID number
+ * @param node The node number
+ * @return The key, or an empty QByteArray if the node is blank
+ */
+QByteArray RatchetTreeManager::nodeKey(int chatID, int node)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT key FROM treenodes WHERE chatid = (:chatID) AND node = (:node)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":node", node);
+	if (!query.exec() || !query.next())
+	{
+		return QByteArray();
+	}
+	return query.value(0).toByteArray();
+}
+
+/**
+ * @brief Writes the key and member of one node
+ * @param chatID An integer representing the chat ID number
+ * @param node The node number
+ * @param key The node's key, or an empty QByteArray to blank the node
+ * @param member The member at a leaf, or a null QString
+ * @return boolean indicating whether the node was written
+ */
+bool RatchetTreeManager::setNode(int chatID, int node, const QByteArray& key, const QString& member)
+{
+	QSqlQuery query(manager.database());
+	query.prepare("INSERT OR REPLACE INTO treenodes (chatid, node, key, member) VALUES (:chatID, :node, :key, :member)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":node", node);
+	query.bindValue(":key", key.isEmpty() ? QVariant(QVariant::ByteArray) : QVariant(key));
+	query.bindValue(":member", member.isEmpty() ? QVariant(QVariant::String) : QVariant(member));
+	if (!query.exec())
+	{
+		DBLOG_ERROR("setNode", DbErrorQuery, chatID, "tree node could not be written", query.lastError().text());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Seals a node key under one of its children's keys and stores it for the members
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The tree epoch of the change
+ * @param node The node whose key is sealed
+ * @param child The child whose key seals it, or -1 for a leaf key sealed under its member's user key
+ * @param key The key to seal
+ * @param childKey The key to seal it under
+ * @return boolean indicating whether the sealed key was stored
+ */
+bool RatchetTreeManager::sealUpdate(int chatID, qint64 epoch, int node, int child, const QByteArray& key, const QByteArray& childKey)
+{
+	MessageCrypto crypto(childKey);
+	QByteArray sealed = crypto.seal(key, treeData(chatID, epoch, node, child));
+	if (sealed.isEmpty())
+	{
+		return false;
+	}
+
+	QSqlQuery query(manager.database());
+	query.prepare("INSERT OR REPLACE INTO treeupdates (chatid, epoch, node, childnode, sealedkey) VALUES (:chatID, :epoch, :node, :child, :sealedkey)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":epoch", epoch);
+	query.bindValue(":node", node);
+	query.bindValue(":child", child);
+	query.bindValue(":sealedkey", sealed);
+	if (!query.exec())
+	{
+		DBLOG_ERROR("sealUpdate", DbErrorQuery, chatID, "sealed tree key could not be stored", query.lastError().text());
+		return false;
+	}
+	encryptions++;
+	updateBytes += sealed.size();
+	return true;
+}
+
+/**
+ * @brief Gives every node on a leaf's path to the root a fresh key
+ * Each new key is sealed under the new key of the child on the path and the unchanged key of its sibling
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The tree epoch of the change
+ * @param leafCount The number of leaves the tree has room for
+ * @param leaf The leaf that changed
+ * @param leafKey The leaf's new key, or an empty QByteArray if it was blanked
+ * @return boolean indicating whether the whole path was rekeyed
+ */
+bool RatchetTreeManager::rekeyPath(int chatID, qint64 epoch, int leafCount, int leaf, const QByteArray& leafKey)
+{
+	int root = leafCount - 1;
+	int child = leaf;
+	QByteArray childKey = leafKey;
+	while (child != root)
+	{
+		int parent = nodeParent(child);
+		int sibling = nodeSibling(child);
+		QByteArray siblingKey = nodeKey(chatID, sibling);
+		QByteArray key;
+		if (!childKey.isEmpty() || !siblingKey.isEmpty())
+		{
+			key = MessageCrypto::generateKey();
+			if ((!childKey.isEmpty() && !sealUpdate(chatID, epoch, parent, child, key, childKey))
+				|| (!siblingKey.isEmpty() && !sealUpdate(chatID, epoch, parent, sibling, key, siblingKey)))
+			{
+				return false;
+			}
+		}
+		if (!setNode(chatID, parent, key, QString()))
+		{
+			return false;
+		}
+
+		childKey.fill(0);
+		childKey = key;
+		child = parent;
+	}
+	childKey.fill(0);
+	return true;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file ratchettree.h
+ * @brief This contains the prototypes for tree-based group keys
+ *
+ * Each chat's members sit at the leaves of a binary tree of keys; every member knows the keys on
+ * the path from their leaf to the root, and the root key is the chat's group key. Adding or
+ * removing a member replaces only the keys on one leaf's path, and each new key is sealed under
+ * the keys of that node's two children, so a membership change costs O(log n) encryptions and
+ * O(log n) rows instead of sealing a fresh key for every remaining member.
+ *
+ * Nodes are numbered as in the MLS array tree: leaf i is node 2i and the root of a tree with
+ * leafCount leaves is node leafCount - 1, so growing the tree never renumbers existing nodes.
+ *
+ * Tables:
+ * grouptrees--one row per chat: its tree epoch, leaf capacity and next unused leaf.
+ * treenodes--the key of each node and the member at each leaf; NULL keys are blank nodes.
+ * treeupdates--every sealed node key, addressed by the child key it is sealed under, which is what
+ * members read to follow the tree from their leaf to the root. Only each node's latest seals are kept.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef RATCHETTREE_H
+#define RATCHETTREE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+
+class DbManager;
+class SenderKeyManager;
+
+class RatchetTreeManager
+{
+	public:
+		RatchetTreeManager(DbManager& manager, SenderKeyManager& userKeys);
+		bool createTables();
+		bool createGroup(int chatID);
+		bool deleteGroup(int chatID);
+		bool addMember(int chatID, const QString& username);
+		bool removeMember(int chatID, const QString& username);
+		qint64 treeEpoch(int chatID);
+		QByteArray groupKey(int chatID);
+		QByteArray memberGroupKey(int chatID, const QString& username);
+		qint64 stateSize(int chatID);
+		int lastEncryptions() const;
+		qint64 lastUpdateBytes() const;
+	private:
+		bool readTree(int chatID, qint64& epoch, int& leafCount, int& nextLeaf);
+		bool writeTree(int chatID, qint64 epoch, int leafCount, int nextLeaf);
+		bool pruneUpdates(int chatID, qint64 epoch, int leafCount, int leaf);
+		int memberLeaf(int chatID, const QString& username);
+		QByteArray nodeKey(int chatID, int node);
+		bool setNode(int chatID, int node, const QByteArray& key, const QString& member);
+		bool sealUpdate(int chatID, qint64 epoch, int node, int child, const QByteArray& key, const QByteArray& childKey);
+		bool rekeyPath(int chatID, qint64 epoch, int leafCount, int leaf, const QByteArray& leafKey);
+		DbManager& manager;
+		SenderKeyManager& userKeys;
+		int encryptions;
+		qint64 updateBytes;
+};
+
+#endif	// RATCHETTREE_H
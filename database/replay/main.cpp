@@ -0,0 +1,76 @@
+#include <QCoreApplication>
+#include <tracereplayer.h>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * Replays a DbManager call trace recorded with DbManager::startRecording
+ * Usage: replay.out <trace file> <database file> [speed] [threads] [--seed]
+ * A speed of 1 keeps the original timing, 10 runs ten times faster and 0 runs the calls back to back
+ * --seed first creates the tables and every user the trace assumes already exists
+ */
+
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = QCoreApplication::arguments();
+
+	bool seed = args.contains("--seed");
+	args.removeAll("--seed");
+
+	if (args.size() < 3)
+	{
+		std::cout << "Usage: replay.out <trace file> <database file> [speed] [threads] [--seed]" << std::endl;
+		return 1;
+	}
+
+	QString tracePath = args[1];
+	QString databasePath = args[2];
+	double speed = args.size() > 3 ? args[3].toDouble() : 1.0;
+	int threads = args.size() > 4 ? args[4].toInt() : 1;
+
+	TraceReplayer replayer;
+	if (!replayer.load(tracePath))
+	{
+		return 1;
+	}
+	std::cout << "Loaded " << replayer.callCount() << " calls from " << tracePath.toStdString() << std::endl;
+
+	if (seed && !replayer.seedUsers(databasePath))
+	{
+		std::cerr << "Replay error: could not seed the database" << std::endl;
+		return 1;
+	}
+
+	QVector<ReplayStats> results = replayer.replay(databasePath, speed, threads);
+
+	// Print one row per method: recorded latency, replayed latency and the change in the mean
+	std::cout << std::left << std::setw(18) << "method" << std::right
+		<< std::setw(9) << "calls"
+		<< std::setw(12) << "orig mean"
+		<< std::setw(11) << "orig p50"
+		<< std::setw(11) << "orig p99"
+		<< std::setw(12) << "new mean"
+		<< std::setw(11) << "new p50"
+		<< std::setw(11) << "new p99"
+		<< std::setw(10) << "delta" << std::endl;
+
+	std::cout << std::fixed << std::setprecision(1);
+	for (int i = 0; i < results.size(); i++)
+	{
+		const ReplayStats& r = results[i];
+		double delta = r.originalMeanUs > 0 ? (r.replayMeanUs - r.originalMeanUs) / r.originalMeanUs * 100.0 : 0.0;
+		std::cout << std::left << std::setw(18) << TraceReplayer::opName(r.op) << std::right
+			<< std::setw(9) << r.calls
+			<< std::setw(12) << r.originalMeanUs
+			<< std::setw(11) << r.originalP50Us
+			<< std::setw(11) << r.originalP99Us
+			<< std::setw(12) << r.replayMeanUs
+			<< std::setw(11) << r.replayP50Us
+			<< std::setw(11) << r.replayP99Us
+			<< std::setw(9) << delta << "%" << std::endl;
+	}
+	std::cout << "(latencies in microseconds)" << std::endl;
+
+	return 0;
+}
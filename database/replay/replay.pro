@@ -0,0 +1,13 @@
+QT       += core sql
+QT       -= gui
+
+TARGET = replay.out
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+
+SOURCES += main.cpp
+
+include(../database.pri)
@@ -0,0 +1,360 @@
+/**
+ * @file resultset.cpp
+ * @brief Holds membership results in pooled arenas of UTF-8 strings and chat ID numbers
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <resultset.h>
+#include <QMutex>
+#include <QMutexLocker>
+
+// Arenas handed back and waiting to be reused
+static QMutex poolMutex;
+static std::vector<ResultArena*> pool;
+
+/**
+ * @brief Copies the string out of its result set
+ * @return The string as a QString
+ */
+QString Utf8View::toString() const
+{
+	return QString::fromUtf8(bytes, length);
+}
+
+/**
+ * @brief Copies the string's bytes out of its result set
+ * @return The UTF-8 bytes
+ */
+QByteArray Utf8View::toByteArray() const
+{
+	return QByteArray(bytes, length);
+}
+
+/**
+ * @brief Constructor for an empty arena
+ */
+ResultArena::ResultArena()
+{
+	offsets.push_back(0);
+}
+
+/**
+ * @brief Destructor for the arena
+ */
+ResultArena::~ResultArena()
+{
+}
+
+/**
+ * @brief Takes an empty arena from the pool, or makes one if the pool is empty
+ * @return The arena, to be handed back with release()
+ */
+ResultArena* ResultArena::acquire()
+{
+	{
+		QMutexLocker locker(&poolMutex);
+		if (!pool.empty())
+		{
+			ResultArena* arena = pool.back();
+			pool.pop_back();
+			return arena;
+		}
+	}
+	return new ResultArena();
+}
+
+/**
+ * @brief Clears an arena and returns it to the pool, or frees it if it is too big or the pool is full
+ * @param arena The arena, which may be nullptr
+ * @return void
+ */
+void ResultArena::release(ResultArena* arena)
+{
+	if (!arena)
+	{
+		return;
+	}
+	arena->clear();
+	if (arena->memoryUsage() <= maxPooledBytes)
+	{
+		QMutexLocker locker(&poolMutex);
+		if (int(pool.size()) < maxPooledArenas)
+		{
+			pool.push_back(arena);
+			return;
+		}
+	}
+	delete arena;
+	return;
+}
+
+/**
+ * @brief Appends a string that is already UTF-8
+ * @param data The bytes
+ * @param size The number of bytes
+ * @return void
+ */
+void ResultArena::appendText(const char* data, int size)
+{
+	if (size > 0)
+	{
+		bytes.insert(bytes.end(), data, data + size);
+	}
+	offsets.push_back(quint32(bytes.size()));
+	return;
+}
+
+/**
+ * @brief Appends a string, encoding it as UTF-8 straight into the buffer
+ * Unpaired surrogates become U+FFFD, as QString::toUtf8 does
+ * @param text The string
+ * @return void
+ */
+void ResultArena::appendText(const QString& text)
+{
+	const QChar* data = text.constData();
+	int length = text.size();
+	size_t start = bytes.size();
+	bytes.resize(start + size_t(length) * 3);
+	char* out = bytes.data() + start;
+	for (int i = 0; i < length; i++)
+	{
+		uint code = data[i].unicode();
+		if (code >= 0xd800 && code < 0xdc00 && i + 1 < length && data[i + 1].unicode() >= 0xdc00 && data[i + 1].unicode() < 0xe000)
+		{
+			code = 0x10000 + ((code - 0xd800) << 10) + (data[++i].unicode() - 0xdc00);
+		}
+		else if (code >= 0xd800 && code < 0xe000)
+		{
+			code = 0xfffd;
+		}
+
+		if (code < 0x80)
+		{
+			*out++ = char(code);
+		}
+		else if (code < 0x800)
+		{
+			*out++ = char(0xc0 | (code >> 6));
+			*out++ = char(0x80 | (code & 0x3f));
+		}
+		else if (code < 0x10000)
+		{
+			*out++ = char(0xe0 | (code >> 12));
+			*out++ = char(0x80 | ((code >> 6) & 0x3f));
+			*out++ = char(0x80 | (code & 0x3f));
+		}
+		else
+		{
+			// A surrogate pair is two code units, so its four bytes fit in the six reserved
+			*out++ = char(0xf0 | (code >> 18));
+			*out++ = char(0x80 | ((code >> 12) & 0x3f));
+			*out++ = char(0x80 | ((code >> 6) & 0x3f));
+			*out++ = char(0x80 | (code & 0x3f));
+		}
+	}
+	bytes.resize(size_t(out - bytes.data()));
+	offsets.push_back(quint32(bytes.size()));
+	return;
+}
+
+/**
+ * @brief Appends a chat ID number
+ * @param id The chat ID number
+ * @return void
+ */
+void ResultArena::appendId(int id)
+{
+	ids.push_back(id);
+	return;
+}
+
+/**
+ * @brief Empties the arena, keeping its memory for the next result
+ * @return void
+ */
+void ResultArena::clear()
+{
+	bytes.clear();
+	offsets.resize(1);
+	ids.clear();
+	return;
+}
+
+/**
+ * @brief Gets the memory the arena has reserved
+ * @return The size in bytes
+ */
+qint64 ResultArena::memoryUsage() const
+{
+	return qint64(bytes.capacity()) + qint64(offsets.capacity() * sizeof(quint32)) + qint64(ids.capacity() * sizeof(int));
+}
+
+/**
+ * @brief Constructor for an empty list, which holds no arena
+ */
+UsernameList::UsernameList()
+	: arena(nullptr)
+{
+}
+
+/**
+ * @brief Constructor for a list of the usernames in an arena
+ * @param arena The arena, from ResultArena::acquire(), which the list now owns
+ */
+UsernameList::UsernameList(ResultArena* arena)
+	: arena(arena)
+{
+}
+
+/**
+ * @brief Move constructor, leaving the other list empty
+ * @param other The list to take the arena from
+ */
+UsernameList::UsernameList(UsernameList&& other)
+	: arena(other.arena)
+{
+	other.arena = nullptr;
+}
+
+/**
+ * @brief Move assignment, releasing this list's arena and leaving the other list empty
+ * @param other The list to take the arena from
+ * @return This list
+ */
+UsernameList& UsernameList::operator=(UsernameList&& other)
+{
+	if (this != &other)
+	{
+		ResultArena::release(arena);
+		arena = other.arena;
+		other.arena = nullptr;
+	}
+	return *this;
+}
+
+/**
+ * @brief Destructor for the list, which returns its arena to the pool
+ */
+UsernameList::~UsernameList()
+{
+	ResultArena::release(arena);
+}
+
+/**
+ * @brief Checks whether a username is in the list
+ * @param username The username
+ * @return boolean indicating whether it is in the list
+ */
+bool UsernameList::contains(const QString& username) const
+{
+	QByteArray utf8 = username.toUtf8();
+	Utf8View wanted(utf8.constData(), utf8.size());
+	for (int i = 0; i < size(); i++)
+	{
+		if (at(i) == wanted)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Copies the list into the form getChatUsers returns
+ * @return QVector<QString> of the usernames
+ */
+QVector<QString> UsernameList::toVector() const
+{
+	QVector<QString> usernames;
+	usernames.reserve(size());
+	for (int i = 0; i < size(); i++)
+	{
+		usernames.append(at(i).toString());
+	}
+	return usernames;
+}
+
+/**
+ * @brief Constructor for an empty list, which holds no arena
+ */
+ChatIdList::ChatIdList()
+	: arena(nullptr)
+{
+}
+
+/**
+ * @brief Constructor for a list of the chat ID numbers in an arena
+ * @param arena The arena, from ResultArena::acquire(), which the list now owns
+ */
+ChatIdList::ChatIdList(ResultArena* arena)
+	: arena(arena)
+{
+}
+
+/**
+ * @brief Move constructor, leaving the other list empty
+ * @param other The list to take the arena from
+ */
+ChatIdList::ChatIdList(ChatIdList&& other)
+	: arena(other.arena)
+{
+	other.arena = nullptr;
+}
+
+/**
+ * @brief Move assignment, releasing this list's arena and leaving the other list empty
+ * @param other The list to take the arena from
+ * @return This list
+ */
+ChatIdList& ChatIdList::operator=(ChatIdList&& other)
+{
+	if (this != &other)
+	{
+		ResultArena::release(arena);
+		arena = other.arena;
+		other.arena = nullptr;
+	}
+	return *this;
+}
+
+/**
+ * @brief Destructor for the list, which returns its arena to the pool
+ */
+ChatIdList::~ChatIdList()
+{
+	ResultArena::release(arena);
+}
+
+/**
+ * @brief Checks whether a chat ID number is in the list
+ * @param chatID An integer representing the chat ID number
+ * @return boolean indicating whether it is in the list
+ */
+bool ChatIdList::contains(int chatID) const
+{
+	for (int i = 0; i < size(); i++)
+	{
+		if (at(i) == chatID)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Copies the list into the form getChatsUserIsIn returns
+ * @return QVector<int> of the chat ID numbers
+ */
+QVector<int> ChatIdList::toVector() const
+{
+	QVector<int> chats;
+	chats.reserve(size());
+	for (int i = 0; i < size(); i++)
+	{
+		chats.append(at(i));
+	}
+	return chats;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file resultset.h
+ * @brief This contains the prototypes for the arena-backed membership result sets
+ *
+ * getChatUsers and getChatsUserIsIn return a QVector with one QString per member, each converted
+ * from a QVariant, so a large chat costs an allocation per member on every call. UsernameList
+ * and ChatIdList hold the same results in a ResultArena instead: every username is appended to
+ * one contiguous UTF-8 buffer, with an offsets array marking where each one starts, and chat ID
+ * numbers go in one flat array. Members are read back as Utf8View, which points into the buffer.
+ *
+ * Arenas are taken from a process-wide pool and handed back, cleared but keeping their memory,
+ * when the list holding them is destroyed, so once the pool is warm a call allocates nothing for
+ * its results however many rows it returns. Arenas that grew past maxPooledBytes are freed
+ * instead, so one huge chat does not pin its memory forever. A view is only valid while the list
+ * it came from is alive.
+ *
+ * Callers that only walk a result once can skip the list too: the forEach methods of DbManager
+ * call a visitor per row while the query steps, passing views of SQLite's own row buffer that
+ * are only valid during the call. A visitor returns false to stop early.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef RESULTSET_H
+#define RESULTSET_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+// A UTF-8 string held by a result set, which it does not own
+class Utf8View
+{
+	public:
+		Utf8View() : bytes(nullptr), length(0) {}
+		Utf8View(const char* bytes, int length) : bytes(bytes), length(length) {}
+		const char* data() const { return bytes; }
+		int size() const { return length; }
+		bool isEmpty() const { return length == 0; }
+		bool operator==(const Utf8View& other) const
+		{
+			return length == other.length && (length == 0 || memcmp(bytes, other.bytes, size_t(length)) == 0);
+		}
+		bool operator!=(const Utf8View& other) const { return !(*this == other); }
+		QString toString() const;
+		QByteArray toByteArray() const;
+	private:
+		const char* bytes;
+		int length;
+};
+
+// Visitors called once per row; returning false stops the iteration
+typedef std::function<bool(Utf8View username)> UsernameVisitor;
+typedef std::function<bool(int chatID)> ChatIdVisitor;
+typedef std::function<bool(int chatID, Utf8View username)> RosterVisitor;
+
+class ResultArena
+{
+	public:
+		static const int maxPooledArenas = 64;
+		static const int maxPooledBytes = 1 << 20;
+
+		static ResultArena* acquire();
+		static void release(ResultArena* arena);
+		void appendText(const char* data, int size);
+		void appendText(const QString& text);
+		void appendId(int id);
+		void clear();
+		int textCount() const { return int(offsets.size()) - 1; }
+		Utf8View text(int index) const
+		{
+			return Utf8View(bytes.data() + offsets[size_t(index)], int(offsets[size_t(index) + 1] - offsets[size_t(index)]));
+		}
+		int idCount() const { return int(ids.size()); }
+		const int* idData() const { return ids.data(); }
+		qint64 memoryUsage() const;
+	private:
+		ResultArena();
+		~ResultArena();
+		Q_DISABLE_COPY(ResultArena)
+		std::vector<char> bytes;
+		std::vector<quint32> offsets;	// one more than the number of strings; the last is the end of the buffer
+		std::vector<int> ids;
+};
+
+// Usernames read from the database, backed by a pooled arena
+class UsernameList
+{
+	public:
+		class const_iterator
+		{
+			public:
+				const_iterator(const ResultArena* arena, int index) : arena(arena), index(index) {}
+				Utf8View operator*() const { return arena->text(index); }
+				const_iterator& operator++() { index++; return *this; }
+				bool operator==(const const_iterator& other) const { return index == other.index; }
+				bool operator!=(const const_iterator& other) const { return index != other.index; }
+			private:
+				const ResultArena* arena;
+				int index;
+		};
+
+		UsernameList();
+		explicit UsernameList(ResultArena* arena);
+		UsernameList(UsernameList&& other);
+		UsernameList& operator=(UsernameList&& other);
+		~UsernameList();
+		int size() const { return arena ? arena->textCount() : 0; }
+		bool isEmpty() const { return size() == 0; }
+		Utf8View at(int index) const { return arena->text(index); }
+		Utf8View operator[](int index) const { return arena->text(index); }
+		const_iterator begin() const { return const_iterator(arena, 0); }
+		const_iterator end() const { return const_iterator(arena, size()); }
+		bool contains(const QString& username) const;
+		QVector<QString> toVector() const;
+	private:
+		Q_DISABLE_COPY(UsernameList)
+		ResultArena* arena;
+};
+
+// Chat ID numbers read from the database, backed by a pooled arena
+class ChatIdList
+{
+	public:
+		ChatIdList();
+		explicit ChatIdList(ResultArena* arena);
+		ChatIdList(ChatIdList&& other);
+		ChatIdList& operator=(ChatIdList&& other);
+		~ChatIdList();
+		int size() const { return arena ? arena->idCount() : 0; }
+		bool isEmpty() const { return size() == 0; }
+		int at(int index) const { return arena->idData()[index]; }
+		int operator[](int index) const { return arena->idData()[index]; }
+		const int* begin() const { return arena ? arena->idData() : nullptr; }
+		const int* end() const { return arena ? arena->idData() + arena->idCount() : nullptr; }
+		bool contains(int chatID) const;
+		QVector<int> toVector() const;
+	private:
+		Q_DISABLE_COPY(ChatIdList)
+		ResultArena* arena;
+};
+
+#endif	// RESULTSET_H
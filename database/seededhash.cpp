@@ -0,0 +1,29 @@
+/**
+ * @file seededhash.cpp
+ * @brief Hashes strings under a seed for the in-memory tables
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <seededhash.h>
+
+/**
+ * @brief Hashes a string with a seed
+ * @param text The username or address
+ * @param seed The seed
+ * @return The 64-bit hash
+ */
+quint64 seededHash(const QString& text, quint64 seed)
+{
+	// FNV-1a over the UTF-16 code units, then the splitmix64 finalizer to spread the bits
+	quint64 hash = seed ^ 0xcbf29ce484222325ULL;
+	const QChar* data = text.constData();
+	for (int i = 0; i < text.size(); i++)
+	{
+		hash = (hash ^ data[i].unicode()) * 0x100000001b3ULL;
+	}
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
@@ -0,0 +1,19 @@
+/**
+ * @file seededhash.h
+ * @brief This contains the prototype for the seeded string hash of the in-memory tables
+ *
+ * The login throttle and the user cache key their tables by a hash of a username or address
+ * under a random seed, so the slots a name lands in cannot be predicted from outside.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef SEEDEDHASH_H
+#define SEEDEDHASH_H
+
+#include <QString>
+
+quint64 seededHash(const QString& text, quint64 seed);
+
+#endif	// SEEDEDHASH_H
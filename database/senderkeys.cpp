@@ -0,0 +1,377 @@
+/**
+ * @file senderkeys.cpp
+ * @brief Distributes per-chat sender keys and seals chat messages with them
+ *
+ * The associated data of every message and distribution binds it to its chat, epoch and
+ * sender, so a ciphertext cannot be replayed into another chat or passed off as another
+ * member's message.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <senderkeys.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <messagecompressor.h>
+
+/**
+ * @brief Constructor for a sender key manager
+ * @param manager The database manager whose connection and chats are used
+ */
+SenderKeyManager::SenderKeyManager(DbManager& manager)
+	: manager(manager), compressor(nullptr), distributions(0)
+{
+}
+
+/**
+ * @brief Creates the userkeys, senderkeys and senderkeydist tables if they do not exist
+ * Also indexes membershiplog by chat so the epoch lookup done for every message stays cheap
+ * @return boolean indicating whether the tables are ready
+ */
+bool SenderKeyManager::createTables()
+{
+	QSqlQuery query(manager.database());
+	bool ok = query.exec("CREATE TABLE IF NOT EXISTS userkeys(username TEXT PRIMARY KEY, key BLOB NOT NULL);")
+		&& query.exec("CREATE TABLE IF NOT EXISTS senderkeys(chatid INTEGER NOT NULL, epoch INTEGER NOT NULL, sender TEXT NOT NULL, "
+			"sealedkey BLOB NOT NULL, PRIMARY KEY (chatid, epoch, sender));")
+		&& query.exec("CREATE TABLE IF NOT EXISTS senderkeydist(chatid INTEGER NOT NULL, epoch INTEGER NOT NULL, sender TEXT NOT NULL, "
+			"recipient TEXT NOT NULL, sealedkey BLOB NOT NULL, PRIMARY KEY (chatid, epoch, sender, recipient));")
+		&& query.exec("CREATE INDEX IF NOT EXISTS membershiplog_chat ON membershiplog(chatid, seq);");
+
+	if (!ok)
+	{
+		DBLOG_ERROR("createTables", DbErrorQuery, 0, "sender key tables could not be created", query.lastError().text());
+	}
+	return ok;
+}
+
+/**
+ * @brief Gets a chat's current membership epoch
+ * @param chatID An integer representing the chat ID number
+ * @return The sequence number of the chat's latest membership change, 0 if it has none, or -1 on error
+ */
+qint64 SenderKeyManager::chatEpoch(int chatID)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT COALESCE(MAX(seq), 0) FROM membershiplog WHERE chatid = (:chatID)");
+	query.bindValue(":chatID", chatID);
+	if (!query.exec() || !query.next())
+	{
+		DBLOG_ERROR("chatEpoch", DbErrorQuery, chatID, "membership epoch could not be read", query.lastError().text());
+		return -1;
+	}
+	return query.value(0).toLongLong();
+}
+
+/**
+ * @brief Compresses messages before sealing them from now on
+ * Messages sealed earlier still decrypt, since each one records whether it was compressed
+ * @param compressor The compressor, which must outlive the manager, or nullptr to stop compressing
+ * @return void
+ */
+void SenderKeyManager::setCompressor(MessageCompressor* compressor)
+{
+	this->compressor = compressor;
+	return;
+}
+
+/**
+ * @brief Seals a message once for every member of a chat
+ * The first message a sender sends in an epoch generates their sender key and distributes it to
+ * the other members; later messages in the same epoch only cost one seal, whatever the chat size
+ * @param chatID An integer representing the chat ID number
+ * @param sender The username of the member sending the message
+ * @param plaintext The message
+ * @param out Receives the ciphertext to deliver to every member
+ * @return boolean indicating whether the message was sealed
+ */
+bool SenderKeyManager::encryptForChat(int chatID, const QString& sender, const QByteArray& plaintext, ChatCiphertext& out)
+{
+	qint64 epoch = chatEpoch(chatID);
+	if (epoch < 0)
+	{
+		return false;
+	}
+
+	QPair<int, QString> cacheKey(chatID, sender);
+	QHash<QPair<int, QString>, QPair<qint64, QSharedPointer<MessageCrypto> > >::iterator cached = senderCache.find(cacheKey);
+	if (cached == senderCache.end() || cached.value().first != epoch)
+	{
+		// Another connection may already have distributed this sender's key for the epoch
+		QByteArray senderKey;
+		if (!storedSenderKey(chatID, epoch, sender, senderKey))
+		{
+			senderKey = MessageCrypto::generateKey();
+			if (!distribute(chatID, epoch, sender, senderKey))
+			{
+				senderKey.fill(0);
+				return false;
+			}
+		}
+		if (senderKey.isEmpty())
+		{
+			return false;
+		}
+
+		cached = senderCache.insert(cacheKey, qMakePair(epoch, QSharedPointer<MessageCrypto>(new MessageCrypto(senderKey))));
+		senderKey.fill(0);
+	}
+
+	out.chatID = chatID;
+	out.epoch = epoch;
+	out.sender = sender;
+	out.compressed = compressor != nullptr;
+	QByteArray ad = associatedData(chatID, epoch, sender);
+	if (out.compressed)
+	{
+		ad.append(":z");
+	}
+	out.sealed = cached.value().second->seal(out.compressed ? compressor->compress(chatID, plaintext) : plaintext, ad);
+	return !out.sealed.isEmpty();
+}
+
+/**
+ * @brief Opens a chat message the way the given member's client would
+ * Unseals the sender key distributed to the recipient for the message's epoch, then the message
+ * @param message The ciphertext produced by encryptForChat
+ * @param recipient The username of the member reading the message
+ * @param plaintext Receives the message
+ * @return boolean indicating whether the recipient could decrypt the message
+ */
+bool SenderKeyManager::decryptForMember(const ChatCiphertext& message, const QString& recipient, QByteArray& plaintext)
+{
+	QByteArray ad = associatedData(message.chatID, message.epoch, message.sender);
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	if (recipient == message.sender)
+	{
+		query.prepare("SELECT sealedkey FROM senderkeys WHERE chatid = (:chatID) AND epoch = (:epoch) AND sender = (:sender)");
+	}
+	else
+	{
+		query.prepare("SELECT sealedkey FROM senderkeydist WHERE chatid = (:chatID) AND epoch = (:epoch) AND sender = (:sender) AND recipient = (:recipient)");
+		query.bindValue(":recipient", recipient);
+	}
+	query.bindValue(":chatID", message.chatID);
+	query.bindValue(":epoch", message.epoch);
+	query.bindValue(":sender", message.sender);
+	if (!query.exec() || !query.next())
+	{
+		// The recipient was not a member in this epoch
+		return false;
+	}
+
+	QSharedPointer<MessageCrypto> recipientCrypto = userCrypto(recipient);
+	QByteArray senderKey;
+	if (!recipientCrypto || !recipientCrypto->open(query.value(0).toByteArray(), senderKey, ad))
+	{
+		return false;
+	}
+
+	MessageCrypto senderCrypto(senderKey);
+	senderKey.fill(0);
+	if (!message.compressed)
+	{
+		return senderCrypto.open(message.sealed, plaintext, ad);
+	}
+
+	QByteArray compressed;
+	ad.append(":z");
+	if (!senderCrypto.open(message.sealed, compressed, ad))
+	{
+		return false;
+	}
+	if (!compressor)
+	{
+		DBLOG_WARNING("decryptForMember", DbErrorCompression, message.chatID, "compressed message but no compressor set", message.sender);
+		return false;
+	}
+	return compressor->decompress(manager, message.chatID, compressed, plaintext);
+}
+
+/**
+ * @brief Gets the number of sender key copies sealed for recipients so far
+ * @return The number of distributions sealed by this manager
+ */
+int SenderKeyManager::distributionsSealed() const
+{
+	return distributions;
+}
+
+/**
+ * @brief Gets a user's long-term key, generating one the first time it is needed
+ * @param username The username
+ * @return The 32-byte key, or an empty QByteArray if it could not be read or stored
+ */
+QByteArray SenderKeyManager::userKey(const QString& username)
+{
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("INSERT OR IGNORE INTO userkeys (username, key) VALUES (:username, :key)");
+	query.bindValue(":username", username);
+	query.bindValue(":key", MessageCrypto::generateKey());
+	if (!query.exec())
+	{
+		DBLOG_ERROR("userKey", DbErrorQuery, 0, "user key could not be stored", query.lastError().text());
+		return QByteArray();
+	}
+
+	query.prepare("SELECT key FROM userkeys WHERE username = (:username)");
+	query.bindValue(":username", username);
+	if (!query.exec() || !query.next())
+	{
+		DBLOG_ERROR("userKey", DbErrorQuery, 0, "user key could not be read", query.lastError().text());
+		return QByteArray();
+	}
+	return query.value(0).toByteArray();
+}
+
+/**
+ * @brief Builds the associated data that binds a ciphertext to its chat, epoch and sender
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The membership epoch
+ * @param sender The username of the sender
+ * @return The associated data
+ */
+QByteArray SenderKeyManager::associatedData(int chatID, qint64 epoch, const QString& sender)
+{
+	return QByteArray::number(chatID) + ':' + QByteArray::number(epoch) + ':' + sender.toUtf8();
+}
+
+/**
+ * @brief Reads and opens the sender key already stored for a sender's epoch
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The membership epoch
+ * @param sender The username of the sender
+ * @param senderKey Receives the key, or is left empty if the stored copy could not be opened
+ * @return boolean indicating whether a key is stored
+ */
+bool SenderKeyManager::storedSenderKey(int chatID, qint64 epoch, const QString& sender, QByteArray& senderKey)
+{
+	senderKey.clear();
+	QSqlQuery query(manager.database());
+	query.setForwardOnly(true);
+	query.prepare("SELECT sealedkey FROM senderkeys WHERE chatid = (:chatID) AND epoch = (:epoch) AND sender = (:sender)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":epoch", epoch);
+	query.bindValue(":sender", sender);
+	if (!query.exec() || !query.next())
+	{
+		return false;
+	}
+
+	QSharedPointer<MessageCrypto> senderCrypto = userCrypto(sender);
+	if (!senderCrypto || !senderCrypto->open(query.value(0).toByteArray(), senderKey, associatedData(chatID, epoch, sender)))
+	{
+		DBLOG_ERROR("encryptForChat", DbErrorCrypto, chatID, "stored sender key failed authentication", sender);
+		senderKey.clear();
+	}
+	return true;
+}
+
+/**
+ * @brief Seals a new sender key for the sender and for every other member of the chat
+ * All of the copies are stored in one transaction. If another connection stored a key for the
+ * same epoch first, nothing is stored and that key is used instead.
+ * @param chatID An integer representing the chat ID number
+ * @param epoch The membership epoch the key is for
+ * @param sender The username of the sender
+ * @param senderKey The new sender key; replaced by the stored key if another connection won
+ * @return boolean indicating whether the sender is a member and the key was distributed
+ */
+bool SenderKeyManager::distribute(int chatID, qint64 epoch, const QString& sender, QByteArray& senderKey)
+{
+	QVector<QString> members = manager.getChatUsers(chatID);
+	if (!members.contains(sender))
+	{
+		DBLOG_WARNING("encryptForChat", DbErrorUserMissing, chatID, "sender is not a member of the chat", sender);
+		return false;
+	}
+
+	QByteArray ad = associatedData(chatID, epoch, sender);
+	QSharedPointer<MessageCrypto> senderCrypto = userCrypto(sender);
+	if (!senderCrypto)
+	{
+		return false;
+	}
+	QSqlDatabase db = manager.database();
+	if (!manager.beginImmediate())
+	{
+		return false;
+	}
+
+	QSqlQuery query(db);
+	query.prepare("INSERT OR IGNORE INTO senderkeys (chatid, epoch, sender, sealedkey) VALUES (:chatID, :epoch, :sender, :sealedkey)");
+	query.bindValue(":chatID", chatID);
+	query.bindValue(":epoch", epoch);
+	query.bindValue(":sender", sender);
+	query.bindValue(":sealedkey", senderCrypto->seal(senderKey, ad));
+	bool ok = query.exec();
+	if (ok && query.numRowsAffected() == 0)
+	{
+		db.rollback();
+		senderKey.fill(0);
+		return storedSenderKey(chatID, epoch, sender, senderKey) && !senderKey.isEmpty();
+	}
+
+	query.prepare("INSERT INTO senderkeydist (chatid, epoch, sender, recipient, sealedkey) VALUES (:chatID, :epoch, :sender, :recipient, :sealedkey)");
+	for (int i = 0; ok && i < members.size(); i++)
+	{
+		if (members[i] == sender)
+		{
+			continue;
+		}
+
+		QSharedPointer<MessageCrypto> recipientCrypto = userCrypto(members[i]);
+		if (!recipientCrypto)
+		{
+			ok = false;
+			break;
+		}
+		query.bindValue(":chatID", chatID);
+		query.bindValue(":epoch", epoch);
+		query.bindValue(":sender", sender);
+		query.bindValue(":recipient", members[i]);
+		query.bindValue(":sealedkey", recipientCrypto->seal(senderKey, ad));
+		ok = query.exec();
+		if (ok)
+		{
+			distributions++;
+		}
+	}
+
+	if (!ok)
+	{
+		DBLOG_ERROR("encryptForChat", DbErrorQuery, chatID, "sender key could not be distributed", query.lastError().text());
+		db.rollback();
+		return false;
+	}
+	return db.commit();
+}
+
+/**
+ * @brief Gets a keyed engine for a user's long-term key
+ * Engines are kept so that distributing to a large chat does not repeat key schedules
+ * @param username The username
+ * @return The engine, or a null pointer if the user's key is unavailable
+ */
+QSharedPointer<MessageCrypto> SenderKeyManager::userCrypto(const QString& username)
+{
+	QHash<QString, QSharedPointer<MessageCrypto> >::const_iterator cached = userCache.constFind(username);
+	if (cached != userCache.constEnd())
+	{
+		return cached.value();
+	}
+
+	QByteArray key = userKey(username);
+	if (key.size() != MessageCrypto::keySize)
+	{
+		return QSharedPointer<MessageCrypto>();
+	}
+	QSharedPointer<MessageCrypto> crypto(new MessageCrypto(key));
+	key.fill(0);
+	userCache.insert(username, crypto);
+	return crypto;
+}
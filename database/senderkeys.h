@@ -0,0 +1,71 @@
+/**
+ * @file senderkeys.h
+ * @brief This contains the prototypes for per-chat sender keys
+ *
+ * Instead of encrypting every message once per recipient, each sender in a chat has a sender key
+ * for the chat's current membership epoch. The sender key is sealed once for every member (a
+ * "distribution") the first time the sender speaks in that epoch, and after that every message is
+ * sealed a single time and the same ciphertext is fanned out to all members.
+ *
+ * A chat's epoch is the sequence number of its latest membershiplog entry, so any addChat or
+ * removeChat starts a new epoch and members who left cannot read messages sent afterwards.
+ *
+ * Tables:
+ * userkeys--each user's long-term key, used to seal the distributions sent to them.
+ * senderkeys--each sender's key for a chat and epoch, sealed under the sender's own user key.
+ * senderkeydist--one sealed copy of a sender key for each recipient in that epoch.
+ *
+ * With setCompressor(), messages are compressed before they are sealed; whether a message was
+ * compressed is part of its associated data, so the flag cannot be flipped in transit.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef SENDERKEYS_H
+#define SENDERKEYS_H
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QPair>
+#include <QSharedPointer>
+#include <messagecrypto.h>
+
+class DbManager;
+class MessageCompressor;
+
+// One message sealed for a whole chat; every member receives the same bytes
+struct ChatCiphertext
+{
+	int chatID;
+	qint64 epoch;
+	QString sender;
+	bool compressed;
+	QByteArray sealed;
+};
+
+class SenderKeyManager
+{
+	public:
+		explicit SenderKeyManager(DbManager& manager);
+		bool createTables();
+		void setCompressor(MessageCompressor* compressor);
+		qint64 chatEpoch(int chatID);
+		bool encryptForChat(int chatID, const QString& sender, const QByteArray& plaintext, ChatCiphertext& out);
+		bool decryptForMember(const ChatCiphertext& message, const QString& recipient, QByteArray& plaintext);
+		int distributionsSealed() const;
+		QByteArray userKey(const QString& username);
+	private:
+		static QByteArray associatedData(int chatID, qint64 epoch, const QString& sender);
+		bool storedSenderKey(int chatID, qint64 epoch, const QString& sender, QByteArray& senderKey);
+		bool distribute(int chatID, qint64 epoch, const QString& sender, QByteArray& senderKey);
+		QSharedPointer<MessageCrypto> userCrypto(const QString& username);
+		DbManager& manager;
+		MessageCompressor* compressor;
+		QHash<QPair<int, QString>, QPair<qint64, QSharedPointer<MessageCrypto> > > senderCache;		// (chat, sender) -> (epoch, keyed engine)
+		QHash<QString, QSharedPointer<MessageCrypto> > userCache;
+		int distributions;
+};
+
+#endif	// SENDERKEYS_H
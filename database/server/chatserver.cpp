@@ -0,0 +1,1538 @@
+/**
+ * @file chatserver.cpp
+ * @brief Runs the chat server's event loops and database workers
+ *
+ * Each connection is tagged in epoll with a serial number rather than its descriptor, so a reply
+ * or wakeup for a connection that has since closed, and whose descriptor may already be reused,
+ * finds nothing and is dropped. Closed connections are freed only after the batch of events
+ * that closed them has been handled.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <chatserver.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <fanout.h>
+#include <inbox.h>
+#include <loginthrottle.h>
+#include <usercache.h>
+#include <mpscring.h>
+#include <wireprotocol.h>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QMutexLocker>
+#include <QStringList>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+// epoll tags of the two descriptors every loop has; connection serial numbers start above them
+static const quint64 listenTag = 0;
+static const quint64 wakeTag = 1;
+
+static const int maxEvents = 256;
+static const int readChunk = 16384;
+
+// Unparsed input one connection may hold; reading stops there until its requests are answered
+static const int maxUnparsedInput = WireParser::maxFrameSize + readChunk;
+static const int maxLineLength = 65536;
+
+// Chat messages are only taken from the fan-out queue while less than this is waiting to be written
+static const int outputHighWater = 262144;
+
+// Most output segments handed to one sendmsg call
+static const int maxWriteSegments = 256;
+
+enum class ConnectionProtocol
+{
+	Unknown,	// nothing received yet
+	Text,
+	Binary
+};
+
+struct ChatServer::Connection
+{
+	int fd;
+	quint64 serial;
+	QByteArray input;
+	int inputParsed;
+	QVector<QByteArray> output;	// segments waiting to be written
+	int outputHead;	// the first segment not completely written
+	int outputSent;	// bytes of the head segment already written
+	int outputPending;	// bytes waiting in all segments
+	qint64 outputWritten;	// bytes written since the connection was accepted
+	qint64 inboxSeq;	// the last inbox message in the output, deleted once it is written
+	qint64 inboxWrittenAt;	// outputWritten once that message has been written
+	bool tailOwned;	// the last segment belongs to this connection and can be appended to
+	QString username;
+	QString address;	// the peer's IP address
+	int fanoutID;
+	int inFlight;	// requests with the workers
+	ConnectionProtocol protocol;
+	bool closing;	// close once the output is written
+	bool throttled;	// chat messages are waiting for the output to drain
+	bool outputBlocked;	// requests are waiting for the output to drain
+	bool readPaused;	// too much input is waiting, so the socket is not read
+	bool replied;	// replies arrived in the batch being handled
+};
+
+struct ChatServer::EventLoop
+{
+	int index;
+	int epollFd;
+	int listenFd;
+	int wakeFd;
+	std::thread thread;
+	quint64 nextSerial;
+	QHash<quint64, Connection*> connections;
+	QHash<int, quint64> fanoutConnections;	// fan-out connection id -> serial
+	QVector<Connection*> closed;
+	MpscRing<Job*> finished;
+	MpscRing<int> ready;
+	std::atomic<bool> signalled;
+
+	// A connection has at most one wakeup outstanding, so the ready ring never fills
+	explicit EventLoop(int index)
+		: index(index), epollFd(-1), listenFd(-1), wakeFd(-1), nextSerial(wakeTag + 1),
+		finished(maxLoopConnections), ready(maxLoopConnections), signalled(false)
+	{
+	}
+};
+
+// One request on its way to the workers and back; text requests use the same operations
+struct ChatServer::Job
+{
+	EventLoop* loop;
+	quint64 serial;
+	WireOp op;
+	quint64 requestID;
+	bool binary;
+	QString username;	// the logged-in user, or the user registering or logging in
+	QString argument;	// the password, or the other user for UsersChat
+	QString source;	// the connection's peer address
+	int chatID;
+	QVector<QString> members;
+	QByteArray text;
+	QByteArray reply;
+	bool loggedIn;
+	qint64 inboxSeq;	// inbox messages written up to here are deleted; then the last one read
+
+	Job(EventLoop* loop, const Connection* connection, WireOp op, quint64 requestID, bool binary)
+		: loop(loop), serial(connection->serial), op(op), requestID(requestID), binary(binary),
+		username(connection->username), source(connection->address), chatID(0), loggedIn(false), inboxSeq(0)
+	{
+	}
+};
+
+/**
+ * @brief Splits the next space-separated word off a request line
+ * @param line The request line
+ * @param position The offset to start at, moved past the word and the space after it
+ * @return The word, which is empty at the end of the line
+ */
+static QByteArray nextWord(const QByteArray& line, int& position)
+{
+	int end = line.indexOf(' ', position);
+	if (end < 0)
+	{
+		end = line.size();
+	}
+	QByteArray word = line.mid(position, end - position);
+	position = qMin(end + 1, line.size());
+	return word;
+}
+
+/**
+ * @brief Checks a username both protocols may register or log in with
+ * A username is echoed in MSG lines after a space and stored in comma-separated rosters, so
+ * it may not contain a space, a comma or a control byte.
+ * @param name The username's UTF-8 bytes
+ * @param size The number of bytes
+ * @return True if the username is allowed
+ */
+static bool validUsername(const char* name, int size)
+{
+	if (size <= 0)
+	{
+		return false;
+	}
+	for (int i = 0; i < size; i++)
+	{
+		unsigned char c = static_cast<unsigned char>(name[i]);
+		if (c <= ' ' || c == ',' || c == 0x7F)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Checks whether message text contains a line break
+ * A text client reads one message per line, so text with one could forge further lines.
+ * @param text The text
+ * @param size The number of bytes
+ * @return True if the text contains '\n' or '\r'
+ */
+static bool hasLineBreak(const char* text, int size)
+{
+	return size > 0 && (memchr(text, '\n', size) != nullptr || memchr(text, '\r', size) != nullptr);
+}
+
+/**
+ * @brief Builds a binary reply that carries only a status
+ * @param op The request's operation
+ * @param requestID The request's id
+ * @param status The status
+ * @return The reply frame
+ */
+static QByteArray statusReply(quint8 op, quint64 requestID, WireStatus status)
+{
+	WireWriter reply(op | wireReplyFlag, requestID);
+	reply.writeByte(quint8(status));
+	return reply.frame();
+}
+
+/**
+ * @brief Turns a pushed chat message frame into the text protocol's MSG line
+ * @param frame A WireOp::Message frame
+ * @return The line, or an empty QByteArray if the frame is not a valid message or could not
+ * be shown as one line
+ */
+static QByteArray messageLine(const QByteArray& frame)
+{
+	WireFrame parsed;
+	if (WireParser::parse(frame.constData(), frame.size(), parsed) <= 0)
+	{
+		return QByteArray();
+	}
+	WireReader reader(parsed);
+	int chatID = 0;
+	WireString sender;
+	WireString text;
+	if (!reader.readInt(chatID) || !reader.readString(sender) || !reader.readString(text) ||
+		!validUsername(sender.data, sender.size) || hasLineBreak(text.data, text.size))
+	{
+		return QByteArray();
+	}
+	QByteArray line = "MSG " + QByteArray::number(chatID) + " ";
+	line.append(sender.data, sender.size);
+	line.append(' ');
+	line.append(text.data, text.size);
+	line.append('\n');
+	return line;
+}
+
+/**
+ * @brief Constructor for a chat server
+ * @param databasePath The database file the server's connections open; its tables must exist
+ */
+ChatServer::ChatServer(const QString& databasePath)
+	: databasePath(databasePath), listenPort(0), running(false), sharedFrames(true),
+	throttle(new LoginThrottle()), throttleLogins(true), userCache(new UserCache()),
+	acceptedCount(0), connectionCount(0), requestCount(0), deliveredCount(0), copiedCount(0), writeCount(0)
+{
+}
+
+/**
+ * @brief Destructor for the chat server, which stops it if it is running
+ */
+ChatServer::~ChatServer()
+{
+	stop();
+}
+
+/**
+ * @brief Starts listening and starts the event loop and worker threads
+ * @param port The TCP port, or 0 to pick a free one (see port())
+ * @param loopCount The number of event loops, or 0 for one per core
+ * @param workerCount The number of database workers, or 0 for one per core
+ * @return boolean indicating whether the server started
+ */
+bool ChatServer::start(quint16 port, int loopCount, int workerCount)
+{
+	int cores = qMax(int(std::thread::hardware_concurrency()), 1);
+	loopCount = loopCount > 0 ? loopCount : cores;
+	workerCount = workerCount > 0 ? workerCount : cores;
+
+	{
+		DbManager setup(databasePath, "chatserver-setup");
+		if (!setup.isOpen())
+		{
+			DBLOG_ERROR("start", DbErrorConnection, 0, "the server database could not be opened", databasePath);
+			return false;
+		}
+		InboxStore(setup).createTables();
+	}
+	fanout.reset(new FanoutEngine());
+	fanout->setWakeHandler([this](const QVector<int>& connectionIDs)
+	{
+		QReadLocker locker(&ownerLock);
+		for (int i = 0; i < connectionIDs.size(); i++)
+		{
+			EventLoop* loop = fanoutOwners.value(connectionIDs[i]);
+			if (loop)
+			{
+				loop->ready.tryPush(connectionIDs[i]);
+				signalLoop(loop);
+			}
+		}
+	});
+
+	listenPort = port;
+	for (int i = 0; i < loopCount; i++)
+	{
+		EventLoop* loop = new EventLoop(i);
+		loops.push_back(loop);
+
+		int on = 1;
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(listenPort);
+		loop->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		bool ok = loop->listenFd >= 0
+			&& setsockopt(loop->listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0
+			&& setsockopt(loop->listenFd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0
+			&& bind(loop->listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+			&& listen(loop->listenFd, SOMAXCONN) == 0;
+
+		// The first loop may have been given an ephemeral port, which the others then share
+		socklen_t length = sizeof(address);
+		if (ok && listenPort == 0 && getsockname(loop->listenFd, reinterpret_cast<sockaddr*>(&address), &length) == 0)
+		{
+			listenPort = ntohs(address.sin_port);
+		}
+
+		loop->epollFd = ok ? epoll_create1(EPOLL_CLOEXEC) : -1;
+		loop->wakeFd = ok ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+		if (loop->epollFd >= 0 && loop->wakeFd >= 0)
+		{
+			epoll_event event;
+			event.events = EPOLLIN | EPOLLET;
+			event.data.u64 = listenTag;
+			ok = epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->listenFd, &event) == 0;
+			event.data.u64 = wakeTag;
+			ok = ok && epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) == 0;
+		}
+		else
+		{
+			ok = false;
+		}
+
+		if (!ok)
+		{
+			DBLOG_ERROR("start", DbErrorConnection, 0, "could not listen on the server port", QString::fromLocal8Bit(strerror(errno)));
+			stop();
+			return false;
+		}
+	}
+
+	running = true;
+	for (int i = 0; i < workerCount; i++)
+	{
+		workers.emplace_back(&ChatServer::runWorker, this, i);
+	}
+	for (size_t i = 0; i < loops.size(); i++)
+	{
+		loops[i]->thread = std::thread(&ChatServer::runLoop, this, loops[i]);
+	}
+	return true;
+}
+
+/**
+ * @brief Stops the server, closing every connection
+ * Requests already with the workers are finished but their replies are not sent
+ * @return void
+ */
+void ChatServer::stop()
+{
+	running = false;
+	for (size_t i = 0; i < loops.size(); i++)
+	{
+		if (loops[i]->wakeFd >= 0)
+		{
+			eventfd_write(loops[i]->wakeFd, 1);
+		}
+	}
+	{
+		QMutexLocker locker(&jobMutex);
+		jobReady.wakeAll();
+	}
+
+	// Workers first; one waiting on a full finished ring drops its job once it sees running is false
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+	workers.clear();
+	for (size_t i = 0; i < loops.size(); i++)
+	{
+		if (loops[i]->thread.joinable())
+		{
+			loops[i]->thread.join();
+		}
+	}
+
+	for (size_t i = 0; i < loops.size(); i++)
+	{
+		EventLoop* loop = loops[i];
+		Job* job;
+		while (loop->finished.tryPop(job))
+		{
+			delete job;
+		}
+		QVector<Connection*> open;
+		for (QHash<quint64, Connection*>::const_iterator it = loop->connections.constBegin(); it != loop->connections.constEnd(); ++it)
+		{
+			open.append(it.value());
+		}
+		for (int c = 0; c < open.size(); c++)
+		{
+			closeConnection(loop, open[c]);
+		}
+		for (int c = 0; c < loop->closed.size(); c++)
+		{
+			delete loop->closed[c];
+		}
+		if (loop->listenFd >= 0)
+		{
+			close(loop->listenFd);
+		}
+		if (loop->wakeFd >= 0)
+		{
+			close(loop->wakeFd);
+		}
+		if (loop->epollFd >= 0)
+		{
+			close(loop->epollFd);
+		}
+		delete loop;
+	}
+	loops.clear();
+
+	fanout.reset();
+	return;
+}
+
+/**
+ * @brief Chooses whether chat messages and large replies are written from shared buffers or copied per connection
+ * Sharing is the default; turning it off copies everything, which the benchmarks compare against.
+ * Must be called before start()
+ * @param enabled Whether to share
+ * @return void
+ */
+void ChatServer::setSharedFrames(bool enabled)
+{
+	sharedFrames = enabled;
+	return;
+}
+
+/**
+ * @brief Chooses whether logins and registrations are throttled per user and per address
+ * Throttling is the default; the benchmarks turn it off because all their clients share one address.
+ * Must be called before start()
+ * @param enabled Whether to throttle
+ * @return void
+ */
+void ChatServer::setLoginThrottle(bool enabled)
+{
+	throttleLogins = enabled;
+	return;
+}
+
+/**
+ * @brief Gets the port the server is listening on
+ * @return The port, which is the one chosen by the system if start() was given 0
+ */
+quint16 ChatServer::port() const
+{
+	return listenPort;
+}
+
+/**
+ * @brief Gets the server's counters
+ * @return Connections accepted and open, requests answered, chat messages delivered, bytes copied
+ * into output buffers and write system calls
+ */
+ServerStats ChatServer::stats() const
+{
+	ServerStats result;
+	result.accepted = acceptedCount.load(std::memory_order_relaxed);
+	result.connections = connectionCount.load(std::memory_order_relaxed);
+	result.requests = requestCount.load(std::memory_order_relaxed);
+	result.messagesDelivered = deliveredCount.load(std::memory_order_relaxed);
+	result.bytesCopied = copiedCount.load(std::memory_order_relaxed);
+	result.writeCalls = writeCount.load(std::memory_order_relaxed);
+	return result;
+}
+
+/**
+ * @brief Runs one event loop until the server stops
+ * @param loop The loop
+ * @return void
+ */
+void ChatServer::runLoop(EventLoop* loop)
+{
+	epoll_event events[maxEvents];
+	while (running.load(std::memory_order_acquire))
+	{
+		int count = epoll_wait(loop->epollFd, events, maxEvents, -1);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			DBLOG_ERROR("runLoop", DbErrorConnection, 0, "epoll_wait failed", QString::fromLocal8Bit(strerror(errno)));
+			break;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			quint64 tag = events[i].data.u64;
+			if (tag == listenTag)
+			{
+				acceptConnections(loop);
+				continue;
+			}
+			if (tag == wakeTag)
+			{
+				finishJobs(loop);
+				continue;
+			}
+
+			Connection* connection = loop->connections.value(tag);
+			if (!connection)
+			{
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+			{
+				closeConnection(loop, connection);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT)
+			{
+				flushOutput(loop, connection);
+				if (connection->fd >= 0 && connection->throttled && connection->outputPending < outputHighWater)
+				{
+					deliverMessages(loop, connection);
+				}
+				if (connection->fd >= 0 && connection->outputBlocked && connection->outputPending < outputHighWater)
+				{
+					processInput(loop, connection);
+				}
+			}
+			if (connection->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+			{
+				readInput(loop, connection);
+			}
+		}
+
+		for (int i = 0; i < loop->closed.size(); i++)
+		{
+			delete loop->closed[i];
+		}
+		loop->closed.clear();
+	}
+	return;
+}
+
+/**
+ * @brief Runs one database worker until the server stops
+ * The worker opens its own connection to the database, so workers never share a QSqlDatabase
+ * @param index The worker's number, used to name its connection
+ * @return void
+ */
+void ChatServer::runWorker(int index)
+{
+	DbManager manager(databasePath, QString("chatserver-worker-%1").arg(index));
+	manager.setPresence(&fanout->presence());
+	manager.setThrottle(throttleLogins ? throttle.data() : nullptr);
+	manager.setUserCache(userCache.data());
+	InboxStore inbox(manager);
+	while (true)
+	{
+		Job* job = nullptr;
+		{
+			QMutexLocker locker(&jobMutex);
+			while (jobs.isEmpty() && running.load(std::memory_order_acquire))
+			{
+				jobReady.wait(&jobMutex);
+			}
+			if (jobs.isEmpty())
+			{
+				break;
+			}
+			job = jobs.dequeue();
+		}
+
+		execute(manager, inbox, job);
+		// A pipelining connection can have many jobs outstanding, so the ring can briefly be full.
+		// Once the server is stopping its loop may already have exited and will never drain the
+		// ring, so the finished job is dropped rather than waited on
+		bool pushed = job->loop->finished.tryPush(job);
+		while (!pushed && running.load(std::memory_order_acquire))
+		{
+			std::this_thread::yield();
+			pushed = job->loop->finished.tryPush(job);
+		}
+		if (!pushed)
+		{
+			delete job;
+			continue;
+		}
+		signalLoop(job->loop);
+	}
+	manager.close();
+	return;
+}
+
+/**
+ * @brief Accepts every pending connection on a loop's listening socket
+ * @param loop The loop
+ * @return void
+ */
+void ChatServer::acceptConnections(EventLoop* loop)
+{
+	while (true)
+	{
+		sockaddr_in peer;
+		socklen_t peerLength = sizeof(peer);
+		int fd = accept4(loop->listenFd, reinterpret_cast<sockaddr*>(&peer), &peerLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				DBLOG_WARNING("acceptConnections", DbErrorConnection, 0, "could not accept a connection", QString::fromLocal8Bit(strerror(errno)));
+			}
+			return;
+		}
+		if (loop->connections.size() >= maxLoopConnections)
+		{
+			close(fd);
+			continue;
+		}
+
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		Connection* connection = new Connection();
+		connection->fd = fd;
+		connection->serial = loop->nextSerial++;
+		char address[INET_ADDRSTRLEN];
+		connection->address = inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address)) ? QString::fromLatin1(address) : QString();
+		connection->inputParsed = 0;
+		connection->outputHead = 0;
+		connection->outputSent = 0;
+		connection->outputPending = 0;
+		connection->outputWritten = 0;
+		connection->inboxSeq = 0;
+		connection->inboxWrittenAt = 0;
+		connection->tailOwned = false;
+		connection->fanoutID = 0;
+		connection->inFlight = 0;
+		connection->protocol = ConnectionProtocol::Unknown;
+		connection->closing = false;
+		connection->throttled = false;
+		connection->outputBlocked = false;
+		connection->readPaused = false;
+		connection->replied = false;
+
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.u64 = connection->serial;
+		if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+		{
+			close(fd);
+			delete connection;
+			continue;
+		}
+		loop->connections.insert(connection->serial, connection);
+		acceptedCount.fetch_add(1, std::memory_order_relaxed);
+		connectionCount.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Reads everything a connection has sent and handles the complete requests
+ * Data is read straight into the end of the connection's input buffer, where it is parsed. Once
+ * maxUnparsedInput is waiting and none of it can be handed to the workers, the socket is no
+ * longer read until replies let the connection's requests move on.
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @return void
+ */
+void ChatServer::readInput(EventLoop* loop, Connection* connection)
+{
+	while (true)
+	{
+		if (connection->input.size() - connection->inputParsed >= maxUnparsedInput)
+		{
+			processInput(loop, connection);
+			if (connection->fd < 0)
+			{
+				return;
+			}
+			if (connection->input.size() - connection->inputParsed >= maxUnparsedInput)
+			{
+				setReading(loop, connection, false);
+				return;
+			}
+		}
+
+		int size = connection->input.size();
+		connection->input.resize(size + readChunk);
+		ssize_t received = read(connection->fd, connection->input.data() + size, readChunk);
+		connection->input.resize(size + int(qMax<ssize_t>(received, 0)));
+		if (received > 0)
+		{
+			continue;
+		}
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			closeConnection(loop, connection);
+			return;
+		}
+		break;
+	}
+	processInput(loop, connection);
+	return;
+}
+
+/**
+ * @brief Parses the complete requests in a connection's input and hands them to the workers
+ * Requests beyond what the connection may have in flight stay in the buffer until replies arrive,
+ * and none are parsed while the client leaves outputHighWater bytes of replies unread
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @return void
+ */
+void ChatServer::processInput(EventLoop* loop, Connection* connection)
+{
+	if (connection->fd < 0)
+	{
+		return;
+	}
+	if (connection->protocol == ConnectionProtocol::Unknown && connection->input.size() > connection->inputParsed)
+	{
+		if (connection->input.at(connection->inputParsed) == wirePreface)
+		{
+			connection->protocol = ConnectionProtocol::Binary;
+			connection->inputParsed++;
+		}
+		else
+		{
+			connection->protocol = ConnectionProtocol::Text;
+		}
+	}
+
+	while (true)
+	{
+		QVector<Job*> parsed;
+		if (connection->protocol == ConnectionProtocol::Binary)
+		{
+			parseFrames(loop, connection, parsed);
+		}
+		else if (connection->protocol == ConnectionProtocol::Text)
+		{
+			parseLines(loop, connection, parsed);
+		}
+		submitJobs(connection, parsed);
+
+		// Parsing stopped for the output; carry on if writing drained it, else EPOLLOUT resumes it
+		bool blocked = connection->outputPending >= outputHighWater;
+		flushOutput(loop, connection);
+		if (connection->fd < 0)
+		{
+			return;
+		}
+		connection->outputBlocked = connection->outputPending >= outputHighWater;
+		if (!blocked || connection->outputBlocked)
+		{
+			break;
+		}
+	}
+
+	if (connection->inputParsed == connection->input.size())
+	{
+		connection->input.clear();
+		connection->inputParsed = 0;
+	}
+	else if (connection->inputParsed > readChunk)
+	{
+		connection->input.remove(0, connection->inputParsed);
+		connection->inputParsed = 0;
+	}
+	if (connection->readPaused && connection->input.size() - connection->inputParsed < maxUnparsedInput)
+	{
+		setReading(loop, connection, true);
+	}
+	return;
+}
+
+/**
+ * @brief Starts or stops watching a connection's socket for input
+ * Watching again reports input that arrived meanwhile, since the socket is edge-triggered
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @param reading Whether the socket should be read
+ * @return void
+ */
+void ChatServer::setReading(EventLoop* loop, Connection* connection, bool reading)
+{
+	if (connection->readPaused == !reading)
+	{
+		return;
+	}
+	epoll_event event;
+	event.events = (reading ? EPOLLIN : 0) | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.u64 = connection->serial;
+	if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, connection->fd, &event) != 0)
+	{
+		DBLOG_WARNING("setReading", DbErrorConnection, 0, "could not change the events watched", QString::fromLocal8Bit(strerror(errno)));
+		closeConnection(loop, connection);
+		return;
+	}
+	connection->readPaused = !reading;
+	return;
+}
+
+/**
+ * @brief Hands jobs for a connection to the workers
+ * @param connection The connection the jobs belong to
+ * @param submitted The jobs
+ * @return void
+ */
+void ChatServer::submitJobs(Connection* connection, const QVector<Job*>& submitted)
+{
+	if (submitted.isEmpty())
+	{
+		return;
+	}
+	connection->inFlight += submitted.size();
+	QMutexLocker locker(&jobMutex);
+	for (int i = 0; i < submitted.size(); i++)
+	{
+		jobs.enqueue(submitted[i]);
+	}
+	if (submitted.size() == 1)
+	{
+		jobReady.wakeOne();
+	}
+	else
+	{
+		jobReady.wakeAll();
+	}
+	return;
+}
+
+/**
+ * @brief Parses text request lines, stopping at the first one that has to go to the workers
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @param parsed Receives the request for the workers, if there is one
+ * @return void
+ */
+void ChatServer::parseLines(EventLoop* loop, Connection* connection, QVector<Job*>& parsed)
+{
+	while (connection->inFlight == 0 && parsed.isEmpty() && !connection->closing && connection->outputPending < outputHighWater)
+	{
+		int end = connection->input.indexOf('\n', connection->inputParsed);
+		if (end < 0)
+		{
+			if (connection->input.size() - connection->inputParsed > maxLineLength)
+			{
+				queueOutput(connection, "ERR line too long\n");
+				connection->closing = true;
+			}
+			return;
+		}
+
+		QByteArray line = connection->input.mid(connection->inputParsed, end - connection->inputParsed);
+		connection->inputParsed = end + 1;
+		if (line.endsWith('\r'))
+		{
+			line.chop(1);
+		}
+
+		int position = 0;
+		QByteArray command = nextWord(line, position);
+		if (command == "QUIT")
+		{
+			queueOutput(connection, "OK\n");
+			connection->closing = true;
+			return;
+		}
+		else if (command == "REGISTER" || command == "LOGIN")
+		{
+			QScopedPointer<Job> job(new Job(loop, connection, command == "LOGIN" ? WireOp::Login : WireOp::Register, 0, false));
+			QByteArray name = nextWord(line, position);
+			job->username = QString::fromUtf8(name);
+			job->argument = QString::fromUtf8(nextWord(line, position));
+			if (job->username.isEmpty() || job->argument.isEmpty())
+			{
+				queueOutput(connection, "ERR expected a username and a password\n");
+				continue;
+			}
+			if (!validUsername(name.constData(), name.size()))
+			{
+				queueOutput(connection, "ERR invalid username\n");
+				continue;
+			}
+			parsed.append(job.take());
+		}
+		else if (command == "CREATE" || command == "DELETE" || command == "ROSTER" || command == "SEND" || command == "ONLINE")
+		{
+			if (connection->username.isEmpty())
+			{
+				queueOutput(connection, "ERR not logged in\n");
+				continue;
+			}
+			WireOp op = command == "CREATE" ? WireOp::CreateChat : command == "DELETE" ? WireOp::DeleteChat
+				: command == "ROSTER" ? WireOp::Roster : command == "ONLINE" ? WireOp::OnlineUsers : WireOp::Send;
+			QScopedPointer<Job> job(new Job(loop, connection, op, 0, false));
+			if (op != WireOp::Roster)
+			{
+				bool ok = false;
+				job->chatID = nextWord(line, position).toInt(&ok);
+				if (!ok || job->chatID <= 0)
+				{
+					queueOutput(connection, "ERR expected a chat id\n");
+					continue;
+				}
+			}
+			if (op == WireOp::Send)
+			{
+				job->text = line.mid(position);
+				if (hasLineBreak(job->text.constData(), job->text.size()))
+				{
+					queueOutput(connection, "ERR message contains a line break\n");
+					continue;
+				}
+			}
+			else if (op == WireOp::CreateChat)
+			{
+				job->members.append(connection->username);
+				QList<QByteArray> names = line.mid(position).split(',');
+				for (int i = 0; i < names.size(); i++)
+				{
+					QString name = QString::fromUtf8(names[i].trimmed());
+					if (!name.isEmpty() && !job->members.contains(name))
+					{
+						job->members.append(name);
+					}
+				}
+			}
+			parsed.append(job.take());
+		}
+		else
+		{
+			queueOutput(connection, "ERR unknown request\n");
+		}
+	}
+	return;
+}
+
+/**
+ * @brief Parses binary frames in place until the input runs out or the pipeline is full
+ * Requests that are malformed, unknown or need a login are answered here without the workers
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @param parsed Receives the requests for the workers
+ * @return void
+ */
+void ChatServer::parseFrames(EventLoop* loop, Connection* connection, QVector<Job*>& parsed)
+{
+	while (connection->inFlight + parsed.size() < maxPipelineDepth && !connection->closing &&
+		connection->outputPending < outputHighWater)
+	{
+		WireFrame frame;
+		int size = WireParser::parse(connection->input.constData() + connection->inputParsed,
+			connection->input.size() - connection->inputParsed, frame);
+		if (size == 0)
+		{
+			return;
+		}
+		if (size < 0)
+		{
+			// The framing is lost, so nothing after this point can be trusted
+			DBLOG_WARNING("parseFrames", DbErrorConnection, 0, "malformed frame; closing the connection", connection->username);
+			connection->closing = true;
+			return;
+		}
+		connection->inputParsed += size;
+
+		WireReader reader(frame);
+		WireOp op = WireOp(frame.opcode);
+		QScopedPointer<Job> job(new Job(loop, connection, op, frame.requestID, true));
+		WireString field = { nullptr, 0 };
+		bool valid = true;
+		bool needsLogin = true;
+		switch (op)
+		{
+			case WireOp::Register:
+			case WireOp::Login:
+			{
+				WireString password = { nullptr, 0 };
+				needsLogin = false;
+				valid = reader.readString(field) && reader.readString(password) && validUsername(field.data, field.size) && password.size > 0;
+				job->username = field.toString();
+				job->argument = password.toString();
+				break;
+			}
+			case WireOp::UserExists:
+				needsLogin = false;
+				valid = reader.readString(field);
+				job->argument = field.toString();
+				break;
+			case WireOp::CreateChat:
+			{
+				quint64 count = 0;
+				valid = reader.readInt(job->chatID) && reader.readVarint(count) && count <= quint64(frame.payloadSize);
+				job->members.append(connection->username);
+				for (quint64 i = 0; valid && i < count; i++)
+				{
+					valid = reader.readString(field);
+					QString name = field.toString();
+					if (valid && !name.isEmpty() && !job->members.contains(name))
+					{
+						job->members.append(name);
+					}
+				}
+				break;
+			}
+			case WireOp::DeleteChat:
+			case WireOp::ChatExists:
+			case WireOp::ChatOwner:
+			case WireOp::ChatUsers:
+			case WireOp::OnlineUsers:
+				valid = reader.readInt(job->chatID);
+				break;
+			case WireOp::UsersChat:
+				valid = reader.readString(field);
+				job->argument = field.toString();
+				break;
+			case WireOp::UserChats:
+			case WireOp::Roster:
+				break;
+			case WireOp::Send:
+				valid = reader.readInt(job->chatID) && reader.readString(field) && !hasLineBreak(field.data, field.size);
+				job->text = QByteArray(field.data, field.size);
+				break;
+			default:
+				queueOutput(connection, statusReply(frame.opcode, frame.requestID, WireStatus::UnknownOp));
+				continue;
+		}
+
+		if (!valid || !reader.atEnd())
+		{
+			queueOutput(connection, statusReply(frame.opcode, frame.requestID, WireStatus::Malformed));
+		}
+		else if (needsLogin && connection->username.isEmpty())
+		{
+			queueOutput(connection, statusReply(frame.opcode, frame.requestID, WireStatus::NotLoggedIn));
+		}
+		else
+		{
+			parsed.append(job.take());
+		}
+	}
+	return;
+}
+
+/**
+ * @brief Adds bytes to the end of a connection's output
+ * Chat messages, which every member's connection is sent, and replies of at least sharedFrameSize
+ * bytes are queued as references to their buffer and never copied. Smaller replies are copied
+ * into a buffer of the connection's own, so they do not each cost a segment.
+ * @param connection The connection
+ * @param data The bytes
+ * @param shared True if the buffer is shared with other connections, so copying it would be wasted
+ * @return void
+ */
+void ChatServer::queueOutput(Connection* connection, const QByteArray& data, bool shared)
+{
+	if (data.isEmpty())
+	{
+		return;
+	}
+	if (sharedFrames && (shared || data.size() >= sharedFrameSize))
+	{
+		connection->output.append(data);
+		connection->tailOwned = false;
+	}
+	else
+	{
+		if (!connection->tailOwned)
+		{
+			connection->output.append(QByteArray());
+			connection->tailOwned = true;
+		}
+		connection->output.last().append(data);
+		copiedCount.fetch_add(data.size(), std::memory_order_relaxed);
+	}
+	connection->outputPending += data.size();
+	return;
+}
+
+/**
+ * @brief Writes as much of a connection's output as the socket will take
+ * All the waiting segments go to the kernel in one scatter-gather sendmsg call where possible.
+ * Whatever is left is written when epoll reports the socket writable again. Once a batch of
+ * inbox messages has been written, a job deletes it from the inbox and reads the next batch.
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @return void
+ */
+void ChatServer::flushOutput(EventLoop* loop, Connection* connection)
+{
+	while (connection->fd >= 0 && connection->outputPending > 0)
+	{
+		iovec segments[maxWriteSegments];
+		int count = 0;
+		for (int i = connection->outputHead; i < connection->output.size() && count < maxWriteSegments; i++)
+		{
+			int skip = i == connection->outputHead ? connection->outputSent : 0;
+			segments[count].iov_base = const_cast<char*>(connection->output[i].constData() + skip);
+			segments[count].iov_len = size_t(connection->output[i].size() - skip);
+			count++;
+		}
+
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = segments;
+		message.msg_iovlen = size_t(count);
+		ssize_t sent = sendmsg(connection->fd, &message, MSG_NOSIGNAL);
+		writeCount.fetch_add(1, std::memory_order_relaxed);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				closeConnection(loop, connection);
+			}
+			break;
+		}
+
+		// Let go of the segments that are now written, which frees shared frames nobody else needs
+		connection->outputPending -= int(sent);
+		connection->outputWritten += sent;
+		while (sent > 0)
+		{
+			int left = connection->output[connection->outputHead].size() - connection->outputSent;
+			if (sent < left)
+			{
+				connection->outputSent += int(sent);
+				break;
+			}
+			sent -= left;
+			connection->output[connection->outputHead++] = QByteArray();
+			connection->outputSent = 0;
+		}
+	}
+
+	if (connection->fd < 0)
+	{
+		return;
+	}
+	if (connection->inboxSeq > 0 && connection->outputWritten >= connection->inboxWrittenAt)
+	{
+		Job* next = new Job(loop, connection, WireOp::Message, 0, connection->protocol == ConnectionProtocol::Binary);
+		next->inboxSeq = connection->inboxSeq;
+		connection->inboxSeq = 0;
+		submitJobs(connection, QVector<Job*>() << next);
+	}
+	if (connection->outputPending == 0)
+	{
+		connection->output.clear();
+		connection->outputHead = 0;
+		connection->outputSent = 0;
+		connection->tailOwned = false;
+		if (connection->closing)
+		{
+			closeConnection(loop, connection);
+		}
+	}
+	else if (connection->outputHead >= maxWriteSegments)
+	{
+		connection->output.remove(0, connection->outputHead);
+		connection->outputHead = 0;
+	}
+	return;
+}
+
+/**
+ * @brief Moves the chat messages queued for a connection into its output
+ * Leaves them queued while the connection already has a lot of output waiting; a client that
+ * stops reading then loses messages to its full fan-out queue rather than growing the server
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @return void
+ */
+void ChatServer::deliverMessages(EventLoop* loop, Connection* connection)
+{
+	if (connection->fd < 0 || connection->fanoutID == 0)
+	{
+		return;
+	}
+	if (connection->outputPending >= outputHighWater)
+	{
+		connection->throttled = true;
+		return;
+	}
+	connection->throttled = false;
+
+	// Messages are queued as binary frames with their MSG lines as the alternate for text connections
+	QVector<FanoutMessage*> messages;
+	fanout->drain(connection->fanoutID, messages);
+	for (int i = 0; i < messages.size(); i++)
+	{
+		queueOutput(connection, connection->protocol == ConnectionProtocol::Binary ? messages[i]->payload() : messages[i]->alternate(), true);
+		messages[i]->release();
+	}
+	deliveredCount.fetch_add(messages.size(), std::memory_order_relaxed);
+	flushOutput(loop, connection);
+	return;
+}
+
+/**
+ * @brief Sends the replies the workers have finished and delivers chat messages to woken connections
+ * @param loop The loop
+ * @return void
+ */
+void ChatServer::finishJobs(EventLoop* loop)
+{
+	// Cleared before the rings are read, so anything pushed after the last read signals again
+	loop->signalled.store(false, std::memory_order_release);
+	eventfd_t value;
+	eventfd_read(loop->wakeFd, &value);
+
+	QVector<Connection*> replied;
+	QVector<Connection*> loggedIn;
+	Job* job;
+	while (loop->finished.tryPop(job))
+	{
+		Connection* connection = loop->connections.value(job->serial);
+		if (connection)
+		{
+			if (job->op == WireOp::Login && job->loggedIn && job->username != connection->username)
+			{
+				if (connection->fanoutID != 0)
+				{
+					QWriteLocker locker(&ownerLock);
+					fanoutOwners.remove(connection->fanoutID);
+					loop->fanoutConnections.remove(connection->fanoutID);
+					fanout->removeConnection(connection->fanoutID);
+				}
+				connection->username = job->username;
+				connection->inboxSeq = 0;
+				connection->fanoutID = fanout->addConnection(connection->username);
+				{
+					QWriteLocker locker(&ownerLock);
+					fanoutOwners.insert(connection->fanoutID, loop);
+				}
+				loop->fanoutConnections.insert(connection->fanoutID, connection->serial);
+				loggedIn.append(connection);
+			}
+			queueOutput(connection, job->reply);
+			connection->inFlight--;
+			if (job->op != WireOp::Message)
+			{
+				requestCount.fetch_add(1, std::memory_order_relaxed);
+			}
+			else if (job->inboxSeq > 0 && job->username == connection->username)
+			{
+				connection->inboxSeq = job->inboxSeq;
+				connection->inboxWrittenAt = connection->outputWritten + connection->outputPending;
+			}
+			if (!connection->replied)
+			{
+				connection->replied = true;
+				replied.append(connection);
+			}
+		}
+		delete job;
+	}
+
+	// Each connection parses its waiting requests and writes its replies once per batch
+	for (int i = 0; i < replied.size(); i++)
+	{
+		replied[i]->replied = false;
+		processInput(loop, replied[i]);
+	}
+
+	// Messages sent before a connection was registered with this loop raised no wakeup, and
+	// messages sent while the user was offline are in their inbox. The inbox is read after the
+	// connection is registered, so only a send routed before the login and stored after the
+	// drain is left in the inbox, where it waits for the next login
+	for (int i = 0; i < loggedIn.size(); i++)
+	{
+		deliverMessages(loop, loggedIn[i]);
+		bool binary = loggedIn[i]->protocol == ConnectionProtocol::Binary;
+		submitJobs(loggedIn[i], QVector<Job*>() << new Job(loop, loggedIn[i], WireOp::Message, 0, binary));
+	}
+
+	int fanoutID;
+	while (loop->ready.tryPop(fanoutID))
+	{
+		Connection* connection = loop->connections.value(loop->fanoutConnections.value(fanoutID));
+		if (connection)
+		{
+			deliverMessages(loop, connection);
+		}
+	}
+	return;
+}
+
+/**
+ * @brief Closes a connection and unregisters it; it is freed after the current batch of events
+ * @param loop The loop holding the connection
+ * @param connection The connection
+ * @return void
+ */
+void ChatServer::closeConnection(EventLoop* loop, Connection* connection)
+{
+	if (connection->fd < 0)
+	{
+		return;
+	}
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+	close(connection->fd);
+	connection->fd = -1;
+	loop->connections.remove(connection->serial);
+	if (connection->fanoutID != 0)
+	{
+		{
+			QWriteLocker locker(&ownerLock);
+			fanoutOwners.remove(connection->fanoutID);
+		}
+		loop->fanoutConnections.remove(connection->fanoutID);
+		fanout->removeConnection(connection->fanoutID);
+	}
+	connectionCount.fetch_sub(1, std::memory_order_relaxed);
+	loop->closed.append(connection);
+	return;
+}
+
+/**
+ * @brief Wakes a loop to collect finished jobs and ready connections
+ * Only the first signal since the loop last looked writes to its eventfd
+ * @param loop The loop
+ * @return void
+ */
+void ChatServer::signalLoop(EventLoop* loop)
+{
+	if (!loop->signalled.exchange(true, std::memory_order_acq_rel))
+	{
+		eventfd_write(loop->wakeFd, 1);
+	}
+	return;
+}
+
+/**
+ * @brief Runs a request against the database on a worker thread and sets its reply
+ * Text requests get the text protocol's reply line and binary requests a reply frame. A
+ * WireOp::Message job drains the user's inbox, and its reply is the messages themselves.
+ * @param manager The worker's database manager
+ * @param inbox The worker's inbox store, on the same connection
+ * @param job The request
+ * @return void
+ */
+void ChatServer::execute(DbManager& manager, InboxStore& inbox, Job* job)
+{
+	WireWriter reply(quint8(job->op) | wireReplyFlag, job->requestID);
+	switch (job->op)
+	{
+		case WireOp::Register:
+		{
+			bool added = manager.addUser(job->username, job->argument, job->source);
+			reply.writeByte(quint8(added ? WireStatus::Ok : WireStatus::Failed));
+			job->reply = added ? "OK\n" : "ERR could not register that username\n";
+			break;
+		}
+		case WireOp::Login:
+			job->loggedIn = manager.checkUserInfo(job->username, job->argument, job->source);
+			reply.writeByte(quint8(job->loggedIn ? WireStatus::Ok : WireStatus::Failed));
+			job->reply = job->loggedIn ? "OK\n" : "ERR wrong username or password\n";
+			break;
+		case WireOp::UserExists:
+			reply.writeByte(quint8(WireStatus::Ok));
+			reply.writeByte(manager.userExists(job->argument) ? 1 : 0);
+			break;
+		case WireOp::CreateChat:
+		{
+			bool created = manager.addChat(job->chatID, job->username, job->members);
+			fanout->invalidateChat(job->chatID);
+			reply.writeByte(quint8(created ? WireStatus::Ok : WireStatus::Failed));
+			job->reply = created ? "OK\n" : "ERR could not create the chat\n";
+			break;
+		}
+		case WireOp::DeleteChat:
+		{
+			bool removed = manager.removeChat(job->chatID, job->username);
+			fanout->invalidateChat(job->chatID);
+			reply.writeByte(quint8(removed ? WireStatus::Ok : WireStatus::Failed));
+			job->reply = removed ? "OK\n" : "ERR could not delete the chat\n";
+			break;
+		}
+		case WireOp::ChatExists:
+			reply.writeByte(quint8(WireStatus::Ok));
+			reply.writeByte(manager.chatExists(job->chatID) ? 1 : 0);
+			break;
+		case WireOp::ChatOwner:
+		{
+			QString owner = manager.getChatOwner(job->chatID);
+			reply.writeByte(quint8(owner.isEmpty() ? WireStatus::Failed : WireStatus::Ok));
+			reply.writeString(owner);
+			break;
+		}
+		case WireOp::UsersChat:
+			reply.writeByte(quint8(WireStatus::Ok));
+			reply.writeByte(manager.doUsersChat(job->username, job->argument) ? 1 : 0);
+			break;
+		case WireOp::ChatUsers:
+			if (!fanout->isMember(manager, job->chatID, job->username))
+			{
+				reply.writeByte(quint8(WireStatus::NotMember));
+			}
+			else
+			{
+				UsernameList users = manager.getChatUserList(job->chatID);
+				reply.writeByte(quint8(WireStatus::Ok));
+				reply.writeVarint(quint64(users.size()));
+				for (Utf8View user : users)
+				{
+					reply.writeString(user.data(), user.size());
+				}
+			}
+			break;
+		case WireOp::OnlineUsers:
+			if (!fanout->isMember(manager, job->chatID, job->username))
+			{
+				reply.writeByte(quint8(WireStatus::NotMember));
+				job->reply = "ERR not a member of that chat\n";
+			}
+			else
+			{
+				QVector<QString> users = manager.getOnlineChatUsers(job->chatID);
+				reply.writeByte(quint8(WireStatus::Ok));
+				reply.writeVarint(quint64(users.size()));
+				QStringList names;
+				for (int i = 0; i < users.size(); i++)
+				{
+					reply.writeString(users[i]);
+					names.append(users[i]);
+				}
+				job->reply = "OK " + names.join(',').toUtf8() + "\n";
+			}
+			break;
+		case WireOp::UserChats:
+		{
+			ChatIdList chats = manager.getChatIdsUserIsIn(job->username);
+			reply.writeByte(quint8(WireStatus::Ok));
+			reply.writeVarint(quint64(chats.size()));
+			for (int chatID : chats)
+			{
+				reply.writeVarint(quint64(chatID));
+			}
+			break;
+		}
+		case WireOp::Roster:
+			if (!job->binary)
+			{
+				// Built and sent as UTF-8, without decoding the roster into a QString in between
+				QByteArray self = job->username.toUtf8();
+				job->reply = "OK " + manager.getUserChatInfoUtf8(Utf8View(self.constData(), self.size())) + "\n";
+			}
+			else
+			{
+				// The same pairs getUserChatInfo joins with commas, as fields, gathered in one arena first
+				ResultArena* arena = ResultArena::acquire();
+				UsernameList roster(arena);
+				manager.forEachRosterEntry(job->username, [arena](int chatID, Utf8View user)
+				{
+					arena->appendId(chatID);
+					arena->appendText(user.data(), user.size());
+					return true;
+				});
+				reply.writeByte(quint8(WireStatus::Ok));
+				reply.writeVarint(quint64(roster.size()));
+				for (int i = 0; i < roster.size(); i++)
+				{
+					reply.writeVarint(quint64(arena->idData()[i]));
+					reply.writeString(roster[i].data(), roster[i].size());
+				}
+			}
+			break;
+		case WireOp::Send:
+			if (!fanout->isMember(manager, job->chatID, job->username))
+			{
+				reply.writeByte(quint8(WireStatus::NotMember));
+				job->reply = "ERR not a member of that chat\n";
+			}
+			else
+			{
+				WireWriter message(quint8(WireOp::Message), 0);
+				message.writeVarint(quint64(job->chatID));
+				message.writeString(job->username);
+				message.writeString(job->text);
+				QVector<QString> offline;
+				QByteArray frame = message.frame();
+				int delivered = fanout->send(manager, job->chatID, frame, &offline, messageLine(frame));
+				inbox.store(job->chatID, job->username, job->text, offline);
+				reply.writeByte(quint8(WireStatus::Ok));
+				reply.writeVarint(quint64(delivered));
+				job->reply = "OK " + QByteArray::number(delivered) + "\n";
+			}
+			break;
+		case WireOp::Message:
+		{
+			// The batch just written is deleted before the next one is read, so a message is only
+			// lost from the inbox once it has reached the socket
+			bool removed = job->inboxSeq == 0 || inbox.remove(job->username, job->inboxSeq);
+			job->inboxSeq = 0;
+			QVector<InboxMessage> messages = removed ? inbox.peek(job->username, inboxBatch, &job->inboxSeq) : QVector<InboxMessage>();
+			for (int i = 0; i < messages.size(); i++)
+			{
+				WireWriter message(quint8(WireOp::Message), 0);
+				message.writeVarint(quint64(messages[i].chatID));
+				message.writeString(messages[i].sender);
+				message.writeString(messages[i].payload);
+				job->reply.append(job->binary ? message.frame() : messageLine(message.frame()));
+			}
+			return;
+		}
+		default:
+			reply.writeByte(quint8(WireStatus::UnknownOp));
+			break;
+	}
+
+	if (job->binary)
+	{
+		job->reply = reply.frame();
+	}
+	return;
+}
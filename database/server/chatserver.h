@@ -0,0 +1,143 @@
+/**
+ * @file chatserver.h
+ * @brief This contains the prototypes for the epoll-based chat server
+ *
+ * The server runs one event loop thread per core. Every loop has its own listening socket bound
+ * to the same port with SO_REUSEPORT, so the kernel spreads new connections across the loops and
+ * no loop ever touches another loop's connections. Sockets are non-blocking and registered
+ * edge-triggered, so each readiness event is handled by reading or writing until EAGAIN.
+ *
+ * Requests are lines of text and every reply is one line starting with OK or ERR:
+ *   REGISTER <username> <password>
+ *   LOGIN <username> <password>
+ *   CREATE <chat id> <member>,<member>,...	(the logged-in user owns the chat and is always a member)
+ *   DELETE <chat id>
+ *   ROSTER					(replies with getUserChatInfo for the logged-in user)
+ *   ONLINE <chat id>				(replies with the connected members, separated by commas)
+ *   SEND <chat id> <text>			(members' connections receive "MSG <chat id> <sender> <text>")
+ *   QUIT
+ *
+ * A connection whose first byte is wirePreface speaks the binary protocol in wireprotocol.h
+ * instead, which covers every DbManager operation. Its frames are parsed in place in the
+ * receive buffer, and up to maxPipelineDepth of its requests can be in flight at once. A
+ * connection stops being read while a full frame's worth of its input is waiting to be parsed,
+ * so a client that pipelines faster than it is answered cannot grow its buffer without limit.
+ *
+ * Anything that touches the database is handed to a pool of worker threads, each with its own
+ * DbManager connection, and the reply comes back to the connection's loop through a lock-free
+ * ring and an eventfd, so an I/O thread never waits on SQLite. A text connection has one request
+ * in flight at a time; lines that arrive meanwhile wait in its input buffer and are answered in
+ * order. A binary connection's requests run concurrently and their replies come back in the order
+ * they finish, so a client must wait for a reply before sending a request that depends on it.
+ * Chat messages are delivered through a FanoutEngine shared by all loops. Members with no
+ * connection get the message in their InboxStore inbox instead, and once a login has registered
+ * its connection the inbox is drained to it in batches of inboxBatch messages. A batch is deleted
+ * from the inbox only once it has been written to the socket, so a connection that drops first
+ * gets the same messages again at its next login.
+ * Logins and registrations are throttled by a LoginThrottle keyed on the username and the
+ * peer's IP address, shared by all workers, so attempt bursts are refused without a query.
+ * The workers also share a UserCache, so repeated user lookups do not query userinfo.
+ *
+ * A connection's output is a list of segments written with one scatter-gather sendmsg call.
+ * A chat message frame is built once and the same buffer is queued on every recipient's
+ * connection, so a group send copies nothing per member; small replies are still coalesced.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef CHATSERVER_H
+#define CHATSERVER_H
+
+#include <QString>
+#include <QHash>
+#include <QQueue>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QReadWriteLock>
+#include <QScopedPointer>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class DbManager;
+class FanoutEngine;
+class InboxStore;
+class LoginThrottle;
+class UserCache;
+
+struct ServerStats
+{
+	qint64 accepted;
+	qint64 connections;
+	qint64 requests;
+	qint64 messagesDelivered;
+	qint64 bytesCopied;	// into connections' output buffers
+	qint64 writeCalls;
+};
+
+class ChatServer
+{
+	public:
+		// Most connections one loop will hold; further connections are closed as they are accepted
+		static const int maxLoopConnections = 65536;
+		// Most requests one binary connection may have in flight; later frames wait to be parsed
+		static const int maxPipelineDepth = 256;
+		// Replies at least this large are written from their own buffer rather than copied; pushed messages always are
+		static const int sharedFrameSize = 256;
+		// Most inbox messages drained by one worker job; a fuller inbox is drained by several
+		static const int inboxBatch = 1024;
+
+		explicit ChatServer(const QString& databasePath);
+		~ChatServer();
+		bool start(quint16 port, int loopCount = 0, int workerCount = 0);
+		void stop();
+		void setSharedFrames(bool enabled);
+		void setLoginThrottle(bool enabled);
+		quint16 port() const;
+		ServerStats stats() const;
+	private:
+		Q_DISABLE_COPY(ChatServer)
+		struct Connection;
+		struct EventLoop;
+		struct Job;
+		void runLoop(EventLoop* loop);
+		void runWorker(int index);
+		void acceptConnections(EventLoop* loop);
+		void readInput(EventLoop* loop, Connection* connection);
+		void processInput(EventLoop* loop, Connection* connection);
+		void setReading(EventLoop* loop, Connection* connection, bool reading);
+		void submitJobs(Connection* connection, const QVector<Job*>& submitted);
+		void parseLines(EventLoop* loop, Connection* connection, QVector<Job*>& parsed);
+		void parseFrames(EventLoop* loop, Connection* connection, QVector<Job*>& parsed);
+		void queueOutput(Connection* connection, const QByteArray& data, bool shared = false);
+		void flushOutput(EventLoop* loop, Connection* connection);
+		void deliverMessages(EventLoop* loop, Connection* connection);
+		void finishJobs(EventLoop* loop);
+		void closeConnection(EventLoop* loop, Connection* connection);
+		void signalLoop(EventLoop* loop);
+		void execute(DbManager& manager, InboxStore& inbox, Job* job);
+		QString databasePath;
+		quint16 listenPort;
+		std::atomic<bool> running;
+		bool sharedFrames;
+		QScopedPointer<FanoutEngine> fanout;
+		QScopedPointer<LoginThrottle> throttle;
+		bool throttleLogins;
+		QScopedPointer<UserCache> userCache;
+		std::vector<EventLoop*> loops;
+		std::vector<std::thread> workers;
+		QMutex jobMutex;
+		QWaitCondition jobReady;
+		QQueue<Job*> jobs;
+		QReadWriteLock ownerLock;
+		QHash<int, EventLoop*> fanoutOwners;	// fan-out connection id -> the loop holding it
+		std::atomic<qint64> acceptedCount;
+		std::atomic<qint64> connectionCount;
+		std::atomic<qint64> requestCount;
+		std::atomic<qint64> deliveredCount;
+		std::atomic<qint64> copiedCount;
+		std::atomic<qint64> writeCount;
+};
+
+#endif	// CHATSERVER_H
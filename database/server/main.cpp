@@ -0,0 +1,72 @@
+#include <QCoreApplication>
+#include <dbmanager.h>
+#include <chatserver.h>
+#include <iostream>
+#include <csignal>
+#include <sys/resource.h>
+
+/**
+ * Runs the chat server until it receives SIGINT or SIGTERM
+ * Usage: server.out <database file> [port] [loops] [workers]
+ * Loops and workers default to one per core; the tables are created if the database is new
+ */
+
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = QCoreApplication::arguments();
+
+	if (args.size() < 2)
+	{
+		std::cout << "Usage: server.out <database file> [port] [loops] [workers]" << std::endl;
+		return 1;
+	}
+
+	QString databasePath = args[1];
+	quint16 port = args.size() > 2 ? quint16(args[2].toUInt()) : 7878;
+	int loops = args.size() > 3 ? args[3].toInt() : 0;
+	int workers = args.size() > 4 ? args[4].toInt() : 0;
+
+	// Every client holds a descriptor, so allow as many as the hard limit does
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	{
+		DbManager db(databasePath, "chatserver-setup");
+		if (!db.isOpen())
+		{
+			return 1;
+		}
+		// These fail harmlessly when the database already has its tables
+		db.createUserTable();
+		db.createChatTables();
+		db.close();
+	}
+
+	// Block the stop signals before any threads start so that only sigwait below sees them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	ChatServer server(databasePath);
+	if (!server.start(port, loops, workers))
+	{
+		std::cout << "Could not start the server on port " << port << std::endl;
+		return 1;
+	}
+	std::cout << "Listening on port " << server.port() << std::endl;
+
+	int received = 0;
+	sigwait(&signals, &received);
+
+	ServerStats stats = server.stats();
+	server.stop();
+	std::cout << "Stopped after " << stats.accepted << " connections and " << stats.requests << " requests" << std::endl;
+	return 0;
+}
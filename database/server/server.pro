@@ -0,0 +1,20 @@
+QT       += core sql
+QT       -= gui
+
+TARGET = server.out
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+           chatserver.cpp \
+           wireprotocol.cpp
+
+HEADERS += chatserver.h \
+           wireprotocol.h
+
+INCLUDEPATH += $$PWD
+
+include(../database.pri)
@@ -0,0 +1,280 @@
+/**
+ * @file wireprotocol.cpp
+ * @brief Parses and builds binary wire protocol frames
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <wireprotocol.h>
+
+/**
+ * @brief Reads an unsigned LEB128 varint
+ * @param data Pointer to the first byte
+ * @param end Pointer one past the last byte available
+ * @param value Receives the value
+ * @return The number of bytes read, 0 if the varint is incomplete or -1 if it is longer than ten bytes
+ */
+int WireParser::readVarint(const char* data, const char* end, quint64& value)
+{
+	value = 0;
+	for (int i = 0; i < 10; i++)
+	{
+		if (data + i >= end)
+		{
+			return 0;
+		}
+		quint8 byte = quint8(data[i]);
+		value |= quint64(byte & 0x7f) << (7 * i);
+		if ((byte & 0x80) == 0)
+		{
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Finds the next complete frame in a receive buffer
+ * @param data The unparsed part of the buffer
+ * @param size The number of bytes available
+ * @param frame Receives the frame, which points into data
+ * @return The size of the frame, 0 if more bytes are needed or -1 if the data is not a valid frame
+ */
+int WireParser::parse(const char* data, int size, WireFrame& frame)
+{
+	const char* end = data + size;
+	quint64 length = 0;
+	int prefix = readVarint(data, end, length);
+	if (prefix <= 0)
+	{
+		return prefix < 0 || size >= 5 ? -1 : 0;
+	}
+	if (length < 2 || length > quint64(maxFrameSize))
+	{
+		return -1;
+	}
+	if (quint64(size - prefix) < length)
+	{
+		return 0;
+	}
+
+	const char* body = data + prefix;
+	const char* bodyEnd = body + length;
+	int idSize = readVarint(body + 1, bodyEnd, frame.requestID);
+	if (idSize <= 0)
+	{
+		return -1;
+	}
+	frame.opcode = quint8(body[0]);
+	frame.payload = body + 1 + idSize;
+	frame.payloadSize = int(bodyEnd - frame.payload);
+	frame.frameSize = prefix + int(length);
+	return frame.frameSize;
+}
+
+/**
+ * @brief Constructor for a reader over a frame's payload
+ * @param frame The frame
+ */
+WireReader::WireReader(const WireFrame& frame)
+	: position(frame.payload), end(frame.payload + frame.payloadSize)
+{
+}
+
+/**
+ * @brief Reads a varint field
+ * @param value Receives the value
+ * @return boolean indicating whether a complete varint was read
+ */
+bool WireReader::readVarint(quint64& value)
+{
+	int size = WireParser::readVarint(position, end, value);
+	if (size <= 0)
+	{
+		return false;
+	}
+	position += size;
+	return true;
+}
+
+/**
+ * @brief Reads a varint field that must fit in a non-negative int, such as a chat id
+ * @param value Receives the value
+ * @return boolean indicating whether a valid value was read
+ */
+bool WireReader::readInt(int& value)
+{
+	quint64 wide = 0;
+	if (!readVarint(wide) || wide > 0x7fffffff)
+	{
+		return false;
+	}
+	value = int(wide);
+	return true;
+}
+
+/**
+ * @brief Reads a single byte field
+ * @param value Receives the byte
+ * @return boolean indicating whether a byte was left to read
+ */
+bool WireReader::readByte(quint8& value)
+{
+	if (position >= end)
+	{
+		return false;
+	}
+	value = quint8(*position++);
+	return true;
+}
+
+/**
+ * @brief Reads a string field without copying it
+ * @param value Receives a view of the string inside the receive buffer
+ * @return boolean indicating whether the whole string was present
+ */
+bool WireReader::readString(WireString& value)
+{
+	quint64 size = 0;
+	if (!readVarint(size) || size > quint64(end - position))
+	{
+		return false;
+	}
+	value.data = position;
+	value.size = int(size);
+	position += size;
+	return true;
+}
+
+/**
+ * @brief Checks whether the whole payload has been read
+ * @return boolean indicating whether no bytes are left
+ */
+bool WireReader::atEnd() const
+{
+	return position == end;
+}
+
+/**
+ * @brief Constructor for a frame writer
+ * @param opcode The frame's opcode, with wireReplyFlag set for replies
+ * @param requestID The request id, which is 0 for pushed messages
+ */
+WireWriter::WireWriter(quint8 opcode, quint64 requestID)
+{
+	body.reserve(32);
+	body.append(char(opcode));
+	writeVarint(requestID);
+}
+
+/**
+ * @brief Writes a varint field
+ * @param value The value
+ * @return void
+ */
+void WireWriter::writeVarint(quint64 value)
+{
+	while (value >= 0x80)
+	{
+		body.append(char((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	body.append(char(value));
+	return;
+}
+
+/**
+ * @brief Writes a single byte field
+ * @param value The byte
+ * @return void
+ */
+void WireWriter::writeByte(quint8 value)
+{
+	body.append(char(value));
+	return;
+}
+
+/**
+ * @brief Writes a string field
+ * @param value The string's bytes
+ * @return void
+ */
+void WireWriter::writeString(const QByteArray& value)
+{
+	writeVarint(quint64(value.size()));
+	body.append(value);
+	return;
+}
+
+/**
+ * @brief Writes a string field as UTF-8
+ * @param value The string
+ * @return void
+ */
+void WireWriter::writeString(const QString& value)
+{
+	writeString(value.toUtf8());
+	return;
+}
+
+/**
+ * @brief Writes a string field that is already UTF-8, such as a Utf8View from a result set
+ * @param data The bytes
+ * @param size The number of bytes
+ * @return void
+ */
+void WireWriter::writeString(const char* data, int size)
+{
+	writeVarint(quint64(size));
+	body.append(data, size);
+	return;
+}
+
+/**
+ * @brief Appends the finished frame, with its length prefix, to an output buffer
+ * @param output The buffer
+ * @return void
+ */
+void WireWriter::appendTo(QByteArray& output) const
+{
+	char prefix[10];
+	int prefixSize = 0;
+	quint64 length = quint64(body.size());
+	while (length >= 0x80)
+	{
+		prefix[prefixSize++] = char((length & 0x7f) | 0x80);
+		length >>= 7;
+	}
+	prefix[prefixSize++] = char(length);
+	output.append(prefix, prefixSize);
+	output.append(body);
+	return;
+}
+
+/**
+ * @brief Gets the finished frame with its length prefix
+ * @return The frame
+ */
+QByteArray WireWriter::frame() const
+{
+	QByteArray output;
+	output.reserve(varintSize(quint64(body.size())) + body.size());
+	appendTo(output);
+	return output;
+}
+
+/**
+ * @brief Gets the number of bytes a value takes as a varint
+ * @param value The value
+ * @return The size, from 1 to 10 bytes
+ */
+int WireWriter::varintSize(quint64 value)
+{
+	int size = 1;
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
@@ -0,0 +1,122 @@
+/**
+ * @file wireprotocol.h
+ * @brief This contains the prototypes for the chat server's binary wire protocol
+ *
+ * A frame is [length][opcode:1][request id][payload], where length counts everything after
+ * itself and both length and request id are unsigned LEB128 varints. Payload fields are varints,
+ * single bytes for statuses and booleans, and strings as a varint byte count followed by UTF-8.
+ *
+ * A reply has the request's opcode with wireReplyFlag set, the same request id and a payload
+ * that starts with a WireStatus byte. Clients may have many requests in flight and match replies
+ * by request id, since replies come back in the order the requests finish. Chat messages are
+ * pushed to clients as WireOp::Message frames with request id 0.
+ *
+ * WireParser and WireReader work on the receive buffer in place: a parsed frame and the
+ * WireStrings read from it point into the buffer and are valid only until it next changes.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef WIREPROTOCOL_H
+#define WIREPROTOCOL_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+
+// Request payloads are listed with each opcode, followed by the reply payload after the status
+enum class WireOp : quint8
+{
+	Register = 1,	// username, password
+	Login,		// username, password
+	UserExists,	// username -> bool
+	CreateChat,	// chat id, member count, members... (the logged-in user owns the chat)
+	DeleteChat,	// chat id
+	ChatExists,	// chat id -> bool
+	ChatOwner,	// chat id -> username
+	UsersChat,	// username -> bool, whether the logged-in user shares a chat with them
+	ChatUsers,	// chat id -> count, usernames...
+	UserChats,	// -> count, chat ids... of the logged-in user
+	Roster,		// -> count, (chat id, username)... as getUserChatInfo, without the logged-in user
+	Send,		// chat id, text -> number of connections it was delivered to
+	OnlineUsers,	// chat id -> count, usernames... of the members who are connected
+	Message = 64	// pushed by the server: chat id, sender, text
+};
+
+enum class WireStatus : quint8
+{
+	Ok = 0,
+	Failed,		// the database refused the operation
+	NotLoggedIn,
+	NotMember,
+	Malformed,
+	UnknownOp
+};
+
+static const quint8 wireReplyFlag = 0x80;
+
+// A binary connection's first byte; no text command or frame starts with it
+static const char wirePreface = '\0';
+
+// A string inside a receive buffer
+struct WireString
+{
+	const char* data;
+	int size;
+
+	QString toString() const
+	{
+		return QString::fromUtf8(data, size);
+	}
+};
+
+struct WireFrame
+{
+	quint8 opcode;
+	quint64 requestID;
+	const char* payload;
+	int payloadSize;
+	int frameSize;	// including the length prefix
+};
+
+class WireParser
+{
+	public:
+		static const int maxFrameSize = 1 << 20;
+
+		static int parse(const char* data, int size, WireFrame& frame);
+		static int readVarint(const char* data, const char* end, quint64& value);
+};
+
+class WireReader
+{
+	public:
+		explicit WireReader(const WireFrame& frame);
+		bool readVarint(quint64& value);
+		bool readInt(int& value);
+		bool readByte(quint8& value);
+		bool readString(WireString& value);
+		bool atEnd() const;
+	private:
+		const char* position;
+		const char* end;
+};
+
+class WireWriter
+{
+	public:
+		WireWriter(quint8 opcode, quint64 requestID);
+		void writeVarint(quint64 value);
+		void writeByte(quint8 value);
+		void writeString(const QByteArray& value);
+		void writeString(const QString& value);
+		void writeString(const char* data, int size);
+		void appendTo(QByteArray& output) const;
+		QByteArray frame() const;
+		static int varintSize(quint64 value);
+	private:
+		QByteArray body;
+};
+
+#endif	// WIREPROTOCOL_H
@@ -0,0 +1,394 @@
+/**
+ * @file sessionmanager.cpp
+ * @brief Issues, checks and revokes HMAC-signed session tokens
+ *
+ * Each signing key keeps two digest contexts that have already absorbed the HMAC inner and
+ * outer pad blocks, so checking a token hashes only the token itself plus one short block.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <sessionmanager.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <QDateTime>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <cstring>
+
+static const quint8 tokenVersion = 1;
+static const int headerSize = 1 + 1 + 4 + 8 + 1;
+
+// A signing key with its HMAC pads already hashed
+struct SessionKey
+{
+	EVP_MD_CTX* inner;
+	EVP_MD_CTX* outer;
+
+	SessionKey() : inner(EVP_MD_CTX_new()), outer(EVP_MD_CTX_new()) {}
+	~SessionKey()
+	{
+		EVP_MD_CTX_free(inner);
+		EVP_MD_CTX_free(outer);
+	}
+};
+
+// A digest context per thread, so checking tokens from many threads allocates nothing
+struct ThreadDigest
+{
+	EVP_MD_CTX* ctx;
+
+	ThreadDigest() : ctx(EVP_MD_CTX_new()) {}
+	~ThreadDigest()
+	{
+		EVP_MD_CTX_free(ctx);
+	}
+};
+
+/**
+ * @brief Builds a signing key from raw key bytes
+ * @param key The key, which must be 32 bytes
+ * @return The signing key, or a null pointer if the digest contexts could not be set up
+ */
+static QSharedPointer<SessionKey> makeKey(const QByteArray& key)
+{
+	QSharedPointer<SessionKey> sessionKey(new SessionKey());
+	unsigned char innerPad[64];
+	unsigned char outerPad[64];
+	memset(innerPad, 0x36, sizeof(innerPad));
+	memset(outerPad, 0x5c, sizeof(outerPad));
+	for (int i = 0; i < key.size(); i++)
+	{
+		innerPad[i] ^= static_cast<unsigned char>(key[i]);
+		outerPad[i] ^= static_cast<unsigned char>(key[i]);
+	}
+
+	bool ok = sessionKey->inner && sessionKey->outer
+		&& EVP_DigestInit_ex(sessionKey->inner, EVP_sha256(), nullptr) == 1
+		&& EVP_DigestUpdate(sessionKey->inner, innerPad, sizeof(innerPad)) == 1
+		&& EVP_DigestInit_ex(sessionKey->outer, EVP_sha256(), nullptr) == 1
+		&& EVP_DigestUpdate(sessionKey->outer, outerPad, sizeof(outerPad)) == 1;
+	OPENSSL_cleanse(innerPad, sizeof(innerPad));
+	OPENSSL_cleanse(outerPad, sizeof(outerPad));
+	return ok ? sessionKey : QSharedPointer<SessionKey>();
+}
+
+/**
+ * @brief Computes the truncated HMAC-SHA256 tag of a token
+ * @param key The signing key
+ * @param data The signed part of the token
+ * @param length The length of the signed part
+ * @param tag Receives tagSize bytes
+ * @return boolean indicating whether the tag was computed
+ */
+static bool computeTag(const SessionKey& key, const char* data, int length, unsigned char* tag)
+{
+	thread_local ThreadDigest digest;
+	unsigned char innerHash[32];
+	unsigned char outerHash[32];
+	unsigned int hashLength = 0;
+
+	bool ok = digest.ctx
+		&& EVP_MD_CTX_copy_ex(digest.ctx, key.inner) == 1
+		&& EVP_DigestUpdate(digest.ctx, data, length) == 1
+		&& EVP_DigestFinal_ex(digest.ctx, innerHash, &hashLength) == 1
+		&& EVP_MD_CTX_copy_ex(digest.ctx, key.outer) == 1
+		&& EVP_DigestUpdate(digest.ctx, innerHash, sizeof(innerHash)) == 1
+		&& EVP_DigestFinal_ex(digest.ctx, outerHash, &hashLength) == 1;
+	if (ok)
+	{
+		memcpy(tag, outerHash, SessionManager::tagSize);
+	}
+	return ok;
+}
+
+/**
+ * @brief Reads a big-endian integer from a token
+ * @param data Pointer to the first byte
+ * @param bytes The number of bytes
+ * @return The integer
+ */
+static quint64 readBigEndian(const char* data, int bytes)
+{
+	quint64 value = 0;
+	for (int i = 0; i < bytes; i++)
+	{
+		value = (value << 8) | static_cast<quint8>(data[i]);
+	}
+	return value;
+}
+
+/**
+ * @brief Appends a big-endian integer to a token
+ * @param token The token being built
+ * @param value The integer
+ * @param bytes The number of bytes to write
+ * @return void
+ */
+static void appendBigEndian(QByteArray& token, quint64 value, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--)
+	{
+		token.append(char((value >> (8 * i)) & 0xff));
+	}
+	return;
+}
+
+/**
+ * @brief Constructor for a session manager
+ * Starts with one freshly generated signing key
+ * @param manager The database manager used to check credentials at login
+ */
+SessionManager::SessionManager(DbManager& manager)
+	: manager(manager), currentKey(0), revokedCount(0)
+{
+	rotateKey();
+}
+
+/**
+ * @brief Destructor for the session manager
+ */
+SessionManager::~SessionManager()
+{
+}
+
+/**
+ * @brief Checks a user's credentials against the database and issues a token if they are correct
+ * @param username The username
+ * @param password The password
+ * @param lifetimeSeconds How long the token stays valid
+ * @return The token, or an empty QByteArray if the credentials were wrong
+ */
+QByteArray SessionManager::login(const QString& username, const QString& password, int lifetimeSeconds)
+{
+	if (!manager.checkUserInfo(username, password))
+	{
+		return QByteArray();
+	}
+	return issue(username, lifetimeSeconds);
+}
+
+/**
+ * @brief Issues a token for a user who has already been authenticated
+ * @param username The username
+ * @param lifetimeSeconds How long the token stays valid
+ * @return The token, or an empty QByteArray if the username is too long or signing failed
+ */
+QByteArray SessionManager::issue(const QString& username, int lifetimeSeconds)
+{
+	QByteArray name = username.toUtf8();
+	if (name.isEmpty() || name.size() > 255)
+	{
+		DBLOG_WARNING("issue", DbErrorUserMissing, 0, "usernames in tokens must be 1 to 255 bytes", username);
+		return QByteArray();
+	}
+
+	quint64 tokenID = 0;
+	RAND_bytes(reinterpret_cast<unsigned char*>(&tokenID), sizeof(tokenID));
+	quint32 expiry = quint32(QDateTime::currentSecsSinceEpoch() + lifetimeSeconds);
+
+	QReadLocker locker(&keyLock);
+	QByteArray token;
+	token.reserve(headerSize + name.size() + tagSize);
+	token.append(char(tokenVersion));
+	token.append(char(currentKey));
+	appendBigEndian(token, expiry, 4);
+	appendBigEndian(token, tokenID, 8);
+	token.append(char(name.size()));
+	token.append(name);
+
+	unsigned char tag[tagSize];
+	if (!keys[currentKey] || !computeTag(*keys[currentKey], token.constData(), token.size(), tag))
+	{
+		DBLOG_ERROR("issue", DbErrorCrypto, 0, "token could not be signed", username);
+		return QByteArray();
+	}
+	token.append(reinterpret_cast<const char*>(tag), tagSize);
+	return token;
+}
+
+/**
+ * @brief Checks a token and gets the user it was issued to
+ * @param token The token
+ * @param username Receives the username if the token is valid
+ * @return boolean indicating whether the token is authentic, unexpired and not revoked
+ */
+bool SessionManager::verify(const QByteArray& token, QString& username)
+{
+	return checkToken(token, &username);
+}
+
+/**
+ * @brief Checks a token
+ * @param token The token
+ * @return boolean indicating whether the token is authentic, unexpired and not revoked
+ */
+bool SessionManager::verify(const QByteArray& token)
+{
+	return checkToken(token, nullptr);
+}
+
+/**
+ * @brief Revokes a token before it expires
+ * Revoked tokens are remembered until their expiry, after which they are rejected anyway
+ * @param token The token, which must itself be valid
+ * @return boolean indicating whether the token was revoked
+ */
+bool SessionManager::revoke(const QByteArray& token)
+{
+	if (!verify(token))
+	{
+		return false;
+	}
+
+	quint64 tokenID = readBigEndian(token.constData() + 6, 8);
+	quint32 expiry = quint32(readBigEndian(token.constData() + 2, 4));
+	quint32 now = quint32(QDateTime::currentSecsSinceEpoch());
+
+	QWriteLocker locker(&revokedLock);
+	QHash<quint64, quint32>::iterator it = revoked.begin();
+	while (it != revoked.end())
+	{
+		if (it.value() < now)
+		{
+			it = revoked.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+	revoked.insert(tokenID, expiry);
+	revokedCount = revoked.size();
+	return true;
+}
+
+/**
+ * @brief Starts signing new tokens with a freshly generated key
+ * Tokens signed with the previous key stay valid; the key before that is retired
+ * @return The id of the new key
+ */
+quint8 SessionManager::rotateKey()
+{
+	QByteArray key(32, '\0');
+	RAND_bytes(reinterpret_cast<unsigned char*>(key.data()), key.size());
+	QSharedPointer<SessionKey> sessionKey = makeKey(key);
+	key.fill(0);
+
+	QWriteLocker locker(&keyLock);
+	quint8 next = quint8(currentKey + 1);
+	keys[quint8(currentKey - 1)].clear();
+	keys[next] = sessionKey;
+	currentKey = next;
+	if (!sessionKey)
+	{
+		DBLOG_ERROR("rotateKey", DbErrorCrypto, 0, "signing key could not be created", QString());
+	}
+	return next;
+}
+
+/**
+ * @brief Gets the id of the key new tokens are signed with
+ * @return The key id
+ */
+quint8 SessionManager::currentKeyId()
+{
+	QReadLocker locker(&keyLock);
+	return currentKey;
+}
+
+/**
+ * @brief Installs a shared signing key and signs new tokens with it
+ * Lets several servers accept each other's tokens
+ * @param keyId The id to store the key under
+ * @param key A key of 32 bytes
+ * @return boolean indicating whether the key was installed
+ */
+bool SessionManager::setKey(quint8 keyId, const QByteArray& key)
+{
+	if (key.size() != 32)
+	{
+		DBLOG_ERROR("setKey", DbErrorCrypto, 0, "signing keys must be 32 bytes", QString());
+		return false;
+	}
+
+	QSharedPointer<SessionKey> sessionKey = makeKey(key);
+	if (!sessionKey)
+	{
+		return false;
+	}
+	QWriteLocker locker(&keyLock);
+	keys[keyId] = sessionKey;
+	currentKey = keyId;
+	return true;
+}
+
+/**
+ * @brief Stops accepting tokens signed with a key, which logs out everyone holding one
+ * @param keyId The id of the key
+ * @return void
+ */
+void SessionManager::retireKey(quint8 keyId)
+{
+	QWriteLocker locker(&keyLock);
+	keys[keyId].clear();
+	return;
+}
+
+/**
+ * @brief Parses and checks a token
+ * @param token The token
+ * @param username Receives the username if it is not nullptr and the token is valid
+ * @return boolean indicating whether the token is authentic, unexpired and not revoked
+ */
+bool SessionManager::checkToken(const QByteArray& token, QString* username)
+{
+	const char* data = token.constData();
+	if (token.size() < headerSize + 1 + tagSize || quint8(data[0]) != tokenVersion)
+	{
+		return false;
+	}
+	int nameLength = quint8(data[headerSize - 1]);
+	if (token.size() != headerSize + nameLength + tagSize)
+	{
+		return false;
+	}
+
+	unsigned char tag[tagSize];
+	{
+		QReadLocker locker(&keyLock);
+		const QSharedPointer<SessionKey>& key = keys[quint8(data[1])];
+		if (!key || !computeTag(*key, data, headerSize + nameLength, tag))
+		{
+			return false;
+		}
+	}
+	if (CRYPTO_memcmp(tag, data + headerSize + nameLength, tagSize) != 0)
+	{
+		return false;
+	}
+
+	if (readBigEndian(data + 2, 4) < quint64(QDateTime::currentSecsSinceEpoch()))
+	{
+		return false;
+	}
+
+	if (revokedCount.load(std::memory_order_relaxed) > 0)
+	{
+		QReadLocker locker(&revokedLock);
+		if (revoked.contains(readBigEndian(data + 6, 8)))
+		{
+			return false;
+		}
+	}
+
+	if (username)
+	{
+		*username = QString::fromUtf8(data + headerSize, nameLength);
+	}
+	return true;
+}
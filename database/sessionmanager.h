@@ -0,0 +1,64 @@
+/**
+ * @file sessionmanager.h
+ * @brief This contains the prototypes for HMAC-signed session tokens
+ *
+ * After a successful checkUserInfo the session manager issues a token that carries the
+ * username, an expiry time and the id of the key that signed it. Checking a token needs no
+ * database access: the signature is an HMAC-SHA256 over the token, which OpenSSL computes
+ * with the SHA extensions or AVX2 when the CPU has them.
+ *
+ * A token is laid out as [version:1][key id:1][expiry:4][token id:8][name length:1][username]
+ * [tag:16], all integers big-endian and the expiry in seconds since the Unix epoch. Tokens are
+ * raw bytes; text protocols can carry them base64url encoded.
+ *
+ * Signing keys live only in memory. rotateKey() starts signing with a new key while tokens
+ * signed with the previous one stay valid; setKey() lets several servers share keys.
+ * Individual tokens can be revoked before they expire.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef SESSIONMANAGER_H
+#define SESSIONMANAGER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <atomic>
+
+class DbManager;
+struct SessionKey;
+
+class SessionManager
+{
+	public:
+		static const int tagSize = 16;
+		static const int defaultLifetime = 3600;
+
+		explicit SessionManager(DbManager& manager);
+		~SessionManager();
+		QByteArray login(const QString& username, const QString& password, int lifetimeSeconds = defaultLifetime);
+		QByteArray issue(const QString& username, int lifetimeSeconds = defaultLifetime);
+		bool verify(const QByteArray& token, QString& username);
+		bool verify(const QByteArray& token);
+		bool revoke(const QByteArray& token);
+		quint8 rotateKey();
+		quint8 currentKeyId();
+		bool setKey(quint8 keyId, const QByteArray& key);
+		void retireKey(quint8 keyId);
+	private:
+		Q_DISABLE_COPY(SessionManager)
+		bool checkToken(const QByteArray& token, QString* username);
+		DbManager& manager;
+		QReadWriteLock keyLock;
+		QSharedPointer<SessionKey> keys[256];
+		quint8 currentKey;
+		QReadWriteLock revokedLock;
+		QHash<quint64, quint32> revoked;	// token id -> expiry
+		std::atomic<int> revokedCount;
+};
+
+#endif	// SESSIONMANAGER_H
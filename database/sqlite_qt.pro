@@ -8,6 +8,6 @@ CONFIG   -= app_bundle
 TEMPLATE = app
 
 
-SOURCES += main.cpp dbmanager.cpp
+SOURCES += main.cpp
 
-HEADERS += dbmanager.h
\ No newline at end of file
+include(database.pri)
\ No newline at end of file
@@ -0,0 +1,555 @@
+/**
+ * @file storagebackend.cpp
+ * @brief Runs DbManager's statements through QSqlQuery or straight through the sqlite3 C API
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <storagebackend.h>
+#include <dblog.h>
+#include <sqlite3.h>
+#include <cstring>
+#include <vector>
+
+// A statement run as a forward-only QSqlQuery
+class QtSqlStorageQuery : public StorageQuery
+{
+	public:
+		QtSqlStorageQuery(const QSqlDatabase& db, const char* sql);
+		void bind(int index, int value) override;
+		void bind(int index, const QString& value) override;
+		void bind(int index, Utf8View value) override;
+		bool exec() override;
+		bool next() override;
+		int columnInt(int column) override;
+		qint64 columnInt64(int column) override;
+		QString columnString(int column) override;
+		Utf8View columnText(int column) override;
+		qint64 lastInsertId() override;
+		QString lastError() const override;
+	private:
+		QSqlQuery query;
+		QByteArray text;
+};
+
+class QtSqlStorage : public StorageBackend
+{
+	public:
+		explicit QtSqlStorage(const QSqlDatabase& db) : db(db) {}
+		StorageKind kind() const override { return StorageKind::QtSql; }
+		StorageQuery* prepare(const char* sql) override { return new QtSqlStorageQuery(db, sql); }
+		bool release() override { return true; }
+		bool inTransaction() override;
+	private:
+		QSqlDatabase db;
+};
+
+class SqliteStorage;
+
+// A statement stepped with the sqlite3 C API, borrowed from its backend's cache
+class SqliteStorageQuery : public StorageQuery
+{
+	public:
+		SqliteStorageQuery(SqliteStorage* storage, sqlite3_stmt* statement, int slot, const QString& error);
+		~SqliteStorageQuery();
+		void bind(int index, int value) override;
+		void bind(int index, const QString& value) override;
+		void bind(int index, Utf8View value) override;
+		bool exec() override;
+		bool next() override;
+		int columnInt(int column) override;
+		qint64 columnInt64(int column) override;
+		QString columnString(int column) override;
+		Utf8View columnText(int column) override;
+		qint64 lastInsertId() override;
+		QString lastError() const override;
+	private:
+		bool step();
+		void rewind();
+		SqliteStorage* storage;
+		sqlite3_stmt* statement;
+		int slot;		// the cache slot the statement is borrowed from, or -1 if it is the query's own
+		QString error;
+		bool pending;	// exec stepped onto a row that next has not returned yet
+		bool done;
+};
+
+class SqliteStorage : public StorageBackend
+{
+	public:
+		explicit SqliteStorage(sqlite3* connection) : connection(connection), outstanding(0) {}
+		~SqliteStorage();
+		StorageKind kind() const override { return StorageKind::Sqlite; }
+		StorageQuery* prepare(const char* sql) override;
+		bool release() override;
+		bool inTransaction() override;
+		void giveBack(int slot);
+		sqlite3* handle() const { return connection; }
+	private:
+		struct Cached
+		{
+			const char* sql;
+			sqlite3_stmt* statement;
+			bool busy;
+		};
+		sqlite3* connection;
+		std::vector<Cached> cache;
+		int outstanding;	// queries prepared and not yet deleted
+};
+
+/**
+ * @brief Creates a storage backend on an open connection
+ * @param kind Which backend to create
+ * @param db The connection, which must stay open until the backend is released
+ * @return The backend, a QtSql one if kind is Sqlite but the build or the connection cannot run it
+ */
+StorageBackend* StorageBackend::create(StorageKind kind, const QSqlDatabase& db)
+{
+	if (kind == StorageKind::Sqlite)
+	{
+#ifdef DB_SYSTEM_SQLITE
+		QVariant handle = db.driver()->handle();
+		if (handle.isValid() && qstrcmp(handle.typeName(), "sqlite3*") == 0)
+		{
+			sqlite3* connection = *static_cast<sqlite3* const*>(handle.constData());
+			if (connection)
+			{
+				return new SqliteStorage(connection);
+			}
+		}
+		DBLOG_WARNING("StorageBackend", DbErrorConnection, 0, "connection has no sqlite3 handle, using QtSql", db.connectionName());
+#else
+		DBLOG_WARNING("StorageBackend", DbErrorConnection, 0, "built without DB_SYSTEM_SQLITE, using QtSql", db.connectionName());
+#endif
+	}
+	return new QtSqlStorage(db);
+}
+
+/**
+ * @brief Checks whether a transaction is open on the connection
+ * QtSql cannot ask SQLite directly, so this tries to begin one; BEGIN fails inside a transaction
+ * @return boolean indicating whether a transaction is open
+ */
+bool QtSqlStorage::inTransaction()
+{
+	QSqlQuery query(db);
+	if (!query.exec("BEGIN"))
+	{
+		return true;
+	}
+	query.exec("ROLLBACK");
+	return false;
+}
+
+/**
+ * @brief Constructor that prepares a statement as a forward-only QSqlQuery
+ * @param db The connection
+ * @param sql The statement, with ? placeholders
+ */
+QtSqlStorageQuery::QtSqlStorageQuery(const QSqlDatabase& db, const char* sql)
+	: query(db)
+{
+	query.setForwardOnly(true);
+	query.prepare(QString::fromLatin1(sql));
+}
+
+/**
+ * @brief Binds an integer parameter
+ * @param index The parameter's position
+ * @param value The value
+ * @return void
+ */
+void QtSqlStorageQuery::bind(int index, int value)
+{
+	query.bindValue(index, value);
+	return;
+}
+
+/**
+ * @brief Binds a text parameter
+ * @param index The parameter's position
+ * @param value The value
+ * @return void
+ */
+void QtSqlStorageQuery::bind(int index, const QString& value)
+{
+	query.bindValue(index, value);
+	return;
+}
+
+/**
+ * @brief Binds a UTF-8 text parameter, which QtSql needs as a QString
+ * @param index The parameter's position
+ * @param value The value
+ * @return void
+ */
+void QtSqlStorageQuery::bind(int index, Utf8View value)
+{
+	query.bindValue(index, value.toString());
+	return;
+}
+
+/**
+ * @brief Runs the statement
+ * @return boolean indicating whether it ran without error
+ */
+bool QtSqlStorageQuery::exec()
+{
+	return query.exec();
+}
+
+/**
+ * @brief Moves to the next row of the result
+ * @return boolean indicating whether there was another row
+ */
+bool QtSqlStorageQuery::next()
+{
+	return query.next();
+}
+
+/**
+ * @brief Reads an integer column of the current row
+ * @param column The column's position
+ * @return The value
+ */
+int QtSqlStorageQuery::columnInt(int column)
+{
+	return query.value(column).toInt();
+}
+
+/**
+ * @brief Reads a 64-bit integer column of the current row
+ * @param column The column's position
+ * @return The value
+ */
+qint64 QtSqlStorageQuery::columnInt64(int column)
+{
+	return query.value(column).toLongLong();
+}
+
+/**
+ * @brief Reads a text column of the current row
+ * @param column The column's position
+ * @return The value
+ */
+QString QtSqlStorageQuery::columnString(int column)
+{
+	return query.value(column).toString();
+}
+
+/**
+ * @brief Reads a text column of the current row as UTF-8, converted from the QString QtSql returns
+ * @param column The column's position
+ * @return A view of the value, valid until the next call
+ */
+Utf8View QtSqlStorageQuery::columnText(int column)
+{
+	text = query.value(column).toString().toUtf8();
+	return Utf8View(text.constData(), text.size());
+}
+
+/**
+ * @brief Gets the rowid of the row the statement inserted
+ * @return The rowid
+ */
+qint64 QtSqlStorageQuery::lastInsertId()
+{
+	return query.lastInsertId().toLongLong();
+}
+
+/**
+ * @brief Gets the error from the last step that failed
+ * @return The error message
+ */
+QString QtSqlStorageQuery::lastError() const
+{
+	return query.lastError().text();
+}
+
+/**
+ * @brief Destructor for the backend, which finalizes its statements
+ */
+SqliteStorage::~SqliteStorage()
+{
+	release();
+}
+
+/**
+ * @brief Prepares a statement, or reuses the one prepared before for the same string
+ * Statements are cached by the address of their text and checked against it, so the text must
+ * outlive the backend, as string literals do. A statement still in use by an earlier query, as
+ * when one result is stepped inside another, is prepared again for the new query alone.
+ * @param sql The statement, with ? placeholders
+ * @return The query, to be deleted by the caller; its exec fails if the statement could not be prepared
+ */
+StorageQuery* SqliteStorage::prepare(const char* sql)
+{
+	int slot = -1;
+	for (int i = 0; i < int(cache.size()) && slot < 0; i++)
+	{
+		if (cache[size_t(i)].sql == sql && strcmp(sqlite3_sql(cache[size_t(i)].statement), sql) == 0)
+		{
+			slot = i;
+		}
+	}
+	outstanding++;
+	if (slot >= 0 && !cache[size_t(slot)].busy)
+	{
+		cache[size_t(slot)].busy = true;
+		return new SqliteStorageQuery(this, cache[size_t(slot)].statement, slot, QString());
+	}
+
+	sqlite3_stmt* statement = nullptr;
+	if (sqlite3_prepare_v2(connection, sql, -1, &statement, nullptr) != SQLITE_OK)
+	{
+		QString error = QString::fromUtf8(sqlite3_errmsg(connection));
+		sqlite3_finalize(statement);
+		return new SqliteStorageQuery(this, nullptr, -1, error);
+	}
+	if (slot >= 0)
+	{
+		return new SqliteStorageQuery(this, statement, -1, QString());
+	}
+	Cached cached = { sql, statement, true };
+	cache.push_back(cached);
+	return new SqliteStorageQuery(this, statement, int(cache.size()) - 1, QString());
+}
+
+/**
+ * @brief Finalizes every cached statement, as must happen before the connection is closed
+ * Nothing is finalized while a query is still alive, since it may be stepping a cached statement
+ * @return boolean indicating whether the statements were finalized
+ */
+bool SqliteStorage::release()
+{
+	if (outstanding > 0)
+	{
+		DBLOG_ERROR("StorageBackend", DbErrorConnection, 0, "statements are still in use and cannot be released", QString::number(outstanding));
+		return false;
+	}
+	for (size_t i = 0; i < cache.size(); i++)
+	{
+		sqlite3_finalize(cache[i].statement);
+	}
+	cache.clear();
+	return true;
+}
+
+/**
+ * @brief Checks whether a transaction is open on the connection
+ * @return boolean indicating whether a transaction is open
+ */
+bool SqliteStorage::inTransaction()
+{
+	return sqlite3_get_autocommit(connection) == 0;
+}
+
+/**
+ * @brief Marks a query finished, and its cached statement free for the next query
+ * @param slot The statement's place in the cache, or -1 if the query owned its statement
+ * @return void
+ */
+void SqliteStorage::giveBack(int slot)
+{
+	outstanding--;
+	if (slot >= 0 && slot < int(cache.size()))
+	{
+		cache[size_t(slot)].busy = false;
+	}
+	return;
+}
+
+/**
+ * @brief Constructor for a query on a prepared statement
+ * @param storage The backend the statement belongs to
+ * @param statement The statement, or nullptr if it could not be prepared
+ * @param slot The statement's place in the backend's cache, or -1 if the query owns it
+ * @param error The preparation error, if there was one
+ */
+SqliteStorageQuery::SqliteStorageQuery(SqliteStorage* storage, sqlite3_stmt* statement, int slot, const QString& error)
+	: storage(storage), statement(statement), slot(slot), error(error), pending(false), done(true)
+{
+}
+
+/**
+ * @brief Destructor for the query, which resets a cached statement for reuse or finalizes its own
+ */
+SqliteStorageQuery::~SqliteStorageQuery()
+{
+	if (statement && slot >= 0)
+	{
+		sqlite3_reset(statement);
+		sqlite3_clear_bindings(statement);
+	}
+	else
+	{
+		sqlite3_finalize(statement);
+	}
+	storage->giveBack(slot);
+}
+
+/**
+ * @brief Binds an integer parameter
+ * @param index The parameter's position
+ * @param value The value
+ * @return void
+ */
+void SqliteStorageQuery::bind(int index, int value)
+{
+	rewind();
+	sqlite3_bind_int(statement, index + 1, value);
+	return;
+}
+
+/**
+ * @brief Binds a text parameter, which SQLite converts to UTF-8 as it copies it
+ * @param index The parameter's position
+ * @param value The value
+ * @return void
+ */
+void SqliteStorageQuery::bind(int index, const QString& value)
+{
+	rewind();
+	sqlite3_bind_text16(statement, index + 1, value.utf16(), value.size() * 2, SQLITE_TRANSIENT);
+	return;
+}
+
+/**
+ * @brief Binds a UTF-8 text parameter
+ * @param index The parameter's position
+ * @param value The value
+ * @return void
+ */
+void SqliteStorageQuery::bind(int index, Utf8View value)
+{
+	rewind();
+	sqlite3_bind_text(statement, index + 1, value.data() ? value.data() : "", value.size(), SQLITE_TRANSIENT);
+	return;
+}
+
+/**
+ * @brief Runs the statement up to its first row, so statements that return nothing run completely
+ * @return boolean indicating whether it ran without error
+ */
+bool SqliteStorageQuery::exec()
+{
+	if (!statement)
+	{
+		return false;
+	}
+	sqlite3_reset(statement);
+	error.clear();
+	done = false;
+	pending = step();
+	return error.isEmpty();
+}
+
+/**
+ * @brief Moves to the next row of the result
+ * @return boolean indicating whether there was another row
+ */
+bool SqliteStorageQuery::next()
+{
+	if (pending)
+	{
+		pending = false;
+		return true;
+	}
+	return !done && step();
+}
+
+/**
+ * @brief Steps the statement once
+ * @return boolean indicating whether it stepped onto a row
+ */
+bool SqliteStorageQuery::step()
+{
+	int status = sqlite3_step(statement);
+	if (status == SQLITE_ROW)
+	{
+		return true;
+	}
+	done = true;
+	if (status != SQLITE_DONE)
+	{
+		error = QString::fromUtf8(sqlite3_errmsg(storage->handle()));
+	}
+	// A finished statement is reset at once, so it holds no lock and can be bound again
+	sqlite3_reset(statement);
+	return false;
+}
+
+/**
+ * @brief Resets a statement whose result has not been stepped through, so its parameters can be bound again
+ * @return void
+ */
+void SqliteStorageQuery::rewind()
+{
+	if (statement && !done)
+	{
+		sqlite3_reset(statement);
+		pending = false;
+		done = true;
+	}
+	return;
+}
+
+/**
+ * @brief Reads an integer column of the current row
+ * @param column The column's position
+ * @return The value
+ */
+int SqliteStorageQuery::columnInt(int column)
+{
+	return sqlite3_column_int(statement, column);
+}
+
+/**
+ * @brief Reads a 64-bit integer column of the current row
+ * @param column The column's position
+ * @return The value
+ */
+qint64 SqliteStorageQuery::columnInt64(int column)
+{
+	return sqlite3_column_int64(statement, column);
+}
+
+/**
+ * @brief Reads a text column of the current row
+ * @param column The column's position
+ * @return The value
+ */
+QString SqliteStorageQuery::columnString(int column)
+{
+	const char* text = reinterpret_cast<const char*>(sqlite3_column_text(statement, column));
+	return text ? QString::fromUtf8(text, sqlite3_column_bytes(statement, column)) : QString();
+}
+
+/**
+ * @brief Reads a text column of the current row as UTF-8 from SQLite's own buffer
+ * @param column The column's position
+ * @return A view of the value, valid until the next call to next()
+ */
+Utf8View SqliteStorageQuery::columnText(int column)
+{
+	const char* text = reinterpret_cast<const char*>(sqlite3_column_text(statement, column));
+	return Utf8View(text, sqlite3_column_bytes(statement, column));
+}
+
+/**
+ * @brief Gets the rowid of the row the statement inserted
+ * @return The rowid
+ */
+qint64 SqliteStorageQuery::lastInsertId()
+{
+	return sqlite3_last_insert_rowid(storage->handle());
+}
+
+/**
+ * @brief Gets the error from the last step that failed
+ * @return The error message
+ */
+QString SqliteStorageQuery::lastError() const
+{
+	return error;
+}
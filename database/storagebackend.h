@@ -0,0 +1,68 @@
+/**
+ * @file storagebackend.h
+ * @brief This contains the prototypes for the storage backends DbManager runs its statements on
+ *
+ * DbManager prepares every statement through a StorageBackend and reads results through the
+ * StorageQuery it returns. Parameters are bound by position and columns read by position and
+ * type, so no backend needs to resolve placeholder names or box values in a QVariant. Two
+ * backends are provided, chosen when the DbManager is constructed:
+ *
+ * StorageKind::QtSql, the default, runs each statement as a forward-only QSqlQuery, as DbManager
+ * always did.
+ *
+ * StorageKind::Sqlite runs statements with the sqlite3 C API on the handle under the QSQLITE
+ * connection, so it shares the connection's transactions with every QSqlQuery other modules
+ * run on DbManager::database(). Text is bound and read as UTF-8 straight from SQLite's buffers,
+ * and each distinct statement is prepared once and then reset and reused. The handle belongs to
+ * whichever SQLite the QSQLITE driver was built with. Stock Qt bundles its own copy, and calling
+ * this file's SQLite on that copy's handle is undefined behaviour, so the backend is only built
+ * with DEFINES += DB_SYSTEM_SQLITE, for Qt configured with -system-sqlite. Without it, or where
+ * the connection has no sqlite3 handle, the QtSql backend is used instead.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef STORAGEBACKEND_H
+#define STORAGEBACKEND_H
+
+#include <QString>
+#include <QtSql>
+#include <resultset.h>
+
+enum class StorageKind
+{
+	QtSql,
+	Sqlite
+};
+
+// One prepared statement; parameters and columns are numbered from 0
+class StorageQuery
+{
+	public:
+		virtual ~StorageQuery() {}
+		virtual void bind(int index, int value) = 0;
+		virtual void bind(int index, const QString& value) = 0;
+		virtual void bind(int index, Utf8View value) = 0;
+		virtual bool exec() = 0;
+		virtual bool next() = 0;
+		virtual int columnInt(int column) = 0;
+		virtual qint64 columnInt64(int column) = 0;
+		virtual QString columnString(int column) = 0;
+		virtual Utf8View columnText(int column) = 0;	// valid until the next call to next()
+		virtual qint64 lastInsertId() = 0;
+		virtual QString lastError() const = 0;
+};
+
+class StorageBackend
+{
+	public:
+		static StorageBackend* create(StorageKind kind, const QSqlDatabase& db);
+		virtual ~StorageBackend() {}
+		virtual StorageKind kind() const = 0;
+		virtual StorageQuery* prepare(const char* sql) = 0;
+		virtual bool release() = 0;
+		virtual bool inTransaction() = 0;
+};
+
+#endif	// STORAGEBACKEND_H
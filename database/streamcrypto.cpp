@@ -0,0 +1,517 @@
+/**
+ * @file streamcrypto.cpp
+ * @brief Encrypts and decrypts attachment streams chunk by chunk on a pool of worker threads
+ *
+ * The calling thread reads chunks into a ring of slots, hands them to the workers and writes
+ * the results out as they finish in index order. A stream keeps at most four slots per worker
+ * in flight, and the slots' buffers are reused, so memory use does not grow with file size.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <streamcrypto.h>
+#include <dblog.h>
+#include <QMutexLocker>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <cstring>
+
+static const quint8 streamVersion = 1;
+static const char keyInfo[] = "chat attachment stream";
+
+// The key, header and chunk size of one encrypted stream
+struct StreamCrypto::Stream
+{
+	QByteArray key;
+	QByteArray header;
+	CipherSuite suite;
+	int chunkSize;
+
+	~Stream()
+	{
+		key.fill(0);
+	}
+};
+
+// One chunk on its way through the pipeline
+struct StreamCrypto::Slot
+{
+	enum State { Free, Queued, Done, Failed };
+
+	const Stream* stream;
+	bool encrypting;
+	qint64 index;
+	bool last;
+	QByteArray input;
+	QByteArray output;
+	State state;
+};
+
+// A cipher context per thread for the chunks decrypted outside the pool
+struct ChunkCipher
+{
+	EVP_CIPHER_CTX* ctx;
+
+	ChunkCipher() : ctx(EVP_CIPHER_CTX_new()) {}
+	~ChunkCipher()
+	{
+		EVP_CIPHER_CTX_free(ctx);
+	}
+};
+
+/**
+ * @brief Seals or opens one chunk
+ * @param ctx The cipher context to use
+ * @param key The stream's key
+ * @param header The stream's header, authenticated with every chunk
+ * @param suite The stream's cipher suite
+ * @param index The chunk's index in the stream
+ * @param last Whether this is the final chunk
+ * @param in The plaintext, or the ciphertext followed by its tag
+ * @param length The length of the input
+ * @param out Receives length + tagSize bytes when sealing, length - tagSize when opening
+ * @param encrypting Whether to seal rather than open
+ * @return boolean indicating whether the chunk was sealed, or opened and authentic
+ */
+static bool processChunk(EVP_CIPHER_CTX* ctx, const QByteArray& key, const QByteArray& header, CipherSuite suite, qint64 index,
+	bool last, const char* in, int length, char* out, bool encrypting)
+{
+	unsigned char nonce[MessageCrypto::nonceSize];
+	memset(nonce, 0, sizeof(nonce));
+	for (int i = 0; i < 8; i++)
+	{
+		nonce[i] = quint8(quint64(index) >> (56 - 8 * i));
+	}
+	nonce[8] = last ? 1 : 0;
+
+	const unsigned char* input = reinterpret_cast<const unsigned char*>(in);
+	unsigned char* output = reinterpret_cast<unsigned char*>(out);
+	int bodyLength = encrypting ? length : length - StreamCrypto::tagSize;
+	int outLength = 0;
+	if (!ctx || bodyLength < 0)
+	{
+		return false;
+	}
+
+	bool ok = EVP_CipherInit_ex(ctx, suite == CipherSuite::Aes256Gcm ? EVP_aes_256_gcm() : EVP_chacha20_poly1305(), nullptr,
+			reinterpret_cast<const unsigned char*>(key.constData()), nonce, encrypting ? 1 : 0) == 1
+		&& EVP_CipherUpdate(ctx, nullptr, &outLength, reinterpret_cast<const unsigned char*>(header.constData()), header.size()) == 1;
+	if (encrypting)
+	{
+		ok = ok && EVP_CipherUpdate(ctx, output, &outLength, input, bodyLength) == 1
+			&& EVP_CipherFinal_ex(ctx, output + outLength, &outLength) == 1
+			&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, StreamCrypto::tagSize, output + bodyLength) == 1;
+	}
+	else
+	{
+		ok = ok && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, StreamCrypto::tagSize, const_cast<unsigned char*>(input + bodyLength)) == 1
+			&& EVP_CipherUpdate(ctx, output, &outLength, input, bodyLength) == 1
+			&& EVP_CipherFinal_ex(ctx, output + outLength, &outLength) == 1;
+	}
+	return ok;
+}
+
+/**
+ * @brief Reads from a device until a buffer is full or the device has no more data
+ * @param device The device
+ * @param buffer Receives the data; its capacity is reused
+ * @param size The number of bytes wanted
+ * @return boolean indicating whether the device could be read
+ */
+static bool readFully(QIODevice& device, QByteArray& buffer, int size)
+{
+	buffer.resize(size);
+	int filled = 0;
+	while (filled < size)
+	{
+		qint64 count = device.read(buffer.data() + filled, size - filled);
+		if (count < 0)
+		{
+			return false;
+		}
+		if (count == 0)
+		{
+			break;
+		}
+		filled += int(count);
+	}
+	buffer.resize(filled);
+	return true;
+}
+
+/**
+ * @brief Constructor for a stream encryption engine, which starts its worker threads
+ * @param key A 32-byte key
+ * @param threads The number of worker threads sealing and opening chunks
+ * @param chunkSize The plaintext bytes per chunk of new streams, a power of two from 4 KiB to 16 MiB
+ */
+StreamCrypto::StreamCrypto(const QByteArray& key, int threads, int chunkSize)
+	: key(key), chunkShift(minChunkShift), stopping(false)
+{
+	while (chunkShift < maxChunkShift && (1 << chunkShift) < chunkSize)
+	{
+		chunkShift++;
+	}
+	if ((1 << chunkShift) != chunkSize)
+	{
+		DBLOG_WARNING("StreamCrypto", DbErrorCrypto, 0, "chunk size rounded to a power of two", QString::number(1 << chunkShift));
+	}
+	if (key.size() != MessageCrypto::keySize)
+	{
+		DBLOG_ERROR("StreamCrypto", DbErrorCrypto, 0, "keys must be 32 bytes", QString());
+	}
+
+	for (int i = 0; i < qMax(threads, 1); i++)
+	{
+		workers.emplace_back(&StreamCrypto::workerLoop, this);
+	}
+}
+
+/**
+ * @brief Destructor for the stream encryption engine, which stops its worker threads
+ */
+StreamCrypto::~StreamCrypto()
+{
+	{
+		QMutexLocker locker(&queueMutex);
+		stopping = true;
+		workAvailable.wakeAll();
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+	key.fill(0);
+}
+
+/**
+ * @brief Encrypts everything a device holds into another device
+ * The source is read until it reports no more data
+ * @param source The device to read the plaintext from
+ * @param sink The device to write the encrypted stream to
+ * @return boolean indicating whether the whole stream was encrypted and written
+ */
+bool StreamCrypto::encrypt(QIODevice& source, QIODevice& sink)
+{
+	Stream stream;
+	if (!createStream(stream))
+	{
+		return false;
+	}
+	if (sink.write(stream.header) != stream.header.size())
+	{
+		DBLOG_ERROR("encrypt", DbErrorCrypto, 0, "stream header could not be written", sink.errorString());
+		return false;
+	}
+	return run(stream, source, sink, true);
+}
+
+/**
+ * @brief Decrypts a whole encrypted stream into a device
+ * Chunks are written as they are verified, so if a later chunk fails the sink already holds
+ * the verified start of the plaintext; discard it on failure.
+ * @param source The device to read the encrypted stream from
+ * @param sink The device to write the plaintext to
+ * @return boolean indicating whether the whole stream was authentic, complete and written
+ */
+bool StreamCrypto::decrypt(QIODevice& source, QIODevice& sink)
+{
+	Stream stream;
+	if (!readHeader(source, stream))
+	{
+		return false;
+	}
+	return run(stream, source, sink, false);
+}
+
+/**
+ * @brief Decrypts a single chunk of an encrypted stream
+ * @param source A seekable device holding the whole encrypted stream
+ * @param index The chunk's index
+ * @param plaintext Receives the chunk's plaintext
+ * @return boolean indicating whether the chunk exists and is authentic
+ */
+bool StreamCrypto::decryptChunk(QIODevice& source, qint64 index, QByteArray& plaintext)
+{
+	Stream stream;
+	return source.seek(0) && readHeader(source, stream) && openChunk(stream, source, index, plaintext);
+}
+
+/**
+ * @brief Decrypts a range of plaintext bytes, reading only the chunks that hold them
+ * @param source A seekable device holding the whole encrypted stream
+ * @param offset The first plaintext byte to write
+ * @param length The number of bytes to write
+ * @param sink The device to write them to
+ * @return boolean indicating whether the range exists, is authentic and was written
+ */
+bool StreamCrypto::decryptRange(QIODevice& source, qint64 offset, qint64 length, QIODevice& sink)
+{
+	Stream stream;
+	if (offset < 0 || length < 0 || !source.seek(0) || !readHeader(source, stream))
+	{
+		return false;
+	}
+
+	QByteArray plaintext;
+	qint64 end = offset + length;
+	for (qint64 index = offset / stream.chunkSize; offset < end; index++)
+	{
+		if (!openChunk(stream, source, index, plaintext))
+		{
+			return false;
+		}
+		qint64 from = offset - index * stream.chunkSize;
+		qint64 count = qMin<qint64>(plaintext.size() - from, end - offset);
+		if (count <= 0 || sink.write(plaintext.constData() + from, count) != count)
+		{
+			return false;
+		}
+		offset += count;
+	}
+	return true;
+}
+
+/**
+ * @brief Gets the number of worker threads
+ * @return The number of workers
+ */
+int StreamCrypto::threadCount() const
+{
+	return int(workers.size());
+}
+
+/**
+ * @brief Computes the size of the encrypted stream for a plaintext
+ * @param plaintextSize The plaintext size in bytes
+ * @param chunkSize The chunk size
+ * @return The encrypted size in bytes
+ */
+qint64 StreamCrypto::encryptedSize(qint64 plaintextSize, int chunkSize)
+{
+	qint64 chunks = qMax<qint64>((plaintextSize + chunkSize - 1) / chunkSize, 1);
+	return headerSize + plaintextSize + chunks * tagSize;
+}
+
+/**
+ * @brief Starts a new stream with a fresh salt and derives its key
+ * @param stream Receives the stream
+ * @return boolean indicating whether the key was derived
+ */
+bool StreamCrypto::createStream(Stream& stream)
+{
+	stream.suite = MessageCrypto::preferredSuite();
+	stream.chunkSize = 1 << chunkShift;
+	stream.header.resize(headerSize);
+	stream.header[0] = char(streamVersion);
+	stream.header[1] = char(stream.suite);
+	stream.header[2] = char(chunkShift);
+	if (RAND_bytes(reinterpret_cast<unsigned char*>(stream.header.data()) + 3, saltSize) != 1)
+	{
+		DBLOG_ERROR("encrypt", DbErrorCrypto, 0, "stream salt could not be generated", QString());
+		return false;
+	}
+	return deriveKey(stream);
+}
+
+/**
+ * @brief Reads and checks a stream's header and derives the stream's key
+ * @param source The device, positioned at the start of the stream
+ * @param stream Receives the stream
+ * @return boolean indicating whether the header is valid
+ */
+bool StreamCrypto::readHeader(QIODevice& source, Stream& stream)
+{
+	if (!readFully(source, stream.header, headerSize) || stream.header.size() != headerSize || quint8(stream.header[0]) != streamVersion
+		|| (quint8(stream.header[1]) != quint8(CipherSuite::Aes256Gcm) && quint8(stream.header[1]) != quint8(CipherSuite::ChaCha20Poly1305))
+		|| quint8(stream.header[2]) < minChunkShift || quint8(stream.header[2]) > maxChunkShift)
+	{
+		DBLOG_WARNING("decrypt", DbErrorCrypto, 0, "not an encrypted attachment stream", QString());
+		return false;
+	}
+	stream.suite = CipherSuite(quint8(stream.header[1]));
+	stream.chunkSize = 1 << quint8(stream.header[2]);
+	return deriveKey(stream);
+}
+
+/**
+ * @brief Derives a stream's key from the engine's key and the salt in the stream's header
+ * @param stream The stream, whose header is set
+ * @return boolean indicating whether the key was derived
+ */
+bool StreamCrypto::deriveKey(Stream& stream)
+{
+	stream.key.resize(MessageCrypto::keySize);
+	size_t keyLength = stream.key.size();
+	EVP_PKEY_CTX* kdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+	bool ok = key.size() == MessageCrypto::keySize && kdf
+		&& EVP_PKEY_derive_init(kdf) == 1
+		&& EVP_PKEY_CTX_set_hkdf_md(kdf, EVP_sha256()) == 1
+		&& EVP_PKEY_CTX_set1_hkdf_salt(kdf, reinterpret_cast<const unsigned char*>(stream.header.constData()) + 3, saltSize) == 1
+		&& EVP_PKEY_CTX_set1_hkdf_key(kdf, reinterpret_cast<const unsigned char*>(key.constData()), key.size()) == 1
+		&& EVP_PKEY_CTX_add1_hkdf_info(kdf, reinterpret_cast<const unsigned char*>(keyInfo), sizeof(keyInfo) - 1) == 1
+		&& EVP_PKEY_derive(kdf, reinterpret_cast<unsigned char*>(stream.key.data()), &keyLength) == 1;
+	EVP_PKEY_CTX_free(kdf);
+	if (!ok)
+	{
+		DBLOG_ERROR("deriveKey", DbErrorCrypto, 0, "stream key could not be derived", QString());
+	}
+	return ok;
+}
+
+/**
+ * @brief Moves a stream through the worker pool, reading ahead and writing chunks in order
+ * @param stream The stream
+ * @param source The device to read chunks from, positioned after any header
+ * @param sink The device to write results to
+ * @param encrypting Whether to seal rather than open
+ * @return boolean indicating whether every chunk was processed and written
+ */
+bool StreamCrypto::run(const Stream& stream, QIODevice& source, QIODevice& sink, bool encrypting)
+{
+	int inputSize = encrypting ? stream.chunkSize : stream.chunkSize + tagSize;
+	int depth = 4 * int(workers.size());
+	std::vector<Slot> slots(depth);
+	for (int i = 0; i < depth; i++)
+	{
+		slots[i].stream = &stream;
+		slots[i].encrypting = encrypting;
+		slots[i].state = Slot::Free;
+	}
+
+	// One chunk is always read ahead, since a chunk is only known to be the last once the next read finds nothing
+	QByteArray ahead;
+	bool ok = readFully(source, ahead, inputSize);
+	if (ok && !encrypting && ahead.isEmpty())
+	{
+		DBLOG_WARNING("decrypt", DbErrorCrypto, 0, "encrypted stream has no chunks", QString());
+		ok = false;
+	}
+
+	qint64 readIndex = 0;
+	qint64 writeIndex = 0;
+	bool reading = ok;
+	while (ok && (reading || writeIndex < readIndex))
+	{
+		while (reading && readIndex - writeIndex < depth)
+		{
+			Slot& slot = slots[readIndex % depth];
+			slot.input.swap(ahead);
+			ahead.clear();
+			if (slot.input.size() == inputSize && !readFully(source, ahead, inputSize))
+			{
+				ok = false;
+				break;
+			}
+			slot.index = readIndex++;
+			slot.last = ahead.isEmpty();
+			reading = !slot.last;
+
+			QMutexLocker locker(&queueMutex);
+			slot.state = Slot::Queued;
+			queue.enqueue(&slot);
+			workAvailable.wakeOne();
+		}
+
+		if (writeIndex < readIndex)
+		{
+			Slot& slot = slots[writeIndex % depth];
+			{
+				QMutexLocker locker(&queueMutex);
+				while (slot.state == Slot::Queued)
+				{
+					slotFinished.wait(&queueMutex);
+				}
+			}
+			ok = slot.state == Slot::Done && sink.write(slot.output) == slot.output.size();
+			slot.state = Slot::Free;
+			writeIndex++;
+		}
+	}
+
+	// Slots still being worked on must finish before the slots go away
+	{
+		QMutexLocker locker(&queueMutex);
+		for (qint64 i = writeIndex; i < readIndex; i++)
+		{
+			while (slots[i % depth].state == Slot::Queued)
+			{
+				slotFinished.wait(&queueMutex);
+			}
+		}
+	}
+	if (!ok)
+	{
+		DBLOG_WARNING(encrypting ? "encrypt" : "decrypt", DbErrorCrypto, 0, "stream failed at chunk", QString::number(qMax<qint64>(writeIndex - 1, 0)));
+	}
+	for (int i = 0; i < depth; i++)
+	{
+		OPENSSL_cleanse(slots[i].output.data(), slots[i].output.size());
+		OPENSSL_cleanse(slots[i].input.data(), slots[i].input.size());
+	}
+	return ok;
+}
+
+/**
+ * @brief Reads and decrypts one chunk of a stream whose header has been read
+ * @param stream The stream
+ * @param source A seekable device holding the whole encrypted stream
+ * @param index The chunk's index
+ * @param plaintext Receives the chunk's plaintext
+ * @return boolean indicating whether the chunk exists and is authentic
+ */
+bool StreamCrypto::openChunk(const Stream& stream, QIODevice& source, qint64 index, QByteArray& plaintext)
+{
+	thread_local ChunkCipher cipher;
+	qint64 chunkBytes = stream.chunkSize + tagSize;
+	qint64 chunks = (source.size() - headerSize + chunkBytes - 1) / chunkBytes;
+	if (index < 0 || index >= chunks || !source.seek(headerSize + index * chunkBytes))
+	{
+		return false;
+	}
+
+	QByteArray sealed;
+	if (!readFully(source, sealed, int(chunkBytes)) || sealed.size() < tagSize)
+	{
+		return false;
+	}
+	plaintext.resize(sealed.size() - tagSize);
+	return processChunk(cipher.ctx, stream.key, stream.header, stream.suite, index, index == chunks - 1,
+		sealed.constData(), sealed.size(), plaintext.data(), false);
+}
+
+/**
+ * @brief The body of a worker thread: seals or opens queued chunks until the engine is destroyed
+ * @return void
+ */
+void StreamCrypto::workerLoop()
+{
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	QMutexLocker locker(&queueMutex);
+	while (!stopping)
+	{
+		if (queue.isEmpty())
+		{
+			workAvailable.wait(&queueMutex);
+			continue;
+		}
+		Slot* slot = queue.dequeue();
+		locker.unlock();
+
+		const Stream& stream = *slot->stream;
+		int outputSize = slot->input.size() + (slot->encrypting ? tagSize : -tagSize);
+		slot->output.resize(qMax(outputSize, 0));
+		bool ok = outputSize >= 0 && processChunk(ctx, stream.key, stream.header, stream.suite, slot->index, slot->last,
+			slot->input.constData(), slot->input.size(), slot->output.data(), slot->encrypting);
+
+		locker.relock();
+		slot->state = ok ? Slot::Done : Slot::Failed;
+		slotFinished.wakeAll();
+	}
+	locker.unlock();
+	EVP_CIPHER_CTX_free(ctx);
+	return;
+}
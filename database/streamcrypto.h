@@ -0,0 +1,72 @@
+/**
+ * @file streamcrypto.h
+ * @brief This contains the prototypes for streaming encryption of large attachments
+ *
+ * An attachment is encrypted as a sequence of fixed-size chunks, each sealed on its own with the
+ * same AEAD suites as MessageCrypto, so a file is never held in memory whole and any chunk can be
+ * decrypted without the ones before it. Chunks are sealed by a pool of worker threads while the
+ * calling thread reads and writes, and are written out in order.
+ *
+ * An encrypted stream is laid out as [version:1][suite:1][chunk size log2:1][salt:16] followed
+ * by the chunks, each [ciphertext][tag:16]; every chunk but the last holds exactly chunk size
+ * bytes of plaintext. Each stream is sealed under its own key, derived with HKDF-SHA256 from the
+ * caller's key and the random salt. A chunk's nonce is its index (8 bytes, big-endian), a byte
+ * that is 1 only for the final chunk, and 3 zero bytes, and the header is the associated data of
+ * every chunk. Reordering chunks, changing the header or cutting the stream at a chunk boundary
+ * therefore all fail authentication.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef STREAMCRYPTO_H
+#define STREAMCRYPTO_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QMutex>
+#include <QQueue>
+#include <QWaitCondition>
+#include <messagecrypto.h>
+#include <thread>
+#include <vector>
+
+class StreamCrypto
+{
+	public:
+		static const int saltSize = 16;
+		static const int headerSize = 3 + saltSize;
+		static const int tagSize = 16;
+		static const int minChunkShift = 12;	// 4 KiB
+		static const int maxChunkShift = 24;	// 16 MiB
+		static const int defaultChunkSize = 64 * 1024;
+
+		explicit StreamCrypto(const QByteArray& key, int threads = 1, int chunkSize = defaultChunkSize);
+		~StreamCrypto();
+		bool encrypt(QIODevice& source, QIODevice& sink);
+		bool decrypt(QIODevice& source, QIODevice& sink);
+		bool decryptChunk(QIODevice& source, qint64 index, QByteArray& plaintext);
+		bool decryptRange(QIODevice& source, qint64 offset, qint64 length, QIODevice& sink);
+		int threadCount() const;
+		static qint64 encryptedSize(qint64 plaintextSize, int chunkSize = defaultChunkSize);
+	private:
+		Q_DISABLE_COPY(StreamCrypto)
+		struct Stream;
+		struct Slot;
+		bool createStream(Stream& stream);
+		bool readHeader(QIODevice& source, Stream& stream);
+		bool deriveKey(Stream& stream);
+		bool run(const Stream& stream, QIODevice& source, QIODevice& sink, bool encrypting);
+		bool openChunk(const Stream& stream, QIODevice& source, qint64 index, QByteArray& plaintext);
+		void workerLoop();
+		QByteArray key;
+		int chunkShift;
+		QMutex queueMutex;
+		QWaitCondition workAvailable;
+		QWaitCondition slotFinished;
+		QQueue<Slot*> queue;
+		bool stopping;
+		std::vector<std::thread> workers;
+};
+
+#endif	// STREAMCRYPTO_H
@@ -0,0 +1,341 @@
+/**
+ * @file tracereplayer.cpp
+ * @brief Re-executes a recorded call trace against a database and compares latencies
+ *
+ * Hashed usernames are turned back into stable synthetic names ("u" followed by the hash),
+ * and every synthetic user gets a password derived from the same hash, so a checkUserInfo
+ * that succeeded in the recording also succeeds in the replay.
+ * Calls are shared out round-robin between the replay threads, and each thread waits
+ * until a call's recorded start time (divided by the speed factor) before running it.
+ *
+ * @author mdolan2
+ * @bug Calls are only ordered by their start time, so with more than one thread a call
+ * may run before an earlier call it depended on has finished.
+ */
+
+#include <tracereplayer.h>
+#include <dbmanager.h>
+#include <dblog.h>
+#include <QFile>
+#include <QSet>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+/**
+ * @brief Constructor for the trace replayer
+ */
+TraceReplayer::TraceReplayer()
+{
+}
+
+/**
+ * @brief Reads a trace file and reassembles its calls
+ * @param tracePath The path of the trace file written by DbManager::startRecording
+ * @return boolean indicating whether the trace was read successfully
+ */
+bool TraceReplayer::load(const QString& tracePath)
+{
+	QFile file(tracePath);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		DBLOG_ERROR("load", DbErrorIo, 0, "trace file could not be opened", file.errorString());
+		return false;
+	}
+
+	char magic[sizeof(traceMagic)];
+	quint32 header[2];
+	if (file.read(magic, sizeof(magic)) != qint64(sizeof(magic))
+		|| memcmp(magic, traceMagic, sizeof(magic)) != 0
+		|| file.read(reinterpret_cast<char*>(header), sizeof(header)) != qint64(sizeof(header))
+		|| header[0] != traceVersion || header[1] != sizeof(TraceRecord))
+	{
+		DBLOG_ERROR("load", DbErrorIo, 0, "not a supported trace file", tracePath);
+		return false;
+	}
+
+	calls.clear();
+	TraceRecord record;
+	while (file.read(reinterpret_cast<char*>(&record), sizeof(record)) == qint64(sizeof(record)))
+	{
+		if (record.op == quint8(TraceOp::ChatMember))
+		{
+			// Member records always directly follow their addChat record
+			if (!calls.isEmpty() && calls.last().op == TraceOp::AddChat)
+			{
+				calls.last().members.append(record.user1);
+				if (record.user2 != 0)
+				{
+					calls.last().members.append(record.user2);
+				}
+			}
+			continue;
+		}
+
+		TraceCall call;
+		call.op = TraceOp(record.op);
+		call.timestampNs = record.timestampNs;
+		call.latencyNs = record.latencyNs;
+		call.chatID = record.chatID;
+		call.resultSize = record.resultSize;
+		call.user1 = record.user1;
+		call.user2 = record.user2;
+		calls.append(call);
+	}
+
+	return true;
+}
+
+/**
+ * @brief Gets the number of calls in the loaded trace
+ * @return The number of calls, not counting member records
+ */
+int TraceReplayer::callCount() const
+{
+	return calls.size();
+}
+
+/**
+ * @brief Creates the tables and every user the trace expects to exist already
+ * Users that the trace itself adds with addUser are left for the replay to create
+ * @param databasePath The path of the database the trace will be replayed against
+ * @return boolean indicating whether the database was opened
+ */
+bool TraceReplayer::seedUsers(const QString& databasePath)
+{
+	bool success = false;
+	{
+		DbManager db(databasePath, "replay-seed");
+		if (db.isOpen())
+		{
+			db.createUserTable();
+			db.createChatTables();
+
+			QSet<quint64> added;
+			QSet<quint64> seeded;
+			for (int i = 0; i < calls.size(); i++)
+			{
+				const TraceCall& call = calls[i];
+				if (call.op == TraceOp::AddUser)
+				{
+					added.insert(call.user1);
+					continue;
+				}
+
+				QVector<quint64> hashes = call.members;
+				hashes.append(call.user1);
+				hashes.append(call.user2);
+				for (int j = 0; j < hashes.size(); j++)
+				{
+					quint64 hash = hashes[j];
+					if (hash != 0 && !added.contains(hash) && !seeded.contains(hash))
+					{
+						seeded.insert(hash);
+						db.addUser(username(hash), password(hash));
+					}
+				}
+			}
+			success = true;
+		}
+		db.close();
+	}
+	QSqlDatabase::removeDatabase("replay-seed");
+	return success;
+}
+
+/**
+ * @brief Replays the loaded trace and compares the latencies with the recorded ones
+ * @param databasePath The path of the database to replay against
+ * @param speed How much faster than the recording to issue calls; 0 or less issues them back to back
+ * @param threads The number of replay threads, each with its own database connection
+ * @return One ReplayStats entry for each method that appears in the trace
+ */
+QVector<ReplayStats> TraceReplayer::replay(const QString& databasePath, double speed, int threads)
+{
+	if (calls.isEmpty())
+	{
+		return QVector<ReplayStats>();
+	}
+	threads = qMax(threads, 1);
+
+	QVector<quint32> replayLatency(calls.size(), 0);
+	quint64 firstTimestamp = calls.first().timestampNs;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([this, t, threads, speed, start, firstTimestamp, &databasePath, &replayLatency]()
+		{
+			QString connectionName = QString("replay-%1").arg(t);
+			{
+				DbManager db(databasePath, connectionName);
+				for (int i = t; i < calls.size(); i += threads)
+				{
+					const TraceCall& call = calls[i];
+					if (speed > 0)
+					{
+						std::chrono::nanoseconds offset(qint64((call.timestampNs - firstTimestamp) / speed));
+						std::this_thread::sleep_until(start + offset);
+					}
+
+					std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+					runCall(db, call);
+					qint64 elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count();
+					replayLatency[i] = elapsed > 0xFFFFFFFFll ? 0xFFFFFFFFu : quint32(elapsed);
+				}
+				db.close();
+			}
+			QSqlDatabase::removeDatabase(connectionName);
+		});
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+
+	// Gather the latencies for each method
+	QVector<QVector<quint32> > original(256);
+	QVector<QVector<quint32> > replayed(256);
+	for (int i = 0; i < calls.size(); i++)
+	{
+		original[int(calls[i].op)].append(calls[i].latencyNs);
+		replayed[int(calls[i].op)].append(replayLatency[i]);
+	}
+
+	QVector<ReplayStats> results;
+	for (int op = 0; op < 256; op++)
+	{
+		QVector<quint32>& a = original[op];
+		QVector<quint32>& b = replayed[op];
+		if (a.isEmpty())
+		{
+			continue;
+		}
+		std::sort(a.begin(), a.end());
+		std::sort(b.begin(), b.end());
+
+		double sumA = 0;
+		double sumB = 0;
+		for (int i = 0; i < a.size(); i++)
+		{
+			sumA += a[i];
+			sumB += b[i];
+		}
+
+		ReplayStats stats;
+		stats.op = TraceOp(op);
+		stats.calls = a.size();
+		stats.originalMeanUs = sumA / a.size() / 1000.0;
+		stats.originalP50Us = a[a.size() / 2] / 1000.0;
+		stats.originalP99Us = a[(a.size() * 99) / 100] / 1000.0;
+		stats.replayMeanUs = sumB / b.size() / 1000.0;
+		stats.replayP50Us = b[b.size() / 2] / 1000.0;
+		stats.replayP99Us = b[(b.size() * 99) / 100] / 1000.0;
+		results.append(stats);
+	}
+	return results;
+}
+
+/**
+ * @brief Gets the synthetic username used in place of a hashed username
+ * @param hash The hashed username from the trace
+ * @return The letter u followed by the hash in hexadecimal
+ */
+QString TraceReplayer::username(quint64 hash)
+{
+	return QString("u%1").arg(hash, 16, 16, QLatin1Char('0'));
+}
+
+/**
+ * @brief Gets the password given to a synthetic user
+ * @param hash The hashed username from the trace
+ * @return A password that is stable for the given hash
+ */
+QString TraceReplayer::password(quint64 hash)
+{
+	return QString("p%1").arg(hash, 16, 16, QLatin1Char('0'));
+}
+
+/**
+ * @brief Gets the DbManager method name for a trace operation
+ * @param op The trace operation
+ * @return The method name as a C string
+ */
+const char* TraceReplayer::opName(TraceOp op)
+{
+	switch (op)
+	{
+		case TraceOp::AddUser: return "addUser";
+		case TraceOp::UserExists: return "userExists";
+		case TraceOp::CheckUserInfo: return "checkUserInfo";
+		case TraceOp::AddChat: return "addChat";
+		case TraceOp::RemoveChat: return "removeChat";
+		case TraceOp::ChatExists: return "chatExists";
+		case TraceOp::GetChatOwner: return "getChatOwner";
+		case TraceOp::DoUsersChat: return "doUsersChat";
+		case TraceOp::GetChatUsers: return "getChatUsers";
+		case TraceOp::GetChatsUserIsIn: return "getChatsUserIsIn";
+		case TraceOp::GetUserChatInfo: return "getUserChatInfo";
+		default: return "unknown";
+	}
+}
+
+/**
+ * @brief Issues one recorded call against the database
+ * @param db The database manager owned by the calling replay thread
+ * @param call The call to be replayed
+ * @return void
+ */
+void TraceReplayer::runCall(DbManager& db, const TraceCall& call)
+{
+	switch (call.op)
+	{
+		case TraceOp::AddUser:
+			db.addUser(username(call.user1), password(call.user1));
+			break;
+		case TraceOp::UserExists:
+			db.userExists(username(call.user1));
+			break;
+		case TraceOp::CheckUserInfo:
+			// Reproduce failed log-ins as well as successful ones
+			db.checkUserInfo(username(call.user1), call.resultSize ? password(call.user1) : QString("wrongpassword"));
+			break;
+		case TraceOp::AddChat:
+		{
+			QVector<QString> members;
+			members.reserve(call.members.size());
+			for (int i = 0; i < call.members.size(); i++)
+			{
+				members.append(username(call.members[i]));
+			}
+			db.addChat(call.chatID, username(call.user1), members);
+			break;
+		}
+		case TraceOp::RemoveChat:
+			db.removeChat(call.chatID, username(call.user1));
+			break;
+		case TraceOp::ChatExists:
+			db.chatExists(call.chatID);
+			break;
+		case TraceOp::GetChatOwner:
+			db.getChatOwner(call.chatID);
+			break;
+		case TraceOp::DoUsersChat:
+			db.doUsersChat(username(call.user1), username(call.user2));
+			break;
+		case TraceOp::GetChatUsers:
+			db.getChatUsers(call.chatID);
+			break;
+		case TraceOp::GetChatsUserIsIn:
+			db.getChatsUserIsIn(username(call.user1));
+			break;
+		case TraceOp::GetUserChatInfo:
+			db.getUserChatInfo(username(call.user1));
+			break;
+		default:
+			break;
+	}
+	return;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file tracereplayer.h
+ * @brief This contains the prototypes for replaying recorded DbManager call traces
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef TRACEREPLAYER_H
+#define TRACEREPLAYER_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <calltrace.h>
+
+class DbManager;
+
+// One recorded call with its addChat member list reassembled
+struct TraceCall
+{
+	TraceOp op;
+	quint64 timestampNs;
+	quint32 latencyNs;
+	qint32 chatID;
+	quint32 resultSize;
+	quint64 user1;
+	quint64 user2;
+	QVector<quint64> members;
+};
+
+// Latency figures for one method, original recording versus replay
+struct ReplayStats
+{
+	TraceOp op;
+	int calls;
+	double originalMeanUs;
+	double originalP50Us;
+	double originalP99Us;
+	double replayMeanUs;
+	double replayP50Us;
+	double replayP99Us;
+};
+
+class TraceReplayer
+{
+	public:
+		TraceReplayer();
+		bool load(const QString& tracePath);
+		int callCount() const;
+		bool seedUsers(const QString& databasePath);
+		QVector<ReplayStats> replay(const QString& databasePath, double speed, int threads);
+		static QString username(quint64 hash);
+		static QString password(quint64 hash);
+		static const char* opName(TraceOp op);
+	private:
+		void runCall(DbManager& db, const TraceCall& call);
+		QVector<TraceCall> calls;
+};
+
+#endif	// TRACEREPLAYER_H
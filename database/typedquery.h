@@ -0,0 +1,327 @@
+/**
+ * @file typedquery.h
+ * @brief Statements declared once with the types of their parameters and result columns
+ *
+ * A Statement pairs its SQL with a QueryParams list of parameter types and a QueryColumns list
+ * of result column types. Each is declared once as a constexpr object, and its constructor fails
+ * the build if the number of ? placeholders differs from the number of parameter types, or if
+ * the SQL still uses a named placeholder. Preparing a statement gives a TypedQuery whose exec()
+ * takes exactly those parameters and binds them by position, and whose column<N>() reads column
+ * N as its declared type, so nothing is looked up by name. The sqlite3 backend binds and reads
+ * the values directly; the QtSql backend still passes each one through a QVariant.
+ *
+ * Parameters may be int, QString, Utf8View or QueryText, which takes either kind of text and
+ * binds it as it is; columns may be int, qint64, QString or Utf8View.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef TYPEDQUERY_H
+#define TYPEDQUERY_H
+
+#include <storagebackend.h>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+template <typename... P>
+struct QueryParams
+{
+};
+
+template <typename... C>
+struct QueryColumns
+{
+};
+
+// A text parameter given as a QString or as UTF-8, bound without converting one to the other
+class QueryText
+{
+	public:
+		QueryText(const QString& text) : string(&text) {}
+		QueryText(Utf8View text) : string(nullptr), utf8(text) {}
+		void bind(StorageQuery& query, int index) const
+		{
+			if (string)
+			{
+				query.bind(index, *string);
+			}
+			else
+			{
+				query.bind(index, utf8);
+			}
+		}
+	private:
+		const QString* string;
+		Utf8View utf8;
+};
+
+// Which types a backend can bind as a parameter and read as a column
+template <typename T>
+struct StorageType
+{
+	static const bool bindable = false;
+	static const bool readable = false;
+};
+
+template <>
+struct StorageType<int>
+{
+	static const bool bindable = true;
+	static const bool readable = true;
+	static void bind(StorageQuery& query, int index, int value) { query.bind(index, value); }
+	static int read(StorageQuery& query, int column) { return query.columnInt(column); }
+};
+
+template <>
+struct StorageType<qint64>
+{
+	static const bool bindable = false;
+	static const bool readable = true;
+	static qint64 read(StorageQuery& query, int column) { return query.columnInt64(column); }
+};
+
+template <>
+struct StorageType<QString>
+{
+	static const bool bindable = true;
+	static const bool readable = true;
+	static void bind(StorageQuery& query, int index, const QString& value) { query.bind(index, value); }
+	static QString read(StorageQuery& query, int column) { return query.columnString(column); }
+};
+
+template <>
+struct StorageType<Utf8View>
+{
+	static const bool bindable = true;
+	static const bool readable = true;
+	static void bind(StorageQuery& query, int index, Utf8View value) { query.bind(index, value); }
+	static Utf8View read(StorageQuery& query, int column) { return query.columnText(column); }
+};
+
+template <>
+struct StorageType<QueryText>
+{
+	static const bool bindable = true;
+	static const bool readable = false;
+	static void bind(StorageQuery& query, int index, const QueryText& value) { value.bind(query, index); }
+};
+
+/**
+ * @brief Checks that every flag in a list is set
+ * @param flags The flags
+ * @return boolean indicating whether all of them are set, true for an empty list
+ */
+template <typename... B>
+constexpr bool allOf(B... flags)
+{
+	bool all = true;
+	bool list[] = { true, flags... };
+	for (bool flag : list)
+	{
+		all = all && flag;
+	}
+	return all;
+}
+
+/**
+ * @brief Counts the ? placeholders in a statement, skipping quoted text
+ * @param sql The statement
+ * @return The number of placeholders
+ */
+constexpr int countPlaceholders(const char* sql)
+{
+	int count = 0;
+	char quote = 0;
+	for (; *sql; sql++)
+	{
+		if (quote)
+		{
+			quote = *sql == quote ? 0 : quote;
+		}
+		else if (*sql == '\'' || *sql == '"')
+		{
+			quote = *sql;
+		}
+		else if (*sql == '?')
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+/**
+ * @brief Checks a statement for named placeholders such as :chatID, which TypedQuery cannot bind
+ * @param sql The statement
+ * @return boolean indicating whether a named placeholder appears outside quoted text
+ */
+constexpr bool hasNamedPlaceholder(const char* sql)
+{
+	char quote = 0;
+	for (; *sql; sql++)
+	{
+		if (quote)
+		{
+			quote = *sql == quote ? 0 : quote;
+		}
+		else if (*sql == '\'' || *sql == '"')
+		{
+			quote = *sql;
+		}
+		else if ((*sql == ':' || *sql == '@' || *sql == '$') && ((sql[1] >= 'A' && sql[1] <= 'Z') || (sql[1] >= 'a' && sql[1] <= 'z') || sql[1] == '_'))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Never defined; a constexpr Statement whose placeholders do not match its parameter types calls it, which fails the build
+void statementPlaceholdersDoNotMatchParameterTypes();
+
+template <typename Parameters, typename Columns>
+class TypedQuery;
+
+template <typename... P, typename... C>
+class TypedQuery<QueryParams<P...>, QueryColumns<C...>>
+{
+	static_assert(allOf(StorageType<P>::bindable...), "a statement parameter must be int, QString, Utf8View or QueryText");
+	static_assert(allOf(StorageType<C>::readable...), "a statement column must be int, qint64, QString or Utf8View");
+
+	public:
+		/**
+		 * @brief Constructor for a query on a prepared statement
+		 * @param query The statement from StorageBackend::prepare, which the query now owns
+		 */
+		explicit TypedQuery(StorageQuery* query)
+			: query(query)
+		{
+		}
+
+		TypedQuery(TypedQuery&& other) = default;
+
+		/**
+		 * @brief Binds the parameters by position and runs the statement
+		 * The query may be run again with new parameters once its result is no longer needed
+		 * @param parameters One value for each parameter type, in order
+		 * @return boolean indicating whether it ran without error
+		 */
+		bool exec(const P&... parameters)
+		{
+			bindAll(std::index_sequence_for<P...>(), parameters...);
+			return query->exec();
+		}
+
+		/**
+		 * @brief Moves to the next row of the result
+		 * @return boolean indicating whether there was another row
+		 */
+		bool next()
+		{
+			return query->next();
+		}
+
+		/**
+		 * @brief Reads a column of the current row as its declared type
+		 * A Utf8View is only valid until the next call to next()
+		 * @return The value
+		 */
+		template <int N>
+		typename std::tuple_element<N, std::tuple<C...>>::type column()
+		{
+			return StorageType<typename std::tuple_element<N, std::tuple<C...>>::type>::read(*query, N);
+		}
+
+		/**
+		 * @brief Reads every column of the current row
+		 * @return The values, in column order
+		 */
+		std::tuple<C...> row()
+		{
+			return readAll(std::index_sequence_for<C...>());
+		}
+
+		/**
+		 * @brief Gets the rowid of the row the statement inserted
+		 * @return The rowid
+		 */
+		qint64 lastInsertId()
+		{
+			return query->lastInsertId();
+		}
+
+		/**
+		 * @brief Gets the error from the last step that failed
+		 * @return The error message, empty if there was none
+		 */
+		QString lastError() const
+		{
+			return query->lastError();
+		}
+
+	private:
+		template <std::size_t... I>
+		void bindAll(std::index_sequence<I...>, const P&... parameters)
+		{
+			int unused[] = { 0, (StorageType<P>::bind(*query, int(I), parameters), 0)... };
+			(void)unused;
+			return;
+		}
+
+		template <std::size_t... I>
+		std::tuple<C...> readAll(std::index_sequence<I...>)
+		{
+			return std::tuple<C...>(StorageType<C>::read(*query, int(I))...);
+		}
+
+		std::unique_ptr<StorageQuery> query;
+};
+
+template <typename Parameters, typename Columns>
+class Statement
+{
+	public:
+		/**
+		 * @brief Constructor for a statement
+		 * Declared constexpr, a statement whose placeholders do not match its parameter types does not compile
+		 * @param sql The statement, with one ? for each parameter type; it must outlive every backend, as literals do
+		 */
+		constexpr explicit Statement(const char* sql)
+			: text(countPlaceholders(sql) == parameterCount(Parameters()) && !hasNamedPlaceholder(sql)
+				? sql : (statementPlaceholdersDoNotMatchParameterTypes(), sql))
+		{
+		}
+
+		/**
+		 * @brief Gets the statement's SQL
+		 * @return The SQL
+		 */
+		constexpr const char* sql() const
+		{
+			return text;
+		}
+
+		/**
+		 * @brief Prepares the statement on a backend, which reuses it if it was prepared before
+		 * @param storage The backend
+		 * @return The query, whose exec fails if the statement could not be prepared
+		 */
+		TypedQuery<Parameters, Columns> prepare(StorageBackend& storage) const
+		{
+			return TypedQuery<Parameters, Columns>(storage.prepare(text));
+		}
+
+	private:
+		template <typename... P>
+		static constexpr int parameterCount(QueryParams<P...>)
+		{
+			return int(sizeof...(P));
+		}
+
+		const char* text;
+};
+
+#endif	// TYPEDQUERY_H
@@ -0,0 +1,350 @@
+/**
+ * @file usercache.cpp
+ * @brief Caches userinfo records in shards read under sequence locks
+ *
+ * A slot is four 64-bit words: the two halves of the username's hash, the rowid (-1 for a user
+ * known not to exist) and the password hash. An empty slot has a zero first half, which no key
+ * has. Every field is an atomic read and written with relaxed ordering; the shard's version,
+ * with the fences around it, is what orders them.
+ *
+ * @author mdolan2
+ * @bug No known bugs.
+ */
+
+#include <usercache.h>
+#include <seededhash.h>
+#include <QMutex>
+#include <QMutexLocker>
+#include <openssl/evp.h>
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <thread>
+
+struct UserCache::Key
+{
+	quint64 high;	// never 0
+	quint64 low;
+};
+
+struct UserCache::Slot
+{
+	std::atomic<quint64> high;
+	std::atomic<quint64> low;
+	std::atomic<qint64> id;
+	std::atomic<quint64> credential;
+};
+
+// The version is odd while a writer is changing the shard's slots
+struct alignas(64) UserCache::Shard
+{
+	std::atomic<quint32> version;
+	QMutex mutex;
+	Slot* slots;
+};
+
+struct UserCache::Record
+{
+	qint64 id;
+	quint64 credential;
+};
+
+/**
+ * @brief Hashes a password with a salt
+ * @param password The password
+ * @param salt The salt
+ * @return The first 64 bits of SHA-256 over the salt and the password's UTF-8
+ */
+static quint64 hashPassword(const QString& password, quint64 salt)
+{
+	QByteArray input(reinterpret_cast<const char*>(&salt), sizeof(salt));
+	input.append(password.toUtf8());
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	quint64 credential = 0;
+	if (EVP_Digest(input.constData(), size_t(input.size()), digest, &length, EVP_sha256(), nullptr) == 1)
+	{
+		memcpy(&credential, digest, sizeof(credential));
+	}
+	return credential;
+}
+
+/**
+ * @brief Constructor for an empty user cache
+ * @param capacity The number of records to make room for, rounded up so each shard has a power of two
+ */
+UserCache::UserCache(int capacity)
+	: shards(new Shard[shardCount]), slotsPerShard(probeLength)
+{
+	while (qint64(slotsPerShard) * shardCount < capacity)
+	{
+		slotsPerShard <<= 1;
+	}
+	for (int s = 0; s < shardCount; s++)
+	{
+		shards[s].version.store(0, std::memory_order_relaxed);
+		shards[s].slots = new Slot[slotsPerShard];
+	}
+	clear();
+
+	std::random_device random;
+	for (int i = 0; i < 3; i++)
+	{
+		seeds[i] = (quint64(random()) << 32) | random();
+	}
+}
+
+/**
+ * @brief Destructor for the user cache
+ */
+UserCache::~UserCache()
+{
+	for (int s = 0; s < shardCount; s++)
+	{
+		delete[] shards[s].slots;
+	}
+	delete[] shards;
+}
+
+/**
+ * @brief Looks a user up
+ * @param username The username
+ * @param id Receives the user's rowid if they are present; may be nullptr
+ * @return Whether the user is present, missing, or not cached
+ */
+CachedUser UserCache::lookup(const QString& username, qint64* id) const
+{
+	Record record;
+	if (!read(keyFor(username), record))
+	{
+		return CachedUser::Unknown;
+	}
+	if (record.id < 0)
+	{
+		return CachedUser::Missing;
+	}
+	if (id)
+	{
+		*id = record.id;
+	}
+	return CachedUser::Present;
+}
+
+/**
+ * @brief Checks a password against a cached user
+ * @param username The username
+ * @param password The password to check
+ * @param matches Set to whether the password is the user's, if they are present
+ * @return Whether the user is present, missing, or not cached
+ */
+CachedUser UserCache::verify(const QString& username, const QString& password, bool& matches) const
+{
+	Record record;
+	matches = false;
+	if (!read(keyFor(username), record))
+	{
+		return CachedUser::Unknown;
+	}
+	if (record.id < 0)
+	{
+		return CachedUser::Missing;
+	}
+	matches = hashPassword(password, seeds[2]) == record.credential;
+	return CachedUser::Present;
+}
+
+/**
+ * @brief Records a user as it is in userinfo
+ * @param username The username
+ * @param id The user's rowid
+ * @param password The user's password
+ * @return void
+ */
+void UserCache::storeUser(const QString& username, qint64 id, const QString& password)
+{
+	Record record = { id, hashPassword(password, seeds[2]) };
+	write(keyFor(username), record);
+	return;
+}
+
+/**
+ * @brief Records that a user does not exist
+ * A user already recorded as present stays present, so a lookup that ran before an addUser of
+ * the same name committed cannot hide the new user once addUser has stored it
+ * @param username The username
+ * @return void
+ */
+void UserCache::storeMissing(const QString& username)
+{
+	Record record = { -1, 0 };
+	write(keyFor(username), record);
+	return;
+}
+
+/**
+ * @brief Forgets a user, so the next lookup asks the database
+ * @param username The username
+ * @return void
+ */
+void UserCache::invalidate(const QString& username)
+{
+	Key key = keyFor(username);
+	Shard& shard = shards[key.high >> (64 - shardBits)];
+	QMutexLocker locker(&shard.mutex);
+	quint32 version = shard.version.load(std::memory_order_relaxed);
+	shard.version.store(version + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	int start = int(key.low & quint64(slotsPerShard - 1));
+	for (int i = 0; i < probeLength; i++)
+	{
+		Slot& slot = shard.slots[(start + i) & (slotsPerShard - 1)];
+		if (slot.high.load(std::memory_order_relaxed) == key.high && slot.low.load(std::memory_order_relaxed) == key.low)
+		{
+			slot.high.store(0, std::memory_order_relaxed);
+		}
+	}
+	shard.version.store(version + 2, std::memory_order_release);
+	return;
+}
+
+/**
+ * @brief Forgets every user
+ * @return void
+ */
+void UserCache::clear()
+{
+	for (int s = 0; s < shardCount; s++)
+	{
+		Shard& shard = shards[s];
+		QMutexLocker locker(&shard.mutex);
+		quint32 version = shard.version.load(std::memory_order_relaxed);
+		shard.version.store(version + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (int i = 0; i < slotsPerShard; i++)
+		{
+			shard.slots[i].high.store(0, std::memory_order_relaxed);
+			shard.slots[i].low.store(0, std::memory_order_relaxed);
+			shard.slots[i].id.store(0, std::memory_order_relaxed);
+			shard.slots[i].credential.store(0, std::memory_order_relaxed);
+		}
+		shard.version.store(version + 2, std::memory_order_release);
+	}
+	return;
+}
+
+/**
+ * @brief Gets the number of records the cache has room for
+ * @return The number of slots
+ */
+int UserCache::capacity() const
+{
+	return slotsPerShard * shardCount;
+}
+
+/**
+ * @brief Gets the memory the cache holds, which does not change as it fills
+ * @return The size in bytes
+ */
+qint64 UserCache::memoryUsage() const
+{
+	return qint64(sizeof(Shard)) * shardCount + qint64(sizeof(Slot)) * slotsPerShard * shardCount;
+}
+
+/**
+ * @brief Hashes a username into the key its record is stored under
+ * @param username The username
+ * @return The key
+ */
+UserCache::Key UserCache::keyFor(const QString& username) const
+{
+	Key key = { seededHash(username, seeds[0]), seededHash(username, seeds[1]) };
+	key.high = key.high ? key.high : 1;
+	return key;
+}
+
+/**
+ * @brief Copies a record out of its shard without locking, retrying while a writer is busy
+ * @param key The record's key
+ * @param record Receives the record
+ * @return boolean indicating whether the record was found
+ */
+bool UserCache::read(const Key& key, Record& record) const
+{
+	const Shard& shard = shards[key.high >> (64 - shardBits)];
+	int start = int(key.low & quint64(slotsPerShard - 1));
+	while (true)
+	{
+		quint32 before = shard.version.load(std::memory_order_acquire);
+		if (before & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		bool found = false;
+		for (int i = 0; i < probeLength && !found; i++)
+		{
+			const Slot& slot = shard.slots[(start + i) & (slotsPerShard - 1)];
+			if (slot.high.load(std::memory_order_relaxed) == key.high && slot.low.load(std::memory_order_relaxed) == key.low)
+			{
+				record.id = slot.id.load(std::memory_order_relaxed);
+				record.credential = slot.credential.load(std::memory_order_relaxed);
+				found = true;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (shard.version.load(std::memory_order_relaxed) == before)
+		{
+			return found;
+		}
+	}
+}
+
+/**
+ * @brief Stores a record in its shard, replacing the key's old record or evicting another
+ * @param key The record's key
+ * @param record The record
+ * @return void
+ */
+void UserCache::write(const Key& key, const Record& record)
+{
+	Shard& shard = shards[key.high >> (64 - shardBits)];
+	int start = int(key.low & quint64(slotsPerShard - 1));
+	QMutexLocker locker(&shard.mutex);
+
+	// The key's own slot, else the first empty one, else one picked by the key's unused bits
+	int target = -1;
+	for (int i = 0; i < probeLength && target < 0; i++)
+	{
+		const Slot& slot = shard.slots[(start + i) & (slotsPerShard - 1)];
+		if (slot.high.load(std::memory_order_relaxed) == key.high && slot.low.load(std::memory_order_relaxed) == key.low)
+		{
+			// Users are never removed, so a present user is never marked missing again
+			if (record.id < 0 && slot.id.load(std::memory_order_relaxed) >= 0)
+			{
+				return;
+			}
+			target = i;
+		}
+	}
+	for (int i = 0; i < probeLength && target < 0; i++)
+	{
+		if (shard.slots[(start + i) & (slotsPerShard - 1)].high.load(std::memory_order_relaxed) == 0)
+		{
+			target = i;
+		}
+	}
+	target = target >= 0 ? target : int((key.low >> 32) % probeLength);
+
+	Slot& slot = shard.slots[(start + target) & (slotsPerShard - 1)];
+	quint32 version = shard.version.load(std::memory_order_relaxed);
+	shard.version.store(version + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.high.store(key.high, std::memory_order_relaxed);
+	slot.low.store(key.low, std::memory_order_relaxed);
+	slot.id.store(record.id, std::memory_order_relaxed);
+	slot.credential.store(record.credential, std::memory_order_relaxed);
+	shard.version.store(version + 2, std::memory_order_release);
+	return;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file usercache.h
+ * @brief This contains the prototypes for the in-memory cache of userinfo records
+ *
+ * userExists and checkUserInfo, and the methods that call userExists for themselves, look a
+ * user up here before querying userinfo. A record holds whether the user exists, their rowid
+ * and a hash of their password, so one query fills in everything both checks need, and users
+ * that do not exist are remembered too. Records are loaded on first use and replaced whenever
+ * a DbManager using the cache writes the user.
+ *
+ * The cache has a fixed number of slots spread over shardCount shards by the hash of the
+ * username, so its memory never grows; a shard whose probe window is full evicts a record.
+ * Each shard is guarded by a sequence lock: writers take the shard's mutex and bump its version,
+ * and readers take no lock at all, copying the record and retrying if the version changed
+ * meanwhile. Lookups on any number of threads therefore never write shared memory.
+ *
+ * Usernames are identified by a 128-bit seeded hash rather than stored, and passwords by the
+ * first 64 bits of a salted SHA-256, so a record is 32 bytes. The salt and seeds are random per
+ * cache. Writes made to userinfo by other processes are not seen.
+ *
+ * @author mdolan2
+ * @bug No known bugs
+ */
+
+#ifndef USERCACHE_H
+#define USERCACHE_H
+
+#include <QString>
+#include <QtGlobal>
+
+enum class CachedUser : quint8
+{
+	Unknown,	// not cached, so the database must be asked
+	Missing,	// known not to exist
+	Present
+};
+
+class UserCache
+{
+	public:
+		static const int shardBits = 8;
+		static const int shardCount = 1 << shardBits;
+		static const int probeLength = 8;
+		static const int defaultCapacity = 1 << 20;
+
+		explicit UserCache(int capacity = defaultCapacity);
+		~UserCache();
+		CachedUser lookup(const QString& username, qint64* id = nullptr) const;
+		CachedUser verify(const QString& username, const QString& password, bool& matches) const;
+		void storeUser(const QString& username, qint64 id, const QString& password);
+		void storeMissing(const QString& username);
+		void invalidate(const QString& username);
+		void clear();
+		int capacity() const;
+		qint64 memoryUsage() const;
+	private:
+		Q_DISABLE_COPY(UserCache)
+		struct Key;
+		struct Slot;
+		struct Shard;
+		struct Record;
+		Key keyFor(const QString& username) const;
+		bool read(const Key& key, Record& record) const;
+		void write(const Key& key, const Record& record);
+		Shard* shards;
+		int slotsPerShard;
+		quint64 seeds[3];
+};
+
+#endif	// USERCACHE_H